@@ -0,0 +1,491 @@
+// Timings of the hot paths, each section set against the slower path it replaced.
+// Run as bench [section ...] for some of the sections, or bench for all of them.
+
+#include "stdafx.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "InverseColormap.h"
+#include "NeuQuantizer.h"
+#include "PaletteIndex.h"
+
+using namespace std;
+
+// Timings are the best of this many runs
+const UINT RUNS = 5;
+
+// Folds results in so that the timed work is not optimized away
+static UINT sink = 0;
+
+struct Section {
+	string name;
+	string description;
+	function<void()> run;
+};
+
+// Best wall time of fn over runs, in milliseconds
+static double BestOf(const function<void()>& fn, const UINT runs = RUNS)
+{
+	double best = 0;
+	for (UINT run = 0; run < runs; ++run) {
+		const auto start = chrono::steady_clock::now();
+		fn();
+		const double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if (run == 0 || elapsed < best)
+			best = elapsed;
+	}
+	return best;
+}
+
+struct Image {
+	UINT width, height;
+	vector<ARGB> pixels;
+};
+
+// Gradients with noise, a quarter of the pixels translucent if asked for
+static Image MakeImage(const UINT width, const UINT height, mt19937& random, const bool translucent = false)
+{
+	Image image = { width, height, vector<ARGB>((size_t) width * height) };
+	for (UINT y = 0; y < height; ++y) {
+		for (UINT x = 0; x < width; ++x) {
+			const BYTE red = static_cast<BYTE>(x * 255 / width + random() % 24);
+			const BYTE green = static_cast<BYTE>(y * 255 / height + random() % 24);
+			const BYTE blue = static_cast<BYTE>(x ^ y);
+			const BYTE alpha = (translucent && random() % 4 == 0) ? static_cast<BYTE>(random() % 256) : BYTE_MAX;
+			image.pixels[(size_t) y * width + x] = Color::MakeARGB(alpha, red, green, blue);
+		}
+	}
+	return image;
+}
+
+static vector<BYTE> MakePalette(const UINT nMaxColors, mt19937& random, const bool translucent = false)
+{
+	vector<BYTE> paletteBytes(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+	auto pPalette = (ColorPalette*) paletteBytes.data();
+	pPalette->Count = nMaxColors;
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		// One entry in eight repeats an earlier one, so that ties are exercised
+		if (i > 0 && random() % 8 == 0)
+			pPalette->Entries[i] = pPalette->Entries[random() % i];
+		else
+			pPalette->Entries[i] = Color::MakeARGB(translucent ? random() % 256 : BYTE_MAX, random() % 256, random() % 256, random() % 256);
+	}
+	return paletteBytes;
+}
+
+// The scan PaletteIndex replaced, keeping the last entry of several at equal distance
+static unsigned short LinearNearest(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+{
+	unsigned short k = 0;
+	Color c(argb);
+
+	double mindist = INT_MAX;
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		Color c2(pPalette->Entries[i]);
+		double curdist = sqr(c2.GetA() - c.GetA());
+		if (curdist > mindist)
+			continue;
+
+		curdist += sqr(c2.GetR() - c.GetR());
+		if (curdist > mindist)
+			continue;
+
+		curdist += sqr(c2.GetG() - c.GetG());
+		if (curdist > mindist)
+			continue;
+
+		curdist += sqr(c2.GetB() - c.GetB());
+		if (curdist > mindist)
+			continue;
+
+		mindist = curdist;
+		k = i;
+	}
+	return k;
+}
+
+static void BenchPaletteIndex()
+{
+	cout << "  colors   linear ns   tree ns   mismatches" << endl;
+	mt19937 random(1);
+	for (UINT nMaxColors : { 16U, 256U, 4096U, 65536U }) {
+		const auto paletteBytes = MakePalette(nMaxColors, random);
+		auto pPalette = (const ColorPalette*) paletteBytes.data();
+		vector<ARGB> queries(nMaxColors > 4096 ? 20000 : 200000);
+		for (auto& argb : queries)
+			argb = Color::MakeARGB(BYTE_MAX, random() % 256, random() % 256, random() % 256);
+
+		vector<unsigned short> linear(queries.size()), tree(queries.size());
+		const double linearMs = BestOf([&]() {
+			for (size_t i = 0; i < queries.size(); ++i)
+				linear[i] = LinearNearest(pPalette, nMaxColors, queries[i]);
+		});
+
+		PaletteIndex index;
+		index.Build(pPalette, nMaxColors);
+		const double treeMs = BestOf([&]() {
+			for (size_t i = 0; i < queries.size(); ++i)
+				tree[i] = index.Nearest(queries[i]);
+		});
+
+		UINT nMismatches = 0;
+		for (size_t i = 0; i < queries.size(); ++i)
+			nMismatches += linear[i] != tree[i];
+		sink += linear.back() + tree.back();
+		cout << setw(8) << nMaxColors << setw(12) << linearMs * 1e6 / queries.size() << setw(10) << treeMs * 1e6 / queries.size() << setw(13) << nMismatches << endl;
+	}
+}
+
+static void BenchWavefront()
+{
+	cout << "  " << max(thread::hardware_concurrency(), 1U) << " hardware threads, 256 colours, ms" << endl;
+	cout << "  image        lookup     serpentine   raster" << endl;
+	mt19937 random(1);
+	const UINT nMaxColors = 256;
+	const auto paletteBytes = MakePalette(nMaxColors, random);
+	auto pPalette = (const ColorPalette*) paletteBytes.data();
+	PaletteIndex index;
+	index.Build(pPalette, nMaxColors);
+	DitherFn ditherFn = [&index](const ColorPalette*, const UINT, const ARGB argb) { return index.Nearest(argb); };
+	InverseColormap colormap;
+	colormap.Build(pPalette, nMaxColors, false);
+
+	const struct { const char* name; UINT width, height; } sizes[] = { { "4K", 3840, 2160 }, { "8K", 7680, 4320 } };
+	for (const auto& size : sizes) {
+		const auto image = MakeImage(size.width, size.height, random);
+		vector<unsigned short> qPixels(image.pixels.size());
+		// The raster mode spreads over threads with a colormap, built before timing or
+		// deferred and filled while dithering
+		const char* lookups[] = { "lazy", "deferred", "colormap" };
+		for (const char* lookup : lookups) {
+			double ms[2];
+			int i = 0;
+			for (DitherMode mode : { DitherMode::ErrorDiffusion, DitherMode::ErrorDiffusionRaster }) {
+				ms[i++] = BestOf([&]() {
+					InverseColormap deferred;
+					deferred.Defer([&index](const ARGB argb) { return index.Nearest(argb); }, false);
+					const InverseColormap* pColormap = lookup == lookups[0] ? nullptr : lookup == lookups[1] ? &deferred : &colormap;
+					dither_image(image.pixels.data(), pPalette, ditherFn, false, -1, nMaxColors, qPixels.data(), image.width, image.height, pColormap, mode);
+				}, 3);
+				sink += qPixels.back();
+			}
+			cout << "  " << setw(4) << size.name << setw(14) << lookup << setw(13) << ms[0] << setw(9) << ms[1] << endl;
+		}
+	}
+}
+
+// The serpentine Floyd-Steinberg loop the templates replaced. It checks
+// the alpha mode and the colormap for every pixel and calls ditherFn on cache misses.
+static void LegacyDither(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT rows, const InverseColormap* pColormap)
+{
+	DitherState state(width);
+	UINT pixelIndex = 0;
+
+	short *row0, *row1;
+	int dir, k;
+	const int DJ = 4;
+	const int DITHER_MAX = 20;
+	BYTE clamp[DJ * 256] = { 0 };
+	char limtb[512] = { 0 };
+	auto lim = &limtb[256];
+	auto erowerr = state.erowErr.data();
+	auto orowerr = state.orowErr.data();
+	auto lookup = state.lookup.data();
+	auto pDitherPixel = make_unique<int[]>(4);
+
+	for (int i = 0; i < 256; i++) {
+		clamp[i] = 0;
+		clamp[i + 256] = static_cast<BYTE>(i);
+		clamp[i + 512] = BYTE_MAX;
+		clamp[i + 768] = BYTE_MAX;
+
+		limtb[i] = -DITHER_MAX;
+		limtb[i + 256] = DITHER_MAX;
+	}
+	for (int i = -DITHER_MAX; i <= DITHER_MAX; i++)
+		limtb[i + 256] = i;
+
+	for (UINT i = 0; i < rows; i++) {
+		if (state.odd_scanline) {
+			dir = -1;
+			pixelIndex = i * width + (width - 1);
+			row0 = &orowerr[DJ];
+			row1 = &erowerr[width * DJ];
+		}
+		else {
+			dir = 1;
+			pixelIndex = i * width;
+			row0 = &erowerr[DJ];
+			row1 = &orowerr[width * DJ];
+		}
+		row1[0] = row1[1] = row1[2] = row1[3] = 0;
+		for (UINT j = 0; j < width; ++j) {
+			Color c(pixels[pixelIndex]);
+
+			if (hasSemiTransparency) {
+				pDitherPixel[0] = clamp[((row0[0] + 0x1008) >> 4) + c.GetR()];
+				pDitherPixel[1] = clamp[((row0[1] + 0x1008) >> 4) + c.GetG()];
+				pDitherPixel[2] = clamp[((row0[2] + 0x1008) >> 4) + c.GetB()];
+				pDitherPixel[3] = clamp[((row0[3] + 0x1008) >> 4) + c.GetA()];
+			}
+			else {
+				pDitherPixel[0] = clamp[((row0[0] + 0x2010) >> 5) + c.GetR()];
+				pDitherPixel[1] = clamp[((row0[1] + 0x1008) >> 4) + c.GetG()];
+				pDitherPixel[2] = clamp[((row0[2] + 0x2010) >> 5) + c.GetB()];
+				pDitherPixel[3] = c.GetA();
+			}
+			int r_pix = pDitherPixel[0];
+			int g_pix = pDitherPixel[1];
+			int b_pix = pDitherPixel[2];
+			int a_pix = pDitherPixel[3];
+			auto argb = Color::MakeARGB(a_pix, r_pix, g_pix, b_pix);
+			Color c1(argb);
+			int offset = GetARGBIndex(c1, hasSemiTransparency);
+			if (pColormap)
+				qPixels[pixelIndex] = pColormap->Lookup(offset);
+			else {
+				if (!lookup[offset])
+					lookup[offset] = ditherFn(pPalette, nMaxColors, argb) + 1;
+				qPixels[pixelIndex] = lookup[offset] - 1;
+			}
+
+			Color c2(pPalette->Entries[qPixels[pixelIndex]]);
+
+			r_pix = lim[c1.GetR() - c2.GetR()];
+			g_pix = lim[c1.GetG() - c2.GetG()];
+			b_pix = lim[c1.GetB() - c2.GetB()];
+			a_pix = lim[c1.GetA() - c2.GetA()];
+
+			k = r_pix * 2;
+			row1[0 - DJ] = r_pix;
+			row1[0 + DJ] += (r_pix += k);
+			row1[0] += (r_pix += k);
+			row0[0 + DJ] += (r_pix += k);
+
+			k = g_pix * 2;
+			row1[1 - DJ] = g_pix;
+			row1[1 + DJ] += (g_pix += k);
+			row1[1] += (g_pix += k);
+			row0[1 + DJ] += (g_pix += k);
+
+			k = b_pix * 2;
+			row1[2 - DJ] = b_pix;
+			row1[2 + DJ] += (b_pix += k);
+			row1[2] += (b_pix += k);
+			row0[2 + DJ] += (b_pix += k);
+
+			k = a_pix * 2;
+			row1[3 - DJ] = a_pix;
+			row1[3 + DJ] += (a_pix += k);
+			row1[3] += (a_pix += k);
+			row0[3 + DJ] += (a_pix += k);
+
+			row0 += DJ;
+			row1 -= DJ;
+			pixelIndex += dir;
+		}
+
+		state.odd_scanline = !state.odd_scanline;
+	}
+}
+
+static void BenchDiffusion()
+{
+	cout << "  one thread, 2048x1536, ms" << endl;
+	cout << "  image  colors    lookup     legacy   templated   same" << endl;
+	mt19937 random(1);
+	for (bool translucent : { false, true }) {
+		const auto image = MakeImage(2048, 1536, random, translucent);
+		for (UINT nMaxColors : { 256U, 16U }) {
+			const auto paletteBytes = MakePalette(nMaxColors, random, translucent);
+			auto pPalette = (const ColorPalette*) paletteBytes.data();
+			PaletteIndex index;
+			index.Build(pPalette, nMaxColors);
+			DitherFn ditherFn = [&index](const ColorPalette*, const UINT, const ARGB argb) { return index.Nearest(argb); };
+			InverseColormap colormap;
+			colormap.Build(pPalette, nMaxColors, translucent);
+
+			const InverseColormap* colormaps[] = { nullptr, &colormap };
+			for (auto pColormap : colormaps) {
+				vector<unsigned short> legacy(image.pixels.size()), templated(image.pixels.size());
+				const double legacyMs = BestOf([&]() {
+					LegacyDither(image.pixels.data(), pPalette, ditherFn, translucent, nMaxColors, legacy.data(), image.width, image.height, pColormap);
+				});
+				const double templatedMs = BestOf([&]() {
+					dither_image(image.pixels.data(), pPalette, ditherFn, translucent, -1, nMaxColors, templated.data(), image.width, image.height, pColormap);
+				});
+				sink += legacy.back() + templated.back();
+				cout << "  " << setw(5) << (translucent ? "ARGB" : "RGB") << setw(8) << nMaxColors << setw(10) << (pColormap ? "colormap" : "lazy")
+					<< setw(11) << legacyMs << setw(12) << templatedMs << setw(7) << (legacy == templated ? "yes" : "NO") << endl;
+			}
+		}
+	}
+}
+
+static void BenchKernels()
+{
+	cout << "  one thread, 2048x1536, 256 colours, MP/s" << endl;
+	cout << "  kernel            lazy   colormap" << endl;
+	mt19937 random(1);
+	const auto image = MakeImage(2048, 1536, random);
+	const UINT nMaxColors = 256;
+	const auto paletteBytes = MakePalette(nMaxColors, random);
+	auto pPalette = (const ColorPalette*) paletteBytes.data();
+	PaletteIndex index;
+	index.Build(pPalette, nMaxColors);
+	DitherFn ditherFn = [&index](const ColorPalette*, const UINT, const ARGB argb) { return index.Nearest(argb); };
+	InverseColormap colormap;
+	colormap.Build(pPalette, nMaxColors, false);
+
+	const struct { const char* name; DitherMode mode; } kernels[] = {
+		{ "Floyd-Steinberg", DitherMode::ErrorDiffusion }, { "Sierra Lite", DitherMode::SierraLite },
+		{ "Atkinson", DitherMode::Atkinson }, { "Stucki", DitherMode::Stucki }, { "Jarvis", DitherMode::Jarvis }
+	};
+	vector<unsigned short> qPixels(image.pixels.size());
+	const double megapixels = image.pixels.size() / 1e6;
+	for (const auto& kernel : kernels) {
+		cout << "  " << left << setw(16) << kernel.name << right;
+		const InverseColormap* colormaps[] = { nullptr, &colormap };
+		for (auto pColormap : colormaps) {
+			const double ms = BestOf([&]() {
+				dither_image(image.pixels.data(), pPalette, ditherFn, false, -1, nMaxColors, qPixels.data(), image.width, image.height, pColormap, kernel.mode);
+			});
+			sink += qPixels.back();
+			cout << setw(pColormap ? 11 : 6) << megapixels * 1000 / ms;
+		}
+		cout << endl;
+	}
+}
+
+// Stands in for Bitmap::GetPixel, which DecodeRows replaced and which needs GDI+:
+// one call per pixel that finds its row and decodes just that pixel
+static ARGB GetPixel(const BYTE* pSource, const int stride, const RowFormat format, const ColorPalette* pPalette, const UINT x, const UINT y)
+{
+	const BYTE* pRow = pSource + (ptrdiff_t) y * stride;
+	if (format == RowFormat::Indexed8)
+		return pRow[x] < pPalette->Count ? pPalette->Entries[pRow[x]] : Color::Black;
+
+	const UINT value = ((const unsigned short*) pRow)[x];
+	const UINT red = value >> 11, green = (value >> 5) & 0x3F, blue = value & 0x1F;
+	return Color::MakeARGB(BYTE_MAX, (BYTE) ((red << 3) | (red >> 2)), (BYTE) ((green << 2) | (green >> 4)), (BYTE) ((blue << 3) | (blue >> 2)));
+}
+
+// Called through a volatile pointer so that it stays out of line like GetPixel
+static ARGB (* volatile getPixel)(const BYTE*, const int, const RowFormat, const ColorPalette*, const UINT, const UINT) = GetPixel;
+
+static void BenchDecodeRows()
+{
+	const UINT width = 4096, height = 4096;
+	cout << "  " << width << "x" << height << ", ms" << endl;
+	cout << "  format     per pixel   DecodeRows   same" << endl;
+	mt19937 random(1);
+	const auto paletteBytes = MakePalette(256, random);
+	auto pPalette = (const ColorPalette*) paletteBytes.data();
+
+	const struct { const char* name; RowFormat format; UINT bytesPerPixel; } formats[] = {
+		{ "Indexed8", RowFormat::Indexed8, 1 }, { "RGB565", RowFormat::RGB565, 2 }
+	};
+	vector<ARGB> perPixel((size_t) width * height), decoded((size_t) width * height);
+	for (const auto& format : formats) {
+		const int stride = (width * format.bytesPerPixel + 3) & ~3;
+		vector<BYTE> source((size_t) stride * height);
+		for (auto& value : source)
+			value = static_cast<BYTE>(random());
+
+		const double perPixelMs = BestOf([&]() {
+			for (UINT y = 0; y < height; ++y) {
+				for (UINT x = 0; x < width; ++x)
+					perPixel[(size_t) y * width + x] = getPixel(source.data(), stride, format.format, pPalette, x, y);
+			}
+		});
+		const double decodeMs = BestOf([&]() {
+			DecodeRows(source.data(), width, height, stride, format.format, pPalette, decoded.data());
+		});
+		sink += perPixel.back() + decoded.back();
+		cout << "  " << left << setw(10) << format.name << right << setw(10) << perPixelMs << setw(13) << decodeMs << setw(7) << (perPixel == decoded ? "yes" : "NO") << endl;
+	}
+}
+
+// Mean over the pixels of the squared channel differences to their palette entries
+static double MeanSquaredError(const Image& image, const ColorPalette* pPalette, const unsigned short* qPixels)
+{
+	double sum = 0;
+	for (size_t i = 0; i < image.pixels.size(); ++i) {
+		Color c(image.pixels[i]), c2(pPalette->Entries[qPixels[i]]);
+		sum += sqr(c.GetA() - c2.GetA()) + sqr(c.GetR() - c2.GetR()) + sqr(c.GetG() - c2.GetG()) + sqr(c.GetB() - c2.GetB());
+	}
+	return sum / image.pixels.size();
+}
+
+// Learn dominates NeuQuant without dithering. Only the public QuantizeImage is used,
+// so the section builds against older trees as well for a before and after.
+static void BenchNeuQuant()
+{
+	cout << "  256 colours, seed 1, no dithering" << endl;
+	cout << "  image          ms       MSE" << endl;
+	const struct { UINT size; bool translucent; } images[] = { { 64, false }, { 512, false }, { 512, true }, { 1024, false }, { 1024, true } };
+	for (const auto& entry : images) {
+		mt19937 random(entry.size);
+		const auto image = MakeImage(entry.size, entry.size, random, entry.translucent);
+		const UINT nMaxColors = 256;
+		vector<BYTE> paletteBytes(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*) paletteBytes.data();
+		vector<unsigned short> qPixels(image.pixels.size());
+		const double ms = BestOf([&]() {
+			NeuralNet::NeuQuantizer quantizer;
+			quantizer.SetSeed(1);
+			UINT nColors = nMaxColors;
+			quantizer.QuantizeImage(image.pixels.data(), image.width, image.height, image.width * sizeof(ARGB), pPalette, qPixels.data(), nColors, false);
+		}, 3);
+		sink += qPixels.back();
+		cout << "  " << setw(4) << entry.size << "x" << left << setw(4) << entry.size << right << (entry.translucent ? " A" : "  ")
+			<< setw(9) << ms << setw(10) << MeanSquaredError(image, pPalette, qPixels.data()) << endl;
+	}
+}
+
+static vector<Section> GetSections()
+{
+	return {
+		{ "palette", "PaletteIndex k-d tree against a linear scan, per nearest colour query", BenchPaletteIndex },
+		{ "wavefront", "Serpentine error diffusion against the threaded raster wavefront at 4K and 8K", BenchWavefront },
+		{ "diffusion", "Floyd-Steinberg through the templated loop against the function-pointer loop it replaced", BenchDiffusion },
+		{ "kernels", "Throughput of each serpentine error diffusion kernel", BenchKernels },
+		{ "decode", "DecodeRows on indexed and 565 rows against a per-pixel decode", BenchDecodeRows },
+		{ "neuquant", "NeuQuant learning, timed through QuantizeImage without dithering", BenchNeuQuant },
+	};
+}
+
+int main(int argc, char** argv)
+{
+	const auto sections = GetSections();
+	vector<const Section*> selected;
+	for (int i = 1; i < argc; ++i) {
+		auto found = find_if(sections.begin(), sections.end(), [&](const Section& section) { return section.name == argv[i]; });
+		if (found == sections.end()) {
+			cerr << "Unknown section " << argv[i] << ", expected one of:" << endl;
+			for (const auto& section : sections)
+				cerr << "  " << section.name << "  " << section.description << endl;
+			return 1;
+		}
+		selected.emplace_back(&*found);
+	}
+	if (selected.empty()) {
+		for (const auto& section : sections)
+			selected.emplace_back(&section);
+	}
+
+	cout << fixed << setprecision(1);
+	for (auto pSection : selected) {
+		cout << pSection->name << ": " << pSection->description << endl;
+		pSection->run();
+		cout << endl;
+	}
+	return sink == UINT_MAX ? 2 : 0;
+}
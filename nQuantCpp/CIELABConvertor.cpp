@@ -1,187 +1,625 @@
-﻿#include "stdafx.h"
-#include "CIELABConvertor.h"
-
-#define _USE_MATH_DEFINES
-#include <math.h>
-
-#ifdef _DEBUG
-#define new DEBUG_NEW
-#endif	
-	
-void CIELABConvertor::RGB2LAB(const Color& c1, Lab& lab)
-{
-	double r = c1.GetR() / 255.0, g = c1.GetG() / 255.0, b = c1.GetB() / 255.0;
-	double x, y, z;
-
-	r = (r > 0.04045) ? pow((r + 0.055) / 1.055, 2.4) : r / 12.92;
-	g = (g > 0.04045) ? pow((g + 0.055) / 1.055, 2.4) : g / 12.92;
-	b = (b > 0.04045) ? pow((b + 0.055) / 1.055, 2.4) : b / 12.92;
-
-	x = (r * 0.4124 + g * 0.3576 + b * 0.1805) / 0.95047;
-	y = (r * 0.2126 + g * 0.7152 + b * 0.0722) / 1.00000;
-	z = (r * 0.0193 + g * 0.1192 + b * 0.9505) / 1.08883;
-
-	x = (x > 0.008856) ? cbrt(x) : (7.787 * x) + 16.0 / 116.0;
-	y = (y > 0.008856) ? cbrt(y) : (7.787 * y) + 16.0 / 116.0;
-	z = (z > 0.008856) ? cbrt(z) : (7.787 * z) + 16.0 / 116.0;
-
-	lab.alpha = c1.GetA();
-	lab.L = (116 * y) - 16;
-	lab.A = 500 * (x - y);
-	lab.B = 200 * (y - z);
-}
-	
-ARGB CIELABConvertor::LAB2RGB(const Lab& lab){
-	double y = (lab.L + 16) / 116;
-	double x = lab.A / 500 + y;
-	double z = y - lab.B / 200;
-	double r, g, b;
-
-	x = 0.95047 * ((x * x * x > 0.008856) ? x * x * x : (x - 16.0 / 116.0) / 7.787);
-	y = 1.00000 * ((y * y * y > 0.008856) ? y * y * y : (y - 16.0 / 116.0) / 7.787);
-	z = 1.08883 * ((z * z * z > 0.008856) ? z * z * z : (z - 16.0 / 116.0) / 7.787);
-
-	r = x *  3.2406 + y * -1.5372 + z * -0.4986;
-	g = x * -0.9689 + y *  1.8758 + z *  0.0415;
-	b = x *  0.0557 + y * -0.2040 + z *  1.0570;
-
-	r = (r > 0.0031308) ? (1.055 * pow(r, 1 / 2.4) - 0.055) : 12.92 * r;
-	g = (g > 0.0031308) ? (1.055 * pow(g, 1 / 2.4) - 0.055) : 12.92 * g;
-	b = (b > 0.0031308) ? (1.055 * pow(b, 1 / 2.4) - 0.055) : 12.92 * b;
-
-	return Color::MakeARGB(min(lab.alpha, BYTE_MAX), max(0, min(1, r)) * BYTE_MAX, max(0, min(1, g)) * BYTE_MAX, max(0, min(1, b)) * BYTE_MAX);
-}
-
-/*******************************************************************************
-* Conversions.
-******************************************************************************/
-
-inline constexpr double deg2Rad(const double deg)
-{
-	return (deg * (M_PI / 180.0));
-}
-
-inline constexpr double rad2Deg(const double rad)
-{
-	return ((180.0 / M_PI) * rad);
-}
-
-double CIELABConvertor::L_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2)
-{
-	const double k_L = 1.0;
-	double deltaLPrime = lab2.L - lab1.L;	
-	double barLPrime = (lab1.L + lab2.L) / 2.0;
-	double S_L = 1 + ((0.015 * pow(barLPrime - 50.0, 2.0)) / _sqrt(20 + pow(barLPrime - 50.0, 2.0)));
-	return deltaLPrime / (k_L * S_L);
-}
-
-double CIELABConvertor::C_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2)
-{
-	const double k_C = 1.0;
-	const double pow25To7 = 6103515625.0; /* pow(25, 7) */
-	double C1 = _sqrt((lab1.A * lab1.A) + (lab1.B * lab1.B));
-	double C2 = _sqrt((lab2.A * lab2.A) + (lab2.B * lab2.B));
-	double barC = (C1 + C2) / 2.0;
-	double G = 0.5 * (1 - _sqrt(pow(barC, 7) / (pow(barC, 7) + pow25To7)));
-	a1Prime = (1.0 + G) * lab1.A;
-	a2Prime = (1.0 + G) * lab2.A;
-
-	CPrime1 = _sqrt((a1Prime * a1Prime) + (lab1.B * lab1.B));
-	CPrime2 = _sqrt((a2Prime * a2Prime) + (lab2.B * lab2.B));
-	double deltaCPrime = CPrime2 - CPrime1;
-	double barCPrime = (CPrime1 + CPrime2) / 2.0;
-	
-	double S_C = 1 + (0.045 * barCPrime);
-	return deltaCPrime / (k_C * S_C);
-}
-
-double CIELABConvertor::H_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, const double a1Prime, const double a2Prime, const double CPrime1, const double CPrime2, double& barCPrime, double& barhPrime)
-{
-	const double k_H = 1.0;
-	constexpr double deg360InRad = deg2Rad(360.0);
-	constexpr double deg180InRad = deg2Rad(180.0);
-	double CPrimeProduct = CPrime1 * CPrime2;
-	double hPrime1;
-	if (lab1.B == 0 && a1Prime == 0)
-		hPrime1 = 0.0;
-	else {
-		hPrime1 = atan2(lab1.B, a1Prime);
-		/*
-		* This must be converted to a hue angle in degrees between 0
-		* and 360 by addition of 2π to negative hue angles.
-		*/
-		if (hPrime1 < 0)
-			hPrime1 += deg360InRad;
-	}
-	double hPrime2;
-	if (lab2.B == 0 && a2Prime == 0)
-		hPrime2 = 0.0;
-	else {
-		hPrime2 = atan2(lab2.B, a2Prime);
-		/*
-		* This must be converted to a hue angle in degrees between 0
-		* and 360 by addition of 2π to negative hue angles.
-		*/
-		if (hPrime2 < 0)
-			hPrime2 += deg360InRad;
-	}
-	double deltahPrime;
-	if (CPrimeProduct == 0)
-		deltahPrime = 0;
-	else {
-		/* Avoid the fabs() call */
-		deltahPrime = hPrime2 - hPrime1;
-		if (deltahPrime < -deg180InRad)
-			deltahPrime += deg360InRad;
-		else if (deltahPrime > deg180InRad)
-			deltahPrime -= deg360InRad;
-	}
-
-	double deltaHPrime = 2.0 * _sqrt(CPrimeProduct) * sin(deltahPrime / 2.0);
-	double hPrimeSum = hPrime1 + hPrime2;
-	if (CPrime1 * CPrime2 == 0) {
-		barhPrime = hPrimeSum;
-	}
-	else {
-		if (fabs(hPrime1 - hPrime2) <= deg180InRad)
-			barhPrime = hPrimeSum / 2.0;
-		else {
-			if (hPrimeSum < deg360InRad)
-				barhPrime = (hPrimeSum + deg360InRad) / 2.0;
-			else
-				barhPrime = (hPrimeSum - deg360InRad) / 2.0;
-		}
-	}
-
-	barCPrime = (CPrime1 + CPrime2) / 2.0;
-	double T = 1.0 - (0.17 * cos(barhPrime - deg2Rad(30.0))) +
-		(0.24 * cos(2.0 * barhPrime)) +
-		(0.32 * cos((3.0 * barhPrime) + deg2Rad(6.0))) -
-		(0.20 * cos((4.0 * barhPrime) - deg2Rad(63.0)));
-	double S_H = 1 + (0.015 * barCPrime * T);
-	return deltaHPrime / (k_H * S_H);
-}
-
-double CIELABConvertor::R_T(const double barCPrime, const double barhPrime, const double C_prime_div_k_L_S_L, const double H_prime_div_k_L_S_L)
-{
-	const double pow25To7 = 6103515625.0; /* pow(25, 7) */
-	double deltaTheta = deg2Rad(30.0) * exp(-pow((barhPrime - deg2Rad(275.0)) / deg2Rad(25.0), 2.0));
-	double R_C = 2.0 * _sqrt(pow(barCPrime, 7.0) / (pow(barCPrime, 7.0) + pow25To7));
-	double R_T = (-sin(2.0 * deltaTheta)) * R_C;
-	return R_T * C_prime_div_k_L_S_L * H_prime_div_k_L_S_L;
-}
-
-double CIELABConvertor::CIEDE2000(const Lab& lab1, const Lab& lab2)
-{
-	double deltaL_prime_div_k_L_S_L = L_prime_div_k_L_S_L(lab1, lab2);
-	double a1Prime, a2Prime, CPrime1, CPrime2;
-	double deltaC_prime_div_k_L_S_L = C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
-	double barCPrime, barhPrime;
-	double deltaH_prime_div_k_L_S_L = H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
-	double deltaR_T = R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
-	return
-		pow(deltaL_prime_div_k_L_S_L, 2.0) +
-		pow(deltaC_prime_div_k_L_S_L, 2.0) +
-		pow(deltaH_prime_div_k_L_S_L, 2.0) +
-		deltaR_T;
-}
+﻿#include "stdafx.h"
+#include "CIELABConvertor.h"
+#include "CpuFeatures.h"
+#include <algorithm>
+#include <cstring>
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LAB_SSE2
+#endif
+
+#ifdef _DEBUG
+#define new DEBUG_NEW
+#endif	
+	
+void CIELABConvertor::RGB2LAB(const Color& c1, Lab& lab)
+{
+	RGB2LAB(c1.GetR(), c1.GetG(), c1.GetB(), lab);
+	lab.alpha = c1.GetA();
+}
+
+void CIELABConvertor::RGB2LAB(const double red, const double green, const double blue, Lab& lab)
+{
+	double r = red / 255.0, g = green / 255.0, b = blue / 255.0;
+	double x, y, z;
+
+	r = (r > 0.04045) ? pow((r + 0.055) / 1.055, 2.4) : r / 12.92;
+	g = (g > 0.04045) ? pow((g + 0.055) / 1.055, 2.4) : g / 12.92;
+	b = (b > 0.04045) ? pow((b + 0.055) / 1.055, 2.4) : b / 12.92;
+
+	x = (r * 0.4124 + g * 0.3576 + b * 0.1805) / 0.95047;
+	y = (r * 0.2126 + g * 0.7152 + b * 0.0722) / 1.00000;
+	z = (r * 0.0193 + g * 0.1192 + b * 0.9505) / 1.08883;
+
+	x = (x > 0.008856) ? cbrt(x) : (7.787 * x) + 16.0 / 116.0;
+	y = (y > 0.008856) ? cbrt(y) : (7.787 * y) + 16.0 / 116.0;
+	z = (z > 0.008856) ? cbrt(z) : (7.787 * z) + 16.0 / 116.0;
+
+	lab.L = (116 * y) - 16;
+	lab.A = 500 * (x - y);
+	lab.B = 200 * (y - z);
+}
+	
+ARGB CIELABConvertor::LAB2RGB(const Lab& lab){
+	double y = (lab.L + 16) / 116;
+	double x = lab.A / 500 + y;
+	double z = y - lab.B / 200;
+	double r, g, b;
+
+	x = 0.95047 * ((x * x * x > 0.008856) ? x * x * x : (x - 16.0 / 116.0) / 7.787);
+	y = 1.00000 * ((y * y * y > 0.008856) ? y * y * y : (y - 16.0 / 116.0) / 7.787);
+	z = 1.08883 * ((z * z * z > 0.008856) ? z * z * z : (z - 16.0 / 116.0) / 7.787);
+
+	r = x *  3.2406 + y * -1.5372 + z * -0.4986;
+	g = x * -0.9689 + y *  1.8758 + z *  0.0415;
+	b = x *  0.0557 + y * -0.2040 + z *  1.0570;
+
+	r = (r > 0.0031308) ? (1.055 * pow(r, 1 / 2.4) - 0.055) : 12.92 * r;
+	g = (g > 0.0031308) ? (1.055 * pow(g, 1 / 2.4) - 0.055) : 12.92 * g;
+	b = (b > 0.0031308) ? (1.055 * pow(b, 1 / 2.4) - 0.055) : 12.92 * b;
+
+	return Color::MakeARGB(min(lab.alpha, BYTE_MAX), max(0, min(1, r)) * BYTE_MAX, max(0, min(1, g)) * BYTE_MAX, max(0, min(1, b)) * BYTE_MAX);
+}
+
+/*******************************************************************************
+* Conversions.
+******************************************************************************/
+
+inline constexpr double deg2Rad(const double deg)
+{
+	return (deg * (M_PI / 180.0));
+}
+
+inline constexpr double rad2Deg(const double rad)
+{
+	return ((180.0 / M_PI) * rad);
+}
+
+double CIELABConvertor::L_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2)
+{
+	const double k_L = 1.0;
+	double deltaLPrime = lab2.L - lab1.L;	
+	double barLPrime = (lab1.L + lab2.L) / 2.0;
+	double S_L = 1 + ((0.015 * pow(barLPrime - 50.0, 2.0)) / _sqrt(20 + pow(barLPrime - 50.0, 2.0)));
+	return deltaLPrime / (k_L * S_L);
+}
+
+double CIELABConvertor::C_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2)
+{
+	const double k_C = 1.0;
+	const double pow25To7 = 6103515625.0; /* pow(25, 7) */
+	double C1 = _sqrt((lab1.A * lab1.A) + (lab1.B * lab1.B));
+	double C2 = _sqrt((lab2.A * lab2.A) + (lab2.B * lab2.B));
+	double barC = (C1 + C2) / 2.0;
+	double G = 0.5 * (1 - _sqrt(pow(barC, 7) / (pow(barC, 7) + pow25To7)));
+	a1Prime = (1.0 + G) * lab1.A;
+	a2Prime = (1.0 + G) * lab2.A;
+
+	CPrime1 = _sqrt((a1Prime * a1Prime) + (lab1.B * lab1.B));
+	CPrime2 = _sqrt((a2Prime * a2Prime) + (lab2.B * lab2.B));
+	double deltaCPrime = CPrime2 - CPrime1;
+	double barCPrime = (CPrime1 + CPrime2) / 2.0;
+	
+	double S_C = 1 + (0.045 * barCPrime);
+	return deltaCPrime / (k_C * S_C);
+}
+
+double CIELABConvertor::H_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, const double a1Prime, const double a2Prime, const double CPrime1, const double CPrime2, double& barCPrime, double& barhPrime)
+{
+	const double k_H = 1.0;
+	constexpr double deg360InRad = deg2Rad(360.0);
+	constexpr double deg180InRad = deg2Rad(180.0);
+	double CPrimeProduct = CPrime1 * CPrime2;
+	double hPrime1;
+	if (lab1.B == 0 && a1Prime == 0)
+		hPrime1 = 0.0;
+	else {
+		hPrime1 = atan2(lab1.B, a1Prime);
+		/*
+		* This must be converted to a hue angle in degrees between 0
+		* and 360 by addition of 2π to negative hue angles.
+		*/
+		if (hPrime1 < 0)
+			hPrime1 += deg360InRad;
+	}
+	double hPrime2;
+	if (lab2.B == 0 && a2Prime == 0)
+		hPrime2 = 0.0;
+	else {
+		hPrime2 = atan2(lab2.B, a2Prime);
+		/*
+		* This must be converted to a hue angle in degrees between 0
+		* and 360 by addition of 2π to negative hue angles.
+		*/
+		if (hPrime2 < 0)
+			hPrime2 += deg360InRad;
+	}
+	double deltahPrime;
+	if (CPrimeProduct == 0)
+		deltahPrime = 0;
+	else {
+		/* Avoid the fabs() call */
+		deltahPrime = hPrime2 - hPrime1;
+		if (deltahPrime < -deg180InRad)
+			deltahPrime += deg360InRad;
+		else if (deltahPrime > deg180InRad)
+			deltahPrime -= deg360InRad;
+	}
+
+	double deltaHPrime = 2.0 * _sqrt(CPrimeProduct) * sin(deltahPrime / 2.0);
+	double hPrimeSum = hPrime1 + hPrime2;
+	if (CPrime1 * CPrime2 == 0) {
+		barhPrime = hPrimeSum;
+	}
+	else {
+		if (fabs(hPrime1 - hPrime2) <= deg180InRad)
+			barhPrime = hPrimeSum / 2.0;
+		else {
+			if (hPrimeSum < deg360InRad)
+				barhPrime = (hPrimeSum + deg360InRad) / 2.0;
+			else
+				barhPrime = (hPrimeSum - deg360InRad) / 2.0;
+		}
+	}
+
+	barCPrime = (CPrime1 + CPrime2) / 2.0;
+	double T = 1.0 - (0.17 * cos(barhPrime - deg2Rad(30.0))) +
+		(0.24 * cos(2.0 * barhPrime)) +
+		(0.32 * cos((3.0 * barhPrime) + deg2Rad(6.0))) -
+		(0.20 * cos((4.0 * barhPrime) - deg2Rad(63.0)));
+	double S_H = 1 + (0.015 * barCPrime * T);
+	return deltaHPrime / (k_H * S_H);
+}
+
+double CIELABConvertor::R_T(const double barCPrime, const double barhPrime, const double C_prime_div_k_L_S_L, const double H_prime_div_k_L_S_L)
+{
+	const double pow25To7 = 6103515625.0; /* pow(25, 7) */
+	double deltaTheta = deg2Rad(30.0) * exp(-pow((barhPrime - deg2Rad(275.0)) / deg2Rad(25.0), 2.0));
+	double R_C = 2.0 * _sqrt(pow(barCPrime, 7.0) / (pow(barCPrime, 7.0) + pow25To7));
+	double R_T = (-sin(2.0 * deltaTheta)) * R_C;
+	return R_T * C_prime_div_k_L_S_L * H_prime_div_k_L_S_L;
+}
+
+double CIELABConvertor::CIEDE2000(const Lab& lab1, const Lab& lab2)
+{
+	double deltaL_prime_div_k_L_S_L = L_prime_div_k_L_S_L(lab1, lab2);
+	double a1Prime, a2Prime, CPrime1, CPrime2;
+	double deltaC_prime_div_k_L_S_L = C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
+	double barCPrime, barhPrime;
+	double deltaH_prime_div_k_L_S_L = H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
+	double deltaR_T = R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
+	return
+		pow(deltaL_prime_div_k_L_S_L, 2.0) +
+		pow(deltaC_prime_div_k_L_S_L, 2.0) +
+		pow(deltaH_prime_div_k_L_S_L, 2.0) +
+		deltaR_T;
+}
+
+/*******************************************************************************
+* Batch conversion.
+******************************************************************************/
+
+// Pixels converted per pass, their linear R, G and B held on the stack
+const UINT LAB_BLOCK = 256;
+
+// sRGB channel value to linear light, the same curve as RGB2LAB
+struct LinearTable {
+	float value[256];
+
+	LinearTable()
+	{
+		for (int i = 0; i < 256; ++i) {
+			const double c = i / 255.0;
+			value[i] = (float) ((c > 0.04045) ? pow((c + 0.055) / 1.055, 2.4) : c / 12.92);
+		}
+	}
+};
+
+static const LinearTable& GetLinearTable()
+{
+	static const LinearTable table;
+	return table;
+}
+
+// Rows of the linear RGB to XYZ matrix of RGB2LAB, divided by the white point
+static const float XYZ[3][3] = {
+	{ (float) (0.4124 / 0.95047), (float) (0.3576 / 0.95047), (float) (0.1805 / 0.95047) },
+	{ 0.2126f, 0.7152f, 0.0722f },
+	{ (float) (0.0193 / 1.08883), (float) (0.1192 / 1.08883), (float) (0.9505 / 1.08883) }
+};
+static const float LAB_EPSILON = 0.008856f, LAB_KAPPA = 7.787f, LAB_OFFSET = 16.0f / 116.0f;
+// A third of the bits of a float plus CBRT_BIAS is within 4% of its cube root,
+// which CBRT_STEPS Newton steps refine
+static const int CBRT_BIAS = 0x2a5137a0, CBRT_STEPS = 2;
+
+// Cube root by the bit level guess and two Newton steps, within 2e-6 of the true
+// root above LAB_EPSILON. The SIMD versions below do the same operations lane by
+// lane, so every path gives the same floats.
+static inline float FastCbrt(const float x)
+{
+	int bits;
+	memcpy(&bits, &x, sizeof(bits));
+	bits = (int) ((float) bits * (1.0f / 3)) + CBRT_BIAS;
+	float y;
+	memcpy(&y, &bits, sizeof(y));
+	for (int k = 0; k < CBRT_STEPS; ++k)
+		y = (y + y + x / (y * y)) * (1.0f / 3);
+	return y;
+}
+
+static inline float LabF(const float t)
+{
+	return t > LAB_EPSILON ? FastCbrt(t) : LAB_KAPPA * t + LAB_OFFSET;
+}
+
+static void LinearToLab(const float* r, const float* g, const float* b, const UINT count, float* L, float* A, float* B)
+{
+	for (UINT i = 0; i < count; ++i) {
+		const float fx = LabF(r[i] * XYZ[0][0] + g[i] * XYZ[0][1] + b[i] * XYZ[0][2]);
+		const float fy = LabF(r[i] * XYZ[1][0] + g[i] * XYZ[1][1] + b[i] * XYZ[1][2]);
+		const float fz = LabF(r[i] * XYZ[2][0] + g[i] * XYZ[2][1] + b[i] * XYZ[2][2]);
+		L[i] = 116.0f * fy - 16.0f;
+		A[i] = 500.0f * (fx - fy);
+		B[i] = 200.0f * (fy - fz);
+	}
+}
+
+#ifdef LAB_SSE2
+static inline __m128 LabF(const __m128 t)
+{
+	const __m128 third = _mm_set1_ps(1.0f / 3);
+	__m128 y = _mm_castsi128_ps(_mm_add_epi32(_mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_castps_si128(t)), third)), _mm_set1_epi32(CBRT_BIAS)));
+	for (int k = 0; k < CBRT_STEPS; ++k)
+		y = _mm_mul_ps(_mm_add_ps(_mm_add_ps(y, y), _mm_div_ps(t, _mm_mul_ps(y, y))), third);
+	const __m128 linear = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(LAB_KAPPA), t), _mm_set1_ps(LAB_OFFSET));
+	const __m128 above = _mm_cmpgt_ps(t, _mm_set1_ps(LAB_EPSILON));
+	return _mm_or_ps(_mm_and_ps(above, y), _mm_andnot_ps(above, linear));
+}
+
+static void LinearToLabSSE2(const float* r, const float* g, const float* b, const UINT count, float* L, float* A, float* B)
+{
+	UINT i = 0;
+	for (; i + 4 <= count; i += 4) {
+		const __m128 vr = _mm_loadu_ps(r + i), vg = _mm_loadu_ps(g + i), vb = _mm_loadu_ps(b + i);
+		__m128 f[3];
+		for (int k = 0; k < 3; ++k)
+			f[k] = LabF(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vr, _mm_set1_ps(XYZ[k][0])), _mm_mul_ps(vg, _mm_set1_ps(XYZ[k][1]))), _mm_mul_ps(vb, _mm_set1_ps(XYZ[k][2]))));
+		_mm_storeu_ps(L + i, _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(116.0f), f[1]), _mm_set1_ps(16.0f)));
+		_mm_storeu_ps(A + i, _mm_mul_ps(_mm_set1_ps(500.0f), _mm_sub_ps(f[0], f[1])));
+		_mm_storeu_ps(B + i, _mm_mul_ps(_mm_set1_ps(200.0f), _mm_sub_ps(f[1], f[2])));
+	}
+	LinearToLab(r + i, g + i, b + i, count - i, L + i, A + i, B + i);
+}
+#endif // LAB_SSE2
+
+#ifdef NQUANT_X86
+TARGET_AVX2 static inline __m256 LabF(const __m256 t)
+{
+	const __m256 third = _mm256_set1_ps(1.0f / 3);
+	__m256 y = _mm256_castsi256_ps(_mm256_add_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_castps_si256(t)), third)), _mm256_set1_epi32(CBRT_BIAS)));
+	for (int k = 0; k < CBRT_STEPS; ++k)
+		y = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(y, y), _mm256_div_ps(t, _mm256_mul_ps(y, y))), third);
+	const __m256 linear = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(LAB_KAPPA), t), _mm256_set1_ps(LAB_OFFSET));
+	return _mm256_blendv_ps(linear, y, _mm256_cmp_ps(t, _mm256_set1_ps(LAB_EPSILON), _CMP_GT_OQ));
+}
+
+TARGET_AVX2 static void LinearToLabAVX2(const float* r, const float* g, const float* b, const UINT count, float* L, float* A, float* B)
+{
+	UINT i = 0;
+	for (; i + 8 <= count; i += 8) {
+		const __m256 vr = _mm256_loadu_ps(r + i), vg = _mm256_loadu_ps(g + i), vb = _mm256_loadu_ps(b + i);
+		__m256 f[3];
+		for (int k = 0; k < 3; ++k)
+			f[k] = LabF(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vr, _mm256_set1_ps(XYZ[k][0])), _mm256_mul_ps(vg, _mm256_set1_ps(XYZ[k][1]))), _mm256_mul_ps(vb, _mm256_set1_ps(XYZ[k][2]))));
+		_mm256_storeu_ps(L + i, _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(116.0f), f[1]), _mm256_set1_ps(16.0f)));
+		_mm256_storeu_ps(A + i, _mm256_mul_ps(_mm256_set1_ps(500.0f), _mm256_sub_ps(f[0], f[1])));
+		_mm256_storeu_ps(B + i, _mm256_mul_ps(_mm256_set1_ps(200.0f), _mm256_sub_ps(f[1], f[2])));
+	}
+	LinearToLab(r + i, g + i, b + i, count - i, L + i, A + i, B + i);
+}
+#endif // NQUANT_X86
+
+typedef void (*LinearToLabFn)(const float* r, const float* g, const float* b, const UINT count, float* L, float* A, float* B);
+
+// The widest path the processor has of at most maxLanes lanes
+static LinearToLabFn SelectLinearToLab(const UINT maxLanes)
+{
+#ifdef NQUANT_X86
+	if (maxLanes >= 8 && HasAVX2())
+		return LinearToLabAVX2;
+#endif
+#ifdef LAB_SSE2
+	if (maxLanes >= 4)
+		return LinearToLabSSE2;
+#endif
+	return LinearToLab;
+}
+
+static const LinearToLabFn linearToLab = SelectLinearToLab(UINT_MAX);
+
+static void BatchRGB2LAB(const ARGB* pixels, const UINT count, float* L, float* A, float* B, const LinearToLabFn linearToLab)
+{
+	const auto& table = GetLinearTable();
+	float r[LAB_BLOCK], g[LAB_BLOCK], b[LAB_BLOCK];
+	for (UINT i = 0; i < count; i += LAB_BLOCK) {
+		const UINT n = std::min(LAB_BLOCK, count - i);
+		for (UINT j = 0; j < n; ++j) {
+			Color c(pixels[i + j]);
+			r[j] = table.value[c.GetR()];
+			g[j] = table.value[c.GetG()];
+			b[j] = table.value[c.GetB()];
+		}
+		linearToLab(r, g, b, n, L + i, A + i, B + i);
+	}
+}
+
+void CIELABConvertor::RGB2LAB(const ARGB* pixels, const UINT count, float* L, float* A, float* B)
+{
+	BatchRGB2LAB(pixels, count, L, A, B, linearToLab);
+}
+
+UINT CIELABConvertor::RGB2LAB(const ARGB* pixels, const UINT count, float* L, float* A, float* B, const UINT maxLanes)
+{
+	const auto fn = SelectLinearToLab(maxLanes);
+	BatchRGB2LAB(pixels, count, L, A, B, fn);
+#ifdef NQUANT_X86
+	if (fn == LinearToLabAVX2)
+		return 8;
+#endif
+#ifdef LAB_SSE2
+	if (fn == LinearToLabSSE2)
+		return 4;
+#endif
+	return 1;
+}
+
+/*******************************************************************************
+* Batched colour difference.
+******************************************************************************/
+
+// Lanes of floats for the batched CIEDE2000, one float or an SSE2 or AVX2 register.
+// A comparison gives a mask that only Select takes. Every lane type does the same
+// IEEE operations, so a colour gets the same distance whichever path handles it.
+struct Float1 {
+	float v;
+	static const UINT SIZE = 1;
+	Float1(const float v) : v(v) {}
+	static Float1 Load(const float* p) { return *p; }
+	void Store(float* p) const { *p = v; }
+};
+
+inline Float1 operator+(const Float1 a, const Float1 b) { return a.v + b.v; }
+inline Float1 operator-(const Float1 a, const Float1 b) { return a.v - b.v; }
+inline Float1 operator*(const Float1 a, const Float1 b) { return a.v * b.v; }
+inline Float1 operator/(const Float1 a, const Float1 b) { return a.v / b.v; }
+inline Float1 Sqrt(const Float1 a) { return sqrtf(a.v); }
+inline Float1 Min(const Float1 a, const Float1 b) { return a.v < b.v ? a.v : b.v; }
+inline Float1 Max(const Float1 a, const Float1 b) { return a.v > b.v ? a.v : b.v; }
+inline Float1 Abs(const Float1 a) { return fabsf(a.v); }
+inline Float1 Greater(const Float1 a, const Float1 b) { return a.v > b.v ? 1.0f : 0.0f; }
+inline Float1 Select(const Float1 mask, const Float1 a, const Float1 b) { return mask.v != 0 ? a : b; }
+
+#ifdef LAB_SSE2
+struct Float4 {
+	__m128 v;
+	static const UINT SIZE = 4;
+	Float4(const __m128 v) : v(v) {}
+	Float4(const float f) : v(_mm_set1_ps(f)) {}
+	static Float4 Load(const float* p) { return _mm_loadu_ps(p); }
+	void Store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+inline Float4 operator+(const Float4 a, const Float4 b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator-(const Float4 a, const Float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator*(const Float4 a, const Float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline Float4 operator/(const Float4 a, const Float4 b) { return _mm_div_ps(a.v, b.v); }
+inline Float4 Sqrt(const Float4 a) { return _mm_sqrt_ps(a.v); }
+inline Float4 Min(const Float4 a, const Float4 b) { return _mm_min_ps(a.v, b.v); }
+inline Float4 Max(const Float4 a, const Float4 b) { return _mm_max_ps(a.v, b.v); }
+inline Float4 Abs(const Float4 a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+inline Float4 Greater(const Float4 a, const Float4 b) { return _mm_cmpgt_ps(a.v, b.v); }
+inline Float4 Select(const Float4 mask, const Float4 a, const Float4 b) { return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)); }
+#endif // LAB_SSE2
+
+#ifdef NQUANT_X86
+struct Float8 {
+	__m256 v;
+	static const UINT SIZE = 8;
+	TARGET_AVX2 Float8(const __m256 v) : v(v) {}
+	TARGET_AVX2 Float8(const float f) : v(_mm256_set1_ps(f)) {}
+	TARGET_AVX2 static Float8 Load(const float* p) { return _mm256_loadu_ps(p); }
+	TARGET_AVX2 void Store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+TARGET_AVX2 inline Float8 operator+(const Float8 a, const Float8 b) { return _mm256_add_ps(a.v, b.v); }
+TARGET_AVX2 inline Float8 operator-(const Float8 a, const Float8 b) { return _mm256_sub_ps(a.v, b.v); }
+TARGET_AVX2 inline Float8 operator*(const Float8 a, const Float8 b) { return _mm256_mul_ps(a.v, b.v); }
+TARGET_AVX2 inline Float8 operator/(const Float8 a, const Float8 b) { return _mm256_div_ps(a.v, b.v); }
+TARGET_AVX2 inline Float8 Sqrt(const Float8 a) { return _mm256_sqrt_ps(a.v); }
+TARGET_AVX2 inline Float8 Min(const Float8 a, const Float8 b) { return _mm256_min_ps(a.v, b.v); }
+TARGET_AVX2 inline Float8 Max(const Float8 a, const Float8 b) { return _mm256_max_ps(a.v, b.v); }
+TARGET_AVX2 inline Float8 Abs(const Float8 a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+TARGET_AVX2 inline Float8 Greater(const Float8 a, const Float8 b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+TARGET_AVX2 inline Float8 Select(const Float8 mask, const Float8 a, const Float8 b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+
+// GCC only inlines the lanes of Float8 into a function built for AVX2, so the whole
+// kernel is pulled into its AVX2 entry point
+#ifdef _MSC_VER
+#define TARGET_AVX2_FLATTEN TARGET_AVX2
+#else
+#define TARGET_AVX2_FLATTEN TARGET_AVX2 __attribute__((flatten))
+#endif
+#endif // NQUANT_X86
+
+// Arc tangent of y / x in 0 .. 2 pi, 0 for the origin, within 2e-6 of atan2
+template <typename V>
+inline V Atan2(const V y, const V x)
+{
+	const V ax = Abs(x), ay = Abs(y);
+	const V hi = Max(ax, ay);
+	const V z = Min(ax, ay) / Select(Greater(hi, 0.0f), hi, 1.0f);
+	const V z2 = z * z;
+	V a = z * (((((-0.0117190732f * z2 + 0.0526472144f) * z2 - 0.116426393f) * z2 + 0.193540365f) * z2 - 0.332622826f) * z2 + 0.999977231f);
+	a = Select(Greater(ay, ax), (float) (M_PI / 2) - a, a);
+	a = Select(Greater(0.0f, x), (float) M_PI - a, a);
+	return Select(Greater(0.0f, y), (float) (2 * M_PI) - a, a);
+}
+
+// CIEDE2000 of lab1 against count colours given by L, A, B and chroma C, lanes at a
+// time; returns how many were done, the rest being fewer than a lane.
+// G depends on the mean chroma of each pair, so only the chroma of every colour is
+// worked out ahead. The hue angles are not needed: the hue difference follows from
+// the unit vectors of the (a', b') pairs, and cos(k * mean hue) from powers of the
+// unit vector halfway between them. The mean hue itself, needed for
+// the rotation term, comes from Atan2, its exponential from Horner steps on a
+// sixteenth of the exponent squared four times, and its sine from a Taylor series.
+template <typename V>
+inline UINT CIEDE2000Lanes(const CIELABConvertor::Lab& lab1, const float C1, const float* L, const float* A, const float* B, const float* C, const UINT count, float* distances)
+{
+	const V L1 = (float) lab1.L, a1 = (float) lab1.A, b1 = (float) lab1.B, Cab1 = C1;
+	const float deg = (float) (M_PI / 180);
+	const float cos30 = (float) cos(M_PI / 6), sin30 = 0.5f, cos6 = (float) cos(M_PI / 30), sin6 = (float) sin(M_PI / 30);
+	const float cos63 = (float) cos(M_PI * 0.35), sin63 = (float) sin(M_PI * 0.35);
+	UINT i = 0;
+	for (; i + V::SIZE <= count; i += V::SIZE) {
+		const V L2 = V::Load(L + i), a2 = V::Load(A + i), b2 = V::Load(B + i), Cab2 = V::Load(C + i);
+
+		const V barL = (L1 + L2) * 0.5f - 50.0f;
+		const V S_L = 1.0f + 0.015f * barL * barL / Sqrt(20.0f + barL * barL);
+		const V dL = (L2 - L1) / S_L;
+
+		const V barC = (Cab1 + Cab2) * 0.5f;
+		const V barC2 = barC * barC, barC7 = barC2 * barC2 * barC2 * barC;
+		const V G = 1.0f + 0.5f * (1.0f - Sqrt(barC7 / (barC7 + 6103515625.0f)));
+		const V a1p = G * a1, a2p = G * a2;
+		const V Cp1 = Sqrt(a1p * a1p + b1 * b1), Cp2 = Sqrt(a2p * a2p + b2 * b2);
+		const V barCp = (Cp1 + Cp2) * 0.5f;
+		const V dC = (Cp2 - Cp1) / (1.0f + 0.045f * barCp);
+
+		// Unit vectors of the hues, 0 for grey. 2 sin(dh' / 2) is the length of their
+		// difference, which unlike 1 - cos(dh') keeps its precision for close hues, and
+		// takes the sign of the turn from the first to the second.
+		const V r1 = Select(Greater(Cp1, 0.0f), 1.0f / Cp1, 0.0f), r2 = Select(Greater(Cp2, 0.0f), 1.0f / Cp2, 0.0f);
+		const V ux1 = a1p * r1, uy1 = b1 * r1, ux2 = a2p * r2, uy2 = b2 * r2;
+		const V dx = ux2 - ux1, dy = uy2 - uy1;
+		const V dHabs = Sqrt(Cp1 * Cp2 * (dx * dx + dy * dy));
+		const V dH0 = Select(Greater(uy1 * ux2, ux1 * uy2), 0.0f - dHabs, dHabs);
+
+		// Unit vector of the mean hue, the hue of one vector alone when the other is grey
+		const V sx = ux1 + ux2, sy = uy1 + uy2;
+		const V norm = Sqrt(sx * sx + sy * sy);
+		const V hasHue = Greater(norm, 0.0f);
+		const V c = Select(hasHue, sx / Select(hasHue, norm, 1.0f), 1.0f), s = Select(hasHue, sy / Select(hasHue, norm, 1.0f), 0.0f);
+		const V c2 = c * c - s * s, s2 = 2.0f * c * s;
+		const V c3 = c2 * c - s2 * s, s3 = s2 * c + c2 * s;
+		const V c4 = c2 * c2 - s2 * s2, s4 = 2.0f * c2 * s2;
+		const V T = 1.0f - 0.17f * (c * cos30 + s * sin30) + 0.24f * c2
+			+ 0.32f * (c3 * cos6 - s3 * sin6) - 0.20f * (c4 * cos63 + s4 * sin63);
+		const V dH = dH0 / (1.0f + 0.015f * barCp * T);
+
+		// exp(-((h' - 275) / 25)^2), beyond 4 widths of 25 degrees as small as float can tell
+		const V x = (Atan2(sy, sx) - 275 * deg) * (1 / (25 * deg));
+		const V e = Min(x * x, 16.0f) * (1.0f / 16);
+		V expo = 1.0f - e * (1.0f - e * (1.0f / 2 - e * (1.0f / 6 - e * (1.0f / 24 - e * (1.0f / 120 - e * (1.0f / 720 - e * (1.0f / 5040 - e * (1.0f / 40320 - e * (1.0f / 362880)))))))));
+		for (int k = 0; k < 4; ++k)
+			expo = expo * expo;
+		const V theta = 60 * deg * expo;
+		const V theta2 = theta * theta;
+		const V sin2Theta = theta * (1.0f - theta2 * (1.0f / 6 - theta2 * (1.0f / 120 - theta2 * (1.0f / 5040 - theta2 * (1.0f / 362880)))));
+		const V barCp2 = barCp * barCp, barCp7 = barCp2 * barCp2 * barCp2 * barCp;
+		const V R_C = 2.0f * Sqrt(barCp7 / (barCp7 + 6103515625.0f));
+
+		(dL * dL + dC * dC + dH * dH - sin2Theta * R_C * dC * dH).Store(distances + i);
+	}
+	return i;
+}
+
+#ifdef NQUANT_X86
+TARGET_AVX2_FLATTEN static UINT CIEDE2000AVX2(const CIELABConvertor::Lab& lab1, const float C1, const float* L, const float* A, const float* B, const float* C, const UINT count, float* distances)
+{
+	return CIEDE2000Lanes<Float8>(lab1, C1, L, A, B, C, count, distances);
+}
+#endif
+
+static UINT CIEDE2000SIMD(const CIELABConvertor::Lab& lab1, const float C1, const float* L, const float* A, const float* B, const float* C, const UINT count, float* distances)
+{
+#ifdef LAB_SSE2
+	return CIEDE2000Lanes<Float4>(lab1, C1, L, A, B, C, count, distances);
+#else
+	return 0;
+#endif
+}
+
+typedef UINT (*CIEDE2000Fn)(const CIELABConvertor::Lab& lab1, const float C1, const float* L, const float* A, const float* B, const float* C, const UINT count, float* distances);
+
+static CIEDE2000Fn SelectCIEDE2000()
+{
+#ifdef NQUANT_X86
+	if (HasAVX2())
+		return CIEDE2000AVX2;
+#endif
+	return CIEDE2000SIMD;
+}
+
+static const CIEDE2000Fn ciede2000Lanes = SelectCIEDE2000();
+
+void CIELABConvertor::CIEDE2000(const Lab& lab1, const float* L, const float* A, const float* B, const float* C, const UINT count, float* distances)
+{
+	const float a1 = (float) lab1.A, b1 = (float) lab1.B;
+	const float C1 = sqrtf(a1 * a1 + b1 * b1);
+	const UINT done = ciede2000Lanes(lab1, C1, L, A, B, C, count, distances);
+	CIEDE2000Lanes<Float1>(lab1, C1, L + done, A + done, B + done, C + done, count - done, distances + done);
+}
+
+void LabPalette::Build(const ColorPalette* pPalette, const UINT nMaxColors)
+{
+	m_alpha.resize(nMaxColors);
+	m_L.resize(nMaxColors);
+	m_A.resize(nMaxColors);
+	m_B.resize(nMaxColors);
+	m_C.resize(nMaxColors);
+	CIELABConvertor::RGB2LAB(pPalette->Entries, nMaxColors, m_L.data(), m_A.data(), m_B.data());
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		m_alpha[i] = Color(pPalette->Entries[i]).GetA();
+		m_C[i] = sqrtf(m_A[i] * m_A[i] + m_B[i] * m_B[i]);
+	}
+}
+
+void LabPalette::Clear()
+{
+	m_alpha.clear();
+	m_L.clear();
+	m_A.clear();
+	m_B.clear();
+	m_C.clear();
+}
+
+void LabPalette::Nearest(const CIELABConvertor::Lab& lab1, UINT* indices, float* distances) const
+{
+	indices[0] = indices[1] = 0;
+	distances[0] = distances[1] = FLT_MAX;
+	float curdist[LAB_BLOCK];
+	const UINT nMaxColors = Size();
+	for (UINT i = 0; i < nMaxColors; i += LAB_BLOCK) {
+		const UINT n = std::min(LAB_BLOCK, nMaxColors - i);
+		CIELABConvertor::CIEDE2000(lab1, &m_L[i], &m_A[i], &m_B[i], &m_C[i], n, curdist);
+		for (UINT j = 0; j < n; ++j) {
+			const float diff = m_alpha[i + j] - lab1.alpha;
+			const float d = diff * diff + curdist[j];
+			if (d < distances[0]) {
+				indices[1] = indices[0];
+				distances[1] = distances[0];
+				indices[0] = i + j;
+				distances[0] = d;
+			}
+			else if (d < distances[1]) {
+				indices[1] = i + j;
+				distances[1] = d;
+			}
+		}
+	}
+}
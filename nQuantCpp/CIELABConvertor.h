@@ -1,4 +1,5 @@
 #pragma once
+#include <vector>
 
 class CIELABConvertor
 {
@@ -13,6 +14,15 @@ public:
 	
 	static ARGB LAB2RGB(const Lab& lab);
 	static void RGB2LAB(const Color& c1, Lab& lab);
+	// L, A and B of channels in the range 0 .. 255 which need not be whole, alpha left as it is
+	static void RGB2LAB(const double red, const double green, const double blue, Lab& lab);
+	// L, A and B of count pixels at once, in float and column by column. sRGB goes through
+	// a table and cube roots through a bit level guess and Newton steps, with SSE2 or AVX2
+	// doing several pixels at a time. Each value is within 0.0005 of RGB2LAB.
+	static void RGB2LAB(const ARGB* pixels, const UINT count, float* L, float* A, float* B);
+	// The same on the widest path of at most maxLanes pixels at a time, returning the lanes
+	// of the path taken, so that the scalar, SSE2 and AVX2 paths can be checked alike
+	static UINT RGB2LAB(const ARGB* pixels, const UINT count, float* L, float* A, float* B, const UINT maxLanes);
 	static double L_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2);
 	static double C_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2);
 	static double H_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, const double a1Prime, const double a2Prime, const double CPrime1, const double CPrime2, double& barCPrime, double& barhPrime);
@@ -24,4 +34,25 @@ public:
 	/* Color Res. Appl., vol. 30, no. 1, pp. 21-30, Feb. 2005. */
 	/* Return the CIEDE2000 Delta E color difference measure squared, for two Lab values */
 	static double CIEDE2000(const Lab& lab1, const Lab& lab2);
+	// Squared CIEDE2000 from lab1 to count colours given column by column, with C their
+	// chroma sqrt(A * A + B * B), worked out in float several colours at a time with
+	// SSE2 or AVX2. Each distance is within 0.01 + 0.1% of CIEDE2000, unless the hues
+	// are within a tenth of a degree of opposite, where CIEDE2000 itself jumps.
+	static void CIEDE2000(const Lab& lab1, const float* L, const float* A, const float* B, const float* C, const UINT count, float* distances);
+};
+
+// Lab, chroma and alpha of the entries of a palette column by column, for finding the
+// entries nearest to a colour by sqr(dAlpha) + CIEDE2000 with the batched CIEDE2000
+class LabPalette
+{
+	public:
+		void Build(const ColorPalette* pPalette, const UINT nMaxColors);
+		void Clear();
+		UINT Size() const { return (UINT) m_L.size(); }
+		// Nearest and second nearest entries with their distances, the first entry found
+		// of several at equal distance. The second is FLT_MAX away for a single entry.
+		void Nearest(const CIELABConvertor::Lab& lab1, UINT* indices, float* distances) const;
+
+	private:
+		std::vector<float> m_alpha, m_L, m_A, m_B, m_C;
 };
\ No newline at end of file
@@ -0,0 +1,113 @@
+#pragma once
+#include <memory>
+#include "bitmapUtilities.h"
+using namespace std;
+
+// Largest power of two records of recordSize bytes that fit in maxBytes
+constexpr UINT FloorCapacity(const size_t maxBytes, const size_t recordSize, const UINT capacity = 1)
+{
+	return 2 * capacity * recordSize <= maxBytes ? FloorCapacity(maxBytes, recordSize, 2 * capacity) : capacity;
+}
+
+// Cache of the two palette entries closest to a colour, kept as {idx0, idx1, d0, d1}
+// records in a flat open addressing table. The table starts at 1K records and doubles
+// with the number of distinct colours seen, up to 16MB: 1M records of unsigned short,
+// 256K records of double. From then on a colour whose probe run is full replaces the
+// record in its home slot, so memory stays bounded on photographs.
+template <typename T>
+class ClosestCache
+{
+	public:
+		bool Find(const ARGB argb, T* closest) const
+		{
+			if (!m_capacity)
+				return false;
+
+			UINT slot = Hash(argb);
+			for (UINT i = 0; i < MAX_PROBES; ++i, slot = (slot + 1) & (m_capacity - 1)) {
+				const auto& entry = m_entries[slot];
+				if (!entry.used)
+					return false;
+
+				if (entry.argb == argb) {
+					for (int j = 0; j < 4; ++j)
+						closest[j] = entry.closest[j];
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void Insert(const ARGB argb, const T* closest)
+		{
+			if (2 * (m_size + 1) > m_capacity && m_capacity < MAX_CAPACITY)
+				Grow();
+			Place(argb, closest);
+		}
+
+		void Clear()
+		{
+			m_entries.reset();
+			m_capacity = m_size = 0;
+			m_shift = 32;
+		}
+
+	private:
+		struct Entry {
+			ARGB argb;
+			T closest[4];
+			bool used;
+		};
+
+		static const UINT MIN_CAPACITY = 1 << 10;
+		static const size_t MAX_BYTES = 16 << 20;
+		static const UINT MAX_CAPACITY = FloorCapacity(MAX_BYTES, sizeof(Entry));
+		static const UINT MAX_PROBES = 16;
+
+		unique_ptr<Entry[]> m_entries;
+		UINT m_capacity = 0, m_size = 0;
+		int m_shift = 32;
+
+		inline UINT Hash(const ARGB argb) const
+		{
+			return (argb * 2654435769U) >> m_shift;
+		}
+
+		void Place(const ARGB argb, const T* closest)
+		{
+			UINT slot = Hash(argb);
+			Entry* pEntry = &m_entries[slot];
+			for (UINT i = 0; i < MAX_PROBES; ++i, slot = (slot + 1) & (m_capacity - 1)) {
+				auto& entry = m_entries[slot];
+				if (!entry.used) {
+					entry.used = true;
+					++m_size;
+					pEntry = &entry;
+					break;
+				}
+				if (entry.argb == argb) {
+					pEntry = &entry;
+					break;
+				}
+			}
+
+			pEntry->argb = argb;
+			for (int j = 0; j < 4; ++j)
+				pEntry->closest[j] = closest[j];
+		}
+
+		void Grow()
+		{
+			auto entries = move(m_entries);
+			const UINT capacity = m_capacity;
+			m_capacity = capacity ? capacity * 2 : MIN_CAPACITY;
+			m_entries = make_unique<Entry[]>(m_capacity);
+			m_size = 0;
+			for (m_shift = 32; (1U << (32 - m_shift)) < m_capacity; --m_shift)
+				;
+			for (UINT i = 0; i < capacity; ++i) {
+				if (entries[i].used)
+					Place(entries[i].argb, entries[i].closest);
+			}
+		}
+};
@@ -18,6 +18,7 @@
 #include "stdafx.h"
 #include "DivQuantizer.h"
 #include "bitmapUtilities.h"
+#include "InverseColormap.h"
 #include "CIELABConvertor.h"
 #include <algorithm>
 #include <unordered_map>
@@ -25,12 +26,7 @@
 
 namespace DivQuant
 {
-	double PR = .2126, PG = .7152, PB = .0722;
 	const int COLOR_HASH_SIZE = 20023;
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
 
 	struct Bucket
 	{
@@ -39,18 +35,7 @@ namespace DivQuant
 		shared_ptr<Bucket> next;
 	};
 	
-	template <
-		typename T, //real type
-		typename = typename std::enable_if<std::is_arithmetic<T>::value, T>::type
-	> struct Pixel
-	{
-		T alpha = BYTE_MAX;
-		double L = 0, A = 0, B = 0;
-		ARGB argb = 0;
-		T weight = 0;
-	};
-
-	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
+	void DivQuantizer::getLab(const Color& c, CIELABConvertor::Lab& lab1)
 	{
 		auto got = pixelMap.find(c.GetValue());
 		if (got == pixelMap.end()) {
@@ -152,7 +137,7 @@ namespace DivQuant
 			cmap[i] = pixelVec[i];
 	}
 
-	bool map_colors_mps(const ARGB* inPixelsPtr, UINT numPixels, ARGB* qPixels, ColorPalette* pPalette)
+	bool DivQuantizer::map_colors_mps(const ARGB* inPixelsPtr, UINT numPixels, unsigned short* qPixels, ColorPalette* pPalette)
 	{
 		const UINT colormapSize = pPalette->Count;
 		const int size_lut_init = 4 * BYTE_MAX + 1;
@@ -250,15 +235,14 @@ namespace DivQuant
 				}
 			}
 
-			Color c2(pPalette->Entries[index]);			
-			qPixels[ik] = hasSemiTransparency ? c2.GetValue() : GetARGBIndex(c2, hasSemiTransparency);
+			qPixels[ik] = index;
 		}
 		return true;
 	}
 
 	// MT  : type of the member attribute, either BYTE or UINT
 	template <typename MT>
-	void DivQuantClusterInitMeanAndVar(const int num_points, const ARGB* data, const double data_weight, double* weightsPtr, Pixel<double>& total_mean, Pixel<double>& total_var)
+	void DivQuantizer::DivQuantClusterInitMeanAndVar(const int num_points, const ARGB* data, const double data_weight, double* weightsPtr, Pixel<double>& total_mean, Pixel<double>& total_var)
 	{
 		double mean_alpha = 0.0, mean_L = 0.0, mean_A = 0.0, mean_B = 0.0;
 		double var_alpha = 0.0, var_L = 0.0, var_A = 0.0, var_B = 0.0;
@@ -330,7 +314,7 @@ namespace DivQuant
 
 	// MT  : type of the member attribute, either BYTE or UINT
 	template <typename MT>
-	void DivQuantCluster(const int num_points, ARGB* data, ARGB* tmp_buffer, const double data_weight, double* weightsPtr,
+	void DivQuantizer::DivQuantCluster(const int num_points, ARGB* data, ARGB* tmp_buffer, const double data_weight, double* weightsPtr,
 		const int num_bits, const int max_iters, ColorPalette* pPalette, UINT& nMaxColors)
 	{
 		const UINT num_colors = nMaxColors;
@@ -911,8 +895,11 @@ namespace DivQuant
 			DivQuantCluster<UINT>(numPixels, inputPixels.get(), tmpPixels.get(), weightUniform, weightsPtr.get(), num_bits, max_iters, pPalette, nMaxColors);
 	}
 	
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short DivQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
+		if (nMaxColors > 32)
+			return m_paletteIndex.Nearest(pPalette, nMaxColors, argb, PR, PG, PB);
+
 		unsigned short k = 0;
 		Color c(argb);
 
@@ -926,40 +913,26 @@ namespace DivQuant
 			if (curdist > mindist)
 				continue;
 
-			if (nMaxColors > 32) {
-				curdist += PR * sqr(c2.GetR() - c.GetR());
-				if (curdist > mindist)
-					continue;
+			getLab(c2, lab2);
 
-				curdist += PG * sqr(c2.GetG() - c.GetG());
-				if (curdist > mindist)
-					continue;
+			double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1, lab2);
+			curdist += sqr(deltaL_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
 
-				curdist += PB * sqr(c2.GetB() - c.GetB());
-			}
-			else {
-				getLab(c2, lab2);
-
-				double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1, lab2);
-				curdist += sqr(deltaL_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				double a1Prime, a2Prime, CPrime1, CPrime2;
-				double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
-				curdist += sqr(deltaC_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				double barCPrime, barhPrime;
-				double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
-				curdist += sqr(deltaH_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				curdist += CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);		
-			}
-			
+			double a1Prime, a2Prime, CPrime1, CPrime2;
+			double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
+			curdist += sqr(deltaC_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
+
+			double barCPrime, barhPrime;
+			double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
+			curdist += sqr(deltaH_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
+
+			curdist += CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
 			if (curdist > mindist)
 				continue;
 			mindist = curdist;
@@ -968,10 +941,20 @@ namespace DivQuant
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool DivQuantizer::quantize_image(const ARGB* pixels, ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
 	{
-		if (dither)
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);		
+		if (dither || m_colormapRemap) {
+			InverseColormap colormap;
+			if (nMaxColors > 32 && width * height >= MIN_COLORMAP_PIXELS)
+				colormap.Build(pPalette, nMaxColors, hasSemiTransparency, PR, PG, PB);
+			else if (!dither || IsThreadedDither(m_ditherMode))
+				colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+			if (!dither) {
+				colormap.Remap(pixels, width * height, qPixels);
+				return true;
+			}
+			return dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+		}
 
 		UINT pixelIndex = 0;
 		for (UINT j = 0; j < height; ++j) {
@@ -981,31 +964,29 @@ namespace DivQuant
 		return true;
 	}
 
-	bool DivQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool DivQuantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
-
-		int pixelIndex = 0;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
-
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		const UINT nSize = width * height;
 		pPalette->Count = nMaxColors;
+		PR = .2126, PG = .7152, PB = .0722;
+		pixelMap.clear();
+		m_paletteIndex.Clear();
 
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			quant_varpart_fast(pixels.data(), pixels.size(), pPalette);
-			if (dither)
-				dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			else
-				map_colors_mps(pixels.data(), pixels.size(), qPixels.get(), pPalette);
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			quant_varpart_fast(pixels, nSize, pPalette);
+			if (dither) {
+				InverseColormap colormap;
+				if (width * height >= MIN_COLORMAP_PIXELS)
+					colormap.Build(pPalette, nMaxColors, hasSemiTransparency, PR, PG, PB);
+				else if (IsThreadedDither(m_ditherMode))
+					colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+				return dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+			}
+			return map_colors_mps(pixels, nSize, qPixels, pPalette);
 		}		
 
 		if (nMaxColors > 2)
-			quant_varpart_fast(pixels.data(), pixels.size(), pPalette);			
+			quant_varpart_fast(pixels, nSize, pPalette);			
 		else {
 			if (m_transparentPixelIndex >= 0) {
 				pPalette->Entries[0] = m_transparentColor;
@@ -1020,8 +1001,7 @@ namespace DivQuant
 		if (hasSemiTransparency || nMaxColors <= 32)
 			PR = PG = PB = 1;
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
+		quantize_image(pixels, pPalette, nMaxColors, qPixels, width, height, dither);
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -1030,8 +1010,40 @@ namespace DivQuant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
+		return true;
+	}
+
+	bool DivQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
+
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither);
+	}
+
+#ifdef _WIN32
+	bool DivQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(pixels.size());
+		if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
 
+		if (nMaxColors > 256)
+			return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
 
-}
\ No newline at end of file
+}
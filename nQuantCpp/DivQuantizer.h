@@ -1,6 +1,10 @@
 #pragma once
+#include "CIELABConvertor.h"
 #include <memory>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
+#include "PaletteIndex.h"
 using namespace std;
 
 namespace DivQuant
@@ -21,12 +25,53 @@ namespace DivQuant
 	// Use at your own risk!
 	// =============================================================
 
+	template <
+		typename T, //real type
+		typename = typename std::enable_if<std::is_arithmetic<T>::value, T>::type
+	> struct Pixel
+	{
+		T alpha = BYTE_MAX;
+		double L = 0, A = 0, B = 0;
+		ARGB argb = 0;
+		T weight = 0;
+	};
+
 	class DivQuantizer
 	{
 		public:
 			void quant_varpart_fast(const ARGB* inPixels, const UINT numPixels, ColorPalette* pPalette,
 				const UINT numRows = 1, const bool allPixelsUnique = true,
 				const int num_bits = 8, const int dec_factor = 1, const int max_iters = 10);
-			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+			// Quantizes a caller-owned 32bpp ARGB buffer, stride in bytes. pPalette must hold
+			// nMaxColors entries and qPixels width * height indices into it.
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#ifdef _WIN32
+			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#endif // _WIN32
+			// Remaps without dithering through an InverseColormap, one table lookup per pixel
+			// instead of a palette search. Faster on large images, but each colour is reduced to
+			// the 5-6-5 or 4-4-4-4 bits of its cell first. Applies up to 256 colours, off by default.
+			void SetColormapRemap(const bool colormapRemap) { m_colormapRemap = colormapRemap; }
+
+		private:
+			double PR = .2126, PG = .7152, PB = .0722;
+			bool hasSemiTransparency = false;
+			bool m_colormapRemap = false;
+			int m_transparentPixelIndex = -1;
+			DitherMode m_ditherMode = DitherMode::ErrorDiffusion;
+			ARGB m_transparentColor = Color::Transparent;
+			unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
+			PaletteIndex m_paletteIndex;
+
+			void getLab(const Color& c, CIELABConvertor::Lab& lab1);
+			bool map_colors_mps(const ARGB* inPixelsPtr, UINT numPixels, unsigned short* qPixels, ColorPalette* pPalette);
+			template <typename MT>
+			void DivQuantClusterInitMeanAndVar(const int num_points, const ARGB* data, const double data_weight, double* weightsPtr, Pixel<double>& total_mean, Pixel<double>& total_var);
+			template <typename MT>
+			void DivQuantCluster(const int num_points, ARGB* data, ARGB* tmp_buffer, const double data_weight, double* weightsPtr,
+				const int num_bits, const int max_iters, ColorPalette* pPalette, UINT& nMaxColors);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+			bool QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither);
 	};
 }
\ No newline at end of file
@@ -44,15 +44,12 @@
 #include "stdafx.h"
 #include "Dl3Quantizer.h"
 #include "bitmapUtilities.h"
+#include "Histogram.h"
+#include "InverseColormap.h"
 #include <unordered_map>
 
 namespace Dl3Quant
 {
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, vector<unsigned short> > closestMap;
-
 	using namespace std;
 
 	struct CUBE3 {
@@ -102,23 +99,25 @@ namespace Dl3Quant
 		return (dist1 + dist2);
 	}
 
-	void build_table3(CUBE3* rgb_table3, ARGB argb)
+	void build_table3(CUBE3* rgb_table3, const ARGB* pixels, const UINT nSize, const bool hasSemiTransparency)
 	{
-		Color c(argb);
-		int index = GetARGBIndex(c, hasSemiTransparency);
+		auto histogram = make_unique<HistogramBin[]>(65536);
+		BuildHistogram(pixels, nSize, hasSemiTransparency, histogram.get());
+		for (int i = 0; i < 65536; ++i) {
+			const auto& hb = histogram[i];
+			if (!hb.cnt)
+				continue;
 
-		rgb_table3[index].a += c.GetA();
-		rgb_table3[index].r += c.GetR();
-		rgb_table3[index].g += c.GetG();
-		rgb_table3[index].b += c.GetB();
-		rgb_table3[index].pixel_count++;
+			rgb_table3[i].a += (int) hb.a;
+			rgb_table3[i].r += (int) hb.r;
+			rgb_table3[i].g += (int) hb.g;
+			rgb_table3[i].b += (int) hb.b;
+			rgb_table3[i].pixel_count += hb.cnt;
+		}
 	}
 
-	UINT build_table3(CUBE3* rgb_table3, vector<ARGB>& pixels)
+	UINT compact_table3(CUBE3* rgb_table3)
 	{
-		for (const auto & pixel : pixels)
-			build_table3(rgb_table3, pixel);
-
 		UINT tot_colors = 0;
 		for (int i = 0; i < 65536; ++i) {
 			if (rgb_table3[i].pixel_count > 0) {
@@ -207,43 +206,17 @@ namespace Dl3Quant
 		}
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short Dl3Quantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
-		unsigned short k = 0;
-		Color c(argb);
-
-		double mindist = INT_MAX;
-		for (UINT i = 0; i < nMaxColors; ++i) {
-			Color c2(pPalette->Entries[i]);
-			double curdist = sqr(c2.GetA() - c.GetA());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetR() - c.GetR());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetG() - c.GetG());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetB() - c.GetB());
-			if (curdist > mindist)
-				continue;
-
-			mindist = curdist;
-			k = i;
-		}
-		return k;
+		return m_paletteIndex.Nearest(pPalette, nMaxColors, argb);
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short Dl3Quantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		unsigned short k = 0;
 		Color c(argb);
-		vector<unsigned short> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		unsigned short closest[5] = { 0 };
+		if (!closestMap.Find(argb, closest)) {
 			closest[2] = closest[3] = SHORT_MAX;
 
 			for (; k < nMaxColors; k++) {
@@ -263,25 +236,30 @@ namespace Dl3Quant
 
 			if (closest[3] == SHORT_MAX)
 				closest[2] = 0;
+
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next(closest[3] + closest[2]) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
-
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool Dl3Quantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, DitherState& state)
 	{
 		if (dither)
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
+			return dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, nMaxColors, qPixels, width, height, state);
 
-		DitherFn ditherFn = (m_transparentPixelIndex >= 0 || nMaxColors < 256) ? nearestColorIndex : closestColorIndex;
+		if (m_colormapRemap && state.pColormap && state.pColormap->IsBuilt()) {
+			state.pColormap->Remap(pixels, width * height, qPixels);
+			return true;
+		}
+
+		DitherFn ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); };
+		if (m_transparentPixelIndex < 0 && nMaxColors >= 256)
+			ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return closestColorIndex(pPalette, nMaxColors, argb); };
 		UINT pixelIndex = 0;
 		for (int j = 0; j < height; ++j) {
 			for (int i = 0; i < width; ++i, ++pixelIndex)
@@ -300,31 +278,30 @@ namespace Dl3Quant
 		}
 	}
 
-	bool Dl3Quantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	void BuildPalette(CUBE3* rgb_table3, ColorPalette* pPalette, const UINT nMaxColors)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		UINT tot_colors = compact_table3(rgb_table3);
+		int sqr_tbl[BYTE_MAX + BYTE_MAX + 1];
 
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+		for (int i = (-BYTE_MAX); i <= BYTE_MAX; ++i)
+			sqr_tbl[i + BYTE_MAX] = i * i;
 
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
-		pPalette->Count = nMaxColors;
-
-		if (nMaxColors > 2) {
-			auto rgb_table3 = make_unique<CUBE3[]>(65536);
-			UINT tot_colors = build_table3(rgb_table3.get(), pixels);
-			int sqr_tbl[BYTE_MAX + BYTE_MAX + 1];
+		auto squares3 = &sqr_tbl[BYTE_MAX];
 
-			for (int i = (-BYTE_MAX); i <= BYTE_MAX; ++i)
-				sqr_tbl[i + BYTE_MAX] = i * i;
+		reduce_table3(rgb_table3, squares3, tot_colors, nMaxColors);
 
-			auto squares3 = &sqr_tbl[BYTE_MAX];
+		GetQuantizedPalette(pPalette, rgb_table3);
+	}
 
-			reduce_table3(rgb_table3.get(), squares3, tot_colors, nMaxColors);
+	bool Dl3Quantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		m_paletteIndex.Clear();
+		pPalette->Count = nMaxColors;
 
-			GetQuantizedPalette(pPalette, rgb_table3.get());
+		if (nMaxColors > 2) {
+			auto rgb_table3 = make_unique<CUBE3[]>(65536);
+			build_table3(rgb_table3.get(), pixels, width * height, hasSemiTransparency);
+			BuildPalette(rgb_table3.get(), pPalette, nMaxColors);
 		}
 		else {
 			if (m_transparentPixelIndex >= 0) {
@@ -337,16 +314,24 @@ namespace Dl3Quant
 			}
 		}
 
+		InverseColormap colormap;
+		const bool colormapRemap = !dither && m_colormapRemap && nMaxColors <= 256;
+		if ((dither || nMaxColors > 256 || colormapRemap) && width * height >= MIN_COLORMAP_PIXELS)
+			colormap.Build(pPalette, nMaxColors, hasSemiTransparency);
+		else if (((dither || nMaxColors > 256) && IsThreadedDither(m_ditherMode)) || colormapRemap)
+			colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			closestMap.clear();
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+			closestMap.Clear();
+			return true;
 		}
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
-		closestMap.clear();
+		DitherState state(width);
+		state.mode = m_ditherMode;
+		state.pColormap = &colormap;
+		quantize_image(pixels, pPalette, nMaxColors, qPixels, width, height, dither, state);
+		closestMap.Clear();
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -355,7 +340,119 @@ namespace Dl3Quant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
+		return true;
+	}
+
+	bool Dl3Quantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
+
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	bool Dl3Quantizer::QuantizeImage(ReadRowsFn readRows, WriteRowsFn writeRows, const UINT width, const UINT height, const UINT stripeHeight, ColorPalette* pPalette, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		m_paletteIndex.Clear();
+		hasSemiTransparency = false;
+		m_transparentPixelIndex = -1;
+		pPalette->Count = nMaxColors;
+
+		// Transparency is only known after the last stripe, so fill the tables of both layouts
+		unique_ptr<CUBE3[]> rgb_table3, argb_table3;
+		if (nMaxColors > 2) {
+			rgb_table3 = make_unique<CUBE3[]>(65536);
+			argb_table3 = make_unique<CUBE3[]>(65536);
+		}
+
+		vector<ARGB> stripe;
+		bool bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+			ScanTransparency(pixels, width * rows, y * width, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+			if (nMaxColors > 2) {
+				build_table3(rgb_table3.get(), pixels, width * rows, false);
+				build_table3(argb_table3.get(), pixels, width * rows, true);
+			}
+			return true;
+		});
+		if (!bSucceeded)
+			return false;
+
+		if (nMaxColors > 2) {
+			BuildPalette(hasSemiTransparency ? argb_table3.get() : rgb_table3.get(), pPalette, nMaxColors);
+			rgb_table3.reset();
+			argb_table3.reset();
+		}
+		else {
+			if (m_transparentPixelIndex >= 0) {
+				pPalette->Entries[0] = m_transparentColor;
+				pPalette->Entries[1] = Color::Black;
+			}
+			else {
+				pPalette->Entries[0] = Color::Black;
+				pPalette->Entries[1] = Color::White;
+			}
+		}
+
+		InverseColormap colormap;
+		const bool colormapRemap = !dither && m_colormapRemap && nMaxColors <= 256;
+		if ((dither || nMaxColors > 256 || colormapRemap) && width * height >= MIN_COLORMAP_PIXELS)
+			colormap.Build(pPalette, nMaxColors, hasSemiTransparency);
+		else if (((dither || nMaxColors > 256) && IsThreadedDither(m_ditherMode)) || colormapRemap)
+			colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+
+		DitherState state(width);
+		state.mode = m_ditherMode;
+		state.pColormap = &colormap;
+		auto qPixels = make_unique<unsigned short[]>(stripe.size());
+		UINT k = 0;
+		bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+			if (nMaxColors > 256)
+				dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, nMaxColors, qPixels.get(), width, rows, state);
+			else
+				quantize_image(pixels, pPalette, nMaxColors, qPixels.get(), width, rows, dither, state);
+
+			const int offset = m_transparentPixelIndex - (int) (y * width);
+			if (offset >= 0 && offset < (int) (rows * width))
+				k = qPixels[offset];
+			return writeRows(y, rows, qPixels.get());
+		});
+		closestMap.Clear();
+		if (!bSucceeded)
+			return false;
+
+		if (nMaxColors <= 256 && m_transparentPixelIndex >= 0) {
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+		}
+		return true;
+	}
+
+#ifdef _WIN32
+	bool Dl3Quantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(pixels.size());
+		if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		if (nMaxColors > 256)
+			return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
 
 }
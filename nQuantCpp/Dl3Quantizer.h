@@ -1,6 +1,11 @@
 #pragma once
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
+#include "ClosestCache.h"
+#include "PaletteIndex.h"
+#include "RandomGenerator.h"
 using namespace std;
 
 namespace Dl3Quant
@@ -21,9 +26,41 @@ namespace Dl3Quant
 	// Use at your own risk!
 	// =============================================================
 
+	struct CUBE3;
+
 	class Dl3Quantizer
 	{
 		public:
-			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+			// Quantizes a caller-owned 32bpp ARGB buffer, stride in bytes. pPalette must hold
+			// nMaxColors entries and qPixels width * height indices into it.
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+			// Quantizes an image too large to hold in memory. readRows is called twice for
+			// every stripe of at most stripeHeight rows, first for the histogram then for the
+			// remap, and writeRows receives the indices of each stripe as soon as they are known.
+			bool QuantizeImage(ReadRowsFn readRows, WriteRowsFn writeRows, const UINT width, const UINT height, const UINT stripeHeight, ColorPalette* pPalette, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#ifdef _WIN32
+			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#endif // _WIN32
+			// Seeds the random choices of the runs that follow, which repeat for the same seed
+			void SetSeed(const UINT seed) { m_random.Seed(seed); }
+			// Remaps without dithering through an InverseColormap, one table lookup per pixel
+			// instead of a palette search. Faster on large images, but each colour is reduced to
+			// the 5-6-5 or 4-4-4-4 bits of its cell first. Applies up to 256 colours, off by default.
+			void SetColormapRemap(const bool colormapRemap) { m_colormapRemap = colormapRemap; }
+
+		private:
+			bool hasSemiTransparency = false;
+			bool m_colormapRemap = false;
+			int m_transparentPixelIndex = -1;
+			DitherMode m_ditherMode = DitherMode::ErrorDiffusion;
+			ARGB m_transparentColor = Color::Transparent;
+			ClosestCache<unsigned short> closestMap;
+			RandomGenerator m_random;
+			PaletteIndex m_paletteIndex;
+
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, DitherState& state);
+			bool QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither);
 	};
 }
\ No newline at end of file
@@ -33,18 +33,12 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <algorithm>
 #include <unordered_map>
 #include <numeric>
-#include <random>
 #include <math.h>
 #include <time.h>
 #include <limits>
 
 namespace EdgeAwareSQuant
 {
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
-
 	const int DECOMP_SVD = 1;
 
 	static bool mycmp(pair<float, int> p1, pair<float, int> p2)
@@ -104,10 +98,10 @@ namespace EdgeAwareSQuant
 		return result;
 	}
 
-	void fill_random_icm(Mat<BYTE>& indexImg8, int palette_size) {
+	void fill_random_icm(Mat<BYTE>& indexImg8, int palette_size, RandomGenerator& random) {
 		for (int i = 0; i < indexImg8.get_height(); ++i) {
 			for (int j = 0; j < indexImg8.get_width(); ++j) {
-				int ran_val = float(rand()) / RAND_MAX * (palette_size - 1);
+				int ran_val = float(random.NextDouble()) * (palette_size - 1);
 				if (ran_val < 0)
 					ran_val = 0;
 				if (ran_val >= palette_size)
@@ -117,21 +111,20 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void random_permutation(int count, vector<int>& result) {
+	void random_permutation(int count, vector<int>& result, RandomGenerator& random) {
 		result.resize(count);
 		iota(result.begin(), result.end(), 0);
-		auto rng = default_random_engine{};
-		shuffle(result.begin(), result.end(), rng);
+		shuffle(result.begin(), result.end(), random);
 	}
 
-	void random_permutation_2d(int width, int height, deque<pair<int, int> >& result) {
+	void random_permutation_2d(int width, int height, deque<pair<int, int> >& result, RandomGenerator& random) {
 		vector<int> perm1d;
-		random_permutation(width * height, perm1d);
+		random_permutation(width * height, perm1d, random);
 		for (auto it = perm1d.cbegin(); it != perm1d.cend(); ++it)
 			result.emplace_front(*it % width, *it / width);
 	}
 
-	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
+	void EdgeAwareSQuantizer::getLab(const Color& c, CIELABConvertor::Lab& lab1)
 	{
 		auto got = pixelMap.find(c.GetValue());
 		if (got == pixelMap.end()) {
@@ -195,7 +188,7 @@ namespace EdgeAwareSQuant
 		return b_yx(k_y, k_x);
 	}
 
-	void compute_a_image_ea(const vector<ARGB>& image, Mat<Mat<float> >& b, array2d<vector_fixed<float, 4> >& a)
+	void compute_a_image_ea(const ARGB* image, Mat<Mat<float> >& b, array2d<vector_fixed<float, 4> >& a)
 	{
 		int extendedFilterRadius = (b(0, 0).get_width() - 1) / 2;
 		for (int i_y = 0; i_y < a.get_height(); ++i_y) {
@@ -278,7 +271,7 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void compute_initial_s_ea_icm(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8, Mat<Mat<float> >& b)
+	void EdgeAwareSQuantizer::compute_initial_s_ea_icm(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8, Mat<Mat<float> >& b)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
 		int palette_size = s.get_width();
@@ -318,7 +311,7 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void refine_palette_icm_mat(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8,
+	void EdgeAwareSQuantizer::refine_palette_icm_mat(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8,
 		const array2d<vector_fixed<float, 4> >& a, vector<vector_fixed<float, 4> >& palette, int& palatte_changed)
 	{
 		// We only computed the half of S above the diagonal - reflect it
@@ -368,9 +361,9 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void spatial_color_quant_ea_icm_saliency(const vector<ARGB>& image, Mat<Mat<float> >& weightMaps, Mat<float> saliencyMap,
+	void EdgeAwareSQuantizer::spatial_color_quant_ea_icm_saliency(const ARGB* image, Mat<Mat<float> >& weightMaps, Mat<float> saliencyMap,
 		unsigned short* quantized_image, vector<vector_fixed<float, 4> >& palette,
-		const float initial_temperature = 1.0, const float final_temperature = 0.00001, const int temps_per_level = 1, const int repeats_per_temp = 1, const int filter_radius = 1)
+		const float initial_temperature, const float final_temperature, const int temps_per_level, const int repeats_per_temp, const int filter_radius)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
 		const int bitmapWidth = weightMaps.get_width();
@@ -380,7 +373,7 @@ namespace EdgeAwareSQuant
 		int neiSize = 10;
 
 		auto pIndexImg8 = make_unique<Mat<BYTE> >(bitmapHeight >> max_coarse_level, bitmapWidth >> max_coarse_level);
-		fill_random_icm(*pIndexImg8, palette.size());
+		fill_random_icm(*pIndexImg8, palette.size(), m_random);
 
 		// Compute a_I^l, b_{IJ}^l according to  Puzicha's (18)
 		auto a_array = make_unique<array2d<vector_fixed<float, 4> >[]>(max_coarse_level + 1);
@@ -505,7 +498,7 @@ namespace EdgeAwareSQuant
 					pixels_visited = 0;
 
 					deque<pair<int, int> > visit_queue;
-					random_permutation_2d(pIndexImg8->get_width(), pIndexImg8->get_height(), visit_queue);
+					random_permutation_2d(pIndexImg8->get_width(), pIndexImg8->get_height(), visit_queue, m_random);
 
 					// Compute 2*sum(j in extended neighborhood of i, j != i) b_ij
 					while (!visit_queue.empty()) {
@@ -596,7 +589,7 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void filter_bila(const vector<ARGB>& img, Mat<Mat<float> >& weightMaps, const float sigma_s = 1.0f, const float sigma_r = 2.0f)
+	void filter_bila(const ARGB* img, Mat<Mat<float> >& weightMaps, const float sigma_s = 1.0f, const float sigma_r = 2.0f)
 	{
 		// pixel-wise filter		
 		int radius = 1;
@@ -634,18 +627,10 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	bool EdgeAwareSQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool EdgeAwareSQuantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
-
-		m_transparentPixelIndex = -1;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
-
 		// see equation (7) in the paper
-		Mat<float> saliencyMap(bitmapHeight, bitmapWidth);
+		Mat<float> saliencyMap(height, width);
 		float saliencyBase = 0.1;
 		for (int y = 0; y < saliencyMap.get_height(); ++y) {
 			for (int x = 0; x < saliencyMap.get_width(); ++x)
@@ -655,15 +640,10 @@ namespace EdgeAwareSQuant
 		if (nMaxColors > 256)
 			nMaxColors = 256;
 
-		auto pPaletteBytes = make_unique<BYTE[]>(pDest->GetPaletteSize());
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
-		if (nMaxColors == 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
-			pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
-
 		DivQuant::DivQuantizer divQuantizer;
-		divQuantizer.quant_varpart_fast(pixels.data(), pixels.size(), pPalette);
+		divQuantizer.quant_varpart_fast(pixels, width * height, pPalette);
 
 		// init
 		vector<vector_fixed<float, 4> > palette(nMaxColors);
@@ -675,10 +655,9 @@ namespace EdgeAwareSQuant
 			palette[k][3] = c.GetA() / 255.0f;
 		}
 
-		Mat<Mat<float> > weightMaps(bitmapHeight, bitmapWidth);
+		Mat<Mat<float> > weightMaps(height, width);
 		filter_bila(pixels, weightMaps);
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		spatial_color_quant_ea_icm_saliency(pixels, weightMaps, saliencyMap, qPixels.get(), palette);
+		spatial_color_quant_ea_icm_saliency(pixels, weightMaps, saliencyMap, qPixels, palette);
 		pixelMap.clear();
 
 		if (nMaxColors > 2) {
@@ -704,8 +683,39 @@ namespace EdgeAwareSQuant
 				pPalette->Entries[0] = Color::Black;
 			}
 		}
+		return true;
+	}
+
+	bool EdgeAwareSQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
+
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither);
+	}
+
+#ifdef _WIN32
+	bool EdgeAwareSQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(pixels.size());
+		if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		if (nMaxColors == 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
+			pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
 
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
 
-}
\ No newline at end of file
+}
@@ -1,5 +1,8 @@
 #pragma once
+#include "CIELABConvertor.h"
+#include "RandomGenerator.h"
 #include <memory>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -357,6 +360,29 @@ namespace EdgeAwareSQuant
 	class EdgeAwareSQuantizer
 	{
 		public:
+			// Quantizes a caller-owned 32bpp ARGB buffer, stride in bytes. pPalette must hold
+			// nMaxColors entries and qPixels width * height indices into it.
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+#ifdef _WIN32
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+#endif // _WIN32
+			// Seeds the random choices of the runs that follow, which repeat for the same seed
+			void SetSeed(const UINT seed) { m_random.Seed(seed); }
+
+		private:
+			bool hasSemiTransparency = false;
+			int m_transparentPixelIndex = -1;
+			RandomGenerator m_random;
+			ARGB m_transparentColor = Color::Transparent;
+			unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
+
+			void getLab(const Color& c, CIELABConvertor::Lab& lab1);
+			void compute_initial_s_ea_icm(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8, Mat<Mat<float> >& b);
+			void refine_palette_icm_mat(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8,
+				const array2d<vector_fixed<float, 4> >& a, vector<vector_fixed<float, 4> >& palette, int& palatte_changed);
+			void spatial_color_quant_ea_icm_saliency(const ARGB* image, Mat<Mat<float> >& weightMaps, Mat<float> saliencyMap,
+				unsigned short* quantized_image, vector<vector_fixed<float, 4> >& palette,
+				const float initial_temperature = 1.0, const float final_temperature = 0.00001, const int temps_per_level = 1, const int repeats_per_temp = 1, const int filter_radius = 1);
+			bool QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,96 @@
+#pragma once
+// Minimal stand-ins for the GDI+ value types used by the quantizer cores,
+// so that they can be built without <gdiplus.h> on non-Windows platforms.
+// Only the subset of the Gdiplus API referenced by the cores is provided.
+
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+typedef uint8_t BYTE;
+typedef uint32_t UINT;
+typedef uint32_t ULONG;
+typedef uint32_t ARGB;
+typedef uint32_t COLORREF;
+
+#ifndef BYTE_MAX
+#define BYTE_MAX 0xff
+#endif
+#ifndef SHORT_MAX
+#define SHORT_MAX 32767
+#endif
+
+class Color
+{
+public:
+	enum
+	{
+		Black = 0xFF000000,
+		White = 0xFFFFFFFF,
+		Transparent = 0x00FFFFFF
+	};
+
+	enum
+	{
+		AlphaShift = 24,
+		RedShift = 16,
+		GreenShift = 8,
+		BlueShift = 0
+	};
+
+	Color() : Argb(Black)
+	{
+	}
+
+	Color(const ARGB argb) : Argb(argb)
+	{
+	}
+
+	Color(const BYTE a, const BYTE r, const BYTE g, const BYTE b) : Argb(MakeARGB(a, r, g, b))
+	{
+	}
+
+	inline BYTE GetA() const { return static_cast<BYTE>(Argb >> AlphaShift); }
+	inline BYTE GetR() const { return static_cast<BYTE>(Argb >> RedShift); }
+	inline BYTE GetG() const { return static_cast<BYTE>(Argb >> GreenShift); }
+	inline BYTE GetB() const { return static_cast<BYTE>(Argb >> BlueShift); }
+	inline ARGB GetValue() const { return Argb; }
+	inline void SetValue(const ARGB argb) { Argb = argb; }
+
+	inline COLORREF ToCOLORREF() const
+	{
+		return GetR() | (GetG() << 8) | (GetB() << 16);
+	}
+
+	static inline ARGB MakeARGB(const BYTE a, const BYTE r, const BYTE g, const BYTE b)
+	{
+		return (static_cast<ARGB>(b) << BlueShift) | (static_cast<ARGB>(g) << GreenShift) |
+			(static_cast<ARGB>(r) << RedShift) | (static_cast<ARGB>(a) << AlphaShift);
+	}
+
+protected:
+	ARGB Argb;
+};
+
+struct ColorPalette
+{
+	UINT Flags;
+	UINT Count;
+	ARGB Entries[1];
+};
+
+// <windows.h> min/max accept mixed operand types; keep that working for the
+// call sites which rely on it while deferring to std::min/std::max otherwise.
+template <typename T, typename U, typename = typename std::enable_if<!std::is_same<T, U>::value>::type>
+inline typename std::common_type<T, U>::type min(const T a, const U b)
+{
+	return (a < b) ? a : b;
+}
+
+template <typename T, typename U, typename = typename std::enable_if<!std::is_same<T, U>::value>::type>
+inline typename std::common_type<T, U>::type max(const T a, const U b)
+{
+	return (a > b) ? a : b;
+}
@@ -0,0 +1,58 @@
+﻿#include "stdafx.h"
+#include "Histogram.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HISTOGRAM_SSE2
+#endif
+
+// A thread only pays off when its share of the pixels outweighs clearing and merging its table
+const UINT MIN_PIXELS_PER_THREAD = 1 << 18;
+// Upper bound for the private tables of the extra threads
+const size_t MAX_PARTIAL_BYTES = 256 << 20;
+
+UINT GetHistogramThreads(const UINT nSize, const UINT binCount)
+{
+	UINT nThreads = max(thread::hardware_concurrency(), 1U);
+	nThreads = min(nThreads, nSize / max(MIN_PIXELS_PER_THREAD, binCount));
+	const size_t maxPartials = MAX_PARTIAL_BYTES / (binCount * sizeof(HistogramBin));
+	nThreads = (UINT) min((size_t) nThreads, maxPartials + 1);
+	return max(nThreads, 1U);
+}
+
+void GetARGBIndices(const ARGB* pixels, const UINT nSize, const bool hasSemiTransparency, int* indices)
+{
+	UINT i = 0;
+#ifdef HISTOGRAM_SSE2
+	// Same bit fields as GetARGBIndex, shifted straight out of the packed 0xAARRGGBB value
+	if (hasSemiTransparency) {
+		const __m128i maskA = _mm_set1_epi32(0xF000), maskR = _mm_set1_epi32(0x0F00);
+		const __m128i maskG = _mm_set1_epi32(0x00F0), maskB = _mm_set1_epi32(0x000F);
+		for (; i + 4 <= nSize; i += 4) {
+			__m128i argb = _mm_loadu_si128((const __m128i*) (pixels + i));
+			__m128i index = _mm_or_si128(
+				_mm_or_si128(_mm_and_si128(_mm_srli_epi32(argb, 16), maskA), _mm_and_si128(_mm_srli_epi32(argb, 12), maskR)),
+				_mm_or_si128(_mm_and_si128(_mm_srli_epi32(argb, 8), maskG), _mm_and_si128(_mm_srli_epi32(argb, 4), maskB)));
+			_mm_storeu_si128((__m128i*) (indices + i), index);
+		}
+	}
+	else {
+		const __m128i maskR = _mm_set1_epi32(0xF800), maskG = _mm_set1_epi32(0x07E0), maskB = _mm_set1_epi32(0x001F);
+		for (; i + 4 <= nSize; i += 4) {
+			__m128i argb = _mm_loadu_si128((const __m128i*) (pixels + i));
+			__m128i index = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(argb, 8), maskR),
+				_mm_or_si128(_mm_and_si128(_mm_srli_epi32(argb, 5), maskG), _mm_and_si128(_mm_srli_epi32(argb, 3), maskB)));
+			_mm_storeu_si128((__m128i*) (indices + i), index);
+		}
+	}
+#endif
+	for (; i < nSize; ++i)
+		indices[i] = GetARGBIndex(Color(pixels[i]), hasSemiTransparency);
+}
+
+void BuildHistogram(const ARGB* pixels, const UINT nSize, const bool hasSemiTransparency, HistogramBin* bins)
+{
+	BuildHistogram(pixels, nSize, bins, 65536, [hasSemiTransparency](const ARGB* pixels, const UINT nSize, int* indices) {
+		GetARGBIndices(pixels, nSize, hasSemiTransparency, indices);
+	});
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "bitmapUtilities.h"
+using namespace std;
+
+// Integer sums of the pixels falling into one histogram cell. The sums are exact,
+// so the histogram comes out the same whatever the number of threads building it.
+struct HistogramBin {
+	unsigned long long a = 0, r = 0, g = 0, b = 0, squares = 0;
+	UINT cnt = 0;
+
+	inline void Add(const ARGB argb)
+	{
+		Color c(argb);
+		const UINT pixelAlpha = c.GetA(), pixelRed = c.GetR(), pixelGreen = c.GetG(), pixelBlue = c.GetB();
+		a += pixelAlpha;
+		r += pixelRed;
+		g += pixelGreen;
+		b += pixelBlue;
+		squares += pixelAlpha * pixelAlpha + pixelRed * pixelRed + pixelGreen * pixelGreen + pixelBlue * pixelBlue;
+		++cnt;
+	}
+
+	inline void Merge(const HistogramBin& bin)
+	{
+		a += bin.a;
+		r += bin.r;
+		g += bin.g;
+		b += bin.b;
+		squares += bin.squares;
+		cnt += bin.cnt;
+	}
+};
+
+// Pixels looked up per call of the index function
+const UINT HISTOGRAM_BLOCK = 256;
+
+// Number of threads worth spending on nSize pixels for a table of binCount cells.
+// Each extra thread needs a private table which has to be cleared and merged.
+UINT GetHistogramThreads(const UINT nSize, const UINT binCount);
+
+// GetARGBIndex of nSize pixels at once
+void GetARGBIndices(const ARGB* pixels, const UINT nSize, const bool hasSemiTransparency, int* indices);
+
+// Adds the pixels to bins, which may already hold earlier stripes of the image.
+// indexOf(pixels, n, indices) stores the cell of each of n <= HISTOGRAM_BLOCK pixels,
+// or -1 for pixels to leave out.
+template <typename IndexFn>
+void BuildHistogram(const ARGB* pixels, const UINT nSize, HistogramBin* bins, const UINT binCount, IndexFn indexOf)
+{
+	auto addPixels = [&](HistogramBin* pBins, const UINT begin, const UINT end) {
+		int indices[HISTOGRAM_BLOCK];
+		for (UINT i = begin; i < end; i += HISTOGRAM_BLOCK) {
+			const UINT n = min(HISTOGRAM_BLOCK, end - i);
+			indexOf(pixels + i, n, indices);
+			for (UINT j = 0; j < n; ++j) {
+				if (indices[j] >= 0)
+					pBins[indices[j]].Add(pixels[i + j]);
+			}
+		}
+	};
+
+	const UINT nThreads = GetHistogramThreads(nSize, binCount);
+	if (nThreads <= 1) {
+		addPixels(bins, 0, nSize);
+		return;
+	}
+
+	const UINT chunk = (nSize + nThreads - 1) / nThreads;
+	vector<unique_ptr<HistogramBin[]> > partials(nThreads - 1);
+	vector<thread> workers;
+	for (UINT t = 1; t < nThreads; ++t) {
+		workers.emplace_back([&, t]() {
+			partials[t - 1] = make_unique<HistogramBin[]>(binCount);
+			addPixels(partials[t - 1].get(), t * chunk, min(nSize, (t + 1) * chunk));
+		});
+	}
+	addPixels(bins, 0, chunk);
+	for (auto& worker : workers)
+		worker.join();
+
+	for (auto& partial : partials) {
+		for (UINT i = 0; i < binCount; ++i) {
+			if (partial[i].cnt)
+				bins[i].Merge(partial[i]);
+		}
+	}
+}
+
+// Histogram over the 65536 cells addressed by GetARGBIndex
+void BuildHistogram(const ARGB* pixels, const UINT nSize, const bool hasSemiTransparency, HistogramBin* bins);
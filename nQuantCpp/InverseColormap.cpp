@@ -0,0 +1,89 @@
+﻿#include "stdafx.h"
+#include "InverseColormap.h"
+#include "PaletteIndex.h"
+#include "Histogram.h"
+#include <thread>
+
+// Cells filled per thread at least, a thread per 4096 queries being worth its start
+const UINT MIN_CELLS_PER_THREAD = 1 << 12;
+// Pixels remapped per thread at least, a lookup costing far less than a query
+const UINT MIN_REMAP_PIXELS_PER_THREAD = 1 << 16;
+
+// Colour of a cell, each channel widened back to 8 bits by repeating its top bits
+// so that the first and last cells of a channel reach 0 and 255
+static ARGB GetCellColor(const int offset, const bool hasSemiTransparency)
+{
+	if (hasSemiTransparency) {
+		const int a = offset >> 12, r = (offset >> 8) & 0xF, g = (offset >> 4) & 0xF, b = offset & 0xF;
+		return Color::MakeARGB(a << 4 | a, r << 4 | r, g << 4 | g, b << 4 | b);
+	}
+	const int r = offset >> 11, g = (offset >> 5) & 0x3F, b = offset & 0x1F;
+	return Color::MakeARGB(BYTE_MAX, r << 3 | r >> 2, g << 2 | g >> 4, b << 3 | b >> 2);
+}
+
+void InverseColormap::Build(const ColorPalette* pPalette, const UINT nMaxColors, const bool hasSemiTransparency, const double PR, const double PG, const double PB)
+{
+	PaletteIndex paletteIndex;
+	paletteIndex.Build(pPalette, nMaxColors, PR, PG, PB);
+
+	const UINT nCells = 65536;
+	m_table = make_unique<atomic<unsigned short>[]>(nCells);
+	m_nearest = nullptr;
+	m_hasSemiTransparency = hasSemiTransparency;
+	auto fillCells = [&](const UINT begin, const UINT end) {
+		for (UINT i = begin; i < end; ++i)
+			m_table[i].store(paletteIndex.Nearest(GetCellColor(i, hasSemiTransparency)), memory_order_relaxed);
+	};
+
+	const UINT nThreads = max(min(thread::hardware_concurrency(), nCells / MIN_CELLS_PER_THREAD), 1U);
+	const UINT chunk = nCells / nThreads;
+	vector<thread> workers;
+	for (UINT t = 1; t < nThreads; ++t)
+		workers.emplace_back(fillCells, t * chunk, t + 1 < nThreads ? (t + 1) * chunk : nCells);
+	fillCells(0, chunk);
+	for (auto& worker : workers)
+		worker.join();
+}
+
+void InverseColormap::Defer(NearestFn nearest, const bool hasSemiTransparency)
+{
+	const UINT nCells = 65536;
+	m_table = make_unique<atomic<unsigned short>[]>(nCells);
+	for (UINT i = 0; i < nCells; ++i)
+		m_table[i].store(EMPTY_CELL, memory_order_relaxed);
+	m_nearest = nearest;
+	m_hasSemiTransparency = hasSemiTransparency;
+}
+
+void InverseColormap::Remap(const ARGB* pixels, const UINT nSize, unsigned short* qPixels) const
+{
+	auto remapPixels = [&](const UINT begin, const UINT end) {
+		int indices[HISTOGRAM_BLOCK];
+		for (UINT i = begin; i < end; i += HISTOGRAM_BLOCK) {
+			const UINT n = min(HISTOGRAM_BLOCK, end - i);
+			GetARGBIndices(pixels + i, n, m_hasSemiTransparency, indices);
+			for (UINT j = 0; j < n; ++j)
+				qPixels[i + j] = Lookup(indices[j]);
+		}
+	};
+
+	const UINT nThreads = max(min(thread::hardware_concurrency(), nSize / MIN_REMAP_PIXELS_PER_THREAD), 1U);
+	const UINT chunk = nSize / nThreads;
+	vector<thread> workers;
+	for (UINT t = 1; t < nThreads; ++t)
+		workers.emplace_back(remapPixels, t * chunk, t + 1 < nThreads ? (t + 1) * chunk : nSize);
+	remapPixels(0, nThreads > 1 ? chunk : nSize);
+	for (auto& worker : workers)
+		worker.join();
+}
+
+unsigned short InverseColormap::Fill(const int offset) const
+{
+	lock_guard<mutex> lock(m_mutex);
+	unsigned short k = m_table[offset].load(memory_order_relaxed);
+	if (k == EMPTY_CELL) {
+		k = m_nearest(GetCellColor(offset, m_hasSemiTransparency));
+		m_table[offset].store(k, memory_order_relaxed);
+	}
+	return k;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "bitmapUtilities.h"
+using namespace std;
+
+// Images from this many pixels on remap through an InverseColormap instead of
+// looking up each colour when it is first met
+const UINT MIN_COLORMAP_PIXELS = 1 << 18;
+
+// Dense table giving the palette entry of every cell addressed by GetARGBIndex,
+// i.e. colours reduced to 5-6-5 bits when opaque or 4-4-4-4 bits otherwise.
+// Each cell holds the entry nearest to its own colour, found by PaletteIndex with
+// the given weights, so the result of a lookup does not depend on the order in
+// which the pixels are visited. The table is filled by several threads at once.
+// A deferred table is filled as it is looked up instead: a cell gets the entry
+// nearest gives for the cell's colour the first time it is looked up. Cells are
+// filled one at a time under a lock, so nearest need not be thread safe, and the
+// table comes out the same whichever thread looks up a cell first.
+// Remap looks up every pixel of an image, which quantizers do instead of searching
+// the palette when their undithered remap is asked to go through the table.
+class InverseColormap
+{
+	public:
+		typedef function<unsigned short(const ARGB argb)> NearestFn;
+
+		void Build(const ColorPalette* pPalette, const UINT nMaxColors, const bool hasSemiTransparency, const double PR = 1, const double PG = 1, const double PB = 1);
+		void Defer(NearestFn nearest, const bool hasSemiTransparency);
+		// Palette entries of the cells of nSize pixels, looked up by several threads at once
+		void Remap(const ARGB* pixels, const UINT nSize, unsigned short* qPixels) const;
+
+		inline bool IsBuilt() const
+		{
+			return m_table != nullptr;
+		}
+
+		inline unsigned short Lookup(const int offset) const
+		{
+			const unsigned short k = m_table[offset].load(memory_order_relaxed);
+			return (k != EMPTY_CELL || !m_nearest) ? k : Fill(offset);
+		}
+
+	private:
+		// Mark of a deferred cell not filled yet. A cell holding the last entry of a
+		// 65536 colour palette is looked up again each time, which gives the same entry.
+		static const unsigned short EMPTY_CELL = USHRT_MAX;
+
+		unique_ptr<atomic<unsigned short>[]> m_table;
+		NearestFn m_nearest;
+		bool m_hasSemiTransparency = false;
+		mutable mutex m_mutex;
+
+		unsigned short Fill(const int offset) const;
+};
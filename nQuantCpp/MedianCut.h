@@ -34,7 +34,11 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <memory>
 #include <vector>
 #include <limits>
+#include <unordered_map>
+#include "CIELABConvertor.h"
+#include "ClosestCache.h"
 #include "EdgeAwareSQuantizer.h"
+#include "RandomGenerator.h"
 
 using namespace std;
 using namespace EdgeAwareSQuant;
@@ -46,7 +50,35 @@ namespace MedianCutQuant
 	class MedianCut
 	{
 	public:
-		virtual int quantizeImg(const vector<ARGB>& pixels, const UINT& width, Mat<float>& saliencyMap_float, ColorPalette* pPalette, UINT& newcolors);
-		bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+		virtual int quantizeImg(const ARGB* pixels, const UINT nSize, const UINT& width, Mat<float>& saliencyMap_float, ColorPalette* pPalette, UINT& newcolors);
+		// Quantizes a caller-owned 32bpp ARGB buffer, stride in bytes. pPalette must hold
+		// nMaxColors entries and qPixels width * height indices into it.
+		bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#ifdef _WIN32
+		bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#endif // _WIN32
+		// Seeds the random choices of the runs that follow, which repeat for the same seed
+		void SetSeed(const UINT seed) { m_random.Seed(seed); }
+		// Remaps without dithering through an InverseColormap, one table lookup per pixel
+		// instead of a palette search. Faster on large images, but each colour is reduced to
+		// the 5-6-5 or 4-4-4-4 bits of its cell first. Applies up to 256 colours, off by default.
+		void SetColormapRemap(const bool colormapRemap) { m_colormapRemap = colormapRemap; }
+
+	private:
+		double PR = .2126, PG = .7152, PB = .0722;
+		bool hasSemiTransparency = false;
+		bool m_colormapRemap = false;
+		int m_transparentPixelIndex = -1;
+		DitherMode m_ditherMode = DitherMode::ErrorDiffusion;
+		ARGB m_transparentColor = Color::Transparent;
+		unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
+		ClosestCache<unsigned short> closestMap;
+		RandomGenerator m_random;
+
+		void getLab(const Color& c, CIELABConvertor::Lab& lab1);
+		unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+		unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+		bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+		bool QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither);
 	};
 }
\ No newline at end of file
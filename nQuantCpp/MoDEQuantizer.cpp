@@ -11,6 +11,7 @@ Copyright (c) 2018 - 2019 Miller Cy Chan
 #include "stdafx.h"
 #include "MoDEQuantizer.h"
 #include "bitmapUtilities.h"
+#include "InverseColormap.h"
 #include <ctime>
 #include <iomanip>      // std::setprecision
 #include <unordered_map>
@@ -25,21 +26,8 @@ namespace MoDEQuant
 	const BYTE high = BYTE_MAX;
 	const BYTE low = 0;        // the initial bounding region
 	const int my_gens = 200;   //the generation number
-	const int LOOP = 5;        //loop number
-	const int seed[50] = { 20436,18352,10994,26845,24435,29789,28299,11375,10222,9885,25855,4282,22102,29385,16014,32018,3200,11252,6227,5939,8712,12504,25965,6101,30359,1295,29533,19841,14690,2695,3503,16802,18931,28464,1245,13279,5676,8951,7280,24488,6537,27128,9320,16399,24997,24303,16862,17882,15360,31216 };
 
-	BYTE SIDE = 3;
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, vector<unsigned short> > closestMap;
-
-	inline double rand1()
-	{
-		return (double)rand() / (RAND_MAX + 1.0);
-	}
-
-	unsigned short find_nn(const vector<double>& data, const Color& c, unordered_map<ARGB, unsigned short>& cacheMap, double& idis)
+	unsigned short MoDEQuantizer::find_nn(const vector<double>& data, const Color& c, unordered_map<ARGB, unsigned short>& cacheMap, double& idis)
 	{
 		auto argb = c.GetValue();
 		auto got = cacheMap.find(argb);
@@ -78,7 +66,7 @@ namespace MoDEQuant
 		return k;
 	}
 
-	void updateCentroids(vector<double>& data, double* temp_x, const int* temp_x_number)
+	void MoDEQuantizer::updateCentroids(vector<double>& data, double* temp_x, const int* temp_x_number)
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
 
@@ -93,10 +81,9 @@ namespace MoDEQuant
 		}
 	}
 
-	double evaluate1(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data)
+	double MoDEQuantizer::evaluate1(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data)
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
-		UINT nSize = pixels.size();
 		auto k_class_Number = make_unique<int[]>(nMaxColors); //store distance of each class and related parameters
 		auto k_class_dis = make_unique<double[]>(nMaxColors);
 		for (UINT i = 0; i < nSize; ++i) {
@@ -117,10 +104,9 @@ namespace MoDEQuant
 	}
 
 	// Adaptation function designed for multiple targets (1): the minimum value of each inner class distance is the smallest
-	double evaluate1_K(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
+	double MoDEQuantizer::evaluate1_K(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
-		UINT nSize = pixels.size();
 		auto temp_i_k = make_unique<int[]>(nSize);
 
 		for (int ii = 0; ii < K_number; ++ii) {
@@ -165,10 +151,9 @@ namespace MoDEQuant
 		return dis_sum;
 	}
 
-	double evaluate2(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data, const int K_num = 1)  //Adaptive value function with K-means variation
+	double MoDEQuantizer::evaluate2(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data, const int K_num)  //Adaptive value function with K-means variation
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
-		UINT nSize = pixels.size();
 
 		for (int ii = 0; ii < K_num; ++ii) {
 			auto temp_x_number = make_unique<int[]>(nMaxColors);  //store the pixel count of each class
@@ -216,17 +201,16 @@ namespace MoDEQuant
 	}
 
 	// designed for multi objective application function(2)：to maximize the minimum distance of class
-	double evaluate2_K(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
+	double MoDEQuantizer::evaluate2_K(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
 	{
-		return evaluate2(pixels, cacheMap, data, K_number);
+		return evaluate2(pixels, nSize, cacheMap, data, K_number);
 	}
 
 	//designed for multi objective application function(3) MSE
-	double evaluate3(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data)
+	double MoDEQuantizer::evaluate3(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data)
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
 		double dis_sum = 0.0;
-		UINT nSize = pixels.size();
 		for (UINT i = 0; i < nSize; ++i) {
 			double idis = INT_MAX;
 			Color c(pixels[i]);
@@ -238,10 +222,9 @@ namespace MoDEQuant
 		return dis_sum / nSize;
 	}
 
-	double evaluate3_K(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
+	double MoDEQuantizer::evaluate3_K(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
-		UINT nSize = pixels.size();
 		auto temp_i_k = make_unique<int[]>(nSize);
 
 		for (int ii = 0; ii < K_number; ++ii) {
@@ -277,14 +260,14 @@ namespace MoDEQuant
 		return dis_sum / nSize;
 	}
 
-	int moDEquan(const vector<ARGB>& pixels, ColorPalette* pPalette, const unsigned short nMaxColors)
+	int MoDEQuantizer::moDEquan(const ARGB* pixels, const UINT nSize, ColorPalette* pPalette, const unsigned short nMaxColors)
 	{
 		const BYTE INCR_STEP = 1;
 		const float INCR_PERC = INCR_STEP * 100.0f / my_gens;
 		const clock_t begin = clock();
 		cout << std::setprecision(1) << std::fixed;
 
-		const UINT nSizeInit = pixels.size();
+		const UINT nSizeInit = nSize;
 		const UINT D = nMaxColors * SIDE;
 		auto x1 = make_unique<vector<double>[]>(N);
 		auto x2 = make_unique<vector<double>[]>(N);
@@ -297,16 +280,14 @@ namespace MoDEQuant
 		auto bestx = make_unique<double[]>(D);
 
 		float percCompleted = 0;
-		const int ii = LOOP - 1;
 
 		double F = 0.5, CR = 0.6, BVATG = INT_MAX;
-		srand(seed[ii]);
 		auto pCacheMap = make_unique<unordered_map<ARGB, unsigned short>[]>(N);
 		for (int i = 0; i < N; ++i) {            //the initial population 
 			auto& cacheMap = pCacheMap[i];
 			cacheMap.clear();
 			for (UINT j = 0; j < D; j += SIDE) {
-				int TempInit = int(rand1() * nSizeInit);
+				int TempInit = int(m_random.NextDouble() * nSizeInit);
 				Color c(pixels[TempInit]);
 				x1[i][j] = c.GetB();
 				x1[i][j + 1] = c.GetG();
@@ -315,9 +296,9 @@ namespace MoDEQuant
 					x1[i][j + 3] = c.GetA();
 			}
 
-			cost[i] = a1 * evaluate1(pixels, cacheMap, x1[i]);
-			cost[i] -= a2 * evaluate2(pixels, cacheMap, x1[i]);
-			cost[i] += a3 * evaluate3(pixels, cacheMap, x1[i]) + 1000;
+			cost[i] = a1 * evaluate1(pixels, nSize, cacheMap, x1[i]);
+			cost[i] -= a2 * evaluate2(pixels, nSize, cacheMap, x1[i]);
+			cost[i] += a3 * evaluate3(pixels, nSize, cacheMap, x1[i]) + 1000;
 
 			if (cost[i] < BVATG) {
 				BVATG = cost[i];
@@ -336,11 +317,11 @@ namespace MoDEQuant
 			for (int i = 0; i < N; ++i) {
 				auto& cacheMap = pCacheMap[i];
 
-				if (rand1() < K_probability) { // individual according to probability to perform clustering
+				if (m_random.NextDouble() < K_probability) { // individual according to probability to perform clustering
 					double temp_costx1 = cost[i];
-					cost[i] = a1 * evaluate1_K(pixels, cacheMap, x1[i]);
-					cost[i] -= a2 * evaluate2_K(pixels, cacheMap, x1[i]);
-					cost[i] += a3 * evaluate3_K(pixels, cacheMap, x1[i]) + 1000; // clustered and changed the original data of x1[i]
+					cost[i] = a1 * evaluate1_K(pixels, nSize, cacheMap, x1[i]);
+					cost[i] -= a2 * evaluate2_K(pixels, nSize, cacheMap, x1[i]);
+					cost[i] += a3 * evaluate3_K(pixels, nSize, cacheMap, x1[i]) + 1000; // clustered and changed the original data of x1[i]
 
 					if (cost[i] >= temp_costx1)
 						cost[i] = temp_costx1;
@@ -354,20 +335,20 @@ namespace MoDEQuant
 				else { // Differential Evolution
 					int d, b;
 					do {
-						d = (int)(rand1() * N);
+						d = (int)(m_random.NextDouble() * N);
 					} while (d == i);
 					do {
-						b = (int)(rand1() * N);
+						b = (int)(m_random.NextDouble() * N);
 					} while (b == d || b == i);
 
-					int jr = (int)(rand1() * D); // every individual update control parameters
-					if (rand1() < 0.1) {
-						F = 0.1 + rand1() * 0.9;
-						CR = rand1();
+					int jr = (int)(m_random.NextDouble() * D); // every individual update control parameters
+					if (m_random.NextDouble() < 0.1) {
+						F = 0.1 + m_random.NextDouble() * 0.9;
+						CR = m_random.NextDouble();
 					}
 
 					for (UINT j = 0; j < D; ++j) {
-						if (rand1() <= CR || j == jr) {
+						if (m_random.NextDouble() <= CR || j == jr) {
 							double diff = (x1[d][j] - x1[b][j]);
 							if (diff > Max_diff)
 								diff -= Max_diff;
@@ -389,11 +370,11 @@ namespace MoDEQuant
 							x2[i][j] = x1[i][j];
 					}
 
-					double score = a1 * evaluate1(pixels, cacheMap, x1[i]);
-					score -= a2 * evaluate2(pixels, cacheMap, x1[i]);
+					double score = a1 * evaluate1(pixels, nSize, cacheMap, x1[i]);
+					score -= a2 * evaluate2(pixels, nSize, cacheMap, x1[i]);
 					if (score > cost[i])
 						continue;
-					score += a3 * evaluate3(pixels, cacheMap, x1[i]) + 1000;
+					score += a3 * evaluate3(pixels, nSize, cacheMap, x1[i]) + 1000;
 					if (score > cost[i])
 						continue;
 
@@ -424,43 +405,17 @@ namespace MoDEQuant
 		return 0;
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short MoDEQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
-		unsigned short k = 0;
-		Color c(argb);
-
-		UINT mindist = INT_MAX;
-		for (UINT i = 0; i < nMaxColors; ++i) {
-			Color c2(pPalette->Entries[i]);
-			UINT curdist = sqr(c2.GetA() - c.GetA());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetR() - c.GetR());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetG() - c.GetG());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetB() - c.GetB());
-			if (curdist > mindist)
-				continue;
-
-			mindist = curdist;
-			k = i;
-		}
-		return k;
+		return m_paletteIndex.Nearest(pPalette, nMaxColors, argb);
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short MoDEQuantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		UINT k = 0;
 		Color c(argb);
-		vector<unsigned short> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		unsigned short closest[5] = { 0 };
+		if (!closestMap.Find(argb, closest)) {
 			closest[2] = closest[3] = INT_MAX;
 
 			for (; k < nMaxColors; k++) {
@@ -480,25 +435,35 @@ namespace MoDEQuant
 
 			if (closest[3] == INT_MAX)
 				closest[2] = 0;
+
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next(closest[3] + closest[2]) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
-
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool MoDEQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
 	{
-		if (dither)
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
+		if (dither || m_colormapRemap) {
+			InverseColormap colormap;
+			if (width * height >= MIN_COLORMAP_PIXELS)
+				colormap.Build(pPalette, nMaxColors, hasSemiTransparency);
+			else if (!dither || IsThreadedDither(m_ditherMode))
+				colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+			if (!dither) {
+				colormap.Remap(pixels, width * height, qPixels);
+				return true;
+			}
+			return dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+		}
 
-		DitherFn ditherFn = (m_transparentPixelIndex >= 0 || nMaxColors < 256) ? nearestColorIndex : closestColorIndex;
+		DitherFn ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); };
+		if (m_transparentPixelIndex < 0 && nMaxColors >= 256)
+			ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return closestColorIndex(pPalette, nMaxColors, argb); };
 		UINT pixelIndex = 0;
 		for (int j = 0; j < height; ++j) {
 			for (int i = 0; i < width; ++i)
@@ -508,25 +473,14 @@ namespace MoDEQuant
 		return true;
 	}
 
-	bool MoDEQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool MoDEQuantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
-		UINT bitmapWidth = pSource->GetWidth();
-		UINT bitmapHeight = pSource->GetHeight();
-
-		hasSemiTransparency = false;
-		m_transparentPixelIndex = -1;
-		int pixelIndex = 0;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
-
+		m_paletteIndex.Clear();
 		SIDE = hasSemiTransparency ? 4 : 3;
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
 		if (nMaxColors > 2)
-			moDEquan(pixels, pPalette, nMaxColors);
+			moDEquan(pixels, width * height, pPalette, nMaxColors);
 		else {
 			if (m_transparentPixelIndex >= 0) {
 				pPalette->Entries[0] = Color::Transparent;
@@ -539,14 +493,17 @@ namespace MoDEQuant
 		}
 
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			closestMap.clear();
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			InverseColormap colormap;
+			if (width * height >= MIN_COLORMAP_PIXELS)
+				colormap.Build(pPalette, nMaxColors, hasSemiTransparency);
+			else if (IsThreadedDither(m_ditherMode))
+				colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+			dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+			closestMap.Clear();
+			return true;
 		}
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
+		quantize_image(pixels, pPalette, nMaxColors, qPixels, width, height, dither);
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -555,9 +512,41 @@ namespace MoDEQuant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		closestMap.clear();
+		closestMap.Clear();
+		return true;
+	}
+
+	bool MoDEQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
+
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither);
+	}
+
+#ifdef _WIN32
+	bool MoDEQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(pixels.size());
+		if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
 
+		if (nMaxColors > 256)
+			return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
 
-}
\ No newline at end of file
+}
@@ -1,6 +1,10 @@
 #pragma once
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "ClosestCache.h"
+#include "PaletteIndex.h"
+#include "RandomGenerator.h"
 using namespace std;
 
 namespace MoDEQuant
@@ -24,6 +28,42 @@ namespace MoDEQuant
 	class MoDEQuantizer
 	{
 		public:
-			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+			// Quantizes a caller-owned 32bpp ARGB buffer, stride in bytes. pPalette must hold
+			// nMaxColors entries and qPixels width * height indices into it.
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#ifdef _WIN32
+			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#endif // _WIN32
+			// Seeds the random choices of the runs that follow, which repeat for the same seed
+			void SetSeed(const UINT seed) { m_random.Seed(seed); }
+			// Remaps without dithering through an InverseColormap, one table lookup per pixel
+			// instead of a palette search. Faster on large images, but each colour is reduced to
+			// the 5-6-5 or 4-4-4-4 bits of its cell first. Applies up to 256 colours, off by default.
+			void SetColormapRemap(const bool colormapRemap) { m_colormapRemap = colormapRemap; }
+
+		private:
+			BYTE SIDE = 3;
+			bool hasSemiTransparency = false;
+			bool m_colormapRemap = false;
+			int m_transparentPixelIndex = -1;
+			DitherMode m_ditherMode = DitherMode::ErrorDiffusion;
+			ARGB m_transparentColor = Color::Transparent;
+			ClosestCache<unsigned short> closestMap;
+			RandomGenerator m_random;
+			PaletteIndex m_paletteIndex;
+
+			unsigned short find_nn(const vector<double>& data, const Color& c, unordered_map<ARGB, unsigned short>& cacheMap, double& idis);
+			void updateCentroids(vector<double>& data, double* temp_x, const int* temp_x_number);
+			double evaluate1(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data);
+			double evaluate1_K(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data);
+			double evaluate2(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data, const int K_num = 1);
+			double evaluate2_K(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data);
+			double evaluate3(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data);
+			double evaluate3_K(const ARGB* pixels, const UINT nSize, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data);
+			int moDEquan(const ARGB* pixels, const UINT nSize, ColorPalette* pPalette, const unsigned short nMaxColors);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+			bool QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither);
 	};
 }
\ No newline at end of file
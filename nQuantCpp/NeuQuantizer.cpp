@@ -3,7 +3,10 @@
 #include "stdafx.h"
 #include "NeuQuantizer.h"
 #include "bitmapUtilities.h"
+#include "InverseColormap.h"
 #include "CIELABConvertor.h"
+#include "CpuFeatures.h"
+#include <float.h>
 #include <unordered_map>
 
 namespace NeuralNet
@@ -33,16 +36,11 @@ namespace NeuralNet
 	* that this copyright notice remain intact.
 	*/
 
-	double PR = .2126, PG = .7152, PB = .0722;
 	const short specials = 3;		// number of reserved colours used
 	const int ncycles = 115;			// no. of learning cycles
 	const int radiusbiasshift = 8;
 	const int radiusbias = 1 << radiusbiasshift;
 
-	int netsize = 256;		// number of colours used	
-	int maxnetpos = netsize - 1;
-	int initrad = netsize >> 3;   // for 256 cols, radius starts at 32
-	double initradius = initrad * 1.0;
 	const int radiusdec = 30; // factor of 1/30 each cycle
 
 	const short normal_learning_extension_factor = 2; /* normally learn twice as long */
@@ -58,7 +56,6 @@ namespace NeuralNet
 	const short REPEL_THRESHOLD = 16;          /* See repel_coincident()... */
 	const short REPEL_STEP_DOWN = 1;              /* ... for an explanation of... */
 	const short REPEL_STEP_UP = 4;                 /* ... how these points work. */
-	unique_ptr<unsigned short[]> repel_points;
 
 	/* defs for freq and bias */
 	const int gammashift = 10;                  /* gamma = 1024 */
@@ -67,26 +64,6 @@ namespace NeuralNet
 	const double beta = (1.0 / (double)(1 << betashift));/* beta = 1/1024 */
 	const double betagamma = (double)(1 << (gammashift - betashift));
 
-	struct nq_pixel
-	{
-		double al, L, A, B;
-	};
-
-	unique_ptr<nq_pixel[]> network; // the network itself
-
-	unique_ptr<unsigned short[]> netindex; // for network lookup - really 256
-
-	unique_ptr<double[]> bias;  // bias and freq arrays for learning
-	unique_ptr<double[]> freq;
-	unique_ptr<double[]> radpower;
-
-	double gamma_correction = 1.0;         // 1.0/2.2 usually
-
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
-
 	inline double colorimportance(double al)
 	{
 		double transparency = 1.0 - al / 255.0;
@@ -103,28 +80,39 @@ namespace NeuralNet
 		return 1.0;
 	}
 
-	void SetUpArrays() {
-		network = make_unique<nq_pixel[]>(netsize);
+	const int NET_PADDING = 8;
+	/* Channel value of the padding neurons, too far from any colour to ever win a contest */
+	const float FAR_NEURON = 1e30f;
+
+	void NeuQuantizer::SetUpArrays() {
+		const int netcapacity = (netsize + NET_PADDING - 1) / NET_PADDING * NET_PADDING;
+		network.al = make_unique<float[]>(netcapacity);
+		network.L = make_unique<float[]>(netcapacity);
+		network.A = make_unique<float[]>(netcapacity);
+		network.B = make_unique<float[]>(netcapacity);
 		netindex = make_unique<unsigned short[]>(max(netsize, 256));
 		repel_points = make_unique<unsigned short[]>(max(netsize, 256));
-		bias = make_unique<double[]>(netsize);
-		freq = make_unique<double[]>(netsize);
-		radpower = make_unique<double[]>(initrad);
+		bias = make_unique<float[]>(netcapacity);
+		freq = make_unique<float[]>(netsize);
+		radpower = make_unique<double[]>(initrad + 1);
 
 		for (int i = specials; i < netsize; ++i) {
-			network[i].L = network[i].A = network[i].B = i / netsize;
+			network.L[i] = network.A[i] = network.B[i] = i / netsize;
 
 			/*  Sets alpha values at 0 for dark pixels. */
 			if (i < 16)
-				network[i].al = i * 16.0;
+				network.al[i] = i * 16.0f;
 			else
-				network[i].al = BYTE_MAX;
+				network.al[i] = BYTE_MAX;
 
-			freq[i] = 1.0 / netsize;
+			freq[i] = 1.0f / netsize;
 		}
+
+		for (int i = netsize; i < netcapacity; ++i)
+			network.al[i] = network.L[i] = network.A[i] = network.B[i] = FAR_NEURON;
 	}
 
-	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
+	void NeuQuantizer::getLab(const Color& c, CIELABConvertor::Lab& lab1)
 	{
 		auto got = pixelMap.find(c.GetValue());
 		if (got == pixelMap.end()) {
@@ -146,19 +134,19 @@ namespace NeuralNet
 		return (UINT)temp;
 	}
 
-	void Altersingle(double alpha, UINT i, BYTE al, double L, double A, double B) {
+	void NeuQuantizer::Altersingle(double alpha, UINT i, BYTE al, double L, double A, double B) {
 		double colorimp = 1.0;//0.5;// + 0.7 * colorimportance(al);
 
 		alpha /= initalpha;
 
 		/* alter hit neuron */
-		network[i].al -= alpha * (network[i].al - al);
-		network[i].L -= colorimp * alpha * (network[i].L - L);
-		network[i].A -= colorimp * alpha * (network[i].A - A);
-		network[i].B -= colorimp * alpha * (network[i].B - B);
+		network.al[i] -= alpha * (network.al[i] - al);
+		network.L[i] -= colorimp * alpha * (network.L[i] - L);
+		network.A[i] -= colorimp * alpha * (network.A[i] - A);
+		network.B[i] -= colorimp * alpha * (network.B[i] - B);
 	}
 
-	void Alterneigh(UINT rad, UINT i, BYTE al, double L, double A, double B) {
+	void NeuQuantizer::Alterneigh(UINT rad, UINT i, BYTE al, double L, double A, double B) {
 		int lo = i - rad;
 		if (lo < 0)
 			lo = 0;
@@ -172,17 +160,17 @@ namespace NeuralNet
 		while ((j <= hi) || (k >= lo)) {
 			double learning_rate = (*(++learning_rate_table)) / alpharadbias;
 			if (j <= hi) {
-				network[j].al -= learning_rate * (network[j].al - al);
-				network[j].L -= learning_rate * (network[j].L - L);
-				network[j].A -= learning_rate * (network[j].A - A);
-				network[j].B -= learning_rate * (network[j].B - B);
+				network.al[j] -= learning_rate * (network.al[j] - al);
+				network.L[j] -= learning_rate * (network.L[j] - L);
+				network.A[j] -= learning_rate * (network.A[j] - A);
+				network.B[j] -= learning_rate * (network.B[j] - B);
 				j++;
 			}
 			if (k >= lo) {
-				network[k].al -= learning_rate * (network[k].al - al);
-				network[k].L -= learning_rate * (network[k].L - L);
-				network[k].A -= learning_rate * (network[k].A - A);
-				network[k].B -= learning_rate * (network[k].B - B);
+				network.al[k] -= learning_rate * (network.al[k] - al);
+				network.L[k] -= learning_rate * (network.L[k] - L);
+				network.A[k] -= learning_rate * (network.A[k] - A);
+				network.B[k] -= learning_rate * (network.B[k] - B);
 				k--;
 			}
 		}
@@ -197,7 +185,7 @@ namespace NeuralNet
 	 * Eventually the number of repel points will eventually oscillate around the threshold.  With current settings, that means
 	 * that only every 4th function call will result in a full pass.
  	*/
-	void Repelcoincident(int i) {
+	void NeuQuantizer::Repelcoincident(int i) {
 		/* Use brute force to precompute the distance vectors between our neuron and each neuron. */
 
 		if (repel_points[i] > REPEL_THRESHOLD) {
@@ -205,14 +193,8 @@ namespace NeuralNet
 			return;
 		}
 
-		auto diffs = make_unique<nq_pixel[]>(netsize);
-		for (int vdx = 0; vdx < netsize; ++vdx) {
-			diffs[vdx].al = abs(network[vdx].al - network[i].al);
-			diffs[vdx].L = abs(network[vdx].L - network[i].L);
-			diffs[vdx].A = abs(network[vdx].A - network[i].A);
-			diffs[vdx].B = abs(network[vdx].B - network[i].B);
-		}
-
+		/* The neuron moves too, so its colour is taken before the pass. */
+		const float al = network.al[i], L = network.L[i], A = network.A[i], B = network.B[i];
 
 		/* Identify which neurons are too close to neuron[i] and shift them away.
 		 * */
@@ -223,113 +205,170 @@ namespace NeuralNet
 		double repel_step = exclusion_threshold * (radpower[0] / alpharadbias);
 
 		for (int j = 0; j < netsize; ++j) {
-
-			if (diffs[j].al < exclusion_threshold
-				&& diffs[j].L < exclusion_threshold
-				&& diffs[j].A < exclusion_threshold
-				&& diffs[j].B < exclusion_threshold
+			const double diffal = abs(network.al[j] - al);
+			const double diffL = abs(network.L[j] - L);
+			const double diffA = abs(network.A[j] - A);
+			const double diffB = abs(network.B[j] - B);
+
+			if (diffal < exclusion_threshold
+				&& diffL < exclusion_threshold
+				&& diffA < exclusion_threshold
+				&& diffB < exclusion_threshold
 				) {
-
-				nq_pixel repel_vec;
-				repel_vec.al = posneg(diffs[j].al), repel_vec.L = posneg(diffs[j].L), repel_vec.A = posneg(diffs[j].A), repel_vec.B = posneg(diffs[j].B);
-
-				network[j].al += repel_vec.al * repel_step;
-				network[j].L += repel_vec.L * repel_step;
-				network[j].A += repel_vec.A * repel_step;
-				network[j].B += repel_vec.B * repel_step;
+				network.al[j] += posneg(diffal) * repel_step;
+				network.L[j] += posneg(diffL) * repel_step;
+				network.A[j] += posneg(diffA) * repel_step;
+				network.B[j] += posneg(diffB) * repel_step;
 			}
 		}
 
 		repel_points[i] += REPEL_STEP_UP;
 	}
 
-	int Contest(BYTE al, double L, double A, double B) {
-		/* Calculate the component-wise differences between target_pix colour and every colour in the network, and weight according
-		* to component relevance.
-		*/
-		auto diffs = make_unique<nq_pixel[]>(netsize);
-		for (int vdx = 0; vdx < netsize; ++vdx) {
-			diffs[vdx].al = abs(network[vdx].al - al);
-			diffs[vdx].L = abs(network[vdx].L - L);
-			diffs[vdx].A = abs(network[vdx].A - A);
-			diffs[vdx].B = abs(network[vdx].B - B);
+	/* Finds the neuron nearest to the colour by manhattan distance, returned in bestpos, and the
+	* nearest once each neuron's bias is subtracted. A neuron within exclusion_threshold in every
+	* component is a perfect match: the first one met is returned as -bestpos - 1 instead.
+	*/
+	typedef int (*ContestFn)(const nq_network& network, const float* bias, const int netsize, const float al, const float L, const float A, const float B, int& bestpos);
+
+	static int ContestNeurons(const nq_network& network, const float* bias, const int netsize, const float al, const float L, const float A, const float B, int& bestpos)
+	{
+		const float threshold = (float) exclusion_threshold;
+		int bestbiaspos = 0;
+		float bestd = FLT_MAX, bestbiasd = FLT_MAX;
+		bestpos = 0;
+
+		for (int i = 0; i < netsize; ++i) {
+			const float diffal = fabs(network.al[i] - al);
+			const float diffL = fabs(network.L[i] - L);
+			const float diffA = fabs(network.A[i] - A);
+			const float diffB = fabs(network.B[i] - B);
+			if (diffal < threshold && diffL < threshold && diffA < threshold && diffB < threshold) {
+				bestpos = i;
+				return -bestpos - 1;
+			}
+
+			const float dist = diffL + diffA + diffB + diffal;
+			const float biasdist = dist - bias[i];
+			bestpos = dist < bestd ? i : bestpos;
+			bestd = min(dist, bestd);
+			bestbiaspos = biasdist < bestbiasd ? i : bestbiaspos;
+			bestbiasd = min(biasdist, bestbiasd);
 		}
+		return bestbiaspos;
+	}
+
+#ifdef NQUANT_X86
+	/* Eight neurons at a time, each lane keeping its own minima. The padding neurons never
+	* win, and ties go to the lowest position as in the scalar search.
+	*/
+	TARGET_AVX2 static int ContestNeuronsAVX2(const nq_network& network, const float* bias, const int netsize, const float al, const float L, const float A, const float B, int& bestpos)
+	{
+		const __m256 signMask = _mm256_set1_ps(-0.0f);
+		const __m256 threshold = _mm256_set1_ps((float) exclusion_threshold);
+		const __m256 targetal = _mm256_set1_ps(al), targetL = _mm256_set1_ps(L), targetA = _mm256_set1_ps(A), targetB = _mm256_set1_ps(B);
+		__m256 bestd = _mm256_set1_ps(FLT_MAX), bestbiasd = bestd;
+		__m256i bestposes = _mm256_setzero_si256(), bestbiasposes = bestposes;
+		__m256i positions = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i step = _mm256_set1_epi32(NET_PADDING);
+
+		for (int i = 0; i < netsize; i += NET_PADDING) {
+			const __m256 diffal = _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(network.al.get() + i), targetal));
+			const __m256 diffL = _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(network.L.get() + i), targetL));
+			const __m256 diffA = _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(network.A.get() + i), targetA));
+			const __m256 diffB = _mm256_andnot_ps(signMask, _mm256_sub_ps(_mm256_loadu_ps(network.B.get() + i), targetB));
+
+			const __m256 perfect = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(diffal, threshold, _CMP_LT_OQ), _mm256_cmp_ps(diffL, threshold, _CMP_LT_OQ)),
+				_mm256_and_ps(_mm256_cmp_ps(diffA, threshold, _CMP_LT_OQ), _mm256_cmp_ps(diffB, threshold, _CMP_LT_OQ)));
+			const int perfectLanes = _mm256_movemask_ps(perfect);
+			if (perfectLanes) {
+				int lane = 0;
+				while (!(perfectLanes & (1 << lane)))
+					++lane;
+				bestpos = i + lane;
+				return -bestpos - 1;
+			}
+
+			const __m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(diffL, diffA), diffB), diffal);
+			const __m256 biasdist = _mm256_sub_ps(dist, _mm256_loadu_ps(bias + i));
+			const __m256 closer = _mm256_cmp_ps(dist, bestd, _CMP_LT_OQ);
+			bestd = _mm256_min_ps(dist, bestd);
+			bestposes = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestposes), _mm256_castsi256_ps(positions), closer));
+			const __m256 closerBiased = _mm256_cmp_ps(biasdist, bestbiasd, _CMP_LT_OQ);
+			bestbiasd = _mm256_min_ps(biasdist, bestbiasd);
+			bestbiasposes = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestbiasposes), _mm256_castsi256_ps(positions), closerBiased));
+			positions = _mm256_add_epi32(positions, step);
+		}
+
+		float dists[NET_PADDING], biasdists[NET_PADDING];
+		int poses[NET_PADDING], biasposes[NET_PADDING];
+		_mm256_storeu_ps(dists, bestd);
+		_mm256_storeu_ps(biasdists, bestbiasd);
+		_mm256_storeu_si256((__m256i*) poses, bestposes);
+		_mm256_storeu_si256((__m256i*) biasposes, bestbiasposes);
+
+		bestpos = poses[0];
+		int bestbiaspos = biasposes[0];
+		for (int lane = 1; lane < NET_PADDING; ++lane) {
+			if (dists[lane] < dists[0] || (dists[lane] == dists[0] && poses[lane] < bestpos)) {
+				dists[0] = dists[lane];
+				bestpos = poses[lane];
+			}
+			if (biasdists[lane] < biasdists[0] || (biasdists[lane] == biasdists[0] && biasposes[lane] < bestbiaspos)) {
+				biasdists[0] = biasdists[lane];
+				bestbiaspos = biasposes[lane];
+			}
+		}
+		return bestbiaspos;
+	}
+#endif // NQUANT_X86
+
+	static ContestFn SelectContestFn()
+	{
+#ifdef NQUANT_X86
+		if (HasAVX2())
+			return ContestNeuronsAVX2;
+#endif
+		return ContestNeurons;
+	}
 
+	static const ContestFn contestNeurons = SelectContestFn();
+
+	int NeuQuantizer::Contest(BYTE al, double L, double A, double B) {
 		/* finds closest neuron (min dist) and updates freq */
 		/* finds best neuron (min dist-bias) and returns position */
 		/* for frequently chosen neurons, freq[i] is high and bias[i] is negative */
 		/* bias[i] = gamma*((1/netsize)-freq[i]) */
 
-		int bestpos = 0, bestbiaspos = bestpos;
-		double bestd = INT_MAX, bestbiasd = bestd;
-
 		/* Using colorimportance(al) here was causing problems with images that were close to monocolor.
 		See bug reports: 3149791, 2938728, 2896731 and 2938710
 		*/
-		bool perfect = false; /* Is bestpos a perfect match for the colour. */
+		int bestpos = 0;
+		const int result = contestNeurons(network, bias.get(), netsize, al, (float) L, (float) A, (float) B, bestpos);
 
+		/* Age (decay) the neurons bias and freq values. */
 		for (int i = 0; i < netsize; ++i) {
-			if (!perfect) {
-				double bestbiasd_biased = bestbiasd + bias[i];
-				double dist = 0;
-
-				/*Detect perfect matches. */
-				if (diffs[i].al < exclusion_threshold
-					&& diffs[i].L < exclusion_threshold
-					&& diffs[i].A < exclusion_threshold
-					&& diffs[i].B < exclusion_threshold
-					) {
-					perfect = true;
-
-					/* If we don't have a perfect match, the distance between the
-						* target and the neuron is the manhattan distance. */
-				}
-				else {
-					dist = diffs[i].L;
-					dist += diffs[i].A;
-
-					if (dist < bestd || dist < bestbiasd_biased) {
-						dist += diffs[i].B;
-						dist += diffs[i].al;						
-					}
-				}
-
-				/* See if the current neuron is better. */
-				if (dist < bestd) {
-					bestd = dist;
-					bestpos = i;
-				}
-				if (dist < bestbiasd_biased) {
-					bestbiasd = dist - bias[i];
-					bestbiaspos = i;
-				}
-			}
-
-			/* Age (decay) the current neurons bias and freq values. */
-			double betafreq = freq[i] * beta;
+			const float betafreq = freq[i] * (float) beta;
 			freq[i] -= betafreq;
-			bias[i] += betafreq * gamma;
+			bias[i] += betafreq * (float) gamma;
 		}
 
 		/* Increase the freq and bias values for the chosen neuron. */
-		freq[bestpos] += beta;
-		bias[bestpos] -= betagamma;
+		freq[bestpos] += (float) beta;
+		bias[bestpos] -= (float) betagamma;
 		
 		/* If our bestpos pixel is a 'perfect' match, we return bestpos, not bestbiaspos.  That is, we only decide to look at
 		* bestbiaspos if the current target pixel wasn't a good enough match with the bestpos neuron, and there is some hope that
 		* we can train the bestbiaspos neuron to become a better match. */
-		if (perfect)
-			return -bestpos - 1;  /* flag this was a perfect match */
-
-		return bestbiaspos;
+		return result;
 	}
 
-	void Learn(const int samplefac, const vector<ARGB>& pixels) {
+	void NeuQuantizer::Learn(const int samplefac, const ARGB* pixels, const UINT nSize) {
 		UINT stepIndex = 0;
 
 		int pos = 0;
 		int alphadec = 30 + ((samplefac - 1) / 3);
-		const UINT lengthcount = pixels.size();
+		const UINT lengthcount = nSize;
 		UINT samplepixels = lengthcount / samplefac;
 		UINT delta = samplepixels / ncycles;  /* here's a problem with small images: samplepixels < ncycles => delta = 0 */
 		if (delta == 0)
@@ -345,8 +384,9 @@ namespace NeuralNet
 
 		for (UINT i = 0; i < rad; ++i)
 			radpower[i] = floor(alpha * (((sqr(rad) - sqr(i)) * radiusbias) / sqr(rad)));
+		radpower[rad] = 0;	/* Alterneigh reads radpower[1..rad] */
 
-		UINT step = ((float)rand() / (float)RAND_MAX) * lengthcount;
+		UINT step = m_random.Next(lengthcount);
 
 		int learning_extension = normal_learning_extension_factor;
 		if (netsize < extra_long_colour_threshold)
@@ -384,11 +424,12 @@ namespace NeuralNet
 					rad = 0;
 				for (UINT j = 0; j < rad; ++j)
 					radpower[j] = floor(alpha * (((sqr(rad) - sqr(j)) * radiusbias) / sqr(rad)));
+				radpower[rad] = 0;
 			}
 		}
 	}
 
-	void Inxbuild(ColorPalette* pPalette) {
+	void NeuQuantizer::Inxbuild(ColorPalette* pPalette) {
 		UINT nMaxColors = pPalette->Count;		
 
 		int previouscol = 0;
@@ -397,17 +438,17 @@ namespace NeuralNet
 		for (int i = 0; i < nMaxColors; ++i) {
 			Color c(pPalette->Entries[i]);
 			int smallpos = i;
-			auto smallval = network[i].L;			// index on L
+			auto smallval = network.L[i];			// index on L
 											// find smallest in i..netsize-1
 			for (int j = i + 1; j < nMaxColors; ++j) {
-				if (network[j].L < smallval) {		// index on L				
+				if (network.L[j] < smallval) {		// index on L				
 					smallpos = j;
-					smallval = network[j].L;	// index on L
+					smallval = network.L[j];	// index on L
 				}
 			}
 			// swap p (i) and q (smallpos) entries
 			if (i != smallpos)
-				swap(network[smallpos], network[i]);
+				network.Swap(smallpos, i);
 
 			// smallval entry is now in position i
 			if (smallval != previouscol) {
@@ -425,14 +466,17 @@ namespace NeuralNet
 
 		for (UINT k = 0; k < nMaxColors; ++k) {
 			CIELABConvertor::Lab lab1;
-			lab1.alpha = round_biased(network[k].al);
-			lab1.L = network[k].L, lab1.A = network[k].A, lab1.B = network[k].B;
+			lab1.alpha = round_biased(network.al[k]);
+			lab1.L = network.L[k], lab1.A = network.A[k], lab1.B = network.B[k];
 			pPalette->Entries[k] = CIELABConvertor::LAB2RGB(lab1);
 		}
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short NeuQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
+		if (nMaxColors > 32)
+			return m_paletteIndex.Nearest(pPalette, nMaxColors, argb, PR, PG, PB);
+
 		unsigned short k = 0;
 		Color c(argb);
 
@@ -442,56 +486,44 @@ namespace NeuralNet
 
 		for (UINT i = 0; i < nMaxColors; ++i) {
 			Color c2(pPalette->Entries[i]);
-			if (nMaxColors > 32) {
-				double curdist = sqr(c2.GetA() - c.GetA());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PR * sqr(c2.GetR() - c.GetR());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PG * sqr(c2.GetG() - c.GetG());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PB * sqr(c2.GetB() - c.GetB());
-				if (curdist > mindist)
-					continue;
-
-				mindist = curdist;
-			}
-			else {
-				getLab(c2, lab2);
+			getLab(c2, lab2);
 
-				double curdist = sqr(c2.GetA() - c.GetA());
-				if (curdist > mindist)
-					continue;
+			double curdist = sqr(c2.GetA() - c.GetA());
+			if (curdist > mindist)
+				continue;
 
-				curdist += sqr(lab2.L - lab1.L);
-				if (curdist > mindist)
-					continue;
+			curdist += sqr(lab2.L - lab1.L);
+			if (curdist > mindist)
+				continue;
 
-				curdist += sqr(lab2.A - lab1.A);
-				if (curdist > mindist)
-					continue;
+			curdist += sqr(lab2.A - lab1.A);
+			if (curdist > mindist)
+				continue;
 
-				curdist += sqr(lab2.B - lab1.B);
-				if (curdist > mindist)
-					continue;
+			curdist += sqr(lab2.B - lab1.B);
+			if (curdist > mindist)
+				continue;
 
-				mindist = curdist;
-			}
-			
+			mindist = curdist;
 			k = i;
 		}
 		return k;
 	}
 
-	bool quantize_image(const vector<ARGB>& pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool NeuQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
 	{
-		if (dither)
-			return dither_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
+		if (dither || m_colormapRemap) {
+			InverseColormap colormap;
+			if (nMaxColors > 32 && width * height >= MIN_COLORMAP_PIXELS)
+				colormap.Build(pPalette, nMaxColors, hasSemiTransparency, PR, PG, PB);
+			else if (!dither || IsThreadedDither(m_ditherMode))
+				colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+			if (!dither) {
+				colormap.Remap(pixels, width * height, qPixels);
+				return true;
+			}
+			return dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+		}
 
 		UINT pixelIndex = 0;
 		for (UINT j = 0; j < height; ++j) {
@@ -502,28 +534,22 @@ namespace NeuralNet
 		return true;
 	}
 
-	void Clear() {
-		network.reset();
+	void NeuQuantizer::Clear() {
+		network = nq_network();
 		netindex.reset();
 		bias.reset();
 		freq.reset();
 		radpower.reset();
 
 		pixelMap.clear();
+		m_paletteIndex.Clear();
 	}
 
 	// The work horse for NeuralNet color quantizing.
-	bool NeuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool NeuQuantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
-
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
-
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
+		PR = .2126, PG = .7152, PB = .0722;
 
 		netsize = nMaxColors;		// number of colours used
 		maxnetpos = netsize - 1;
@@ -531,21 +557,25 @@ namespace NeuralNet
 		initradius = initrad * 1.0;
 
 		SetUpArrays();
-		Learn(dither ? 5 : 1, pixels);
+		Learn(dither ? 5 : 1, pixels, width * height);
 		Inxbuild(pPalette);
 
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
+			InverseColormap colormap;
+			if (width * height >= MIN_COLORMAP_PIXELS)
+				colormap.Build(pPalette, nMaxColors, hasSemiTransparency, PR, PG, PB);
+			else if (IsThreadedDither(m_ditherMode))
+				colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+			dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
 			Clear();
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			return true;
 		}
 
 		if (hasSemiTransparency || nMaxColors <= 32)
 			PR = PG = PB = 1;
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels, pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);		if (m_transparentPixelIndex >= 0) {
+		quantize_image(pixels, pPalette, nMaxColors, qPixels, width, height, dither);
+		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
 			if (nMaxColors > 2)
 				pPalette->Entries[k] = m_transparentColor;
@@ -554,6 +584,40 @@ namespace NeuralNet
 		}
 
 		Clear();
+		return true;
+	}
+
+	bool NeuQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
+
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither);
+	}
+
+#ifdef _WIN32
+	bool NeuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(pixels.size());
+		if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		if (nMaxColors > 256)
+			return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
+
 }
@@ -1,6 +1,10 @@
 #pragma once
+#include "CIELABConvertor.h"
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "PaletteIndex.h"
+#include "RandomGenerator.h"
 using namespace std;
 
 namespace NeuralNet
@@ -21,9 +25,72 @@ namespace NeuralNet
 	// Use at your own risk!
 	// =============================================================
 
+	// Neurons held channel by channel, padded to whole vectors of eight so that Contest
+	// measures its distances to several neurons at once
+	struct nq_network
+	{
+		unique_ptr<float[]> al, L, A, B;
+
+		void Swap(const int i, const int j)
+		{
+			swap(al[i], al[j]);
+			swap(L[i], L[j]);
+			swap(A[i], A[j]);
+			swap(B[i], B[j]);
+		}
+	};
+
 	class NeuQuantizer
 	{
 		public:
-			bool QuantizeImage(Bitmap* pSource, Bitmap *pDest, UINT& nMaxColors, bool dither = true);
+			// Quantizes a caller-owned 32bpp ARGB buffer, stride in bytes. pPalette must hold
+			// nMaxColors entries and qPixels width * height indices into it.
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#ifdef _WIN32
+			bool QuantizeImage(Bitmap* pSource, Bitmap *pDest, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#endif // _WIN32
+			// Seeds the random choices of the runs that follow, which repeat for the same seed
+			void SetSeed(const UINT seed) { m_random.Seed(seed); }
+			// Remaps without dithering through an InverseColormap, one table lookup per pixel
+			// instead of a palette search. Faster on large images, but each colour is reduced to
+			// the 5-6-5 or 4-4-4-4 bits of its cell first. Applies up to 256 colours, off by default.
+			void SetColormapRemap(const bool colormapRemap) { m_colormapRemap = colormapRemap; }
+
+		private:
+			double PR = .2126, PG = .7152, PB = .0722;
+
+			int netsize = 256;		// number of colours used
+			int maxnetpos = netsize - 1;
+			int initrad = netsize >> 3;   // for 256 cols, radius starts at 32
+			double initradius = initrad * 1.0;
+
+			unique_ptr<unsigned short[]> repel_points;
+			nq_network network; // the network itself
+			unique_ptr<unsigned short[]> netindex; // for network lookup - really 256
+			unique_ptr<float[]> bias;  // bias and freq arrays for learning
+			unique_ptr<float[]> freq;
+			unique_ptr<double[]> radpower;
+
+			bool hasSemiTransparency = false;
+			bool m_colormapRemap = false;
+			int m_transparentPixelIndex = -1;
+			RandomGenerator m_random;
+			DitherMode m_ditherMode = DitherMode::ErrorDiffusion;
+			ARGB m_transparentColor = Color::Transparent;
+			unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
+			PaletteIndex m_paletteIndex;
+
+			void SetUpArrays();
+			void getLab(const Color& c, CIELABConvertor::Lab& lab1);
+			void Altersingle(double alpha, UINT i, BYTE al, double L, double A, double B);
+			void Alterneigh(UINT rad, UINT i, BYTE al, double L, double A, double B);
+			void Repelcoincident(int i);
+			int Contest(BYTE al, double L, double A, double B);
+			void Learn(const int samplefac, const ARGB* pixels, const UINT nSize);
+			void Inxbuild(ColorPalette* pPalette);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+			void Clear();
+			bool QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,250 @@
+﻿#include "stdafx.h"
+#include "OrderedDither.h"
+#include "Histogram.h"
+#include "InverseColormap.h"
+#include <cmath>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ORDERED_DITHER_SSE2
+#endif
+
+// Side of the blue noise matrix, a power of two
+const int BLUE_NOISE_SIZE = 64;
+// Pixels each thread should get at least
+const UINT MIN_ORDERED_PIXELS = 1 << 16;
+
+// Ranks of the classic recursive Bayer matrix
+static vector<unsigned short> MakeBayer(const int size)
+{
+	vector<unsigned short> ranks(1, 0);
+	for (int n = 1; n < size; n *= 2) {
+		vector<unsigned short> next(4 * n * n);
+		for (int y = 0; y < n; ++y) {
+			for (int x = 0; x < n; ++x) {
+				const unsigned short rank = 4 * ranks[y * n + x];
+				next[y * 2 * n + x] = rank;
+				next[y * 2 * n + x + n] = rank + 2;
+				next[(y + n) * 2 * n + x] = rank + 3;
+				next[(y + n) * 2 * n + x + n] = rank + 1;
+			}
+		}
+		ranks.swap(next);
+	}
+	return ranks;
+}
+
+// Ranks of a tileable blue noise matrix made by Ulichney's void-and-cluster method.
+// The energy of a cell is a Gaussian of its distance to the set cells, measured
+// around the torus, so the matrix has no seams when tiled.
+static vector<unsigned short> MakeBlueNoise()
+{
+	const int size = BLUE_NOISE_SIZE, mask = size - 1, nCells = size * size;
+	// The Gaussian is below 1e-5 beyond this many cells
+	const double sigma = 1.5;
+	const int radius = 7, side = 2 * radius + 1;
+	vector<float> kernel(side * side);
+	for (int dy = -radius; dy <= radius; ++dy) {
+		for (int dx = -radius; dx <= radius; ++dx)
+			kernel[(dy + radius) * side + dx + radius] = (float) exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+	}
+
+	vector<BYTE> pattern(nCells);
+	vector<float> energy(nCells);
+	// Tightest cluster and largest void of each row, -1 if there is none, so that a
+	// toggle only rescans the rows its kernel reaches
+	vector<int> rowCluster(size, -1), rowVoid(size);
+	auto scanRow = [&](const int y) {
+		int cluster = -1, emptiest = -1;
+		for (int i = y * size; i < (y + 1) * size; ++i) {
+			if (pattern[i]) {
+				if (cluster < 0 || energy[i] > energy[cluster])
+					cluster = i;
+			}
+			else if (emptiest < 0 || energy[i] < energy[emptiest])
+				emptiest = i;
+		}
+		rowCluster[y] = cluster;
+		rowVoid[y] = emptiest;
+	};
+	auto toggle = [&](const int cell) {
+		pattern[cell] = !pattern[cell];
+		const float sign = pattern[cell] ? 1.0f : -1.0f;
+		const int cx = cell & mask, cy = cell / size;
+		for (int dy = -radius; dy <= radius; ++dy) {
+			float* row = &energy[((cy + dy) & mask) * size];
+			const float* weights = &kernel[(dy + radius) * side + radius];
+			for (int dx = -radius; dx <= radius; ++dx)
+				row[(cx + dx) & mask] += sign * weights[dx];
+		}
+		for (int dy = -radius; dy <= radius; ++dy)
+			scanRow((cy + dy) & mask);
+	};
+	auto tightestCluster = [&]() {
+		int best = -1;
+		for (int y = 0; y < size; ++y) {
+			const int cluster = rowCluster[y];
+			if (cluster >= 0 && (best < 0 || energy[cluster] > energy[best]))
+				best = cluster;
+		}
+		return best;
+	};
+	auto largestVoid = [&]() {
+		int best = -1;
+		for (int y = 0; y < size; ++y) {
+			const int emptiest = rowVoid[y];
+			if (emptiest >= 0 && (best < 0 || energy[emptiest] < energy[best]))
+				best = emptiest;
+		}
+		return best;
+	};
+	for (int y = 0; y < size; ++y)
+		scanRow(y);
+
+	// Sparse random start, then move cells from the tightest cluster to the
+	// largest void until that no longer changes anything
+	int nOnes = 0;
+	for (UINT seed = 1; nOnes < nCells / 10; ) {
+		seed = seed * 1103515245U + 12345U;
+		const int cell = (seed >> 8) % nCells;
+		if (!pattern[cell]) {
+			toggle(cell);
+			++nOnes;
+		}
+	}
+	for (;;) {
+		const int cluster = tightestCluster();
+		toggle(cluster);
+		const int emptiest = largestVoid();
+		toggle(emptiest);
+		if (emptiest == cluster)
+			break;
+	}
+
+	vector<unsigned short> ranks(nCells);
+	const auto initialPattern = pattern;
+	const auto initialEnergy = energy;
+	const auto initialClusters = rowCluster, initialVoids = rowVoid;
+	for (int rank = nOnes - 1; rank >= 0; --rank) {
+		const int cluster = tightestCluster();
+		toggle(cluster);
+		ranks[cluster] = rank;
+	}
+
+	// Filling the largest void past half way also fills the tightest cluster of the
+	// cells left empty, so one loop covers both of the remaining phases
+	pattern = initialPattern;
+	energy = initialEnergy;
+	rowCluster = initialClusters;
+	rowVoid = initialVoids;
+	for (int rank = nOnes; rank < nCells; ++rank) {
+		const int emptiest = largestVoid();
+		toggle(emptiest);
+		ranks[emptiest] = rank;
+	}
+	return ranks;
+}
+
+static const vector<unsigned short>& GetThresholdRanks(const DitherMode mode, int& size)
+{
+	static const vector<unsigned short> bayer4 = MakeBayer(4);
+	static const vector<unsigned short> bayer8 = MakeBayer(8);
+	if (mode == DitherMode::Bayer4x4) {
+		size = 4;
+		return bayer4;
+	}
+	if (mode == DitherMode::Bayer8x8) {
+		size = 8;
+		return bayer8;
+	}
+
+	static const vector<unsigned short> blueNoise = MakeBlueNoise();
+	size = BLUE_NOISE_SIZE;
+	return blueNoise;
+}
+
+bool OrderedDither(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT rows, DitherState& state)
+{
+	int size;
+	const auto& ranks = GetThresholdRanks(state.mode, size);
+	const int nCells = size * size;
+
+	// Thresholds centred on zero, spanning the distance between neighbouring colours of
+	// nMaxColors spread evenly over the RGB cube. They are kept as the 16 bit lanes of
+	// two pixels, B, G, R then A as the bytes of an ARGB, with nothing added to alpha.
+	const double spread = BYTE_MAX / cbrt((double) nMaxColors);
+	vector<short> offsets(nCells * 4);
+	for (int i = 0; i < nCells; ++i) {
+		const short offset = (short) floor(((ranks[i] + .5) / nCells - .5) * spread + .5);
+		offsets[i * 4] = offsets[i * 4 + 1] = offsets[i * 4 + 2] = offset;
+	}
+
+	auto pColormap = (state.pColormap && state.pColormap->IsBuilt()) ? state.pColormap : nullptr;
+	auto lookup = state.lookup.data();
+	const UINT firstRow = state.row;
+
+	auto ditherRows = [&](const UINT begin, const UINT end) {
+		ARGB dithered[HISTOGRAM_BLOCK];
+		int indices[HISTOGRAM_BLOCK];
+		for (UINT i = begin; i < end; ++i) {
+			const short* rowOffsets = &offsets[((firstRow + i) % size) * size * 4];
+			for (UINT x0 = 0; x0 < width; x0 += HISTOGRAM_BLOCK) {
+				const UINT n = min(HISTOGRAM_BLOCK, width - x0);
+				const ARGB* pRow = pixels + i * width + x0;
+				UINT j = 0;
+#ifdef ORDERED_DITHER_SSE2
+				// The block starts on a multiple of 4 and so does every matrix row
+				const __m128i zero = _mm_setzero_si128();
+				for (; j + 4 <= n; j += 4) {
+					const short* cellOffsets = &rowOffsets[((x0 + j) % size) * 4];
+					__m128i argb = _mm_loadu_si128((const __m128i*) (pRow + j));
+					__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(argb, zero), _mm_loadu_si128((const __m128i*) cellOffsets));
+					__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(argb, zero), _mm_loadu_si128((const __m128i*) (cellOffsets + 8)));
+					_mm_storeu_si128((__m128i*) (dithered + j), _mm_packus_epi16(lo, hi));
+				}
+#endif
+				for (; j < n; ++j) {
+					const short offset = rowOffsets[((x0 + j) % size) * 4];
+					Color c(pRow[j]);
+					dithered[j] = Color::MakeARGB(c.GetA(),
+						(BYTE) min(max(c.GetR() + offset, 0), (int) BYTE_MAX),
+						(BYTE) min(max(c.GetG() + offset, 0), (int) BYTE_MAX),
+						(BYTE) min(max(c.GetB() + offset, 0), (int) BYTE_MAX));
+				}
+
+				GetARGBIndices(dithered, n, hasSemiTransparency, indices);
+				unsigned short* qRow = qPixels + i * width + x0;
+				if (pColormap) {
+					for (j = 0; j < n; ++j)
+						qRow[j] = pColormap->Lookup(indices[j]);
+				}
+				else {
+					for (j = 0; j < n; ++j) {
+						const int offset = indices[j];
+						if (!lookup[offset])
+							lookup[offset] = ditherFn(pPalette, nMaxColors, dithered[j]) + 1;
+						qRow[j] = lookup[offset] - 1;
+					}
+				}
+			}
+		}
+	};
+
+	UINT nThreads = 1;
+	if (pColormap) {
+		nThreads = min(max(thread::hardware_concurrency(), 1U), rows);
+		nThreads = max(min(nThreads, width * rows / MIN_ORDERED_PIXELS), 1U);
+	}
+
+	const UINT chunk = (rows + nThreads - 1) / nThreads;
+	vector<thread> workers;
+	for (UINT t = 1; t < nThreads; ++t)
+		workers.emplace_back(ditherRows, min(rows, t * chunk), min(rows, (t + 1) * chunk));
+	ditherRows(0, min(rows, chunk));
+	for (auto& worker : workers)
+		worker.join();
+
+	state.row += rows;
+	return true;
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include "bitmapUtilities.h"
+
+// dither_image for the Bayer and blue noise modes. The red, green and blue of each
+// pixel are offset by the threshold of its cell in the matrix, tiled from row
+// state.row of the image on, scaled to the spacing of nMaxColors colours spread
+// over the RGB cube. Alpha is left as it is. With a state.pColormap, built or
+// deferred, the rows are split between several threads, otherwise they go through
+// ditherFn and the lookup of state one pixel after another.
+bool OrderedDither(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT rows, DitherState& state);
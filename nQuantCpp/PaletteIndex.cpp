@@ -0,0 +1,264 @@
+﻿#include "stdafx.h"
+#include "PaletteIndex.h"
+#include "CpuFeatures.h"
+#include <algorithm>
+
+// Below this many colours a single leaf beats building and walking the tree
+const UINT MIN_INDEXED_COLORS = 64;
+// Entries scanned together at the bottom of the tree
+const UINT LEAF_SIZE = 8;
+// Entries per SIMD block; leaves are padded to whole blocks
+const UINT BLOCK_SIZE = 8;
+// Channel value of the padding, far enough from any colour never to be nearest
+const short PAD_CHANNEL = 0x4000;
+
+// Distances from query to count entries, count a multiple of BLOCK_SIZE
+typedef void (*DistanceFn)(const short* const* channels, const UINT count, const int* query, const double* weights, const bool weighted, double* distances);
+
+static void GetDistances(const short* const* channels, const UINT count, const int* query, const double* weights, const bool weighted, double* distances)
+{
+	for (UINT i = 0; i < count; ++i) {
+		double curdist = sqr(channels[0][i] - query[0]);
+		curdist += weights[1] * sqr(channels[1][i] - query[1]);
+		curdist += weights[2] * sqr(channels[2][i] - query[2]);
+		curdist += weights[3] * sqr(channels[3][i] - query[3]);
+		distances[i] = curdist;
+	}
+}
+
+#ifdef NQUANT_X86
+// Squared differences are exact in 32-bit lanes. Weighted sums are then formed in
+// double in the same order as the scalar code, so the results are bit identical.
+TARGET_SSE41 static void GetDistancesSSE41(const short* const* channels, const UINT count, const int* query, const double* weights, const bool weighted, double* distances)
+{
+	__m128i q[4];
+	__m128d w[4];
+	for (int c = 0; c < 4; ++c) {
+		q[c] = _mm_set1_epi32(query[c]);
+		w[c] = _mm_set1_pd(weights[c]);
+	}
+
+	for (UINT i = 0; i < count; i += 4) {
+		__m128i sq[4];
+		for (int c = 0; c < 4; ++c) {
+			__m128i diff = _mm_sub_epi32(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*) (channels[c] + i))), q[c]);
+			sq[c] = _mm_mullo_epi32(diff, diff);
+		}
+
+		if (!weighted) {
+			__m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_add_epi32(sq[0], sq[1]), sq[2]), sq[3]);
+			_mm_storeu_pd(distances + i, _mm_cvtepi32_pd(sum));
+			_mm_storeu_pd(distances + i + 2, _mm_cvtepi32_pd(_mm_unpackhi_epi64(sum, sum)));
+			continue;
+		}
+
+		for (int half = 0; half < 2; ++half) {
+			__m128d curdist = _mm_cvtepi32_pd(sq[0]);
+			for (int c = 1; c < 4; ++c)
+				curdist = _mm_add_pd(curdist, _mm_mul_pd(w[c], _mm_cvtepi32_pd(sq[c])));
+			_mm_storeu_pd(distances + i + 2 * half, curdist);
+			for (int c = 0; c < 4; ++c)
+				sq[c] = _mm_unpackhi_epi64(sq[c], sq[c]);
+		}
+	}
+}
+
+TARGET_AVX2 static void GetDistancesAVX2(const short* const* channels, const UINT count, const int* query, const double* weights, const bool weighted, double* distances)
+{
+	__m256i q[4];
+	__m256d w[4];
+	for (int c = 0; c < 4; ++c) {
+		q[c] = _mm256_set1_epi32(query[c]);
+		w[c] = _mm256_set1_pd(weights[c]);
+	}
+
+	for (UINT i = 0; i < count; i += 8) {
+		__m256i sq[4];
+		for (int c = 0; c < 4; ++c) {
+			__m256i diff = _mm256_sub_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*) (channels[c] + i))), q[c]);
+			sq[c] = _mm256_mullo_epi32(diff, diff);
+		}
+
+		if (!weighted) {
+			__m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_add_epi32(sq[0], sq[1]), sq[2]), sq[3]);
+			_mm256_storeu_pd(distances + i, _mm256_cvtepi32_pd(_mm256_castsi256_si128(sum)));
+			_mm256_storeu_pd(distances + i + 4, _mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1)));
+			continue;
+		}
+
+		__m256d curdist = _mm256_cvtepi32_pd(_mm256_castsi256_si128(sq[0]));
+		for (int c = 1; c < 4; ++c)
+			curdist = _mm256_add_pd(curdist, _mm256_mul_pd(w[c], _mm256_cvtepi32_pd(_mm256_castsi256_si128(sq[c]))));
+		_mm256_storeu_pd(distances + i, curdist);
+
+		curdist = _mm256_cvtepi32_pd(_mm256_extracti128_si256(sq[0], 1));
+		for (int c = 1; c < 4; ++c)
+			curdist = _mm256_add_pd(curdist, _mm256_mul_pd(w[c], _mm256_cvtepi32_pd(_mm256_extracti128_si256(sq[c], 1))));
+		_mm256_storeu_pd(distances + i + 4, curdist);
+	}
+}
+#endif // NQUANT_X86
+
+static DistanceFn SelectDistanceFn()
+{
+#ifdef NQUANT_X86
+	if (HasAVX2())
+		return GetDistancesAVX2;
+	if (HasSSE41())
+		return GetDistancesSSE41;
+#endif
+	return GetDistances;
+}
+
+static const DistanceFn getDistances = SelectDistanceFn();
+
+inline void GetChannels(const ARGB argb, BYTE* channel)
+{
+	Color c(argb);
+	channel[0] = c.GetA();
+	channel[1] = c.GetR();
+	channel[2] = c.GetG();
+	channel[3] = c.GetB();
+}
+
+void PaletteIndex::Clear()
+{
+	m_pPalette = nullptr;
+	m_nMaxColors = 0;
+	m_points.clear();
+	m_nodes.clear();
+	for (auto& channel : m_channels)
+		channel.clear();
+	m_indices.clear();
+}
+
+void PaletteIndex::Build(const ColorPalette* pPalette, const UINT nMaxColors, const double PR, const double PG, const double PB)
+{
+	Clear();
+	m_pPalette = pPalette;
+	m_nMaxColors = nMaxColors;
+	m_weights[1] = PR, m_weights[2] = PG, m_weights[3] = PB;
+
+	for (int axis = 0; axis < 4; ++axis) {
+		m_sqrDiff[axis].resize(BYTE_MAX + BYTE_MAX + 1);
+		for (int i = -BYTE_MAX; i <= BYTE_MAX; ++i)
+			m_sqrDiff[axis][i + BYTE_MAX] = axis ? m_weights[axis] * sqr(i) : sqr(i);
+	}
+
+	m_points.resize(nMaxColors);
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		GetChannels(pPalette->Entries[i], m_points[i].channel);
+		m_points[i].index = (unsigned short) i;
+	}
+	m_nodes.reserve(2 * nMaxColors / LEAF_SIZE + 1);
+	BuildNode(0, nMaxColors, nMaxColors < MIN_INDEXED_COLORS ? nMaxColors : LEAF_SIZE);
+
+	// Lay the leaves out channel by channel
+	UINT size = 0;
+	for (auto& node : m_nodes) {
+		if (node.left < 0) {
+			node.offset = size;
+			size += (node.end - node.begin + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+		}
+	}
+	for (auto& channel : m_channels)
+		channel.assign(size, PAD_CHANNEL);
+	m_indices.assign(size, 0);
+	for (const auto& node : m_nodes) {
+		if (node.left >= 0)
+			continue;
+
+		for (UINT i = node.begin; i < node.end; ++i) {
+			const UINT j = node.offset + i - node.begin;
+			for (int c = 0; c < 4; ++c)
+				m_channels[c][j] = m_points[i].channel[c];
+			m_indices[j] = m_points[i].index;
+		}
+	}
+}
+
+int PaletteIndex::BuildNode(const UINT begin, const UINT end, const UINT leafSize)
+{
+	const int node = (int) m_nodes.size();
+	m_nodes.emplace_back();
+	m_nodes[node].begin = begin;
+	m_nodes[node].end = end;
+	if (end - begin <= leafSize)
+		return node;
+
+	// Split along the channel with the widest weighted spread
+	BYTE axis = 0;
+	double maxSpread = -1;
+	for (BYTE i = 0; i < 4; ++i) {
+		BYTE lo = BYTE_MAX, hi = 0;
+		for (UINT j = begin; j < end; ++j) {
+			lo = min(lo, m_points[j].channel[i]);
+			hi = max(hi, m_points[j].channel[i]);
+		}
+		const double spread = m_sqrDiff[i][hi - lo + BYTE_MAX];
+		if (spread > maxSpread) {
+			maxSpread = spread;
+			axis = i;
+		}
+	}
+
+	const UINT mid = (begin + end) / 2;
+	nth_element(m_points.begin() + begin, m_points.begin() + mid, m_points.begin() + end, [axis](const Point& a, const Point& b) {
+		return a.channel[axis] < b.channel[axis];
+	});
+	m_nodes[node].axis = axis;
+	m_nodes[node].split = m_points[mid].channel[axis];
+	const int left = BuildNode(begin, mid, leafSize);
+	const int right = BuildNode(mid, end, leafSize);
+	m_nodes[node].left = left;
+	m_nodes[node].right = right;
+	return node;
+}
+
+void PaletteIndex::Search(const int node, const BYTE* channel, double& mindist, int& k) const
+{
+	const auto& current = m_nodes[node];
+	if (current.left < 0) {
+		const UINT count = current.end - current.begin;
+		const short* channels[4] = { &m_channels[0][current.offset], &m_channels[1][current.offset], &m_channels[2][current.offset], &m_channels[3][current.offset] };
+		const int query[4] = { channel[0], channel[1], channel[2], channel[3] };
+		const bool weighted = m_weights[1] != 1 || m_weights[2] != 1 || m_weights[3] != 1;
+		double distances[MIN_INDEXED_COLORS + BLOCK_SIZE];
+		getDistances(channels, (count + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE, query, m_weights, weighted, distances);
+
+		for (UINT i = 0; i < count; ++i) {
+			const int index = m_indices[current.offset + i];
+			if (distances[i] < mindist || (distances[i] == mindist && index > k)) {
+				mindist = distances[i];
+				k = index;
+			}
+		}
+		return;
+	}
+
+	// Entries equal to the split value may sit on either side
+	const int diff = channel[current.axis] - current.split;
+	const int nearNode = diff < 0 ? current.left : current.right;
+	const int farNode = diff < 0 ? current.right : current.left;
+	Search(nearNode, channel, mindist, k);
+	if (m_sqrDiff[current.axis][diff + BYTE_MAX] <= mindist)
+		Search(farNode, channel, mindist, k);
+}
+
+unsigned short PaletteIndex::Nearest(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb, const double PR, const double PG, const double PB)
+{
+	if (pPalette != m_pPalette || nMaxColors != m_nMaxColors || PR != m_weights[1] || PG != m_weights[2] || PB != m_weights[3])
+		Build(pPalette, nMaxColors, PR, PG, PB);
+
+	return Nearest(argb);
+}
+
+unsigned short PaletteIndex::Nearest(const ARGB argb) const
+{
+	BYTE channel[4];
+	GetChannels(argb, channel);
+	double mindist = INT_MAX;
+	int k = -1;
+	Search(0, channel, mindist, k);
+	return (unsigned short) k;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <vector>
+#include "bitmapUtilities.h"
+using namespace std;
+
+// k-d tree over the ARGB entries of a palette, answering the same nearest colour
+// queries as a linear scan with the distance
+//     sqr(dA) + PR * sqr(dR) + PG * sqr(dG) + PB * sqr(dB)
+// and returning the same entry, the last one of several at equal distance.
+// Small palettes are kept as a single leaf. Leaves are stored channel by channel
+// so that their distances are computed 8 entries at a time with SSE4.1 or AVX2.
+class PaletteIndex
+{
+	public:
+		unsigned short Nearest(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb, const double PR = 1, const double PG = 1, const double PB = 1);
+		void Build(const ColorPalette* pPalette, const UINT nMaxColors, const double PR = 1, const double PG = 1, const double PB = 1);
+		// Nearest entry of the palette given to Build, safe to call from several threads
+		unsigned short Nearest(const ARGB argb) const;
+		// Forgets the palette, to be called whenever its entries may have changed
+		void Clear();
+
+	private:
+		struct Point {
+			BYTE channel[4];
+			unsigned short index;
+		};
+
+		struct Node {
+			UINT begin, end;
+			int left = -1, right = -1;
+			BYTE axis = 0, split = 0;
+			// Position of a leaf in the channel arrays, padded to whole blocks
+			UINT offset = 0;
+		};
+
+		const ColorPalette* m_pPalette = nullptr;
+		UINT m_nMaxColors = 0;
+		double m_weights[4] = { 1, 1, 1, 1 };
+		vector<Point> m_points;
+		vector<Node> m_nodes;
+		// Weighted squared difference per channel, indexed by the difference + BYTE_MAX
+		vector<double> m_sqrDiff[4];
+		// A, R, G and B of the leaf entries, and their palette indices
+		vector<short> m_channels[4];
+		vector<unsigned short> m_indices;
+
+		int BuildNode(const UINT begin, const UINT end, const UINT leafSize);
+		void Search(const int node, const BYTE* channel, double& mindist, int& k) const;
+};
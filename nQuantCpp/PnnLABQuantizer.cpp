@@ -7,23 +7,18 @@ Copyright (c) 2018-2019 Miller Cy Chan
 #include "stdafx.h"
 #include "PnnLABQuantizer.h"
 #include "bitmapUtilities.h"
+#include "Histogram.h"
 #include "CIELABConvertor.h"
+#include "InverseColormap.h"
+#include <climits>
 #include <ctime>
+#include <thread>
 #include <unordered_map>
 
 namespace PnnLABQuant
 {
-	double PR = .2126, PG = .7152, PB = .0722;
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	double ratio = 1.0;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
-	unordered_map<ARGB, vector<double> > closestMap;
-
-	inline double rand_gen() {
-		return ((double)rand() / (RAND_MAX));
-	}
+	// Initial neighbour searches per thread at least
+	const int MIN_BINS_PER_THREAD = 1 << 10;
 
 	struct pnnbin {
 		double ac = 0, Lc = 0, Ac = 0, Bc = 0, err = 0;
@@ -31,123 +26,248 @@ namespace PnnLABQuant
 		int nn = 0, fw = 0, bk = 0, tm = 0, mtm = 0;
 	};
 
-	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
+	const LabPalette& PnnLABQuantizer::getLabPalette(const ColorPalette* pPalette, const UINT nMaxColors)
 	{
-		auto got = pixelMap.find(c.GetValue());
-		if (got == pixelMap.end()) {
-			CIELABConvertor::RGB2LAB(c, lab1);
-			pixelMap[c.GetValue()] = lab1;
-		}
-		else
-			lab1 = got->second;
+		if (m_labPalette.Size() != nMaxColors)
+			m_labPalette.Build(pPalette, nMaxColors);
+		return m_labPalette;
 	}
 
-	void find_nn(pnnbin* bins, int idx, const UINT& nMaxColors)
+	// Means and counts of the live bins in index order, column by column, so that find_nn
+	// goes through them in loops the compiler can vectorize instead of walking the list.
+	// A merged away bin keeps its slot with a count of 0 until such slots make up half of
+	// the columns, which are then compacted. The search without crossover scans float
+	// copies of the columns, twice as many per vector, and goes back to the double ones
+	// for the few bins close enough to matter.
+	class BinColumns
 	{
-		int nn = 0;
-		double err = INT_MAX;
+		public:
+			BinColumns(const pnnbin* bins, const int maxbins)
+				: m_bins(bins), m_slotOf(maxbins), m_index(maxbins),
+				m_alpha(maxbins), m_L(maxbins), m_A(maxbins), m_B(maxbins), m_cnt(maxbins),
+				m_alphaF(maxbins), m_LF(maxbins), m_AF(maxbins), m_BF(maxbins), m_cntF(maxbins)
+			{
+				for (int i = 0; i < maxbins; ++i) {
+					m_slotOf[i] = m_index[i] = i;
+					Update(i);
+				}
+			}
 
-		auto& bin1 = bins[idx];
-		auto n1 = bin1.cnt;
-		CIELABConvertor::Lab lab1;
-		lab1.alpha = bin1.ac, lab1.L = bin1.Lc, lab1.A = bin1.Ac, lab1.B = bin1.Bc;
-		bool crossover = rand_gen() < ratio;
-		for (int i = bin1.fw; i; i = bins[i].fw) {
-			double n2 = bins[i].cnt;
-			double nerr2 = (n1 * n2) / (n1 + n2);
-			if (nerr2 >= err)
-				continue;
+			// Copies the means and count of bin i into its slot
+			void Update(const int i)
+			{
+				const auto& bin = m_bins[i];
+				const int slot = m_slotOf[i];
+				m_alpha[slot] = (BYTE) bin.ac;
+				m_L[slot] = bin.Lc;
+				m_A[slot] = bin.Ac;
+				m_B[slot] = bin.Bc;
+				m_cnt[slot] = bin.cnt;
+				CopyToFloat(slot, slot);
+			}
 
-			CIELABConvertor::Lab lab2;
-			lab2.alpha = bins[i].ac, lab2.L = bins[i].Lc, lab2.A = bins[i].Ac, lab2.B = bins[i].Bc;
-			double alphaDiff = lab2.alpha - lab1.alpha;
-			double nerr = nerr2 * sqr(alphaDiff) * alphaDiff / 3.0;
-			if (nerr >= err)
-				continue;
+			void Remove(const int i)
+			{
+				m_cnt[m_slotOf[i]] = 0;
+				if (2 * ++m_removed > (int) m_index.size())
+					Compact();
+			}
 
-			if (crossover) {
-				double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1, lab2);
-				nerr += nerr2 * sqr(deltaL_prime_div_k_L_S_L);
-				if (nerr >= err)
-					continue;
-
-				double a1Prime, a2Prime, CPrime1, CPrime2;
-				double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
-				nerr += nerr2 * sqr(deltaC_prime_div_k_L_S_L);
-				if (nerr >= err)
-					continue;
-
-				double barCPrime, barhPrime;
-				double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
-				nerr += nerr2 * sqr(deltaH_prime_div_k_L_S_L);
-				if (nerr >= err)
-					continue;
-
-				nerr += nerr2 * CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
-				if (nerr >= err)
-					continue;
+			// Same choice as walking the list of live bins after idx: the least error, the
+			// first such bin on a tie
+			void FindNearest(const int idx, const bool crossover, double& err, int& nn) const
+			{
+				nn = 0;
+				err = INT_MAX;
+
+				auto n1 = m_bins[idx].cnt;
+				const int begin = m_slotOf[idx] + 1, end = (int) m_index.size();
+				CIELABConvertor::Lab lab1;
+				lab1.alpha = m_bins[idx].ac, lab1.L = m_bins[idx].Lc, lab1.A = m_bins[idx].Ac, lab1.B = m_bins[idx].Bc;
+				if (crossover) {
+					for (int s = begin; s < end; ++s) {
+						double n2 = m_cnt[s];
+						if (!n2)
+							continue;
+
+						double nerr2 = (n1 * n2) / (n1 + n2);
+						if (nerr2 >= err)
+							continue;
+
+						CIELABConvertor::Lab lab2;
+						lab2.alpha = m_alpha[s], lab2.L = m_L[s], lab2.A = m_A[s], lab2.B = m_B[s];
+						double alphaDiff = lab2.alpha - lab1.alpha;
+						double nerr = nerr2 * sqr(alphaDiff) * alphaDiff / 3.0;
+						if (nerr >= err)
+							continue;
+
+						double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1, lab2);
+						nerr += nerr2 * sqr(deltaL_prime_div_k_L_S_L);
+						if (nerr >= err)
+							continue;
+
+						double a1Prime, a2Prime, CPrime1, CPrime2;
+						double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
+						nerr += nerr2 * sqr(deltaC_prime_div_k_L_S_L);
+						if (nerr >= err)
+							continue;
+
+						double barCPrime, barhPrime;
+						double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
+						nerr += nerr2 * sqr(deltaH_prime_div_k_L_S_L);
+						if (nerr >= err)
+							continue;
+
+						nerr += nerr2 * CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
+						if (nerr >= err)
+							continue;
+
+						err = nerr;
+						nn = m_index[s];
+					}
+					return;
+				}
+
+				// All terms after the alpha one are squares, so a bin passing the test on the
+				// full error also passes the early tests of the crossover loop.
+				// The float error less SLACK times the sum of the magnitudes of its terms, and
+				// a little more, is below the double error: rounding L, A and B to float moves
+				// each difference by less than 3e-5, alpha is a whole number in both, and the
+				// float arithmetic adds a few ulps. Only the bins whose bound is below err are
+				// computed again in double, which makes the choice the same as in double.
+				const float SLACK = 2e-4f;
+				float bounds[BLOCK];
+				const float n1F = (float) n1, alpha1F = lab1.alpha, L1F = (float) lab1.L, A1F = (float) lab1.A, B1F = (float) lab1.B;
+				const float *pAlpha = m_alphaF.data(), *pL = m_LF.data(), *pA = m_AF.data(), *pB = m_BF.data(), *pCnt = m_cntF.data();
+				for (int s = begin; s < end; s += BLOCK) {
+					const int n = min(BLOCK, end - s);
+					for (int j = 0; j < n; ++j) {
+						const float n2 = pCnt[s + j];
+						const float nerr2 = (n1F * n2) / (n1F + n2);
+						const float alphaDiff = pAlpha[s + j] - alpha1F;
+						const float dL = pL[s + j] - L1F, dA = pA[s + j] - A1F, dB = pB[s + j] - B1F;
+						const float squares = dL * dL + dA * dA + dB * dB;
+						const float cube = alphaDiff * alphaDiff * alphaDiff;
+						bounds[j] = nerr2 * (squares + cube / 3 - SLACK * (squares + fabs(cube) + 5));
+					}
+
+					for (int j = 0; j < n; ++j) {
+						if (bounds[j] >= err || !m_cnt[s + j])
+							continue;
+
+						const double n2 = m_cnt[s + j];
+						const double nerr2 = (n1 * n2) / (n1 + n2);
+						const double alphaDiff = m_alpha[s + j] - lab1.alpha;
+						double nerr = nerr2 * sqr(alphaDiff) * alphaDiff / 3.0;
+						nerr += nerr2 * sqr(m_L[s + j] - lab1.L);
+						nerr += nerr2 * sqr(m_A[s + j] - lab1.A);
+						nerr += nerr2 * sqr(m_B[s + j] - lab1.B);
+						if (nerr2 < err && nerr < err) {
+							err = nerr;
+							nn = m_index[s + j];
+						}
+					}
+				}
 			}
-			else {
-				nerr += nerr2 * sqr(lab2.L - lab1.L);
-				if (nerr >= err)
-					continue;
 
-				nerr += nerr2 * sqr(lab2.A - lab1.A);
-				if (nerr >= err)
-					continue;
+		private:
+			// Errors computed per pass over the columns
+			static const int BLOCK = 64;
+
+			const pnnbin* m_bins;
+			int m_removed = 0;
+			vector<int> m_slotOf, m_index;
+			// Alpha is cut down to a whole BYTE, as Lab::alpha holds it, so that the alpha term
+			// of the error is the one the crossover search computes from Lab
+			vector<double> m_alpha, m_L, m_A, m_B, m_cnt;
+			// The same columns rounded to float
+			vector<float> m_alphaF, m_LF, m_AF, m_BF, m_cntF;
+
+			void CopyToFloat(const int to, const int from)
+			{
+				m_alphaF[to] = (float) m_alpha[from];
+				m_LF[to] = (float) m_L[from];
+				m_AF[to] = (float) m_A[from];
+				m_BF[to] = (float) m_B[from];
+				m_cntF[to] = (float) m_cnt[from];
+			}
 
-				nerr += nerr2 * sqr(lab2.B - lab1.B);
+			void Compact()
+			{
+				int size = 0;
+				for (int s = 0; s < (int) m_index.size(); ++s) {
+					if (!m_cnt[s])
+						continue;
+
+					m_slotOf[m_index[s]] = size;
+					m_index[size] = m_index[s];
+					m_alpha[size] = m_alpha[s];
+					m_L[size] = m_L[s];
+					m_A[size] = m_A[s];
+					m_B[size] = m_B[s];
+					m_cnt[size] = m_cnt[s];
+					CopyToFloat(size++, s);
+				}
+				m_index.resize(size);
+				m_alpha.resize(size);
+				m_L.resize(size);
+				m_A.resize(size);
+				m_B.resize(size);
+				m_cnt.resize(size);
+				m_alphaF.resize(size);
+				m_LF.resize(size);
+				m_AF.resize(size);
+				m_BF.resize(size);
+				m_cntF.resize(size);
+				m_removed = 0;
 			}
+	};
 
-			if (nerr >= err)
-				continue;
+	// min takes BLOCK by reference, so it needs a definition as well
+	const int BinColumns::BLOCK;
 
-			err = nerr;
-			nn = i;
-		}
-		bin1.err = err;
-		bin1.nn = nn;
+	void PnnLABQuantizer::find_nn(pnnbin* bins, const BinColumns& columns, int idx, bool crossover)
+	{
+		auto& bin1 = bins[idx];
+		columns.FindNearest(idx, crossover, bin1.err, bin1.nn);
 	}
 
-	int PnnLABQuantizer::pnnquan(const vector<ARGB>& pixels, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
+	int PnnLABQuantizer::pnnquan(const ARGB* pixels, const UINT nSize, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
+	{
+		auto histogram = make_unique<HistogramBin[]>(65536);
+		/* Build histogram */
+		// !!! Can throw gamma correction in here, but what to do about perceptual
+		// !!! nonuniformity then?
+		BuildHistogram(pixels, nSize, hasSemiTransparency, histogram.get());
+		return pnnquan(histogram.get(), pPalette, nMaxColors, quan_sqrt);
+	}
+
+	int PnnLABQuantizer::pnnquan(const HistogramBin* histogram, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
 	{
 		auto bins = make_unique<pnnbin[]>(65536);
 		auto heap = make_unique<int[]>(65537);
 		double err, n1, n2;
 
-		/* Build histogram */
-		for (const auto& pixel : pixels) {
-			// !!! Can throw gamma correction in here, but what to do about perceptual
-			// !!! nonuniformity then?			
-			Color c(pixel);
-			int index = GetARGBIndex(c, hasSemiTransparency);
-
-			CIELABConvertor::Lab lab1;
-			getLab(c, lab1);
-			auto& tb = bins[index];
-			tb.ac += c.GetA();
-			tb.Lc += lab1.L;
-			tb.Ac += lab1.A;
-			tb.Bc += lab1.B;
-			tb.cnt++;
-		}
-
-		/* Cluster nonempty bins at one end of array */
+		/* Cluster nonempty bins at one end of array, each holding the Lab of its mean colour */
 		int maxbins = 0;
 
 		for (int i = 0; i < 65536; ++i) {
-			if (!bins[i].cnt)
+			const auto& hb = histogram[i];
+			if (!hb.cnt)
 				continue;
 
-			double d = 1.0 / (double)bins[i].cnt;
-			bins[i].ac *= d;
-			bins[i].Lc *= d;
-			bins[i].Ac *= d;
-			bins[i].Bc *= d;
+			double d = 1.0 / (double)hb.cnt;
+			auto& tb = bins[maxbins];
+			CIELABConvertor::Lab lab1;
+			CIELABConvertor::RGB2LAB(d * hb.r, d * hb.g, d * hb.b, lab1);
+			tb.ac = d * hb.a;
+			tb.Lc = lab1.L;
+			tb.Ac = lab1.A;
+			tb.Bc = lab1.B;
 
+			tb.cnt = hb.cnt;
 			if (quan_sqrt)
-				bins[i].cnt = _sqrt(bins[i].cnt);
-			bins[maxbins] = bins[i];
+				tb.cnt = _sqrt(tb.cnt);
 			++maxbins;
 		}
 
@@ -158,11 +278,24 @@ namespace PnnLABQuant
 
 		//	bins[0].bk = bins[i].fw = 0;
 
+		auto columns = make_unique<BinColumns>(bins.get(), maxbins);
+
+		/* Initialize nearest neighbors without crossover, each search on its own so they are shared out between threads */
+		auto findNearest = [&](const int first, const int step) {
+			for (int i = first; i < maxbins; i += step)
+				find_nn(bins.get(), *columns, i, false);
+		};
+		const int nThreads = max(min((int) thread::hardware_concurrency(), maxbins / MIN_BINS_PER_THREAD), 1);
+		vector<thread> workers;
+		for (int t = 1; t < nThreads; ++t)
+			workers.emplace_back(findNearest, t, nThreads);
+		findNearest(0, nThreads);
+		for (auto& worker : workers)
+			worker.join();
+
 		int h, l, l2;
-		ratio = 0.0;
-		/* Initialize nearest neighbors and build heap of them */
+		/* Build heap of them */
 		for (int i = 0; i < maxbins; ++i) {
-			find_nn(bins.get(), i, nMaxColors);
 			/* Push slot on heap */
 			err = bins[i].err;
 			for (l = ++heap[0]; l > 1; l = l2) {
@@ -190,7 +323,7 @@ namespace PnnLABQuant
 					b1 = heap[1] = heap[heap[0]--];
 				else /* Too old error value */
 				{
-					find_nn(bins.get(), b1, nMaxColors);
+					find_nn(bins.get(), *columns, b1, m_random.NextDouble() < ratio);
 					tb.tm = i;
 				}
 				/* Push slot down */
@@ -217,6 +350,8 @@ namespace PnnLABQuant
 			tb.Bc = d * (n1 * tb.Bc + n2 * nb.Bc);
 			tb.cnt += nb.cnt;
 			tb.mtm = ++i;
+			columns->Update(b1);
+			columns->Remove(tb.nn);
 
 			/* Unchain deleted bin */
 			bins[nb.bk].fw = nb.fw;
@@ -242,14 +377,18 @@ namespace PnnLABQuant
 		return 0;
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short PnnLABQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
+		if (nMaxColors <= 32) {
+			CIELABConvertor::Lab lab1;
+			CIELABConvertor::RGB2LAB(Color(argb), lab1);
+			return nearestColorIndex(pPalette, nMaxColors, lab1);
+		}
+
 		unsigned short k = 0;
 		Color c(argb);
 
 		double mindist = INT_MAX;
-		CIELABConvertor::Lab lab1, lab2;
-		getLab(c, lab1);
 
 		for (UINT i = 0; i < nMaxColors; ++i) {
 			Color c2(pPalette->Entries[i]);
@@ -257,40 +396,15 @@ namespace PnnLABQuant
 			if (curdist > mindist)
 				continue;
 
-			if (nMaxColors > 32) {
-				curdist += PR * sqr(c2.GetR() - c.GetR());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PG * sqr(c2.GetG() - c.GetG());
-				if (curdist > mindist)
-					continue;
+			curdist += PR * sqr(c2.GetR() - c.GetR());
+			if (curdist > mindist)
+				continue;
 
-				curdist += PB * sqr(c2.GetB() - c.GetB());
-			}
-			else {
-				getLab(c2, lab2);
-
-				double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1, lab2);
-				curdist += sqr(deltaL_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				double a1Prime, a2Prime, CPrime1, CPrime2;
-				double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
-				curdist += sqr(deltaC_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				double barCPrime, barhPrime;
-				double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
-				curdist += sqr(deltaH_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				curdist += CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
-			}
+			curdist += PG * sqr(c2.GetG() - c.GetG());
+			if (curdist > mindist)
+				continue;
 
+			curdist += PB * sqr(c2.GetB() - c.GetB());
 			if (curdist > mindist)
 				continue;
 			mindist = curdist;
@@ -299,55 +413,74 @@ namespace PnnLABQuant
 		return k;
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short PnnLABQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const CIELABConvertor::Lab& lab1)
+	{
+		UINT indices[2];
+		float distances[2];
+		getLabPalette(pPalette, nMaxColors).Nearest(lab1, indices, distances);
+		return (unsigned short) indices[0];
+	}
+
+	unsigned short PnnLABQuantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		UINT k = 0;
 		Color c(argb);
-		vector<double> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		double closest[4] = { 0 };
+		if (!closestMap.Find(argb, closest)) {
 			closest[2] = closest[3] = SHORT_MAX;
 
-			CIELABConvertor::Lab lab1, lab2;
-			getLab(c, lab1);
-			for (; k < nMaxColors; ++k) {
-				Color c2(pPalette->Entries[k]);
-				getLab(c2, lab2);
-				closest[4] = sqr(lab2.alpha - lab1.alpha) + CIELABConvertor::CIEDE2000(lab2, lab1);
-				//closest[4] = abs(lab2.alpha - lab1.alpha) + abs(lab2.L - lab1.L) + abs(lab2.A - lab1.A) + abs(lab2.B - lab1.B);
-				if (closest[4] < closest[2]) {
-					closest[1] = closest[0];
-					closest[3] = closest[2];
-					closest[0] = k;
-					closest[2] = closest[4];
-				}
-				else if (closest[4] < closest[3]) {
-					closest[1] = k;
-					closest[3] = closest[4];
+			CIELABConvertor::Lab lab1;
+			CIELABConvertor::RGB2LAB(c, lab1);
+			UINT indices[2];
+			float distances[2];
+			getLabPalette(pPalette, nMaxColors).Nearest(lab1, indices, distances);
+			for (int i = 0; i < 2; ++i) {
+				if (distances[i] < closest[2 + i]) {
+					closest[i] = indices[i];
+					closest[2 + i] = distances[i];
 				}
 			}
 
 			if (closest[3] == SHORT_MAX)
 				closest[2] = 0;
+
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (int)ceil(closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next((UINT) ceil(closest[3] + closest[2])) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
-
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool PnnLABQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, DitherState& state)
 	{
+		DitherFn ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); };
 		if (dither)
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
+			return dither_image(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, height, state);
 
-		DitherFn ditherFn = (m_transparentPixelIndex >= 0 || nMaxColors < 256) ? nearestColorIndex : closestColorIndex;
+		if (m_colormapRemap && state.pColormap && state.pColormap->IsBuilt()) {
+			state.pColormap->Remap(pixels, width * height, qPixels);
+			return true;
+		}
+		if (m_transparentPixelIndex < 0 && nMaxColors >= 256)
+			ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return closestColorIndex(pPalette, nMaxColors, argb); };
+		else if (nMaxColors <= 32) {
+			// The CIEDE2000 search needs the Lab of every pixel, converted a row at a time
+			vector<float> L(width), A(width), B(width);
+			for (UINT j = 0; j < height; ++j) {
+				const UINT rowIndex = j * width;
+				CIELABConvertor::RGB2LAB(pixels + rowIndex, width, L.data(), A.data(), B.data());
+				for (UINT i = 0; i < width; ++i) {
+					CIELABConvertor::Lab lab1;
+					lab1.alpha = Color(pixels[rowIndex + i]).GetA();
+					lab1.L = L[i], lab1.A = A[i], lab1.B = B[i];
+					qPixels[rowIndex + i] = nearestColorIndex(pPalette, nMaxColors, lab1);
+				}
+			}
+			return true;
+		}
 		UINT pixelIndex = 0;
 		for (int j = 0; j < height; ++j) {
 			for (int i = 0; i < width; ++i, ++pixelIndex)
@@ -356,23 +489,16 @@ namespace PnnLABQuant
 		return true;
 	}
 
-	bool PnnLABQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool PnnLABQuantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
-
-		int pixelIndex = 0;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
-
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
+		PR = .2126, PG = .7152, PB = .0722;
 
-		srand(time(NULL));
-		bool quan_sqrt = rand_gen() < nMaxColors / 64.0;
+		if (!m_seeded)
+			m_random.Seed(time(NULL));
+		bool quan_sqrt = m_random.NextDouble() < nMaxColors / 64.0;
 		if (nMaxColors > 2)
-			pnnquan(pixels, pPalette, nMaxColors, quan_sqrt);
+			pnnquan(pixels, width * height, pPalette, nMaxColors, quan_sqrt);
 		else {
 			if (m_transparentPixelIndex >= 0) {
 				pPalette->Entries[0] = m_transparentColor;
@@ -384,16 +510,25 @@ namespace PnnLABQuant
 			}
 		}
 
+		InverseColormap colormap;
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			if (IsThreadedDither(m_ditherMode))
+				colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+			dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+			m_labPalette.Clear();
+			return true;
 		}
 		if (hasSemiTransparency)
 			PR = PG = PB = 1;
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
+		// Cells are filled by the same search the pixels would take, Lab converted once per cell
+		if ((dither && IsThreadedDither(m_ditherMode)) || (!dither && m_colormapRemap))
+			colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+
+		DitherState state(width);
+		state.mode = m_ditherMode;
+		state.pColormap = &colormap;
+		quantize_image(pixels, pPalette, nMaxColors, qPixels, width, height, dither, state);
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -402,10 +537,124 @@ namespace PnnLABQuant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		pixelMap.clear();
-		closestMap.clear();
+		m_labPalette.Clear();
+		closestMap.Clear();
+		return true;
+	}
+
+	bool PnnLABQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
+
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	bool PnnLABQuantizer::QuantizeImage(ReadRowsFn readRows, WriteRowsFn writeRows, const UINT width, const UINT height, const UINT stripeHeight, ColorPalette* pPalette, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		hasSemiTransparency = false;
+		m_transparentPixelIndex = -1;
+		pPalette->Count = nMaxColors;
+		PR = .2126, PG = .7152, PB = .0722;
+
+		// Transparency is only known after the last stripe, so fill the bins of both layouts
+		unique_ptr<HistogramBin[]> bins, binsAlpha;
+		if (nMaxColors > 2) {
+			bins = make_unique<HistogramBin[]>(65536);
+			binsAlpha = make_unique<HistogramBin[]>(65536);
+		}
+
+		vector<ARGB> stripe;
+		bool bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+			ScanTransparency(pixels, width * rows, y * width, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+			if (nMaxColors > 2) {
+				BuildHistogram(pixels, width * rows, false, bins.get());
+				BuildHistogram(pixels, width * rows, true, binsAlpha.get());
+			}
+			return true;
+		});
+		if (!bSucceeded)
+			return false;
+
+		if (!m_seeded)
+			m_random.Seed(time(NULL));
+		bool quan_sqrt = m_random.NextDouble() < nMaxColors / 64.0;
+		if (nMaxColors > 2) {
+			pnnquan(hasSemiTransparency ? binsAlpha.get() : bins.get(), pPalette, nMaxColors, quan_sqrt);
+			bins.reset();
+			binsAlpha.reset();
+		}
+		else {
+			if (m_transparentPixelIndex >= 0) {
+				pPalette->Entries[0] = m_transparentColor;
+				pPalette->Entries[1] = Color::Black;
+			}
+			else {
+				pPalette->Entries[0] = Color::Black;
+				pPalette->Entries[1] = Color::White;
+			}
+		}
+		if (nMaxColors <= 256 && hasSemiTransparency)
+			PR = PG = PB = 1;
+
+		InverseColormap colormap;
+		if (((dither || nMaxColors > 256) && IsThreadedDither(m_ditherMode)) || (!dither && m_colormapRemap && nMaxColors <= 256))
+			colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+
+		DitherState state(width);
+		state.mode = m_ditherMode;
+		state.pColormap = &colormap;
+		auto qPixels = make_unique<unsigned short[]>(stripe.size());
+		UINT k = 0;
+		bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+			if (nMaxColors > 256)
+				dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, nMaxColors, qPixels.get(), width, rows, state);
+			else
+				quantize_image(pixels, pPalette, nMaxColors, qPixels.get(), width, rows, dither, state);
+
+			const int offset = m_transparentPixelIndex - (int) (y * width);
+			if (offset >= 0 && offset < (int) (rows * width))
+				k = qPixels[offset];
+			return writeRows(y, rows, qPixels.get());
+		});
+		m_labPalette.Clear();
+		closestMap.Clear();
+		if (!bSucceeded)
+			return false;
+
+		if (nMaxColors <= 256 && m_transparentPixelIndex >= 0) {
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+		}
+		return true;
+	}
+
+#ifdef _WIN32
+	bool PnnLABQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(pixels.size());
+		if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
 
+		if (nMaxColors > 256)
+			return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
 
-}
\ No newline at end of file
+}
@@ -1,8 +1,15 @@
 #pragma once
+#include "CIELABConvertor.h"
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
+#include "ClosestCache.h"
+#include "RandomGenerator.h"
 using namespace std;
 
+struct HistogramBin;
+
 namespace PnnLABQuant
 {
 	// =============================================================
@@ -21,10 +28,52 @@ namespace PnnLABQuant
 	// Use at your own risk!
 	// =============================================================
 
+	struct pnnbin;
+	class BinColumns;
+
 	class PnnLABQuantizer
 	{
 		public:
-			int pnnquan(const vector<ARGB>& pixels, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt);
-			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+			int pnnquan(const ARGB* pixels, const UINT nSize, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt);
+			// Quantizes a caller-owned 32bpp ARGB buffer, stride in bytes. pPalette must hold
+			// nMaxColors entries and qPixels width * height indices into it.
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+			// Quantizes an image too large to hold in memory. readRows is called twice for
+			// every stripe of at most stripeHeight rows, first for the histogram then for the
+			// remap, and writeRows receives the indices of each stripe as soon as they are known.
+			bool QuantizeImage(ReadRowsFn readRows, WriteRowsFn writeRows, const UINT width, const UINT height, const UINT stripeHeight, ColorPalette* pPalette, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#ifdef _WIN32
+			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#endif // _WIN32
+			// Seeds the random choices of the runs that follow, which repeat for the same seed.
+			// Until then every run takes its seed from the clock.
+			void SetSeed(const UINT seed) { m_random.Seed(seed); m_seeded = true; }
+			// Remaps without dithering through an InverseColormap, one table lookup per pixel
+			// instead of a palette search. Faster on large images, but each colour is reduced to
+			// the 5-6-5 or 4-4-4-4 bits of its cell first. Applies up to 256 colours, off by default.
+			void SetColormapRemap(const bool colormapRemap) { m_colormapRemap = colormapRemap; }
+
+		private:
+			double PR = .2126, PG = .7152, PB = .0722;
+			bool hasSemiTransparency = false;
+			bool m_colormapRemap = false;
+			int m_transparentPixelIndex = -1;
+			DitherMode m_ditherMode = DitherMode::ErrorDiffusion;
+			double ratio = 1.0;
+			ARGB m_transparentColor = Color::Transparent;
+			// Lab of the palette entries, filled by the first lookup after the palette is done
+			LabPalette m_labPalette;
+			ClosestCache<double> closestMap;
+			RandomGenerator m_random;
+			bool m_seeded = false;
+
+			const LabPalette& getLabPalette(const ColorPalette* pPalette, const UINT nMaxColors);
+			void find_nn(pnnbin* bins, const BinColumns& columns, int idx, bool crossover);
+			int pnnquan(const HistogramBin* histogram, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const CIELABConvertor::Lab& lab1);
+			unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, DitherState& state);
+			bool QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither);
 	};
 }
\ No newline at end of file
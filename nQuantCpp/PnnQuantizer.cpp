@@ -7,14 +7,16 @@ Copyright (c) 2018-2019 Miller Cy Chan
 #include "stdafx.h"
 #include "PnnQuantizer.h"
 #include "bitmapUtilities.h"
+#include "Histogram.h"
+#include "InverseColormap.h"
+#include <climits>
+#include <thread>
 #include <unordered_map>
 
 namespace PnnQuant
 {
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, vector<unsigned short> > closestMap;
+	// Initial neighbour searches per thread at least
+	const int MIN_BINS_PER_THREAD = 1 << 12;
 
 	struct pnnbin {
 		double ac = 0, rc = 0, gc = 0, bc = 0, err = 0;
@@ -22,53 +24,319 @@ namespace PnnQuant
 		int nn = 0, fw = 0, bk = 0, tm = 0, mtm = 0;
 	};
 
-	void find_nn(pnnbin* bins, int idx)
+	// Live bins bucketed by their mean colour in a uniform grid over R, G, B and, with
+	// semi transparency, A. find_nn walks the cells in rings around the cell of a bin
+	// and stops once no cell further out can hold a closer neighbour. Every cell keeps
+	// the smallest count and the largest index of the bins it has held. Counts only
+	// grow and bins only leave or move, so both stay valid bounds.
+	// The bins of a cell sit next to each other in columns of means and counts, with
+	// room to spare for the bins moving in, so their errors are computed in one loop
+	// the compiler can vectorize.
+	class BinGrid
 	{
-		int i, nn = 0;
-		double err = 1e100;
+		public:
+			// Cells per axis for a grid of about BINS_PER_CELL live bins per cell
+			static int GetSide(const int nBins, const bool hasSemiTransparency)
+			{
+				const int dims = hasSemiTransparency ? 4 : 3;
+				int side = 2;
+				for (; side < MAX_SIDE; side *= 2) {
+					int nCells = 1;
+					for (int a = 0; a < dims; ++a)
+						nCells *= side * 2;
+					if (nCells * BINS_PER_CELL > nBins)
+						break;
+				}
+				return side;
+			}
+
+			// Buckets the live bins, those chained from bins[0], into side cells per axis
+			BinGrid(const pnnbin* bins, const int maxbins, const int side, const bool hasSemiTransparency)
+				: m_bins(bins), m_dims(hasSemiTransparency ? 4 : 3), m_side(side),
+				m_slotOf(maxbins), m_cellOf(maxbins)
+			{
+				m_cellSize = 256.0 / m_side;
+				int nCells = 1;
+				for (int a = 0; a < m_dims; ++a)
+					nCells *= m_side;
+				m_start.assign(nCells + 1, 0);
+				m_count.assign(nCells, 0);
+				m_minCnt.assign(nCells, INT_MAX);
+				m_maxIdx.assign(nCells, -1);
+
+				// Offsets of the cells around a cell, ring after ring
+				const int reach = m_side - 1, width = 2 * reach + 1;
+				int nOffsets = 1;
+				for (int a = 0; a < m_dims; ++a)
+					nOffsets *= width;
+				vector<vector<Offset> > rings(m_side);
+				for (int i = 0; i < nOffsets; ++i) {
+					Offset offset = { { BYTE(reach), BYTE(reach), BYTE(reach), BYTE(reach) }, 0 };
+					int ring = 0;
+					for (int a = 0, k = i, stride = 1; a < m_dims; ++a, k /= width, stride *= m_side) {
+						const int d = k % width - reach;
+						offset.axis[a] = BYTE(d + reach);
+						offset.delta += d * stride;
+						ring = max(ring, abs(d));
+					}
+					rings[ring].emplace_back(offset);
+				}
+				for (const auto& ring : rings) {
+					m_ringStart.emplace_back(m_offsets.size());
+					m_offsets.insert(m_offsets.end(), ring.begin(), ring.end());
+				}
+				m_ringStart.emplace_back(m_offsets.size());
+
+				vector<int> live;
+				m_minBinCnt = INT_MAX;
+				for (int i = 0;; i = bins[i].fw) {
+					m_minBinCnt = min(m_minBinCnt, bins[i].cnt);
+					live.emplace_back(i);
+					if (!bins[i].fw)
+						break;
+				}
+				Layout(live);
+			}
+
+			int Side() const
+			{
+				return m_side;
+			}
+
+			void Insert(const int i)
+			{
+				int coords[4];
+				const int cell = m_cellOf[i] = CellOf(m_bins[i], coords);
+				if (m_start[cell] + m_count[cell] == m_start[cell + 1]) {
+					// The cell is full, lay all cells out again with room to spare
+					vector<int> live(1, i);
+					for (int c = 0; c < (int) m_count.size(); ++c)
+						live.insert(live.end(), m_index.begin() + m_start[c], m_index.begin() + m_start[c] + m_count[c]);
+					Layout(live);
+					return;
+				}
+
+				Place(m_start[cell] + m_count[cell]++, i);
+			}
+
+			void Remove(const int i)
+			{
+				const int last = m_start[m_cellOf[i]] + --m_count[m_cellOf[i]];
+				const int slot = m_slotOf[i];
+				if (slot == last)
+					return;
+
+				m_index[slot] = m_index[last];
+				m_slotOf[m_index[slot]] = slot;
+				m_cnt[slot] = m_cnt[last];
+				for (int a = 0; a < 4; ++a)
+					m_means[a][slot] = m_means[a][last];
+			}
+
+			// Same choice as scanning the bins after idx in the list of live bins, which is
+			// in index order: the least error, the first such bin on a tie
+			void FindNearest(const int idx, double& err, int& nn) const
+			{
+				const auto& bin1 = m_bins[idx];
+				const auto n1 = bin1.cnt;
+				const auto wa = bin1.ac, wr = bin1.rc, wg = bin1.gc, wb = bin1.bc;
+				const double q[4] = { wr, wg, wb, wa };
+				int c[4];
+				const int cell0 = CellOf(bin1, c);
+				// Any bin further away than the worst count allows is no better than err.
+				// The margin absorbs the rounding of the error and of the bound.
+				const double MARGIN = 1 - 1e-9;
+				const double minWeight = MARGIN * n1 * m_minBinCnt / (n1 + m_minBinCnt);
+
+				// Squared distance along each axis to the cells offset by -reach .. reach,
+				// OUTSIDE for those beyond the grid, filled in ring by ring
+				const double OUTSIDE = 1e300;
+				const int reach = m_side - 1;
+				double axisDist[4][2 * MAX_SIDE - 1];
+				axisDist[3][reach] = 0;
+
+				const double *pR = m_means[0].data(), *pG = m_means[1].data(), *pB = m_means[2].data(), *pA = m_means[3].data();
+				const double* pCnt = m_cnt.data();
+				double errors[BLOCK];
+				err = 1e100;
+				nn = 0;
+				for (int r = 0; r < m_side; ++r) {
+					for (int a = 0; a < m_dims; ++a) {
+						for (int d = -r; d <= r; d += max(2 * r, 1)) {
+							const int k = c[a] + d;
+							const double lo = k * m_cellSize, hi = lo + m_cellSize;
+							if (k < 0 || k >= m_side)
+								axisDist[a][d + reach] = OUTSIDE;
+							else
+								axisDist[a][d + reach] = q[a] < lo ? sqr(lo - q[a]) : (q[a] > hi ? sqr(q[a] - hi) : 0);
+						}
+					}
+
+					for (int o = m_ringStart[r]; o < m_ringStart[r + 1]; ++o) {
+						const auto& offset = m_offsets[o];
+						const double dist = axisDist[0][offset.axis[0]] + axisDist[1][offset.axis[1]] + axisDist[2][offset.axis[2]] + axisDist[3][offset.axis[3]];
+						if (dist >= OUTSIDE)
+							continue;
+
+						const int cell = cell0 + offset.delta;
+						if (!m_count[cell] || m_maxIdx[cell] <= idx)
+							continue;
+
+						const double minCnt = m_minCnt[cell];
+						if (dist * MARGIN * n1 * minCnt / (n1 + minCnt) > err)
+							continue;
+
+						// A is zero in every bin without semi transparency, adding nothing
+						const int end = m_start[cell] + m_count[cell];
+						for (int s = m_start[cell]; s < end; s += BLOCK) {
+							const int n = min(BLOCK, end - s);
+							for (int j = 0; j < n; ++j) {
+								const double n2 = pCnt[s + j];
+								const double nerr = sqr(pR[s + j] - wr) + sqr(pG[s + j] - wg) + sqr(pB[s + j] - wb) + sqr(pA[s + j] - wa);
+								errors[j] = nerr * ((n1 * n2) / (n1 + n2));
+							}
+
+							for (int j = 0; j < n; ++j) {
+								const int i = m_index[s + j];
+								if (i > idx && (errors[j] < err || (errors[j] == err && i < nn))) {
+									err = errors[j];
+									nn = i;
+								}
+							}
+						}
+					}
+
+					// Cells beyond ring r are at least the nearest face of the block walked so far away
+					double gap = 1e100;
+					for (int a = 0; a < m_dims; ++a) {
+						if (c[a] - r > 0)
+							gap = min(gap, q[a] - (c[a] - r) * m_cellSize);
+						if (c[a] + r < m_side - 1)
+							gap = min(gap, (c[a] + r + 1) * m_cellSize - q[a]);
+					}
+					if (gap >= 1e100 || sqr(gap) * minWeight > err)
+						break;
+				}
+			}
+
+		private:
+			static const int MAX_SIDE = 32;
+			static const int BINS_PER_CELL = 4;
+			// Errors computed per pass over the bins of a cell
+			static const int BLOCK = 16;
+
+			// A neighbouring cell, its coordinates offset by axis[a] - (side - 1) and its
+			// index by delta
+			struct Offset {
+				BYTE axis[4];
+				int delta;
+			};
+
+			const pnnbin* m_bins;
+			const int m_dims, m_side;
+			double m_cellSize;
+			int m_minBinCnt;
+			vector<int> m_slotOf, m_cellOf;
+			// The slots of cell c run from m_start[c], the first m_count[c] of them in use
+			vector<int> m_start, m_count, m_minCnt, m_maxIdx;
+			// Bin, R, G, B and A means and count held in each slot. They stay double: a cell
+			// holds about BINS_PER_CELL bins, too few for wider float vectors to pay for a
+			// second set of columns and a recheck in double.
+			vector<int> m_index;
+			vector<double> m_means[4], m_cnt;
+			vector<Offset> m_offsets;
+			vector<int> m_ringStart;
+
+			int CellOf(const pnnbin& bin, int* coords) const
+			{
+				const double q[4] = { bin.rc, bin.gc, bin.bc, bin.ac };
+				int cell = 0;
+				for (int a = m_dims - 1; a >= 0; --a) {
+					coords[a] = min(max((int) (q[a] / m_cellSize), 0), m_side - 1);
+					cell = cell * m_side + coords[a];
+				}
+				return cell;
+			}
+
+			void Place(const int slot, const int i)
+			{
+				const auto& bin = m_bins[i];
+				const int cell = m_cellOf[i];
+				m_slotOf[i] = slot;
+				m_index[slot] = i;
+				m_means[0][slot] = bin.rc;
+				m_means[1][slot] = bin.gc;
+				m_means[2][slot] = bin.bc;
+				m_means[3][slot] = bin.ac;
+				m_cnt[slot] = bin.cnt;
+				m_minCnt[cell] = min(m_minCnt[cell], bin.cnt);
+				m_maxIdx[cell] = max(m_maxIdx[cell], i);
+			}
+
+			// Gives every cell twice the slots its bins need, plus one
+			void Layout(const vector<int>& live)
+			{
+				int coords[4];
+				fill(m_count.begin(), m_count.end(), 0);
+				for (const int i : live)
+					++m_count[m_cellOf[i] = CellOf(m_bins[i], coords)];
+				for (int c = 0; c < (int) m_count.size(); ++c)
+					m_start[c + 1] = m_start[c] + 2 * m_count[c] + 1;
+
+				const int nSlots = m_start.back();
+				m_index.assign(nSlots, 0);
+				for (auto& means : m_means)
+					means.assign(nSlots, 0);
+				m_cnt.assign(nSlots, 0);
+				fill(m_count.begin(), m_count.end(), 0);
+				for (const int i : live)
+					Place(m_start[m_cellOf[i]] + m_count[m_cellOf[i]]++, i);
+			}
+	};
+
+	// min takes BLOCK by reference, so it needs a definition as well
+	const int BinGrid::BLOCK;
 
+	void PnnQuantizer::find_nn(pnnbin* bins, const BinGrid& grid, int idx)
+	{
 		auto& bin1 = bins[idx];
-		auto n1 = bin1.cnt;
-		auto wa = bin1.ac;
-		auto wr = bin1.rc;
-		auto wg = bin1.gc;
-		auto wb = bin1.bc;
-		for (i = bin1.fw; i; i = bins[i].fw) {
-			double nerr = sqr(bins[i].rc - wr) + sqr(bins[i].gc - wg) + sqr(bins[i].bc - wb);
-			if(hasSemiTransparency)
-				nerr += sqr(bins[i].ac - wa);
-			double n2 = bins[i].cnt;
-			nerr *= (n1 * n2) / (n1 + n2);
-			if (nerr >= err)
+		grid.FindNearest(idx, bin1.err, bin1.nn);
+	}
+
+	void build_histogram(pnnbin* bins, const ARGB* pixels, const UINT nSize, const bool hasSemiTransparency)
+	{
+		// !!! Can throw gamma correction in here, but what to do about perceptual
+		// !!! nonuniformity then?
+		auto histogram = make_unique<HistogramBin[]>(65536);
+		BuildHistogram(pixels, nSize, hasSemiTransparency, histogram.get());
+		for (int i = 0; i < 65536; ++i) {
+			const auto& hb = histogram[i];
+			if (!hb.cnt)
 				continue;
-			err = nerr;
-			nn = i;
+
+			auto& tb = bins[i];
+			if (hasSemiTransparency)
+				tb.ac += hb.a;
+			tb.rc += hb.r;
+			tb.gc += hb.g;
+			tb.bc += hb.b;
+			tb.cnt += hb.cnt;
 		}
-		bin1.err = err;
-		bin1.nn = nn;
 	}
 
-	int pnnquan(const vector<ARGB>& pixels, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
+	int PnnQuantizer::pnnquan(const ARGB* pixels, const UINT nSize, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
 	{
 		auto bins = make_unique<pnnbin[]>(65536);
+		/* Build histogram */
+		build_histogram(bins.get(), pixels, nSize, hasSemiTransparency);
+		return pnnquan(bins.get(), pPalette, nMaxColors, quan_sqrt);
+	}
+
+	int PnnQuantizer::pnnquan(pnnbin* bins, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
+	{
 		auto heap = make_unique<int[]>(65537);
 		double err, n1, n2;
 
-		/* Build histogram */
-		for (const auto& pixel : pixels) {
-			// !!! Can throw gamma correction in here, but what to do about perceptual
-			// !!! nonuniformity then?
-			Color c(pixel);
-			int index = GetARGBIndex(c, hasSemiTransparency);
-			auto& tb = bins[index];
-			if (hasSemiTransparency)
-				tb.ac += c.GetA();
-			tb.rc += c.GetR();
-			tb.gc += c.GetG();
-			tb.bc += c.GetB();
-			tb.cnt++;
-		}
-
 		/* Cluster nonempty bins at one end of array */
 		int maxbins = 0;
 
@@ -96,10 +364,24 @@ namespace PnnQuant
 
 		//	bins[0].bk = bins[i].fw = 0;
 
+		auto grid = make_unique<BinGrid>(bins, maxbins, BinGrid::GetSide(maxbins, hasSemiTransparency), hasSemiTransparency);
+
+		/* Initialize nearest neighbors, each search on its own so they are shared out between threads */
+		auto findNearest = [&](const int first, const int step) {
+			for (int i = first; i < maxbins; i += step)
+				find_nn(bins, *grid, i);
+		};
+		const int nThreads = max(min((int) thread::hardware_concurrency(), maxbins / MIN_BINS_PER_THREAD), 1);
+		vector<thread> workers;
+		for (int t = 1; t < nThreads; ++t)
+			workers.emplace_back(findNearest, t, nThreads);
+		findNearest(0, nThreads);
+		for (auto& worker : workers)
+			worker.join();
+
 		int h, l, l2;
-		/* Initialize nearest neighbors and build heap of them */
+		/* Build heap of them */
 		for (int i = 0; i < maxbins; ++i) {
-			find_nn(bins.get(), i);
 			/* Push slot on heap */
 			err = bins[i].err;
 			for (l = ++heap[0]; l > 1; l = l2) {
@@ -126,7 +408,7 @@ namespace PnnQuant
 					b1 = heap[1] = heap[heap[0]--];
 				else /* Too old error value */
 				{
-					find_nn(bins.get(), b1);
+					find_nn(bins, *grid, b1);
 					tb.tm = i;
 				}
 				/* Push slot down */
@@ -159,6 +441,16 @@ namespace PnnQuant
 			bins[nb.bk].fw = nb.fw;
 			bins[nb.fw].bk = nb.bk;
 			nb.mtm = 0xFFFF;
+
+			/* Move the merged bin to the cell of its new mean, or coarsen the grid as bins run out */
+			const int side = BinGrid::GetSide(maxbins - i, hasSemiTransparency);
+			if (side < grid->Side())
+				grid = make_unique<BinGrid>(bins, maxbins, side, hasSemiTransparency);
+			else {
+				grid->Remove(tb.nn);
+				grid->Remove(b1);
+				grid->Insert(b1);
+			}
 		}
 
 		/* Fill palette */
@@ -176,43 +468,17 @@ namespace PnnQuant
 		return 0;
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short PnnQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
-		unsigned short k = 0;
-		Color c(argb);
-
-		double mindist = INT_MAX;
-		for (UINT i = 0; i < nMaxColors; ++i) {
-			Color c2(pPalette->Entries[i]);
-			double curdist = sqr(c2.GetA() - c.GetA());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetR() - c.GetR());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetG() - c.GetG());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetB() - c.GetB());
-			if (curdist > mindist)
-				continue;
-
-			mindist = curdist;
-			k = i;
-		}
-		return k;
+		return m_paletteIndex.Nearest(pPalette, nMaxColors, argb);
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short PnnQuantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		UINT k = 0;
 		Color c(argb);
-		vector<unsigned short> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		unsigned short closest[5] = { 0 };
+		if (!closestMap.Find(argb, closest)) {
 			closest[2] = closest[3] = SHORT_MAX;
 
 			for (; k < nMaxColors; ++k) {
@@ -232,25 +498,30 @@ namespace PnnQuant
 
 			if (closest[3] == SHORT_MAX)
 				closest[2] = 0;
+
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next(closest[3] + closest[2]) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
-
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool PnnQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, DitherState& state)
 	{		
 		if (dither) 
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
+			return dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, nMaxColors, qPixels, width, height, state);
 
-		DitherFn ditherFn = (m_transparentPixelIndex >= 0 || nMaxColors < 256) ? nearestColorIndex : closestColorIndex;
+		if (m_colormapRemap && state.pColormap && state.pColormap->IsBuilt()) {
+			state.pColormap->Remap(pixels, width * height, qPixels);
+			return true;
+		}
+
+		DitherFn ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); };
+		if (m_transparentPixelIndex < 0 && nMaxColors >= 256)
+			ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return closestColorIndex(pPalette, nMaxColors, argb); };
 		UINT pixelIndex = 0;
 		for (int j = 0; j < height; ++j) {
 			for (int i = 0; i < width; ++i, ++pixelIndex)
@@ -260,21 +531,13 @@ namespace PnnQuant
 		return true;
 	}	
 
-	bool PnnQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool PnnQuantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
-
-		int pixelIndex = 0;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);		
-		
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		m_paletteIndex.Clear();
 		pPalette->Count = nMaxColors;
 
 		if (nMaxColors > 2)
-			pnnquan(pixels, pPalette, nMaxColors, true);
+			pnnquan(pixels, width * height, pPalette, nMaxColors, true);
 		else {
 			if (m_transparentPixelIndex >= 0) {
 				pPalette->Entries[0] = m_transparentColor;
@@ -286,14 +549,20 @@ namespace PnnQuant
 			}
 		}
 		
-		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
-		}
+		InverseColormap colormap;
+		const bool colormapRemap = !dither && m_colormapRemap && nMaxColors <= 256;
+		if ((dither || nMaxColors > 256 || colormapRemap) && width * height >= MIN_COLORMAP_PIXELS)
+			colormap.Build(pPalette, nMaxColors, hasSemiTransparency);
+		else if (((dither || nMaxColors > 256) && IsThreadedDither(m_ditherMode)) || colormapRemap)
+			colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
+		if (nMaxColors > 256)
+			return dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+
+		DitherState state(width);
+		state.mode = m_ditherMode;
+		state.pColormap = &colormap;
+		quantize_image(pixels, pPalette, nMaxColors, qPixels, width, height, dither, state);
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -302,9 +571,120 @@ namespace PnnQuant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		closestMap.clear();
+		closestMap.Clear();
+		return true;
+	}
+
+	bool PnnQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
+
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	bool PnnQuantizer::QuantizeImage(ReadRowsFn readRows, WriteRowsFn writeRows, const UINT width, const UINT height, const UINT stripeHeight, ColorPalette* pPalette, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		m_paletteIndex.Clear();
+		hasSemiTransparency = false;
+		m_transparentPixelIndex = -1;
+		pPalette->Count = nMaxColors;
+
+		// Transparency is only known after the last stripe, so fill the bins of both layouts
+		unique_ptr<pnnbin[]> bins, binsAlpha;
+		if (nMaxColors > 2) {
+			bins = make_unique<pnnbin[]>(65536);
+			binsAlpha = make_unique<pnnbin[]>(65536);
+		}
+
+		vector<ARGB> stripe;
+		bool bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+			ScanTransparency(pixels, width * rows, y * width, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+			if (nMaxColors > 2) {
+				build_histogram(bins.get(), pixels, width * rows, false);
+				build_histogram(binsAlpha.get(), pixels, width * rows, true);
+			}
+			return true;
+		});
+		if (!bSucceeded)
+			return false;
+
+		if (nMaxColors > 2) {
+			pnnquan(hasSemiTransparency ? binsAlpha.get() : bins.get(), pPalette, nMaxColors, true);
+			bins.reset();
+			binsAlpha.reset();
+		}
+		else {
+			if (m_transparentPixelIndex >= 0) {
+				pPalette->Entries[0] = m_transparentColor;
+				pPalette->Entries[1] = Color::Black;
+			}
+			else {
+				pPalette->Entries[0] = Color::Black;
+				pPalette->Entries[1] = Color::White;
+			}
+		}
+
+		InverseColormap colormap;
+		const bool colormapRemap = !dither && m_colormapRemap && nMaxColors <= 256;
+		if ((dither || nMaxColors > 256 || colormapRemap) && width * height >= MIN_COLORMAP_PIXELS)
+			colormap.Build(pPalette, nMaxColors, hasSemiTransparency);
+		else if (((dither || nMaxColors > 256) && IsThreadedDither(m_ditherMode)) || colormapRemap)
+			colormap.Defer([&](const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency);
+
+		DitherState state(width);
+		state.mode = m_ditherMode;
+		state.pColormap = &colormap;
+		auto qPixels = make_unique<unsigned short[]>(stripe.size());
+		UINT k = 0;
+		bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+			if (nMaxColors > 256)
+				dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return nearestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, nMaxColors, qPixels.get(), width, rows, state);
+			else
+				quantize_image(pixels, pPalette, nMaxColors, qPixels.get(), width, rows, dither, state);
+
+			const int offset = m_transparentPixelIndex - (int) (y * width);
+			if (offset >= 0 && offset < (int) (rows * width))
+				k = qPixels[offset];
+			return writeRows(y, rows, qPixels.get());
+		});
+		closestMap.Clear();
+		if (!bSucceeded)
+			return false;
+
+		if (nMaxColors <= 256 && m_transparentPixelIndex >= 0) {
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+		}
+		return true;
+	}
+
+#ifdef _WIN32
+	bool PnnQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);		
+		
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(pixels.size());
+		if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
 
+		if (nMaxColors > 256)
+			return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <cstdint>
+
+// xoshiro128** generator owned by each quantizer in place of the C rand(), whose one
+// state is shared by every thread behind a lock. Seeds go through SplitMix64, so that
+// any seed, 0 included, gives a well mixed state. It meets the requirements of a
+// uniform random bit generator, for shuffle and the distributions of <random>.
+class RandomGenerator
+{
+	public:
+		typedef uint32_t result_type;
+
+		explicit RandomGenerator(const uint64_t seed = 0)
+		{
+			Seed(seed);
+		}
+
+		void Seed(uint64_t seed)
+		{
+			for (int i = 0; i < 4; i += 2) {
+				uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				z ^= z >> 31;
+				m_state[i] = (uint32_t) z;
+				m_state[i + 1] = (uint32_t) (z >> 32);
+			}
+		}
+
+		result_type operator()()
+		{
+			const uint32_t result = Rotl(m_state[1] * 5, 7) * 9;
+			const uint32_t t = m_state[1] << 9;
+			m_state[2] ^= m_state[0];
+			m_state[3] ^= m_state[1];
+			m_state[1] ^= m_state[2];
+			m_state[0] ^= m_state[3];
+			m_state[2] ^= t;
+			m_state[3] = Rotl(m_state[3], 11);
+			return result;
+		}
+
+		// Uniform in 0 .. n - 1 for n > 0, the high half of a 64-bit product
+		inline uint32_t Next(const uint32_t n)
+		{
+			return (uint32_t) (((uint64_t) (*this)() * n) >> 32);
+		}
+
+		// Uniform in [0, 1)
+		inline double NextDouble()
+		{
+			return (*this)() * (1.0 / 4294967296.0);
+		}
+
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return UINT32_MAX; }
+
+	private:
+		uint32_t m_state[4];
+
+		static inline uint32_t Rotl(const uint32_t x, const int k)
+		{
+			return (x << k) | (x >> (32 - k));
+		}
+};
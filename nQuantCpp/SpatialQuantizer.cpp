@@ -29,17 +29,12 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 #include <deque>
 #include <algorithm>
 #include <numeric>
-#include <random>
 #include <math.h>
 #include <time.h>
 #include <limits>
 
 namespace SpatialQuant
 {
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-
 	template <typename T, int length>
 	class vector_fixed
 	{
@@ -298,10 +293,10 @@ namespace SpatialQuant
 			return data[row * width * depth + col * depth + layer];
 		}
 
-		void fill_random() {
+		void fill_random(RandomGenerator& random) {
 			const int volume = width * height * depth;
 			for (int i = 0; i < volume; ++i)
-				data[i] = ((double)rand()) / RAND_MAX;
+				data[i] = random.NextDouble();
 		}
 
 		inline int get_width()  const { return width; }
@@ -325,16 +320,15 @@ namespace SpatialQuant
 		return result;
 	}
 
-	void random_permutation(int count, vector<int>& result) {
+	void random_permutation(int count, vector<int>& result, RandomGenerator& random) {
 		result.resize(count);
 		iota(result.begin(), result.end(), 0);
-		auto rng = default_random_engine{};
-		shuffle(result.begin(), result.end(), rng);
+		shuffle(result.begin(), result.end(), random);
 	}
 
-	void random_permutation_2d(int width, int height, deque<pair<int, int> >& result) {
+	void random_permutation_2d(int width, int height, deque<pair<int, int> >& result, RandomGenerator& random) {
 		vector<int> perm1d;
-		random_permutation(width * height, perm1d);
+		random_permutation(width * height, perm1d, random);
 		for (auto it = perm1d.cbegin(); it != perm1d.cend(); ++it)
 			result.emplace_front(*it % width, *it / width);
 	}
@@ -378,7 +372,7 @@ namespace SpatialQuant
 		return b(k_x, k_y);
 	}
 
-	void compute_a_image(const vector<ARGB>& image, array2d<vector_fixed<double, 4> >& b, array2d<vector_fixed<double, 4> >& a)
+	void compute_a_image(const ARGB* image, array2d<vector_fixed<double, 4> >& b, array2d<vector_fixed<double, 4> >& a)
 	{
 		const int a_width = a.get_width(), a_height = a.get_height();
 		const int radius_width = (b.get_width() - 1) / 2, radius_height = (b.get_height() - 1) / 2;
@@ -503,7 +497,7 @@ namespace SpatialQuant
 		}
 	}
 
-	void compute_initial_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b)
+	void SpatialQuantizer::compute_initial_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
 		const int palette_size = s.get_width();
@@ -540,7 +534,7 @@ namespace SpatialQuant
 		}
 	}
 
-	void update_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b,
+	void SpatialQuantizer::update_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b,
 		const int j_x, const int j_y, const int alpha, const double delta)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
@@ -569,7 +563,7 @@ namespace SpatialQuant
 		s(alpha, alpha) += delta * b_value(b, 0, 0, 0, 0);
 	}
 
-	void refine_palette(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables,
+	void SpatialQuantizer::refine_palette(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables,
 		const array2d<vector_fixed<double, 4> >& a, vector<vector_fixed<double, 4> >& palette)
 	{
 		// We only computed the half of S above the diagonal - reflect it
@@ -626,12 +620,11 @@ namespace SpatialQuant
 		}
 	}
 
-	bool spatial_color_quant(const vector<ARGB>& image, array2d<vector_fixed<double, 4> >& filter_weights,
-		unsigned short* quantized_image, const int bitmapWidth, vector<vector_fixed<double, 4> >& palette,
-		const double initial_temperature = 1.0, const double final_temperature = 0.001, const int temps_per_level = 3, const int repeats_per_temp = 1)
+	bool SpatialQuantizer::spatial_color_quant(const ARGB* image, array2d<vector_fixed<double, 4> >& filter_weights,
+		unsigned short* quantized_image, const int bitmapWidth, const int bitmapHeight, vector<vector_fixed<double, 4> >& palette,
+		const double initial_temperature, const double final_temperature, const int temps_per_level, const int repeats_per_temp)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
-		const int bitmapHeight = image.size() / bitmapWidth;
 
 		const auto nMaxColor = palette.size();
 		int max_coarse_level = compute_max_coarse_level(bitmapWidth, bitmapHeight);
@@ -640,7 +633,7 @@ namespace SpatialQuant
 			bitmapHeight >> max_coarse_level,
 			nMaxColor);
 
-		p_coarse_variables->fill_random();
+		p_coarse_variables->fill_random(m_random);
 
 		double temperature = initial_temperature;
 
@@ -716,7 +709,7 @@ namespace SpatialQuant
 			for (int repeat = 0; repeat < repeats_per_temp; ++repeat) {
 				int pixels_changed = 0, pixels_visited = 0;
 				deque<pair<int, int> > visit_queue;
-				random_permutation_2d(coarse_width, coarse_height, visit_queue);
+				random_permutation_2d(coarse_width, coarse_height, visit_queue, m_random);
 
 				// Compute 2*sum(j in extended neighborhood of i, j != i) b_ij
 
@@ -724,7 +717,7 @@ namespace SpatialQuant
 					// If we get to 10% above initial size, just revisit them all
 					if ((int)visit_queue.size() > coarse_width * coarse_height * 1.1) {
 						visit_queue.clear();
-						random_permutation_2d(coarse_width, coarse_height, visit_queue);
+						random_permutation_2d(coarse_width, coarse_height, visit_queue, m_random);
 					}
 
 					const auto& pos = visit_queue.front();
@@ -861,17 +854,8 @@ namespace SpatialQuant
 		return true;
 	}
 
-	bool SpatialQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool SpatialQuantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
-
-		hasSemiTransparency = false;
-		m_transparentPixelIndex = -1;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
-
 		const int length = hasSemiTransparency ? 4 : 3;
 		double dithering_level = 1.0;
 		array2d<vector_fixed<double, 4> > filter3_weights(3, 3);
@@ -894,21 +878,15 @@ namespace SpatialQuant
 		vector<vector_fixed<double, 4> > palette(nMaxColors);
 		for (UINT i = 0; i < nMaxColors; ++i) {
 			for (BYTE p = 0; p < length; ++p)
-				palette[i][p] = ((double)rand()) / RAND_MAX;
+				palette[i][p] = m_random.NextDouble();
 		}
 
 		if (nMaxColors > 256)
 			nMaxColors = 256;
 
-		auto pPaletteBytes = make_unique<BYTE[]>(pDest->GetPaletteSize());
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
-		if (nMaxColors == 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
-			pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
-
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		if (!spatial_color_quant(pixels, filter3_weights, qPixels.get(), bitmapWidth, palette))
+		if (!spatial_color_quant(pixels, filter3_weights, qPixels, width, height, palette))
 			return false;
 
 		if (nMaxColors > 2) {
@@ -934,8 +912,39 @@ namespace SpatialQuant
 				pPalette->Entries[0] = Color::White;
 			}
 		}
+		return true;
+	}
+
+	bool SpatialQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
+
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither);
+	}
+
+#ifdef _WIN32
+	bool SpatialQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(pixels.size());
+		if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		if (nMaxColors == 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
+			pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
 
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
 
-}
\ No newline at end of file
+}
@@ -23,6 +23,11 @@
 #include "stdafx.h"
 #include "WuQuantizer.h"
 #include "bitmapUtilities.h"
+#include "Histogram.h"
+#include "CpuFeatures.h"
+#include "InverseColormap.h"
+#include <cstring>
+#include <thread>
 #include <unordered_map>
 
 namespace nQuant
@@ -37,13 +42,6 @@ namespace nQuant
 	const BYTE SIDESIZE = MAXSIDEINDEX + 1;
 	const UINT TOTAL_SIDESIZE = SIDESIZE * SIDESIZE * SIDESIZE * SIDESIZE;
 
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	double PR = .2126, PG = .7152, PB = .0722;
-	unordered_map<ARGB, vector<unsigned short> > closestMap;
-	unordered_map<ARGB, UINT> rightMatches;
-
 	struct Box {
 		BYTE AlphaMinimum = 0;
 		BYTE AlphaMaximum = 0;
@@ -69,26 +67,18 @@ namespace nQuant
 	};
 
 	struct ColorData {
-		unique_ptr<long[]> weights;
-		unique_ptr<long[]> momentsAlpha;
-		unique_ptr<long[]> momentsRed;
-		unique_ptr<long[]> momentsGreen;
-		unique_ptr<long[]> momentsBlue;
-		unique_ptr<float[]> moments;
-
+		unique_ptr<HistogramBin[]> histogram;
 		unique_ptr<ARGB[]> pixels;
 
 		UINT pixelsCount = 0;
-		UINT pixelFillingCounter = 0;
 
-		ColorData(UINT sideSize, UINT bitmapWidth, UINT bitmapHeight) {
+		// Histogram only, for images streamed in stripes
+		ColorData(UINT sideSize) {
 			const int TOTAL_SIDESIZE = sideSize * sideSize * sideSize * sideSize;
-			weights = make_unique<long[]>(TOTAL_SIDESIZE);
-			momentsAlpha = make_unique<long[]>(TOTAL_SIDESIZE);
-			momentsRed = make_unique<long[]>(TOTAL_SIDESIZE);
-			momentsGreen = make_unique<long[]>(TOTAL_SIDESIZE);
-			momentsBlue = make_unique<long[]>(TOTAL_SIDESIZE);
-			moments = make_unique<float[]>(TOTAL_SIDESIZE);
+			histogram = make_unique<HistogramBin[]>(TOTAL_SIDESIZE);
+		}
+
+		ColorData(UINT sideSize, UINT bitmapWidth, UINT bitmapHeight) : ColorData(sideSize) {
 			pixelsCount = bitmapWidth * bitmapHeight;
 			pixels = make_unique<ARGB[]>(pixelsCount);
 		}
@@ -96,11 +86,21 @@ namespace nQuant
 		inline ARGB* GetPixels() {
 			return pixels.get();
 		}
+	};
 
-		inline void AddPixel(ARGB pixel)
-		{
-			pixels[pixelFillingCounter] = pixel;
-			++pixelFillingCounter;
+	struct PaletteSums {
+		unique_ptr<UINT[]> alphas;
+		unique_ptr<UINT[]> reds;
+		unique_ptr<UINT[]> greens;
+		unique_ptr<UINT[]> blues;
+		unique_ptr<UINT[]> sums;
+
+		PaletteSums(UINT colorCount) {
+			alphas = make_unique<UINT[]>(colorCount);
+			reds = make_unique<UINT[]>(colorCount);
+			greens = make_unique<UINT[]>(colorCount);
+			blues = make_unique<UINT[]>(colorCount);
+			sums = make_unique<UINT[]>(colorCount);
 		}
 	};
 
@@ -112,323 +112,513 @@ namespace nQuant
 		return alpha + red * SIDESIZE + green * SIDESIZE * SIDESIZE + blue * SIDESIZE * SIDESIZE * SIDESIZE;
 	}
 
-	inline float Volume(const Box& cube, long* moment)
-	{
-		return (moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-			(moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
-	}
-
-	inline float Volume(const Box& cube, float* moment)
-	{
-		return (moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] +
-			moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] -
-			moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-			(moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
-	}
-
-	inline float Top(const Box& cube, Pixel direction, BYTE position, long* moment)
+	// Cumulative sums of the histogram cells up to and including one cell. They are
+	// kept together so that each box corner is a single load.
+	template <typename T, bool hasAlpha>
+	struct MomentCell {
+		T weight = 0, alpha = 0, red = 0, green = 0, blue = 0;
+		float moment = 0;
+
+		inline void Add(const MomentCell& cell)
+		{
+			weight += cell.weight;
+			alpha += cell.alpha;
+			red += cell.red;
+			green += cell.green;
+			blue += cell.blue;
+			moment += cell.moment;
+		}
+	};
+
+	// Opaque images need no alpha sums, every pixel counted there has alpha BYTE_MAX
+	template <typename T>
+	struct MomentCell<T, false> {
+		T weight = 0, red = 0, green = 0, blue = 0;
+		float moment = 0;
+
+		inline void Add(const MomentCell& cell)
+		{
+			weight += cell.weight;
+			red += cell.red;
+			green += cell.green;
+			blue += cell.blue;
+			moment += cell.moment;
+		}
+	};
+
+	// Signed combination of the cells at the corners of a box
+	struct MomentSums {
+		long long weight = 0, alpha = 0, red = 0, green = 0, blue = 0;
+		float moment = 0;
+
+		MomentSums() {}
+
+		template <typename T>
+		MomentSums(const MomentCell<T, true>& cell) : weight(cell.weight), alpha(cell.alpha), red(cell.red), green(cell.green), blue(cell.blue), moment(cell.moment) {}
+
+		template <typename T>
+		MomentSums(const MomentCell<T, false>& cell) : weight(cell.weight), alpha(BYTE_MAX * (long long) cell.weight), red(cell.red), green(cell.green), blue(cell.blue), moment(cell.moment) {}
+
+		inline MomentSums operator+(const MomentSums& sums) const
+		{
+			MomentSums result(*this);
+			result.weight += sums.weight;
+			result.alpha += sums.alpha;
+			result.red += sums.red;
+			result.green += sums.green;
+			result.blue += sums.blue;
+			result.moment += sums.moment;
+			return result;
+		}
+
+		inline MomentSums operator-(const MomentSums& sums) const
+		{
+			MomentSums result(*this);
+			result.weight -= sums.weight;
+			result.alpha -= sums.alpha;
+			result.red -= sums.red;
+			result.green -= sums.green;
+			result.blue -= sums.blue;
+			result.moment -= sums.moment;
+			return result;
+		}
+
+		inline MomentSums operator-() const
+		{
+			MomentSums result;
+			result.weight = -weight;
+			result.alpha = -alpha;
+			result.red = -red;
+			result.green = -green;
+			result.blue = -blue;
+			result.moment = -moment;
+			return result;
+		}
+	};
+
+	// Moments over the ARGB histogram, or over its opaque RGB slice when no pixel
+	// counted is translucent. T is UINT when the sums of the image fit in 32 bits.
+	template <typename T, bool hasAlpha>
+	struct MomentTable {
+		typedef MomentCell<T, hasAlpha> Cell;
+		static const bool HAS_ALPHA = hasAlpha;
+
+		vector<Cell> cells;
+
+		MomentTable() : cells(hasAlpha ? TOTAL_SIDESIZE : SIDESIZE * SIDESIZE * SIDESIZE) {}
+
+		// Cell of a histogram index of CompileColorData
+		inline Cell& FromHistogram(const UINT index)
+		{
+			return cells[hasAlpha ? index : index / SIDESIZE];
+		}
+
+		inline MomentSums At(const BYTE alpha, const BYTE red, const BYTE green, const BYTE blue) const
+		{
+			if (hasAlpha)
+				return MomentSums(cells[Index(alpha, red, green, blue)]);
+
+			// Below the opaque slice the cumulative sums are all zero
+			return alpha < MAXSIDEINDEX ? MomentSums() : MomentSums(cells[Index(red, green, blue)]);
+		}
+	};
+
+	template <typename Table>
+	inline MomentSums Volume(const Table& table, const Box& cube)
+	{
+		return (table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum) -
+			table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) -
+			table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) +
+			table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum) -
+			table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum) +
+			table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) +
+			table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) -
+			table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+			(table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) -
+				table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) -
+				table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+				table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) -
+				table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) +
+				table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) +
+				table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum) -
+				table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
+	}
+
+	template <typename Table>
+	inline MomentSums Top(const Table& table, const Box& cube, Pixel direction, BYTE position)
 	{
 		switch (direction)
 		{
 		case Alpha:
-			return (moment[Index(position, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] -
-				moment[Index(position, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] -
-				moment[Index(position, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] +
-				moment[Index(position, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(moment[Index(position, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(position, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] -
-					moment[Index(position, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(position, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (table.At(position, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum) -
+				table.At(position, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) -
+				table.At(position, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) +
+				table.At(position, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+				(table.At(position, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) -
+					table.At(position, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) -
+					table.At(position, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) +
+					table.At(position, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Red:
-			return (moment[Index(cube.AlphaMaximum, position, cube.GreenMaximum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMaximum, position, cube.GreenMinimum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, position, cube.GreenMaximum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, position, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(moment[Index(cube.AlphaMaximum, position, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMaximum, position, cube.GreenMinimum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, position, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, position, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (table.At(cube.AlphaMaximum, position, cube.GreenMaximum, cube.BlueMaximum) -
+				table.At(cube.AlphaMaximum, position, cube.GreenMinimum, cube.BlueMaximum) -
+				table.At(cube.AlphaMinimum, position, cube.GreenMaximum, cube.BlueMaximum) +
+				table.At(cube.AlphaMinimum, position, cube.GreenMinimum, cube.BlueMaximum)) -
+				(table.At(cube.AlphaMaximum, position, cube.GreenMaximum, cube.BlueMinimum) -
+					table.At(cube.AlphaMaximum, position, cube.GreenMinimum, cube.BlueMinimum) -
+					table.At(cube.AlphaMinimum, position, cube.GreenMaximum, cube.BlueMinimum) +
+					table.At(cube.AlphaMinimum, position, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Green:
-			return (moment[Index(cube.AlphaMaximum, cube.RedMaximum, position, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, position, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, position, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, position, cube.BlueMaximum)]) -
-				(moment[Index(cube.AlphaMaximum, cube.RedMaximum, position, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMaximum, cube.RedMinimum, position, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, position, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, position, cube.BlueMinimum)]);
+			return (table.At(cube.AlphaMaximum, cube.RedMaximum, position, cube.BlueMaximum) -
+				table.At(cube.AlphaMaximum, cube.RedMinimum, position, cube.BlueMaximum) -
+				table.At(cube.AlphaMinimum, cube.RedMaximum, position, cube.BlueMaximum) +
+				table.At(cube.AlphaMinimum, cube.RedMinimum, position, cube.BlueMaximum)) -
+				(table.At(cube.AlphaMaximum, cube.RedMaximum, position, cube.BlueMinimum) -
+					table.At(cube.AlphaMaximum, cube.RedMinimum, position, cube.BlueMinimum) -
+					table.At(cube.AlphaMinimum, cube.RedMaximum, position, cube.BlueMinimum) +
+					table.At(cube.AlphaMinimum, cube.RedMinimum, position, cube.BlueMinimum));
 
 		case Blue:
-			return (moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, position)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, position)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, position)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, position)]) -
-				(moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, position)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, position)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, position)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, position)]);
+			return (table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, position) -
+				table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, position) -
+				table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, position) +
+				table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, position)) -
+				(table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, position) -
+					table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, position) -
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, position) +
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, position));
 
 		default:
-			return 0;
+			return MomentSums();
 		}
 	}
 
-	inline float Bottom(const Box& cube, Pixel direction, long* moment)
+	template <typename Table>
+	inline MomentSums Bottom(const Table& table, const Box& cube, Pixel direction)
 	{
 		switch (direction)
 		{
 		case Alpha:
-			return (-moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(-moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (-table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMaximum) +
+				table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) +
+				table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) -
+				table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+				(-table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) +
+					table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) -
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Red:
-			return (-moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(-moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (-table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) +
+				table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum) +
+				table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMaximum) -
+				table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+				(-table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) +
+					table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum) +
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) -
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Green:
-			return (-moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)] +
-				moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum)] -
-				moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)]) -
-				(-moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (-table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) +
+				table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum) +
+				table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMaximum) -
+				table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMaximum)) -
+				(-table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+					table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum) +
+					table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) -
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		case Blue:
-			return (-moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] -
-				moment[Index(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]) -
-				(-moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum)] +
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum)] -
-					moment[Index(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)]);
+			return (-table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) +
+				table.At(cube.AlphaMaximum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+				table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) -
+				table.At(cube.AlphaMaximum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum)) -
+				(-table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMaximum, cube.BlueMinimum) +
+					table.At(cube.AlphaMinimum, cube.RedMaximum, cube.GreenMinimum, cube.BlueMinimum) +
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMaximum, cube.BlueMinimum) -
+					table.At(cube.AlphaMinimum, cube.RedMinimum, cube.GreenMinimum, cube.BlueMinimum));
 
 		default:
-			return 0;
+			return MomentSums();
 		}
 	}
 
-	void CompileColorData(ColorData& colorData, const Color& color, const BYTE alphaThreshold, const BYTE alphaFader)
+	// The pixel as kept for the remap, with the alpha of translucent pixels faded
+	inline ARGB FadePixel(const Color& color, const BYTE alphaThreshold, const BYTE alphaFader)
 	{
-		BYTE pixelBlue = color.GetB();
-		BYTE pixelGreen = color.GetG();
-		BYTE pixelRed = color.GetR();
 		BYTE pixelAlpha = color.GetA();
+		if (pixelAlpha > alphaThreshold && pixelAlpha < BYTE_MAX) {
+			short alpha = pixelAlpha + (pixelAlpha % alphaFader);
+			pixelAlpha = static_cast<BYTE>(alpha > BYTE_MAX ? BYTE_MAX : alpha);
+		}
+		return Color::MakeARGB(pixelAlpha, color.GetR(), color.GetG(), color.GetB());
+	}
 
-		BYTE indexAlpha = static_cast<BYTE>((pixelAlpha >> SIDEPIXSHIFT) + 1);
-		BYTE indexRed = static_cast<BYTE>((pixelRed >> SIDEPIXSHIFT) + 1);
-		BYTE indexGreen = static_cast<BYTE>((pixelGreen >> SIDEPIXSHIFT) + 1);
-		BYTE indexBlue = static_cast<BYTE>((pixelBlue >> SIDEPIXSHIFT) + 1);
+	void CompileColorData(ColorData& colorData, const ARGB* pixels, const UINT nSize, const BYTE alphaThreshold)
+	{
+		BuildHistogram(pixels, nSize, colorData.histogram.get(), TOTAL_SIDESIZE, [alphaThreshold](const ARGB* pixels, const UINT nSize, int* indices) {
+			for (UINT i = 0; i < nSize; ++i) {
+				Color pixel(pixels[i]);
+				if (pixel.GetA() <= alphaThreshold) {
+					indices[i] = -1;
+					continue;
+				}
 
-		if (pixelAlpha > alphaThreshold) {
-			if (pixelAlpha < BYTE_MAX) {
-				short alpha = pixelAlpha + (pixelAlpha % alphaFader);
-				pixelAlpha = static_cast<BYTE>(alpha > BYTE_MAX ? BYTE_MAX : alpha);
-				indexAlpha = static_cast<BYTE>((pixelAlpha >> 3) + 1);
+				BYTE indexAlpha = static_cast<BYTE>((pixel.GetA() >> SIDEPIXSHIFT) + 1);
+				BYTE indexRed = static_cast<BYTE>((pixel.GetR() >> SIDEPIXSHIFT) + 1);
+				BYTE indexGreen = static_cast<BYTE>((pixel.GetG() >> SIDEPIXSHIFT) + 1);
+				BYTE indexBlue = static_cast<BYTE>((pixel.GetB() >> SIDEPIXSHIFT) + 1);
+				indices[i] = Index(indexAlpha, indexRed, indexGreen, indexBlue);
 			}
+		});
+	}
 
-			const int index = Index(indexAlpha, indexRed, indexGreen, indexBlue);
-			if (index < TOTAL_SIDESIZE) {
-				colorData.weights[index]++;
-				colorData.momentsRed[index] += pixelRed;
-				colorData.momentsGreen[index] += pixelGreen;
-				colorData.momentsBlue[index] += pixelBlue;
-				colorData.momentsAlpha[index] += pixelAlpha;
-				colorData.moments[index] += sqr(pixelAlpha) + sqr(pixelRed) + sqr(pixelGreen) + sqr(pixelBlue);
-			}
-		}
+	// Moves the accumulated histogram into the tables CalculateMoments works on
+	template <typename Table>
+	void LoadHistogram(ColorData& colorData, Table& table)
+	{
+		for (UINT index = 0; index < TOTAL_SIDESIZE; ++index) {
+			const auto& bin = colorData.histogram[index];
+			if (!bin.cnt)
+				continue;
 
-		colorData.AddPixel(Color::MakeARGB(pixelAlpha, pixelRed, pixelGreen, pixelBlue));
+			auto& cell = table.FromHistogram(index);
+			cell.weight += bin.cnt;
+			cell.red += bin.r;
+			cell.green += bin.g;
+			cell.blue += bin.b;
+			LoadAlpha(cell, bin);
+			cell.moment += (float) bin.squares;
+		}
+		colorData.histogram.reset();
 	}
 
-	void BuildHistogram(ColorData& colorData, Bitmap* sourceImage, BYTE alphaThreshold, BYTE alphaFader)
+	void WuQuantizer::FadeStripe(const ARGB* pixels, const UINT nSize, const UINT offset, ARGB* fadedPixels, BYTE alphaThreshold, BYTE alphaFader)
 	{
-		const UINT bitDepth = GetPixelFormatSize(sourceImage->GetPixelFormat());
-		const UINT bitmapWidth = sourceImage->GetWidth();
-		const UINT bitmapHeight = sourceImage->GetHeight();
-
-		int pixelIndex = 0;
-		if (bitDepth <= 16) {
-			for (UINT y = 0; y < bitmapHeight; ++y) {
-				for (UINT x = 0; x < bitmapWidth; ++x, ++pixelIndex) {
-					Color color;
-					sourceImage->GetPixel(x, y, &color);
-					if (color.GetA() < BYTE_MAX) {
-						hasSemiTransparency = true;
-						if (color.GetA() == 0) {
-							m_transparentPixelIndex = pixelIndex;
-							m_transparentColor = color.GetValue();
-						}
-					}
-					CompileColorData(colorData, color, alphaThreshold, alphaFader);
+		for (UINT i = 0; i < nSize; ++i) {
+			Color color(pixels[i]);
+			if (color.GetA() < BYTE_MAX) {
+				hasSemiTransparency = true;
+				if (color.GetA() == 0) {
+					m_transparentPixelIndex = offset + i;
+					m_transparentColor = color.GetValue();
 				}
 			}
-			return;
+			fadedPixels[i] = FadePixel(color, alphaThreshold, alphaFader);
 		}
+	}
 
-		BitmapData data;
-		Status status = sourceImage->LockBits(&Rect(0, 0, bitmapWidth, bitmapHeight), ImageLockModeRead, sourceImage->GetPixelFormat(), &data);
-		if (status != Ok)
-			return;
+	bool WuQuantizer::BuildHistogram(ColorData& colorData, const ARGB* pixels, const UINT width, const UINT height, const int stride, BYTE alphaThreshold, BYTE alphaFader)
+	{
+		hasSemiTransparency = false;
+		m_transparentPixelIndex = -1;
 
-		auto pRowSource = (LPBYTE)data.Scan0;
-		UINT strideSource;
+		if (pixels == nullptr || abs(stride) < (int) (width * sizeof(ARGB))) {
+			cerr << "Invalid pixel buffer" << endl;
+			return false;
+		}
 
-		if (data.Stride > 0) strideSource = data.Stride;
-		else
-		{
-			// Compensate for possible negative stride
-			// (not needed for first loop, but we have to do it
-			// for second loop anyway)
-			pRowSource += bitmapHeight * data.Stride;
-			strideSource = -data.Stride;
+		auto pRowSource = (const BYTE*) pixels;
+		for (UINT y = 0; y < height; ++y) {	// For each row...
+			FadeStripe((const ARGB*) pRowSource, width, y * width, colorData.GetPixels() + y * width, alphaThreshold, alphaFader);
+			pRowSource += stride;
 		}
+		CompileColorData(colorData, colorData.GetPixels(), width * height, alphaThreshold);
+		return true;
+	}
 
-		// First loop: gather color information
-		for (UINT y = 0; y < bitmapHeight; ++y)	// For each row...
-		{
-			auto pPixelSource = pRowSource;
+#ifdef _WIN32
+	bool WuQuantizer::BuildHistogram(ColorData& colorData, Bitmap* sourceImage, BYTE alphaThreshold, BYTE alphaFader)
+	{
+		hasSemiTransparency = false;
+		m_transparentPixelIndex = -1;
+
+		// Decoded straight into the colour data, then faded in place
+		auto pixels = colorData.GetPixels();
+		const UINT pixelsCount = sourceImage->GetWidth() * sourceImage->GetHeight();
+		if (!ReadPixels(sourceImage, pixels)) {
+			cerr << "Cannot read source pixels" << endl;
+			return false;
+		}
 
-			for (UINT x = 0; x < bitmapWidth; ++x, ++pixelIndex)	// ...for each pixel...
-			{
-				BYTE pixelBlue = *pPixelSource++;
-				BYTE pixelGreen = *pPixelSource++;
-				BYTE pixelRed = *pPixelSource++;
-				BYTE pixelAlpha = bitDepth < 32 ? BYTE_MAX : *pPixelSource++;
-
-				Color color(Color::MakeARGB(pixelAlpha, pixelRed, pixelGreen, pixelBlue));
-				if (pixelAlpha < BYTE_MAX) {
-					hasSemiTransparency = true;
-					if (pixelAlpha == 0) {
-						m_transparentPixelIndex = pixelIndex;
-						m_transparentColor = color.GetValue();
-					}
-				}
-				CompileColorData(colorData, color, alphaThreshold, alphaFader);
+		FadeStripe(pixels, pixelsCount, 0, pixels, alphaThreshold, alphaFader);
+		CompileColorData(colorData, pixels, pixelsCount, alphaThreshold);
+		return true;
+	}
+#endif // _WIN32
+
+	template <typename T>
+	inline void LoadAlpha(MomentCell<T, true>& cell, const HistogramBin& bin)
+	{
+		cell.alpha += bin.a;
+	}
+
+	template <typename T>
+	inline void LoadAlpha(MomentCell<T, false>& cell, const HistogramBin& bin)
+	{
+	}
+
+	// Pixels remapped per thread at least when looking up box tags
+	const UINT MIN_REMAP_PIXELS_PER_THREAD = 1 << 16;
+	// Cells a scan needs per thread before spreading over more threads pays off
+	const UINT MIN_SCAN_CELLS_PER_THREAD = 1 << 16;
+	// Cells of a row added along one axis before moving to the next row, so that
+	// the row just written is still cached when the next one adds it
+	const UINT SCAN_BLOCK = 1024;
+
+	// Adds count words of prev to row. The rows are cells of cellWords 32-bit words,
+	// all UINT sums apart from the float moment which comes last.
+	typedef void (*AddWordsFn)(UINT* row, const UINT* prev, const UINT count, const UINT cellWords);
+
+	static void AddWords(UINT* row, const UINT* prev, const UINT count, const UINT cellWords)
+	{
+		for (UINT i = 0; i < count; ++i) {
+			if (i % cellWords == cellWords - 1) {
+				float moment;
+				memcpy(&moment, row + i, sizeof(float));
+				float prevMoment;
+				memcpy(&prevMoment, prev + i, sizeof(float));
+				moment += prevMoment;
+				memcpy(row + i, &moment, sizeof(float));
 			}
+			else
+				row[i] += prev[i];
+		}
+	}
 
-			pRowSource += strideSource;
+#ifdef NQUANT_X86
+	// Lanes of the float moments for a vector starting phase words into a cell.
+	// Only those lanes are added as floats, the integer sums would read as denormals.
+	static void GetMomentLanes(const UINT cellWords, int* lanes, const UINT count)
+	{
+		for (UINT i = 0; i < count; ++i)
+			lanes[i] = i % cellWords == cellWords - 1 ? -1 : 0;
+	}
+
+	static void AddWordsSSE2(UINT* row, const UINT* prev, const UINT count, const UINT cellWords)
+	{
+		int lanes[16];
+		GetMomentLanes(cellWords, lanes, cellWords + 4);
+
+		UINT i = 0, phase = 0;
+		for (; i + 4 <= count; i += 4) {
+			const __m128i a = _mm_loadu_si128((const __m128i*) (row + i));
+			const __m128i b = _mm_loadu_si128((const __m128i*) (prev + i));
+			const __m128 mask = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) (lanes + phase)));
+			const __m128 moments = _mm_add_ps(_mm_and_ps(mask, _mm_castsi128_ps(a)), _mm_and_ps(mask, _mm_castsi128_ps(b)));
+			const __m128 sums = _mm_andnot_ps(mask, _mm_castsi128_ps(_mm_add_epi32(a, b)));
+			_mm_storeu_si128((__m128i*) (row + i), _mm_castps_si128(_mm_or_ps(moments, sums)));
+			phase = (phase + 4) % cellWords;
 		}
+		AddWords(row + i, prev + i, count - i, cellWords);
+	}
 
-		sourceImage->UnlockBits(&data);
+	TARGET_AVX2 static void AddWordsAVX2(UINT* row, const UINT* prev, const UINT count, const UINT cellWords)
+	{
+		int lanes[16];
+		GetMomentLanes(cellWords, lanes, cellWords + 8);
+
+		UINT i = 0, phase = 0;
+		for (; i + 8 <= count; i += 8) {
+			const __m256i a = _mm256_loadu_si256((const __m256i*) (row + i));
+			const __m256i b = _mm256_loadu_si256((const __m256i*) (prev + i));
+			const __m256 mask = _mm256_castsi256_ps(_mm256_loadu_si256((const __m256i*) (lanes + phase)));
+			const __m256 moments = _mm256_add_ps(_mm256_and_ps(mask, _mm256_castsi256_ps(a)), _mm256_and_ps(mask, _mm256_castsi256_ps(b)));
+			const __m256 sums = _mm256_castsi256_ps(_mm256_add_epi32(a, b));
+			_mm256_storeu_si256((__m256i*) (row + i), _mm256_castps_si256(_mm256_blendv_ps(sums, moments, mask)));
+			phase = (phase + 8) % cellWords;
+		}
+		AddWords(row + i, prev + i, count - i, cellWords);
 	}
+#endif // NQUANT_X86
 
-	void CalculateMoments(ColorData& data)
+	static AddWordsFn SelectAddWordsFn()
 	{
-		const UINT SIDESIZE_3 = SIDESIZE * SIDESIZE * SIDESIZE;
-		for (BYTE alphaIndex = 1; alphaIndex <= MAXSIDEINDEX; ++alphaIndex)
-		{
-			auto xarea = make_unique<UINT[]>(SIDESIZE_3);
-			auto xareaAlpha = make_unique<UINT[]>(SIDESIZE_3);
-			auto xareaRed = make_unique<UINT[]>(SIDESIZE_3);
-			auto xareaGreen = make_unique<UINT[]>(SIDESIZE_3);
-			auto xareaBlue = make_unique<UINT[]>(SIDESIZE_3);
-			auto xarea2 = make_unique<float[]>(SIDESIZE_3);
-
-			for (BYTE redIndex = 1; redIndex <= MAXSIDEINDEX; ++redIndex)
-			{
-				UINT area[SIDESIZE] = { 0 };
-				UINT areaAlpha[SIDESIZE] = { 0 };
-				UINT areaRed[SIDESIZE] = { 0 };
-				UINT areaGreen[SIDESIZE] = { 0 };
-				UINT areaBlue[SIDESIZE] = { 0 };
-				float area2[SIDESIZE] = { 0 };
-
-				for (BYTE greenIndex = 1; greenIndex <= MAXSIDEINDEX; ++greenIndex) {
-					volatile UINT line = 0;
-					volatile UINT lineAlpha = 0;
-					volatile UINT lineRed = 0;
-					volatile UINT lineGreen = 0;
-					volatile UINT lineBlue = 0;
-					volatile float line2 = 0.0f;
-
-					for (BYTE blueIndex = 1; blueIndex <= MAXSIDEINDEX; ++blueIndex) {
-						const UINT index = Index(alphaIndex, redIndex, greenIndex, blueIndex);
-						line += data.weights[index];
-						lineAlpha += data.momentsAlpha[index];
-						lineRed += data.momentsRed[index];
-						lineGreen += data.momentsGreen[index];
-						lineBlue += data.momentsBlue[index];
-						line2 += data.moments[index];
-
-						area[blueIndex] += line;
-						areaAlpha[blueIndex] += lineAlpha;
-						areaRed[blueIndex] += lineRed;
-						areaGreen[blueIndex] += lineGreen;
-						areaBlue[blueIndex] += lineBlue;
-						area2[blueIndex] += line2;
-
-						const UINT rgbIndex = Index(redIndex, greenIndex, blueIndex);
-						const UINT prevRgbIndex = Index(redIndex - 1, greenIndex, blueIndex);
-						xarea[rgbIndex] = xarea[prevRgbIndex] + area[blueIndex];
-						xareaAlpha[rgbIndex] = xareaAlpha[prevRgbIndex] + areaAlpha[blueIndex];
-						xareaRed[rgbIndex] = xareaRed[prevRgbIndex] + areaRed[blueIndex];
-						xareaGreen[rgbIndex] = xareaGreen[prevRgbIndex] + areaGreen[blueIndex];
-						xareaBlue[rgbIndex] = xareaBlue[prevRgbIndex] + areaBlue[blueIndex];
-						xarea2[rgbIndex] = xarea2[prevRgbIndex] + area2[blueIndex];
-
-						const UINT prevIndex = Index(alphaIndex - 1, redIndex, greenIndex, blueIndex);
-						data.weights[index] = data.weights[prevIndex] + xarea[rgbIndex];
-						data.momentsAlpha[index] = data.momentsAlpha[prevIndex] + xareaAlpha[rgbIndex];
-						data.momentsRed[index] = data.momentsRed[prevIndex] + xareaRed[rgbIndex];
-						data.momentsGreen[index] = data.momentsGreen[prevIndex] + xareaGreen[rgbIndex];
-						data.momentsBlue[index] = data.momentsBlue[prevIndex] + xareaBlue[rgbIndex];
-						data.moments[index] = data.moments[prevIndex] + xarea2[rgbIndex];
-					}
+#ifdef NQUANT_X86
+		if (HasAVX2())
+			return AddWordsAVX2;
+		return AddWordsSSE2;
+#else
+		return AddWords;
+#endif
+	}
+
+	static const AddWordsFn addWords = SelectAddWordsFn();
+
+	template <typename Cell>
+	inline void AddRow(Cell* row, const Cell* prev, const UINT count)
+	{
+		for (UINT i = 0; i < count; ++i)
+			row[i].Add(prev[i]);
+	}
+
+	// 32-bit cells are added a vector of words at a time across their channels
+	template <bool hasAlpha>
+	inline void AddRow(MomentCell<UINT, hasAlpha>* row, const MomentCell<UINT, hasAlpha>* prev, const UINT count)
+	{
+		const UINT cellWords = sizeof(MomentCell<UINT, hasAlpha>) / sizeof(UINT);
+		static_assert(sizeof(MomentCell<UINT, hasAlpha>) % sizeof(UINT) == 0, "Moment cells must be whole words");
+		addWords((UINT*) row, (const UINT*) prev, count * cellWords, cellWords);
+	}
+
+	// Inclusive scan along the axis whose neighbouring cells are stride cells apart
+	template <typename Cell>
+	void ScanAxis(Cell* cells, const UINT nCells, const UINT stride)
+	{
+		const UINT lineCells = stride * SIDESIZE;
+		const UINT blocks = (stride + SCAN_BLOCK - 1) / SCAN_BLOCK;
+		const UINT items = nCells / lineCells * blocks;
+		auto scan = [&](const UINT begin, const UINT end) {
+			for (UINT item = begin; item < end; ++item) {
+				auto line = cells + item / blocks * lineCells;
+				if (stride == 1) {
+					for (UINT k = 1; k < SIDESIZE; ++k)
+						line[k].Add(line[k - 1]);
+					continue;
 				}
+
+				const UINT first = item % blocks * SCAN_BLOCK;
+				const UINT count = min(SCAN_BLOCK, stride - first);
+				for (UINT k = 1; k < SIDESIZE; ++k)
+					AddRow(line + k * stride + first, line + (k - 1) * stride + first, count);
 			}
-		}
+		};
+
+		const UINT nThreads = max(min(min(thread::hardware_concurrency(), nCells / MIN_SCAN_CELLS_PER_THREAD), items), 1U);
+		const UINT chunk = (items + nThreads - 1) / nThreads;
+		vector<thread> workers;
+		for (UINT t = 1; t < nThreads; ++t)
+			workers.emplace_back(scan, min(items, t * chunk), min(items, (t + 1) * chunk));
+		scan(0, min(items, chunk));
+		for (auto& worker : workers)
+			worker.join();
 	}
 
-	CubeCut Maximize(const ColorData& data, const Box& cube, Pixel direction, BYTE first, BYTE last, UINT wholeAlpha, UINT wholeRed, UINT wholeGreen, UINT wholeBlue, UINT wholeWeight)
+	// Scanning along blue, green, red and then alpha adds every sum, the float moments
+	// included, in the same order as running line, area and volume totals cell by cell.
+	// Cells with any index 0 stay zero.
+	template <typename Table>
+	void CalculateMoments(Table& table)
 	{
-		auto bottomAlpha = Bottom(cube, direction, data.momentsAlpha.get());
-		auto bottomRed = Bottom(cube, direction, data.momentsRed.get());
-		auto bottomGreen = Bottom(cube, direction, data.momentsGreen.get());
-		auto bottomBlue = Bottom(cube, direction, data.momentsBlue.get());
-		auto bottomWeight = Bottom(cube, direction, data.weights.get());
+		const UINT nCells = (UINT) table.cells.size();
+		for (UINT stride = nCells / SIDESIZE; stride > 0; stride /= SIDESIZE)
+			ScanAxis(table.cells.data(), nCells, stride);
+	}
+
+	template <typename Table>
+	CubeCut Maximize(const Table& table, const Box& cube, Pixel direction, BYTE first, BYTE last, UINT wholeAlpha, UINT wholeRed, UINT wholeGreen, UINT wholeBlue, UINT wholeWeight)
+	{
+		// Nothing can be cut along alpha without translucent pixels
+		if (!Table::HAS_ALPHA && direction == Alpha)
+			return CubeCut(false, 0, 0.0f);
+
+		auto bottom = Bottom(table, cube, direction);
+		float bottomAlpha = bottom.alpha;
+		float bottomRed = bottom.red;
+		float bottomGreen = bottom.green;
+		float bottomBlue = bottom.blue;
+		float bottomWeight = bottom.weight;
 
 		volatile bool valid = false;
 		volatile auto result = 0.0f;
@@ -437,11 +627,12 @@ namespace nQuant
 #pragma omp parallel for
 		for (int position = first; position < last; ++position)
 		{
-			auto halfAlpha = bottomAlpha + Top(cube, direction, position, data.momentsAlpha.get());
-			auto halfRed = bottomRed + Top(cube, direction, position, data.momentsRed.get());
-			auto halfGreen = bottomGreen + Top(cube, direction, position, data.momentsGreen.get());
-			auto halfBlue = bottomBlue + Top(cube, direction, position, data.momentsBlue.get());
-			auto halfWeight = bottomWeight + Top(cube, direction, position, data.weights.get());
+			auto top = Top(table, cube, direction, position);
+			auto halfAlpha = bottomAlpha + (float) top.alpha;
+			auto halfRed = bottomRed + (float) top.red;
+			auto halfGreen = bottomGreen + (float) top.green;
+			auto halfBlue = bottomBlue + (float) top.blue;
+			auto halfWeight = bottomWeight + (float) top.weight;
 
 			if (halfWeight == 0)
 				continue;
@@ -470,18 +661,20 @@ namespace nQuant
 		return CubeCut(valid, cutPoint, result);
 	}
 
-	bool Cut(const ColorData& data, Box& first, Box& second)
+	template <typename Table>
+	bool Cut(const Table& table, Box& first, Box& second)
 	{
-		auto wholeAlpha = Volume(first, data.momentsAlpha.get());
-		auto wholeRed = Volume(first, data.momentsRed.get());
-		auto wholeGreen = Volume(first, data.momentsGreen.get());
-		auto wholeBlue = Volume(first, data.momentsBlue.get());
-		auto wholeWeight = Volume(first, data.weights.get());
-
-		auto maxAlpha = Maximize(data, first, Alpha, static_cast<BYTE>(first.AlphaMinimum + 1), first.AlphaMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
-		auto maxRed = Maximize(data, first, Red, static_cast<BYTE>(first.RedMinimum + 1), first.RedMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
-		auto maxGreen = Maximize(data, first, Green, static_cast<BYTE>(first.GreenMinimum + 1), first.GreenMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
-		auto maxBlue = Maximize(data, first, Blue, static_cast<BYTE>(first.BlueMinimum + 1), first.BlueMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
+		auto whole = Volume(table, first);
+		float wholeAlpha = whole.alpha;
+		float wholeRed = whole.red;
+		float wholeGreen = whole.green;
+		float wholeBlue = whole.blue;
+		float wholeWeight = whole.weight;
+
+		auto maxAlpha = Maximize(table, first, Alpha, static_cast<BYTE>(first.AlphaMinimum + 1), first.AlphaMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
+		auto maxRed = Maximize(table, first, Red, static_cast<BYTE>(first.RedMinimum + 1), first.RedMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
+		auto maxGreen = Maximize(table, first, Green, static_cast<BYTE>(first.GreenMinimum + 1), first.GreenMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
+		auto maxBlue = Maximize(table, first, Blue, static_cast<BYTE>(first.BlueMinimum + 1), first.BlueMaximum, wholeAlpha, wholeRed, wholeGreen, wholeBlue, wholeWeight);
 
 		Pixel direction = Blue;
 		if ((maxAlpha.value >= maxRed.value) && (maxAlpha.value >= maxGreen.value) && (maxAlpha.value >= maxBlue.value)) {
@@ -536,21 +729,24 @@ namespace nQuant
 		return true;
 	}
 
-	float CalculateVariance(const ColorData& data, const Box& cube)
+	template <typename Table>
+	float CalculateVariance(const Table& table, const Box& cube)
 	{
-		auto volumeAlpha = Volume(cube, data.momentsAlpha.get());
-		auto volumeRed = Volume(cube, data.momentsRed.get());
-		auto volumeGreen = Volume(cube, data.momentsGreen.get());
-		auto volumeBlue = Volume(cube, data.momentsBlue.get());
-		auto volumeMoment = Volume(cube, data.moments.get());
-		auto volumeWeight = Volume(cube, data.weights.get());
+		auto volume = Volume(table, cube);
+		float volumeAlpha = volume.alpha;
+		float volumeRed = volume.red;
+		float volumeGreen = volume.green;
+		float volumeBlue = volume.blue;
+		float volumeMoment = volume.moment;
+		float volumeWeight = volume.weight;
 
 		float distance = sqr(volumeAlpha) + sqr(volumeRed) + sqr(volumeGreen) + sqr(volumeBlue);
 
 		return volumeWeight != 0.0f ? (volumeMoment - distance / volumeWeight) : 0.0f;
 	}
 
-	void SplitData(vector<Box>& boxList, UINT& colorCount, ColorData& data)
+	template <typename Table>
+	void SplitData(vector<Box>& boxList, UINT& colorCount, const Table& table)
 	{
 		int next = 0;
 		auto volumeVariance = make_unique<float[]>(colorCount);
@@ -561,9 +757,9 @@ namespace nQuant
 		boxList[0].BlueMaximum = MAXSIDEINDEX;
 
 		for (int cubeIndex = 1; cubeIndex < colorCount; ++cubeIndex) {
-			if (Cut(data, boxList[next], boxList[cubeIndex])) {
-				volumeVariance[next] = boxList[next].Size > 1 ? CalculateVariance(data, boxList[next]) : 0.0f;
-				volumeVariance[cubeIndex] = boxList[cubeIndex].Size > 1 ? CalculateVariance(data, boxList[cubeIndex]) : 0.0f;
+			if (Cut(table, boxList[next], boxList[cubeIndex])) {
+				volumeVariance[next] = boxList[next].Size > 1 ? CalculateVariance(table, boxList[next]) : 0.0f;
+				volumeVariance[cubeIndex] = boxList[cubeIndex].Size > 1 ? CalculateVariance(table, boxList[cubeIndex]) : 0.0f;
 			}
 			else {
 				volumeVariance[next] = 0.0f;
@@ -589,25 +785,96 @@ namespace nQuant
 		boxList.resize(colorCount);
 	}
 
-	void BuildLookups(ColorPalette* pPalette, vector<Box>& cubes, const ColorData& data)
+	// Labels the cells of the table inside the box with tag
+	template <typename Table>
+	void TagBox(vector<unsigned short>& tags, const Box& cube, const unsigned short tag)
 	{
-		volatile UINT lookupsCount = 0;
-		if (m_transparentPixelIndex >= 0) {
-			pPalette->Entries[lookupsCount] = m_transparentColor;
-			++lookupsCount;
+		for (BYTE blue = cube.BlueMinimum + 1; blue <= cube.BlueMaximum; ++blue) {
+			for (BYTE green = cube.GreenMinimum + 1; green <= cube.GreenMaximum; ++green) {
+				for (BYTE red = cube.RedMinimum + 1; red <= cube.RedMaximum; ++red) {
+					if (!Table::HAS_ALPHA) {
+						tags[Index(red, green, blue)] = tag;
+						continue;
+					}
+
+					for (BYTE alpha = cube.AlphaMinimum + 1; alpha <= cube.AlphaMaximum; ++alpha)
+						tags[Index(alpha, red, green, blue)] = tag;
+				}
+			}
 		}
-			
+	}
+
+	// Splits the histogram into at most colorCount boxes and returns their mean colours.
+	// Unless tags is null, each cell of a box is tagged with firstTag plus the index of
+	// its colour, and tagsHaveAlpha tells whether the tags cover the alpha slices.
+	template <typename Table>
+	void SplitColors(ColorData& colorData, UINT& colorCount, vector<ARGB>& colors, vector<unsigned short>* tags, const unsigned short firstTag, bool& tagsHaveAlpha)
+	{
+		Table table;
+		LoadHistogram(colorData, table);
+		CalculateMoments(table);
+		vector<Box> cubes;
+		SplitData(cubes, colorCount, table);
+
+		if (tags) {
+			tags->assign(table.cells.size(), 0);
+			tagsHaveAlpha = Table::HAS_ALPHA;
+		}
+
 		for (auto const& cube : cubes) {
-			auto weight = Volume(cube, data.weights.get());
+			auto volume = Volume(table, cube);
+			float weight = volume.weight;
 
 			if (weight <= 0)
 				continue;
 
-			BYTE alpha = static_cast<BYTE>(Volume(cube, data.momentsAlpha.get()) / weight);
-			BYTE red = static_cast<BYTE>(Volume(cube, data.momentsRed.get()) / weight);
-			BYTE green = static_cast<BYTE>(Volume(cube, data.momentsGreen.get()) / weight);
-			BYTE blue = static_cast<BYTE>(Volume(cube, data.momentsBlue.get()) / weight);
-			pPalette->Entries[lookupsCount] = Color::MakeARGB(alpha, red, green, blue);
+			if (tags)
+				TagBox<Table>(*tags, cube, static_cast<unsigned short>(firstTag + colors.size()));
+
+			BYTE alpha = static_cast<BYTE>(volume.alpha / weight);
+			BYTE red = static_cast<BYTE>(volume.red / weight);
+			BYTE green = static_cast<BYTE>(volume.green / weight);
+			BYTE blue = static_cast<BYTE>(volume.blue / weight);
+			colors.emplace_back(Color::MakeARGB(alpha, red, green, blue));
+		}
+	}
+
+	// Picks the smallest moment table the histogram fits in. Opaque images need only
+	// the RGB cube, and 32-bit sums suffice while BYTE_MAX times the pixel count does.
+	void SplitColors(ColorData& colorData, UINT& colorCount, vector<ARGB>& colors, vector<unsigned short>* tags, const unsigned short firstTag, bool& tagsHaveAlpha)
+	{
+		unsigned long long pixelsCount = 0;
+		bool opaque = true;
+		for (UINT index = 0; index < TOTAL_SIDESIZE; ++index) {
+			const auto& bin = colorData.histogram[index];
+			pixelsCount += bin.cnt;
+			if (bin.a != BYTE_MAX * (unsigned long long) bin.cnt)
+				opaque = false;
+		}
+
+		const bool narrow = pixelsCount * BYTE_MAX <= UINT_MAX;
+		if (opaque) {
+			if (narrow)
+				SplitColors<MomentTable<UINT, false> >(colorData, colorCount, colors, tags, firstTag, tagsHaveAlpha);
+			else
+				SplitColors<MomentTable<unsigned long long, false> >(colorData, colorCount, colors, tags, firstTag, tagsHaveAlpha);
+		}
+		else if (narrow)
+			SplitColors<MomentTable<UINT, true> >(colorData, colorCount, colors, tags, firstTag, tagsHaveAlpha);
+		else
+			SplitColors<MomentTable<unsigned long long, true> >(colorData, colorCount, colors, tags, firstTag, tagsHaveAlpha);
+	}
+
+	void WuQuantizer::BuildLookups(ColorPalette* pPalette, const vector<ARGB>& colors)
+	{
+		UINT lookupsCount = 0;
+		if (m_transparentPixelIndex >= 0) {
+			pPalette->Entries[lookupsCount] = m_transparentColor;
+			++lookupsCount;
+		}
+
+		for (auto color : colors) {
+			pPalette->Entries[lookupsCount] = color;
 			++lookupsCount;
 		}
 
@@ -615,13 +882,12 @@ namespace nQuant
 			pPalette->Count = lookupsCount;
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short WuQuantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		UINT k = 0;
 		Color c(argb);
-		vector<unsigned short> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		unsigned short closest[5] = { 0 };
+		if (!closestMap.Find(argb, closest)) {
 			closest[2] = closest[3] = SHORT_MAX;
 
 			for (; k < nMaxColors; k++) {
@@ -641,20 +907,18 @@ namespace nQuant
 
 			if (closest[3] == SHORT_MAX)
 				closest[2] = 0;
+
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next(closest[3] + closest[2]) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
-
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const ARGB argb, const BYTE alphaThreshold)
+	unsigned short WuQuantizer::nearestColorIndex(const ColorPalette* pPalette, const ARGB argb, const BYTE alphaThreshold)
 	{
 		Color c(argb);
 		unsigned short k = 0;
@@ -663,29 +927,7 @@ namespace nQuant
 
 		auto got = rightMatches.find(argb);
 		if (got == rightMatches.end()) {
-			double mindist = INT_MAX;
-			for (UINT i = 0; i < pPalette->Count; i++) {
-				Color c2(pPalette->Entries[i]);
-				double curdist = sqr(c2.GetA() - c.GetA());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PR * sqr(c2.GetR() - c.GetR());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PG * sqr(c2.GetG() - c.GetG());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PB * sqr(c2.GetB() - c.GetB());
-				if (curdist > mindist)
-					continue;
-
-				mindist = curdist;
-				k = i;
-			}
-
+			k = m_paletteIndex.Nearest(pPalette, pPalette->Count, argb, PR, PG, PB);
 			rightMatches[argb] = k;
 		}
 		else
@@ -694,31 +936,74 @@ namespace nQuant
 		return k;
 	}
 
-	void GetQuantizedPalette(const ColorData& data, ColorPalette* pPalette, const UINT colorCount, const BYTE alphaThreshold)
+	// Palette entry of the box the pixel falls in, 0 at or below the alpha threshold
+	unsigned short WuQuantizer::tagColorIndex(const ARGB argb, const BYTE alphaThreshold) const
 	{
-		auto alphas = make_unique<UINT[]>(colorCount);
-		auto reds = make_unique<UINT[]>(colorCount);
-		auto greens = make_unique<UINT[]>(colorCount);
-		auto blues = make_unique<UINT[]>(colorCount);
-		auto sums = make_unique<UINT[]>(colorCount);
+		Color c(argb);
+		if (c.GetA() <= alphaThreshold)
+			return 0;
 
-		int pixelsCount = data.pixelsCount;
+		const BYTE indexRed = static_cast<BYTE>((c.GetR() >> SIDEPIXSHIFT) + 1);
+		const BYTE indexGreen = static_cast<BYTE>((c.GetG() >> SIDEPIXSHIFT) + 1);
+		const BYTE indexBlue = static_cast<BYTE>((c.GetB() >> SIDEPIXSHIFT) + 1);
+		if (!m_tagsHaveAlpha)
+			return m_tags[Index(indexRed, indexGreen, indexBlue)];
+
+		const BYTE indexAlpha = static_cast<BYTE>((c.GetA() >> SIDEPIXSHIFT) + 1);
+		return m_tags[Index(indexAlpha, indexRed, indexGreen, indexBlue)];
+	}
 
-		for (UINT pixelIndex = 0; pixelIndex < pixelsCount; ++pixelIndex) {
-			auto argb = data.pixels[pixelIndex];
+	unsigned short WuQuantizer::remapColorIndex(const ColorPalette* pPalette, const ARGB argb, const BYTE alphaThreshold)
+	{
+		if (m_tags.empty())
+			return nearestColorIndex(pPalette, argb, alphaThreshold);
+		return tagColorIndex(argb, alphaThreshold);
+	}
+
+	void WuQuantizer::RemapTags(const ARGB* pixels, unsigned short* qPixels, const UINT nSize, const BYTE alphaThreshold) const
+	{
+		auto remap = [&](const UINT begin, const UINT end) {
+			for (UINT i = begin; i < end; ++i)
+				qPixels[i] = tagColorIndex(pixels[i], alphaThreshold);
+		};
+
+		const UINT nThreads = max(min(thread::hardware_concurrency(), nSize / MIN_REMAP_PIXELS_PER_THREAD), 1U);
+		const UINT chunk = nSize / nThreads;
+		vector<thread> workers;
+		for (UINT t = 1; t < nThreads; ++t)
+			workers.emplace_back(remap, t * chunk, t + 1 < nThreads ? (t + 1) * chunk : nSize);
+		remap(0, nThreads > 1 ? chunk : nSize);
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	void WuQuantizer::AddPaletteSums(PaletteSums& paletteSums, const ColorPalette* pPalette, const ARGB* pixels, const UINT nSize, const BYTE alphaThreshold)
+	{
+		for (UINT pixelIndex = 0; pixelIndex < nSize; ++pixelIndex) {
+			auto argb = pixels[pixelIndex];
 			Color pixel(argb);
 			if (pixel.GetA() <= alphaThreshold)
 				continue;
 
-			UINT bestMatch = nearestColorIndex(pPalette, argb, alphaThreshold);
+			UINT bestMatch = remapColorIndex(pPalette, argb, alphaThreshold);
 
-			alphas[bestMatch] += pixel.GetA();
-			reds[bestMatch] += pixel.GetR();
-			greens[bestMatch] += pixel.GetG();
-			blues[bestMatch] += pixel.GetB();
-			sums[bestMatch]++;
+			paletteSums.alphas[bestMatch] += pixel.GetA();
+			paletteSums.reds[bestMatch] += pixel.GetR();
+			paletteSums.greens[bestMatch] += pixel.GetG();
+			paletteSums.blues[bestMatch] += pixel.GetB();
+			paletteSums.sums[bestMatch]++;
 		}
+	}
+
+	void WuQuantizer::GetQuantizedPalette(PaletteSums& paletteSums, ColorPalette* pPalette, const UINT colorCount)
+	{
+		auto alphas = paletteSums.alphas.get();
+		auto reds = paletteSums.reds.get();
+		auto greens = paletteSums.greens.get();
+		auto blues = paletteSums.blues.get();
+		auto sums = paletteSums.sums.get();
 		rightMatches.clear();
+		m_paletteIndex.Clear();
 
 		short paletteIndex = (m_transparentPixelIndex < 0) ? 0 : 1;
 		for (; paletteIndex < colorCount; ++paletteIndex) {
@@ -733,22 +1018,21 @@ namespace nQuant
 		}
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, BYTE alphaThreshold)
+	bool WuQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, BYTE alphaThreshold, DitherState& state)
 	{
+		if (dither && state.mode != DitherMode::ErrorDiffusion)
+			return dither_image(pixels, pPalette, [this, alphaThreshold](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return remapColorIndex(pPalette, argb, alphaThreshold); }, hasSemiTransparency, pPalette->Count, qPixels, width, height, state);
+
 		if (dither) {
-			bool odd_scanline = false;
 			short *thisrowerr, *nextrowerr;
 			constexpr BYTE DJ = 4;
 			constexpr BYTE DITHER_MAX = 20;
-			const int err_len = (width + 2) * DJ;
 			BYTE range_tbl[DJ * 256] = { 0 };
 			auto range = &range_tbl[256];
-			auto erowErr = make_unique<short[]>(err_len);
-			auto orowErr = make_unique<short[]>(err_len);
 			char dith_max_tbl[512] = { 0 };
 			auto dith_max = &dith_max_tbl[256];
-			auto erowerr = erowErr.get();
-			auto orowerr = orowErr.get();
+			auto erowerr = state.erowErr.data();
+			auto orowerr = state.orowErr.data();
 
 			for (int i = 0; i < 256; i++) {
 				range_tbl[i] = 0;
@@ -765,16 +1049,17 @@ namespace nQuant
 				dith_max_tbl[i + 256] = i;
 
 			UINT pixelIndex = 0;
-			for (int i = 0; i < height; i++) {
+			for (UINT i = 0; i < height; i++) {
 				int dir;
-				if (odd_scanline) {
+				if (state.odd_scanline) {
 					dir = -1;
-					pixelIndex += (width - 1);
+					pixelIndex = i * width + (width - 1);
 					thisrowerr = orowerr + DJ;
 					nextrowerr = erowerr + width * DJ;
 				}
 				else {
 					dir = 1;
+					pixelIndex = i * width;
 					thisrowerr = erowerr + DJ;
 					nextrowerr = orowerr + width * DJ;
 				}
@@ -788,7 +1073,7 @@ namespace nQuant
 					int b_pix = range[((thisrowerr[3] + 8) >> 4) + c.GetB()];
 
 					ARGB argb = Color::MakeARGB(a_pix, r_pix, g_pix, b_pix);
-					qPixels[pixelIndex] = nearestColorIndex(pPalette, c.GetA() ? argb : pixels[pixelIndex], alphaThreshold);
+					qPixels[pixelIndex] = remapColorIndex(pPalette, c.GetA() ? argb : pixels[pixelIndex], alphaThreshold);
 
 					Color c2(pPalette->Entries[qPixels[pixelIndex]]);
 					a_pix = dith_max[a_pix - c2.GetA()];
@@ -836,58 +1121,181 @@ namespace nQuant
 					nextrowerr -= DJ;
 					pixelIndex += dir;
 				}
-				if ((i % 2) == 1)
-					pixelIndex += (width + 1);
 
-				odd_scanline = !odd_scanline;
+				state.odd_scanline = !state.odd_scanline;
 			}
 			return true;
 		}
 
+		if (!m_tags.empty()) {
+			RemapTags(pixels, qPixels, width * height, alphaThreshold);
+			return true;
+		}
+		if (m_colormapRemap && state.pColormap && state.pColormap->IsBuilt()) {
+			state.pColormap->Remap(pixels, width * height, qPixels);
+			return true;
+		}
+
 		for (int i = 0; i < (width * height); ++i)
 			qPixels[i] = closestColorIndex(pPalette, pPalette->Count, pixels[i]);
 
 		return true;
 	}
 	
-	bool WuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader)
+	void WuQuantizer::BuildCubes(ColorData& colorData, ColorPalette* pPalette, UINT& nMaxColors)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		m_paletteIndex.Clear();
+		m_tags.clear();
+		vector<ARGB> colors;
+		// The transparent entry, when there is one, takes the first of the nMaxColors
+		const unsigned short firstTag = m_transparentPixelIndex >= 0 ? 1 : 0;
+		UINT colorCount = nMaxColors - firstTag;
+		SplitColors(colorData, colorCount, colors, m_nearestRemap ? nullptr : &m_tags, firstTag, m_tagsHaveAlpha);
+		BuildLookups(pPalette, colors);
+
+		nMaxColors = pPalette->Count;
+	}
 
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
-		pPalette->Count = nMaxColors;
+	void WuQuantizer::BuildPalette(ColorData& colorData, ColorPalette* pPalette, UINT& nMaxColors, const BYTE alphaThreshold)
+	{
+		BuildCubes(colorData, pPalette, nMaxColors);
+
+		PaletteSums paletteSums(nMaxColors);
+		AddPaletteSums(paletteSums, pPalette, colorData.GetPixels(), colorData.pixelsCount, alphaThreshold);
+		GetQuantizedPalette(paletteSums, pPalette, nMaxColors);
+	}
+
+	bool WuQuantizer::QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, BYTE alphaThreshold)
+	{
+		if (nMaxColors <= 2) {
+			m_paletteIndex.Clear();
+			m_tags.clear();
+			if (m_transparentPixelIndex >= 0) {
+				pPalette->Entries[0] = m_transparentColor;
+				pPalette->Entries[1] = Color::Black;
+			}
+			else {
+				pPalette->Entries[0] = Color::Black;
+				pPalette->Entries[1] = Color::White;
+			}
+		}
+		else if (nMaxColors > 256) {
+			// The threaded modes search each colour for its nearest entry instead
+			InverseColormap colormap;
+			if (IsThreadedDither(m_ditherMode))
+				colormap.Defer([&](const ARGB argb) { return remapColorIndex(pPalette, argb, alphaThreshold); }, hasSemiTransparency);
+			dither_image(pixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return closestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, &colormap, m_ditherMode);
+			closestMap.Clear();
+			m_tags.clear();
+			return true;
+		}
+
+		InverseColormap colormap;
+		if ((dither && IsThreadedDither(m_ditherMode)) || (!dither && m_colormapRemap && m_tags.empty()))
+			colormap.Defer([&](const ARGB argb) { return remapColorIndex(pPalette, argb, alphaThreshold); }, hasSemiTransparency);
+
+		DitherState state(width);
+		state.mode = m_ditherMode;
+		state.pColormap = &colormap;
+		quantize_image(pixels, pPalette, qPixels, width, height, dither, alphaThreshold, state);
 		
+		if (m_transparentPixelIndex >= 0) {
+			UINT k = qPixels[m_transparentPixelIndex];
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+		}
+		closestMap.Clear();
+		rightMatches.clear();
+		m_tags.clear();
+		return true;
+	}
+
+	bool WuQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		pPalette->Count = nMaxColors;
+		PR = .2126, PG = .7152, PB = .0722;
 		if (nMaxColors <= 32)
 			PR = PG = PB = 1;
 
-		auto qPixels = make_unique<unsigned short[]>(bitmapWidth * bitmapHeight);
 		if (nMaxColors > 2) {
-			ColorData colorData(SIDESIZE, bitmapWidth, bitmapHeight);
-			BuildHistogram(colorData, pSource, alphaThreshold, alphaFader);
-			CalculateMoments(colorData);
-			vector<Box> cubes;
-			SplitData(cubes, nMaxColors, colorData);
+			ColorData colorData(SIDESIZE, width, height);
+			if (!BuildHistogram(colorData, pixels, width, height, stride, alphaThreshold, alphaFader))
+				return false;
 
-			BuildLookups(pPalette, cubes, colorData);
-			cubes.clear();
+			BuildPalette(colorData, pPalette, nMaxColors, alphaThreshold);
+			return QuantizePixels(colorData.GetPixels(), width, height, pPalette, qPixels, nMaxColors, dither, alphaThreshold);
+		}
 
-			nMaxColors = pPalette->Count;
-			if (nMaxColors > 16 && nMaxColors <= 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
-				pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
+		const ARGB* pPixels = nullptr;
+		vector<ARGB> pixelsBuffer;
+		if (!GrabPixels(pixels, width, height, stride, pPixels, pixelsBuffer, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor))
+			return false;
 
-			GetQuantizedPalette(colorData, pPalette, nMaxColors, alphaThreshold);
-			if (nMaxColors > 256) {
-				auto qPixels = make_unique<ARGB[]>(bitmapWidth * bitmapHeight);
-				dithering_image(colorData.GetPixels(), pPalette, closestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-				return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
-			}			
-			quantize_image(colorData.GetPixels(), pPalette, qPixels.get(), bitmapWidth, bitmapHeight, dither, alphaThreshold);
+		return QuantizePixels(pPixels, width, height, pPalette, qPixels, nMaxColors, dither, alphaThreshold);
+	}
+
+	bool WuQuantizer::QuantizeImage(ReadRowsFn readRows, WriteRowsFn writeRows, const UINT width, const UINT height, const UINT stripeHeight, ColorPalette* pPalette, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		m_paletteIndex.Clear();
+		m_tags.clear();
+		hasSemiTransparency = false;
+		m_transparentPixelIndex = -1;
+		pPalette->Count = nMaxColors;
+		PR = .2126, PG = .7152, PB = .0722;
+		if (nMaxColors <= 32)
+			PR = PG = PB = 1;
+
+		vector<ARGB> stripe, fadedStripe;
+		const bool fade = nMaxColors > 2;
+		auto fadePixels = [&](const ARGB* pixels, const UINT nSize) -> const ARGB* {
+			if (!fade)
+				return pixels;
+
+			fadedStripe.resize(stripe.size());
+			for (UINT i = 0; i < nSize; ++i)
+				fadedStripe[i] = FadePixel(Color(pixels[i]), alphaThreshold, alphaFader);
+			return fadedStripe.data();
+		};
+
+		if (fade) {
+			{
+				ColorData colorData(SIDESIZE);
+				bool bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+					fadedStripe.resize(stripe.size());
+					FadeStripe(pixels, width * rows, y * width, fadedStripe.data(), alphaThreshold, alphaFader);
+					CompileColorData(colorData, fadedStripe.data(), width * rows, alphaThreshold);
+					return true;
+				});
+				if (!bSucceeded)
+					return false;
+
+				BuildCubes(colorData, pPalette, nMaxColors);
+			}
+
+			PaletteSums paletteSums(nMaxColors);
+			bool bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+				AddPaletteSums(paletteSums, pPalette, fadePixels(pixels, width * rows), width * rows, alphaThreshold);
+				return true;
+			});
+			if (!bSucceeded)
+				return false;
+
+			GetQuantizedPalette(paletteSums, pPalette, nMaxColors);
 		}
 		else {
-			vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-			GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+			bool bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+				ScanTransparency(pixels, width * rows, y * width, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+				return true;
+			});
+			if (!bSucceeded)
+				return false;
+		}
+
+		if (nMaxColors <= 2) {
 			if (m_transparentPixelIndex >= 0) {
 				pPalette->Entries[0] = m_transparentColor;
 				pPalette->Entries[1] = Color::Black;
@@ -896,20 +1304,81 @@ namespace nQuant
 				pPalette->Entries[0] = Color::Black;
 				pPalette->Entries[1] = Color::White;
 			}
-			quantize_image(pixels.data(), pPalette, qPixels.get(), bitmapWidth, bitmapHeight, dither, alphaThreshold);
-		}		
-		
-		if (m_transparentPixelIndex >= 0) {
-			UINT k = qPixels[m_transparentPixelIndex];
+		}
+
+		InverseColormap colormap;
+		if (((dither || nMaxColors > 256) && IsThreadedDither(m_ditherMode)) || (!dither && m_colormapRemap && nMaxColors <= 256 && m_tags.empty()))
+			colormap.Defer([&](const ARGB argb) { return remapColorIndex(pPalette, argb, alphaThreshold); }, hasSemiTransparency);
+
+		DitherState state(width);
+		state.mode = m_ditherMode;
+		state.pColormap = &colormap;
+		auto qPixels = make_unique<unsigned short[]>(stripe.size());
+		UINT k = 0;
+		bool bSucceeded = ReadStripes(readRows, width, height, stripeHeight, stripe, [&](const UINT y, const UINT rows, const ARGB* pixels) {
+			auto pPixels = fadePixels(pixels, width * rows);
+			if (nMaxColors > 256)
+				dither_image(pPixels, pPalette, [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) { return closestColorIndex(pPalette, nMaxColors, argb); }, hasSemiTransparency, nMaxColors, qPixels.get(), width, rows, state);
+			else
+				quantize_image(pPixels, pPalette, qPixels.get(), width, rows, dither, alphaThreshold, state);
+
+			const int offset = m_transparentPixelIndex - (int) (y * width);
+			if (offset >= 0 && offset < (int) (rows * width))
+				k = qPixels[offset];
+			return writeRows(y, rows, qPixels.get());
+		});
+		closestMap.Clear();
+		rightMatches.clear();
+		m_tags.clear();
+		if (!bSucceeded)
+			return false;
+
+		if (nMaxColors <= 256 && m_transparentPixelIndex >= 0) {
 			if (nMaxColors > 2)
 				pPalette->Entries[k] = m_transparentColor;
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		closestMap.clear();
-		rightMatches.clear();
+		return true;
+	}
+
+#ifdef _WIN32
+	bool WuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader, DitherMode ditherMode)
+	{
+		m_ditherMode = ditherMode;
+		const UINT bitmapWidth = pSource->GetWidth();
+		const UINT bitmapHeight = pSource->GetHeight();
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		pPalette->Count = nMaxColors;
+		PR = .2126, PG = .7152, PB = .0722;
+		if (nMaxColors <= 32)
+			PR = PG = PB = 1;
+
+		auto qPixels = make_unique<unsigned short[]>(bitmapWidth * bitmapHeight);
+		if (nMaxColors > 2) {
+			ColorData colorData(SIDESIZE, bitmapWidth, bitmapHeight);
+			if (!BuildHistogram(colorData, pSource, alphaThreshold, alphaFader))
+				return false;
+			BuildPalette(colorData, pPalette, nMaxColors, alphaThreshold);
+			if (!QuantizePixels(colorData.GetPixels(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither, alphaThreshold))
+				return false;
+
+			if (nMaxColors > 16 && nMaxColors <= 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
+				pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
+		}
+		else {
+			vector<ARGB> pixels(bitmapWidth * bitmapHeight);
+			GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+			if (!QuantizePixels(pixels.data(), bitmapWidth, bitmapHeight, pPalette, qPixels.get(), nMaxColors, dither, alphaThreshold))
+				return false;
+		}
 
+		if (nMaxColors > 256)
+			return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 		return ProcessImagePixels(pDest, pPalette, qPixels.get());
 	}
+#endif // _WIN32
 
 }
@@ -1,6 +1,11 @@
 #pragma once
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
+#include "ClosestCache.h"
+#include "PaletteIndex.h"
+#include "RandomGenerator.h"
 using namespace std;
 
 // =============================================================
@@ -26,9 +31,64 @@ namespace nQuant
 */
 	enum Pixel : BYTE { Blue, Green, Red, Alpha };
 
+	struct ColorData;
+	struct PaletteSums;
+
 	class WuQuantizer
 	{
 		public:
-			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1);
+			// Quantizes a caller-owned 32bpp ARGB buffer, stride in bytes. pPalette must hold
+			// nMaxColors entries and qPixels width * height indices into it.
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+			// Quantizes an image too large to hold in memory. readRows is called up to three
+			// times for every stripe of at most stripeHeight rows, for the histogram, the palette
+			// refinement and the remap, and writeRows receives the indices of each stripe.
+			bool QuantizeImage(ReadRowsFn readRows, WriteRowsFn writeRows, const UINT width, const UINT height, const UINT stripeHeight, ColorPalette* pPalette, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#ifdef _WIN32
+			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1, DitherMode ditherMode = DitherMode::ErrorDiffusion);
+#endif // _WIN32
+			// Seeds the random choices of the runs that follow, which repeat for the same seed
+			void SetSeed(const UINT seed) { m_random.Seed(seed); }
+			// Remaps through the palette entries nearest to each pixel instead of the boxes
+			// of the histogram cells, slower but closer to the source colours
+			void SetNearestRemap(const bool nearestRemap) { m_nearestRemap = nearestRemap; }
+			// Remaps without dithering through an InverseColormap, one table lookup per pixel
+			// instead of a palette search, when there are no box tags to remap by, i.e. with
+			// SetNearestRemap or two colours. Each colour is reduced to its cell first.
+			void SetColormapRemap(const bool colormapRemap) { m_colormapRemap = colormapRemap; }
+
+		private:
+			bool hasSemiTransparency = false;
+			bool m_colormapRemap = false;
+			bool m_nearestRemap = false;
+			bool m_tagsHaveAlpha = false;
+			int m_transparentPixelIndex = -1;
+			DitherMode m_ditherMode = DitherMode::ErrorDiffusion;
+			ARGB m_transparentColor = Color::Transparent;
+			double PR = .2126, PG = .7152, PB = .0722;
+			ClosestCache<unsigned short> closestMap;
+			RandomGenerator m_random;
+			unordered_map<ARGB, UINT> rightMatches;
+			PaletteIndex m_paletteIndex;
+			// Palette entry of the box each histogram cell fell in, empty unless remapping by box
+			vector<unsigned short> m_tags;
+
+			void FadeStripe(const ARGB* pixels, const UINT nSize, const UINT offset, ARGB* fadedPixels, BYTE alphaThreshold, BYTE alphaFader);
+			bool BuildHistogram(ColorData& colorData, const ARGB* pixels, const UINT width, const UINT height, const int stride, BYTE alphaThreshold, BYTE alphaFader);
+#ifdef _WIN32
+			bool BuildHistogram(ColorData& colorData, Bitmap* sourceImage, BYTE alphaThreshold, BYTE alphaFader);
+#endif // _WIN32
+			void BuildLookups(ColorPalette* pPalette, const vector<ARGB>& colors);
+			unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const ARGB argb, const BYTE alphaThreshold);
+			unsigned short tagColorIndex(const ARGB argb, const BYTE alphaThreshold) const;
+			unsigned short remapColorIndex(const ColorPalette* pPalette, const ARGB argb, const BYTE alphaThreshold);
+			void RemapTags(const ARGB* pixels, unsigned short* qPixels, const UINT nSize, const BYTE alphaThreshold) const;
+			void AddPaletteSums(PaletteSums& paletteSums, const ColorPalette* pPalette, const ARGB* pixels, const UINT nSize, const BYTE alphaThreshold);
+			void GetQuantizedPalette(PaletteSums& paletteSums, ColorPalette* pPalette, const UINT colorCount);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, BYTE alphaThreshold, DitherState& state);
+			void BuildCubes(ColorData& colorData, ColorPalette* pPalette, UINT& nMaxColors);
+			void BuildPalette(ColorData& colorData, ColorPalette* pPalette, UINT& nMaxColors, const BYTE alphaThreshold);
+			bool QuantizePixels(const ARGB* pixels, const UINT width, const UINT height, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, BYTE alphaThreshold);
 	};
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -4,7 +4,15 @@
 // GetBitmapHeaderSize
 //
 #include "bitmapUtilities.h"
-
+#include "InverseColormap.h"
+#include "OrderedDither.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
 ULONG GetBitmapHeaderSize(LPCVOID pDib)
 {
 	ULONG nHeaderSize = *(PDWORD)pDib;
@@ -439,228 +447,610 @@ BOOL FillBitmapFileHeader(LPCVOID pDib, PBITMAPFILEHEADER pbmfh)
 
 	return TRUE;
 }
+#endif // _WIN32
 
-void CalcDitherPixel(int* pDitherPixel, const Color& c, const BYTE* clamp, const short* rowerr, const bool& hasSemiTransparency)
+// Clamping and error limiting tables of the diffusion loops
+struct DitherTables
 {
-	if (hasSemiTransparency) {
-		pDitherPixel[0] = clamp[((rowerr[0] + 0x1008) >> 4) + c.GetR()];
-		pDitherPixel[1] = clamp[((rowerr[1] + 0x1008) >> 4) + c.GetG()];
-		pDitherPixel[2] = clamp[((rowerr[2] + 0x1008) >> 4) + c.GetB()];
-		pDitherPixel[3] = clamp[((rowerr[3] + 0x1008) >> 4) + c.GetA()];
+	static const int DITHER_MAX = 20;
+	BYTE clamp[4 * 256];
+	char limtb[512];
+	const char* lim = &limtb[256];
+
+	DitherTables()
+	{
+		for (int i = 0; i < 256; i++) {
+			clamp[i] = 0;
+			clamp[i + 256] = static_cast<BYTE>(i);
+			clamp[i + 512] = BYTE_MAX;
+			clamp[i + 768] = BYTE_MAX;
+
+			limtb[i] = -DITHER_MAX;
+			limtb[i + 256] = DITHER_MAX;
+		}
+		for (int i = -DITHER_MAX; i <= DITHER_MAX; i++)
+			limtb[i + 256] = i;
 	}
-	else {
-		pDitherPixel[0] = clamp[((rowerr[0] + 0x2010) >> 5) + c.GetR()];
-		pDitherPixel[1] = clamp[((rowerr[1] + 0x1008) >> 4) + c.GetG()];
-		pDitherPixel[2] = clamp[((rowerr[2] + 0x2010) >> 5) + c.GetB()];
-		pDitherPixel[3] = c.GetA();
+};
+
+static const DitherTables& GetDitherTables()
+{
+	static const DitherTables tables;
+	return tables;
+}
+
+// Adds the accumulated error to a pixel, rounded to the precision GetARGBIndex keeps
+// of each channel. SEMI selects the ARGB4444 cells, otherwise RGB565 with alpha kept.
+template <bool SEMI>
+inline ARGB CalcDitherPixel(const Color& c, const BYTE* clamp, const short* rowerr)
+{
+	if (SEMI)
+		return Color::MakeARGB(clamp[((rowerr[3] + 0x1008) >> 4) + c.GetA()], clamp[((rowerr[0] + 0x1008) >> 4) + c.GetR()],
+			clamp[((rowerr[1] + 0x1008) >> 4) + c.GetG()], clamp[((rowerr[2] + 0x1008) >> 4) + c.GetB()]);
+	return Color::MakeARGB(c.GetA(), clamp[((rowerr[0] + 0x2010) >> 5) + c.GetR()],
+		clamp[((rowerr[1] + 0x1008) >> 4) + c.GetG()], clamp[((rowerr[2] + 0x2010) >> 5) + c.GetB()]);
+}
+
+template <bool SEMI>
+inline void StoreDithered(unsigned short& qPixel, const unsigned short index, const Color& c2)
+{
+	qPixel = index;
+}
+
+template <bool SEMI>
+inline void StoreDithered(ARGB& qPixel, const unsigned short index, const Color& c2)
+{
+	qPixel = SEMI ? c2.GetValue() : GetARGB1555(c2);
+}
+
+// Palette index of a dithered colour, looked up in a built InverseColormap
+struct ColormapSearch
+{
+	const InverseColormap* pColormap;
+
+	inline unsigned short operator()(const ARGB argb, const int offset) const
+	{
+		return pColormap->Lookup(offset);
 	}
+};
+
+// Palette index of a dithered colour, asking ditherFn once per GetARGBIndex cell
+struct CachedSearch
+{
+	const ColorPalette* pPalette;
+	const UINT nMaxColors;
+	const DitherFn& ditherFn;
+	short* lookup;
+
+	inline unsigned short operator()(const ARGB argb, const int offset) const
+	{
+		if (!lookup[offset])
+			lookup[offset] = ditherFn(pPalette, nMaxColors, argb) + 1;
+		return lookup[offset] - 1;
+	}
+};
+
+// Calls diffuse with the search matching state, a built colormap or the cache of ditherFn
+template <typename DiffuseFn>
+inline void WithSearch(const ColorPalette* pPalette, const DitherFn& ditherFn, const UINT nMaxColors, DitherState& state, DiffuseFn diffuse)
+{
+	if (state.pColormap && state.pColormap->IsBuilt())
+		diffuse(ColormapSearch{ state.pColormap });
+	else
+		diffuse(CachedSearch{ pPalette, nMaxColors, ditherFn, state.lookup.data() });
 }
 
-bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height)
+bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const InverseColormap* pColormap, const DitherMode ditherMode)
+{
+	DitherState state(width);
+	state.pColormap = pColormap;
+	state.mode = ditherMode;
+	return dither_image(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, height, state);
+}
+
+// Pixels a row is dithered in before telling the row below how far it got
+const UINT WAVEFRONT_BLOCK = 64;
+// Pixels each thread of the wavefront should get at least
+const UINT MIN_WAVEFRONT_PIXELS = 1 << 16;
+
+// Same diffusion as dither_image with every row scanned left to right. Pixel x of
+// a row only needs the errors of pixels up to x + 1 of the row above, so row i is
+// given to thread i % nThreads and trails row i - 1 by a block of pixels. Each row
+// in flight writes its own error buffer and keeps the share for its next pixel in
+// a local carry, so the result does not depend on the number of threads. Without
+// a colormap, built or deferred, ditherFn is called, which is not thread safe, so
+// it runs alone.
+template <bool SEMI, typename SearchFn>
+static void DitherRaster(const ARGB* pixels, const ColorPalette* pPalette, unsigned short* qPixels, const UINT width, const UINT rows, const UINT nThreads, DitherState& state, SearchFn nearest)
 {
-	UINT pixelIndex = 0;
-	
-	bool odd_scanline = false;
-	short *row0, *row1;
-	int dir, k;
 	const int DJ = 4;
-	const int DITHER_MAX = 20;
-	const int err_len = (width + 2) * DJ;
-	BYTE clamp[DJ * 256] = { 0 };
-	auto erowErr = make_unique<short[]>(err_len);
-	auto orowErr = make_unique<short[]>(err_len);
-	char limtb[512] = { 0 };
-	auto lim = &limtb[256];
-	auto erowerr = erowErr.get();
-	auto orowerr = orowErr.get();
-	auto lookup = make_unique<short[]>(65536);
-	auto pDitherPixel = make_unique<int[]>(4);
-
-	for (int i = 0; i < 256; i++) {
-		clamp[i] = 0;
-		clamp[i + 256] = static_cast<BYTE>(i);
-		clamp[i + 512] = BYTE_MAX;
-		clamp[i + 768] = BYTE_MAX;
-
-		limtb[i] = -DITHER_MAX;
-		limtb[i + 256] = DITHER_MAX;
-	}
-	for (int i = -DITHER_MAX; i <= DITHER_MAX; i++)
-		limtb[i + 256] = i;
-
-	for (int i = 0; i < height; i++) {
-		if (odd_scanline) {
-			dir = -1;
-			pixelIndex += (width - 1);
-			row0 = &orowerr[DJ];
-			row1 = &erowerr[width * DJ];
-		}
-		else {
-			dir = 1;
-			row0 = &erowerr[DJ];
-			row1 = &orowerr[width * DJ];
-		}
+	const auto& tables = GetDitherTables();
+	const auto clamp = tables.clamp;
+	const auto lim = tables.lim;
+
+	// Row i reads rowErrs[i % nBuffers] and writes rowErrs[(i + 1) % nBuffers]. The buffer
+	// it writes was last read by row i - nThreads, which the same thread has finished.
+	const UINT nBuffers = nThreads + 1;
+	vector<vector<short> > rowErrs(nBuffers, vector<short>((width + 2) * DJ));
+	rowErrs[0] = state.erowErr;
+	// Row i publishes i * width + the number of its pixels done
+	auto progress = make_unique<atomic<size_t>[]>(nBuffers);
+	for (UINT i = 0; i < nBuffers; ++i)
+		progress[i].store(0);
+
+	auto ditherRow = [&](const UINT i) {
+		const short* row0 = &rowErrs[i % nBuffers][DJ];
+		short* row1 = &rowErrs[(i + 1) % nBuffers][DJ];
+		const ARGB* pRow = pixels + i * width;
+		unsigned short* qRow = qPixels + i * width;
+		short rowerr[DJ];
+		int carry[DJ] = { 0 };
 		row1[0] = row1[1] = row1[2] = row1[3] = 0;
-		for (UINT j = 0; j < width; ++j) {
-			Color c(pixels[pixelIndex]);
+		for (UINT x0 = 0; x0 < width; x0 += WAVEFRONT_BLOCK) {
+			const UINT x1 = min(width, x0 + WAVEFRONT_BLOCK);
+			if (i > 0) {
+				const size_t needed = (size_t) (i - 1) * width + min(width, x1 + 1);
+				while (progress[(i - 1) % nBuffers].load(memory_order_acquire) < needed)
+					this_thread::yield();
+			}
+
+			for (UINT x = x0; x < x1; ++x) {
+				const short* err = &row0[x * DJ];
+				short* below = &row1[x * DJ];
+				for (int d = 0; d < DJ; ++d)
+					rowerr[d] = static_cast<short>(err[d] + carry[d]);
+
+				const ARGB argb = CalcDitherPixel<SEMI>(Color(pRow[x]), clamp, rowerr);
+				Color c1(argb);
+				qRow[x] = nearest(argb, GetARGBIndex(c1, SEMI));
+
+				Color c2(pPalette->Entries[qRow[x]]);
+				int pixErr[DJ] = {
+					lim[c1.GetR() - c2.GetR()],
+					lim[c1.GetG() - c2.GetG()],
+					lim[c1.GetB() - c2.GetB()],
+					lim[c1.GetA() - c2.GetA()]
+				};
+
+				// 1/16 ahead, 3/16 behind and 5/16 straight below on the next row, 7/16 to the right
+				for (int d = 0; d < DJ; ++d) {
+					int e = pixErr[d];
+					const int k = e * 2;
+					below[d + DJ] = e;
+					below[d - DJ] += (e += k);
+					below[d] += (e += k);
+					carry[d] = (e += k);
+				}
+			}
+			progress[i % nBuffers].store((size_t) i * width + x1, memory_order_release);
+		}
+	};
+
+	vector<thread> workers;
+	for (UINT t = 1; t < nThreads; ++t) {
+		workers.emplace_back([&, t]() {
+			for (UINT i = t; i < rows; i += nThreads)
+				ditherRow(i);
+		});
+	}
+	for (UINT i = 0; i < rows; i += nThreads)
+		ditherRow(i);
+	for (auto& worker : workers)
+		worker.join();
+
+	state.erowErr = rowErrs[rows % nBuffers];
+}
+
+static bool DitherRaster(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT rows, DitherState& state)
+{
+	UINT nThreads = 1;
+	if (state.pColormap && state.pColormap->IsBuilt()) {
+		nThreads = min(max(thread::hardware_concurrency(), 1U), rows);
+		nThreads = max(min(nThreads, width * rows / MIN_WAVEFRONT_PIXELS), 1U);
+	}
 
-			CalcDitherPixel(pDitherPixel.get(), c, clamp, row0, hasSemiTransparency);
-			int r_pix = pDitherPixel[0];
-			int g_pix = pDitherPixel[1];
-			int b_pix = pDitherPixel[2];
-			int a_pix = pDitherPixel[3];
-			auto argb = Color::MakeARGB(a_pix, r_pix, g_pix, b_pix);
+	WithSearch(pPalette, ditherFn, nMaxColors, state, [&](auto nearest) {
+		if (hasSemiTransparency)
+			DitherRaster<true>(pixels, pPalette, qPixels, width, rows, nThreads, state, nearest);
+		else
+			DitherRaster<false>(pixels, pPalette, qPixels, width, rows, nThreads, state, nearest);
+	});
+	return true;
+}
+
+// Share of the error a pixel passes to the pixel dx ahead in the scan direction
+// and dy rows down, in units of 1 / divisor of its kernel
+struct DiffusionTap
+{
+	int dx, dy, weight;
+};
+
+struct FloydSteinbergKernel
+{
+	static constexpr int divisor = 16, rows = 2, reach = 1;
+	static constexpr DiffusionTap taps[] = {
+		{ 1, 0, 7 },
+		{ -1, 1, 3 }, { 0, 1, 5 }, { 1, 1, 1 }
+	};
+};
+
+struct SierraLiteKernel
+{
+	static constexpr int divisor = 4, rows = 2, reach = 1;
+	static constexpr DiffusionTap taps[] = {
+		{ 1, 0, 2 },
+		{ -1, 1, 1 }, { 0, 1, 1 }
+	};
+};
+
+// Passes on 6/8 of the error only, which keeps more contrast in small palettes
+struct AtkinsonKernel
+{
+	static constexpr int divisor = 8, rows = 3, reach = 2;
+	static constexpr DiffusionTap taps[] = {
+		{ 1, 0, 1 }, { 2, 0, 1 },
+		{ -1, 1, 1 }, { 0, 1, 1 }, { 1, 1, 1 },
+		{ 0, 2, 1 }
+	};
+};
+
+struct StuckiKernel
+{
+	static constexpr int divisor = 42, rows = 3, reach = 2;
+	static constexpr DiffusionTap taps[] = {
+		{ 1, 0, 8 }, { 2, 0, 4 },
+		{ -2, 1, 2 }, { -1, 1, 4 }, { 0, 1, 8 }, { 1, 1, 4 }, { 2, 1, 2 },
+		{ -2, 2, 1 }, { -1, 2, 2 }, { 0, 2, 4 }, { 1, 2, 2 }, { 2, 2, 1 }
+	};
+};
+
+struct JarvisKernel
+{
+	static constexpr int divisor = 48, rows = 3, reach = 2;
+	static constexpr DiffusionTap taps[] = {
+		{ 1, 0, 7 }, { 2, 0, 5 },
+		{ -2, 1, 3 }, { -1, 1, 5 }, { 0, 1, 7 }, { 1, 1, 5 }, { 2, 1, 3 },
+		{ -2, 2, 1 }, { -1, 2, 3 }, { 0, 2, 5 }, { 1, 2, 3 }, { 2, 2, 1 }
+	};
+};
+
+constexpr DiffusionTap FloydSteinbergKernel::taps[];
+constexpr DiffusionTap SierraLiteKernel::taps[];
+constexpr DiffusionTap AtkinsonKernel::taps[];
+constexpr DiffusionTap StuckiKernel::taps[];
+constexpr DiffusionTap JarvisKernel::taps[];
+
+// Error summed in units of 1 / D, rounded to the nearest unit and offset into the clamp table
+template <int D>
+inline int RoundError(const int err)
+{
+	return (err + 256 * D + D / 2) / D;
+}
+
+// Serpentine diffusion with one of the kernels above, shared by dither_image and
+// dithering_image. The kernel, the alpha mode, the output element, a palette index
+// or the colour it stands for, and the search are template parameters, so every
+// combination gets its own loop with the taps unrolled into fixed adds, the search
+// inlined and no branch on any of them per pixel. Errors are summed in units of
+// 1 / divisor and rounded like CalcDitherPixel, red and blue halved without alpha.
+// state.kernelErr holds kernel.rows error rows, the one of the current row first.
+template <typename Kernel, bool SEMI, typename T, typename SearchFn>
+static void DitherKernel(const ARGB* pixels, const ColorPalette* pPalette, T* qPixels, const UINT width, const UINT rows, DitherState& state, SearchFn nearest)
+{
+	const int DJ = 4;
+	const int D = Kernel::divisor;
+	const int nTaps = sizeof(Kernel::taps) / sizeof(Kernel::taps[0]);
+	const auto& tables = GetDitherTables();
+	const auto clamp = tables.clamp;
+	const auto lim = tables.lim;
+
+	auto& errs = state.kernelErr;
+	const size_t rowSize = (width + 2 * Kernel::reach) * DJ;
+	if (errs.size() != Kernel::rows || errs[0].size() != rowSize)
+		errs.assign(Kernel::rows, vector<int>(rowSize));
+
+	for (UINT i = 0; i < rows; i++) {
+		// Kept in locals, which the call to ditherFn on a cache miss cannot change
+		int* errRows[Kernel::rows];
+		for (int r = 0; r < Kernel::rows; ++r)
+			errRows[r] = errs[r].data();
+		const int dir = state.odd_scanline ? -1 : 1;
+		UINT pixelIndex = state.odd_scanline ? i * width + (width - 1) : i * width;
+		int x = state.odd_scanline ? width - 1 : 0;
+		for (UINT j = 0; j < width; ++j, x += dir, pixelIndex += dir) {
+			const int* err = &errRows[0][(x + Kernel::reach) * DJ];
+			Color c(pixels[pixelIndex]);
+			auto argb = Color::MakeARGB(SEMI ? clamp[RoundError<D>(err[3]) + c.GetA()] : c.GetA(),
+				clamp[RoundError<SEMI ? D : 2 * D>(err[0]) + c.GetR()],
+				clamp[RoundError<D>(err[1]) + c.GetG()],
+				clamp[RoundError<SEMI ? D : 2 * D>(err[2]) + c.GetB()]);
 			Color c1(argb);
-			int offset = GetARGBIndex(c1, hasSemiTransparency);
-			if (!lookup[offset])
-				lookup[offset] = ditherFn(pPalette, nMaxColors, argb) + 1;
-			qPixels[pixelIndex] = lookup[offset] - 1;
-
-			Color c2(pPalette->Entries[qPixels[pixelIndex]]);
-
-			r_pix = lim[c1.GetR() - c2.GetR()];
-			g_pix = lim[c1.GetG() - c2.GetG()];
-			b_pix = lim[c1.GetB() - c2.GetB()];
-			a_pix = lim[c1.GetA() - c2.GetA()];
-
-			k = r_pix * 2;
-			row1[0 - DJ] = r_pix;
-			row1[0 + DJ] += (r_pix += k);
-			row1[0] += (r_pix += k);
-			row0[0 + DJ] += (r_pix += k);
-
-			k = g_pix * 2;
-			row1[1 - DJ] = g_pix;
-			row1[1 + DJ] += (g_pix += k);
-			row1[1] += (g_pix += k);
-			row0[1 + DJ] += (g_pix += k);
-
-			k = b_pix * 2;
-			row1[2 - DJ] = b_pix;
-			row1[2 + DJ] += (b_pix += k);
-			row1[2] += (b_pix += k);
-			row0[2 + DJ] += (b_pix += k);
-
-			k = a_pix * 2;
-			row1[3 - DJ] = a_pix;
-			row1[3 + DJ] += (a_pix += k);
-			row1[3] += (a_pix += k);
-			row0[3 + DJ] += (a_pix += k);
-
-			row0 += DJ;
-			row1 -= DJ;
-			pixelIndex += dir;
-		}
-		if ((i % 2) == 1)
-			pixelIndex += (width + 1);
-
-		odd_scanline = !odd_scanline;
+			const unsigned short qIndex = nearest(argb, GetARGBIndex(c1, SEMI));
+
+			Color c2(pPalette->Entries[qIndex]);
+			StoreDithered<SEMI>(qPixels[pixelIndex], qIndex, c2);
+			const int pixErr[DJ] = {
+				lim[c1.GetR() - c2.GetR()],
+				lim[c1.GetG() - c2.GetG()],
+				lim[c1.GetB() - c2.GetB()],
+				lim[c1.GetA() - c2.GetA()]
+			};
+
+			for (int t = 0; t < nTaps; ++t) {
+				const auto& tap = Kernel::taps[t];
+				int* below = &errRows[tap.dy][(x + dir * tap.dx + Kernel::reach) * DJ];
+				for (int d = 0; d < DJ; ++d)
+					below[d] += pixErr[d] * tap.weight;
+			}
+		}
+
+		rotate(errs.begin(), errs.begin() + 1, errs.end());
+		fill(errs.back().begin(), errs.back().end(), 0);
+		state.odd_scanline = !state.odd_scanline;
 	}
+}
+
+template <typename Kernel, typename T>
+static bool DitherKernel(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const UINT nMaxColors, T* qPixels, const UINT width, const UINT rows, DitherState& state)
+{
+	WithSearch(pPalette, ditherFn, nMaxColors, state, [&](auto nearest) {
+		if (hasSemiTransparency)
+			DitherKernel<Kernel, true>(pixels, pPalette, qPixels, width, rows, state, nearest);
+		else
+			DitherKernel<Kernel, false>(pixels, pPalette, qPixels, width, rows, state, nearest);
+	});
 	return true;
 }
 
+bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT rows, DitherState& state)
+{
+	switch (state.mode) {
+	case DitherMode::ErrorDiffusionRaster:
+		return DitherRaster(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, rows, state);
+	case DitherMode::Bayer4x4:
+	case DitherMode::Bayer8x8:
+	case DitherMode::BlueNoise:
+		return OrderedDither(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, rows, state);
+	case DitherMode::SierraLite:
+		return DitherKernel<SierraLiteKernel>(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, rows, state);
+	case DitherMode::Atkinson:
+		return DitherKernel<AtkinsonKernel>(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, rows, state);
+	case DitherMode::Stucki:
+		return DitherKernel<StuckiKernel>(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, rows, state);
+	case DitherMode::Jarvis:
+		return DitherKernel<JarvisKernel>(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, rows, state);
+	default:
+		return DitherKernel<FloydSteinbergKernel>(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, rows, state);
+	}
+}
+
 bool dithering_image(const ARGB* pixels, ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, ARGB* qPixels, const UINT width, const UINT height)
 {
-	UINT pixelIndex = 0;
-	bool odd_scanline = false;
-	short *row0, *row1;
-	int dir, k;
-	const int DJ = 4;
-	const int DITHER_MAX = 20;
-	const int err_len = (width + 2) * DJ;
-	BYTE clamp[DJ * 256] = { 0 };
-	auto erowErr = make_unique<short[]>(err_len);
-	auto orowErr = make_unique<short[]>(err_len);
-	char limtb[512] = { 0 };
-	auto lim = &limtb[256];
-	auto erowerr = erowErr.get();
-	auto orowerr = orowErr.get();
-	auto lookup = make_unique<int[]>(65536);
-	auto pDitherPixel = make_unique<int[]>(4);
-
-	for (int i = 0; i < 256; i++) {
-		clamp[i] = 0;
-		clamp[i + 256] = static_cast<BYTE>(i);
-		clamp[i + 512] = BYTE_MAX;
-		clamp[i + 768] = BYTE_MAX;
-
-		limtb[i] = -DITHER_MAX;
-		limtb[i + 256] = DITHER_MAX;
-	}
-	for (int i = -DITHER_MAX; i <= DITHER_MAX; i++)
-		limtb[i + 256] = i;
-
-	for (int i = 0; i < height; i++) {
-		if (odd_scanline) {
-			dir = -1;
-			pixelIndex += (width - 1);
-			row0 = &orowerr[DJ];
-			row1 = &erowerr[width * DJ];
-		}
-		else {
-			dir = 1;
-			row0 = &erowerr[DJ];
-			row1 = &orowerr[width * DJ];
+	DitherState state(width);
+	return DitherKernel<FloydSteinbergKernel>(pixels, pPalette, ditherFn, hasSemiTransparency, nMaxColors, qPixels, width, height, state);
+}
+
+bool GrabPixels(const ARGB* pSource, const UINT width, const UINT height, const int stride, const ARGB*& pPixels, vector<ARGB>& pixels, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor)
+{
+	hasSemiTransparency = false;
+	transparentPixelIndex = -1;
+
+	const int rowSize = width * sizeof(ARGB);
+	if (pSource == nullptr || width == 0 || height == 0 || abs(stride) < rowSize) {
+		cerr << "Invalid pixel buffer" << endl;
+		return false;
+	}
+
+	// Only repack when the rows are not laid out back to back
+	if (stride == rowSize)
+		pPixels = pSource;
+	else {
+		pixels.resize(width * height);
+		pPixels = pixels.data();
+	}
+
+	int pixelIndex = 0;
+	auto pRowSource = (const BYTE*) pSource;
+	for (UINT y = 0; y < height; ++y) {	// For each row...
+		auto pPixelSource = (const ARGB*) pRowSource;
+
+		for (UINT x = 0; x < width; ++x) {	// ...for each pixel...
+			auto argb = pPixelSource[x];
+			BYTE pixelAlpha = static_cast<BYTE>(argb >> 24);
+			if (pixelAlpha < BYTE_MAX) {
+				if (pixelAlpha == 0) {
+					transparentColor = argb;
+					transparentPixelIndex = pixelIndex;
+				}
+				else
+					hasSemiTransparency = true;
+			}
+			if (pPixels != pSource)
+				pixels[pixelIndex] = argb;
+			++pixelIndex;
 		}
-		row1[0] = row1[1] = row1[2] = row1[3] = 0;
-		for (UINT j = 0; j < width; ++j) {
-			Color c(pixels[pixelIndex]);
 
-			CalcDitherPixel(pDitherPixel.get(), c, clamp, row0, hasSemiTransparency);
-			int r_pix = pDitherPixel[0];
-			int g_pix = pDitherPixel[1];
-			int b_pix = pDitherPixel[2];
-			int a_pix = pDitherPixel[3];
-			auto argb = Color::MakeARGB(a_pix, r_pix, g_pix, b_pix);
-			Color c1(argb);
-			int offset = GetARGBIndex(c1, hasSemiTransparency);
-			if (!lookup[offset])
-				lookup[offset] = ditherFn(pPalette, nMaxColors, argb) + 1;
-
-			Color c2(pPalette->Entries[lookup[offset] - 1]);
-			qPixels[pixelIndex] = hasSemiTransparency ? c2.GetValue() : GetARGB1555(c2);
-
-			r_pix = lim[c1.GetR() - c2.GetR()];
-			g_pix = lim[c1.GetG() - c2.GetG()];
-			b_pix = lim[c1.GetB() - c2.GetB()];
-			a_pix = lim[c1.GetA() - c2.GetA()];
-
-			k = r_pix * 2;
-			row1[0 - DJ] = r_pix;
-			row1[0 + DJ] += (r_pix += k);
-			row1[0] += (r_pix += k);
-			row0[0 + DJ] += (r_pix += k);
-
-			k = g_pix * 2;
-			row1[1 - DJ] = g_pix;
-			row1[1 + DJ] += (g_pix += k);
-			row1[1] += (g_pix += k);
-			row0[1 + DJ] += (g_pix += k);
-
-			k = b_pix * 2;
-			row1[2 - DJ] = b_pix;
-			row1[2 + DJ] += (b_pix += k);
-			row1[2] += (b_pix += k);
-			row0[2 + DJ] += (b_pix += k);
-
-			k = a_pix * 2;
-			row1[3 - DJ] = a_pix;
-			row1[3 + DJ] += (a_pix += k);
-			row1[3] += (a_pix += k);
-			row0[3 + DJ] += (a_pix += k);
-
-			row0 += DJ;
-			row1 -= DJ;
-			pixelIndex += dir;
-		}
-		if ((i % 2) == 1)
-			pixelIndex += (width + 1);
-
-		odd_scanline = !odd_scanline;
+		pRowSource += stride;
+	}
+	return true;
+}
+
+bool ReadStripes(ReadRowsFn readRows, const UINT width, const UINT height, const UINT stripeHeight, vector<ARGB>& stripe, const StripeFn& stripeFn)
+{
+	const UINT rowsPerStripe = max(1u, min(stripeHeight, height));
+	stripe.resize(width * rowsPerStripe);
+	for (UINT y = 0; y < height; y += rowsPerStripe) {
+		const UINT rows = min(rowsPerStripe, height - y);
+		if (!readRows(y, rows, stripe.data())) {
+			cerr << "Cannot read pixel stripe" << endl;
+			return false;
+		}
+		if (!stripeFn(y, rows, stripe.data()))
+			return false;
 	}
 	return true;
 }
 
+void ScanTransparency(const ARGB* pixels, const UINT nSize, const UINT offset, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor)
+{
+	for (UINT i = 0; i < nSize; ++i) {
+		BYTE pixelAlpha = static_cast<BYTE>(pixels[i] >> 24);
+		if (pixelAlpha < BYTE_MAX) {
+			if (pixelAlpha == 0) {
+				transparentColor = pixels[i];
+				transparentPixelIndex = offset + i;
+			}
+			else
+				hasSemiTransparency = true;
+		}
+	}
+}
+
+// Expands a 5 or 6 bit channel to 8 bits, replicating the high bits into the low
+inline BYTE Expand5(const UINT value)
+{
+	return (BYTE) ((value << 3) | (value >> 2));
+}
+
+inline BYTE Expand6(const UINT value)
+{
+	return (BYTE) ((value << 2) | (value >> 4));
+}
+
+// 16 bit channels of the 48 and 64bpp formats are linear in 0 .. 8192
+const UINT LINEAR_MAX = 8192;
+
+static const BYTE* GetLinearToSRGB()
+{
+	static const auto table = [] {
+		vector<BYTE> values(LINEAR_MAX + 1);
+		for (UINT i = 0; i <= LINEAR_MAX; ++i) {
+			const double linear = i / (double) LINEAR_MAX;
+			const double srgb = linear <= 0.0031308 ? 12.92 * linear : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+			values[i] = (BYTE) (srgb * BYTE_MAX + .5);
+		}
+		return values;
+	}();
+	return table.data();
+}
+
+inline BYTE Unpremultiply(const UINT value, const UINT alpha)
+{
+	return (BYTE) min<UINT>(BYTE_MAX, (value * BYTE_MAX + alpha / 2) / alpha);
+}
+
+// entries holds all 256 indices, so packed indices need no range check
+template <UINT bitDepth>
+static void DecodeIndexedRow(const BYTE* pRow, const UINT width, const ARGB* entries, ARGB* pixels)
+{
+	const UINT perByte = 8 / bitDepth;
+	const UINT mask = (1 << bitDepth) - 1;
+	for (UINT x = 0; x < width; ++x) {
+		const UINT shift = 8 - bitDepth * (x % perByte + 1);
+		pixels[x] = entries[(pRow[x / perByte] >> shift) & mask];
+	}
+}
+
+static void DecodeRow(const BYTE* pRow, const UINT width, const RowFormat format, const ARGB* entries, ARGB* pixels)
+{
+	switch (format) {
+	case RowFormat::Indexed1:
+		DecodeIndexedRow<1>(pRow, width, entries, pixels);
+		break;
+	case RowFormat::Indexed4:
+		DecodeIndexedRow<4>(pRow, width, entries, pixels);
+		break;
+	case RowFormat::Indexed8:
+		for (UINT x = 0; x < width; ++x)
+			pixels[x] = entries[pRow[x]];
+		break;
+	case RowFormat::RGB555:
+	case RowFormat::ARGB1555: {
+		auto pSource = (const unsigned short*) pRow;
+		const bool hasAlpha = format == RowFormat::ARGB1555;
+		for (UINT x = 0; x < width; ++x) {
+			const UINT value = pSource[x];
+			const BYTE alpha = !hasAlpha || (value & 0x8000) ? BYTE_MAX : 0;
+			pixels[x] = Color::MakeARGB(alpha, Expand5((value >> 10) & 0x1F), Expand5((value >> 5) & 0x1F), Expand5(value & 0x1F));
+		}
+		break;
+	}
+	case RowFormat::RGB565: {
+		auto pSource = (const unsigned short*) pRow;
+		for (UINT x = 0; x < width; ++x) {
+			const UINT value = pSource[x];
+			pixels[x] = Color::MakeARGB(BYTE_MAX, Expand5(value >> 11), Expand6((value >> 5) & 0x3F), Expand5(value & 0x1F));
+		}
+		break;
+	}
+	case RowFormat::RGB24:
+		for (UINT x = 0; x < width; ++x, pRow += 3)
+			pixels[x] = Color::MakeARGB(BYTE_MAX, pRow[2], pRow[1], pRow[0]);
+		break;
+	case RowFormat::RGB32: {
+		auto pSource = (const ARGB*) pRow;
+		for (UINT x = 0; x < width; ++x)
+			pixels[x] = pSource[x] | 0xFF000000;
+		break;
+	}
+	case RowFormat::ARGB32:
+		memcpy(pixels, pRow, width * sizeof(ARGB));
+		break;
+	case RowFormat::PARGB32: {
+		auto pSource = (const ARGB*) pRow;
+		for (UINT x = 0; x < width; ++x) {
+			const ARGB argb = pSource[x];
+			const UINT alpha = argb >> 24;
+			if (alpha == BYTE_MAX || alpha == 0)
+				pixels[x] = alpha ? argb : 0;
+			else
+				pixels[x] = Color::MakeARGB(alpha, Unpremultiply((argb >> 16) & 0xFF, alpha), Unpremultiply((argb >> 8) & 0xFF, alpha), Unpremultiply(argb & 0xFF, alpha));
+		}
+		break;
+	}
+	case RowFormat::RGB48:
+	case RowFormat::ARGB64:
+	case RowFormat::PARGB64: {
+		auto toSRGB = GetLinearToSRGB();
+		auto pSource = (const unsigned short*) pRow;
+		const UINT channels = format == RowFormat::RGB48 ? 3 : 4;
+		for (UINT x = 0; x < width; ++x, pSource += channels) {
+			UINT alpha = channels > 3 ? min<UINT>(pSource[3], LINEAR_MAX) : LINEAR_MAX;
+			UINT rgb[3];
+			for (int c = 0; c < 3; ++c) {
+				rgb[c] = min<UINT>(pSource[c], LINEAR_MAX);
+				if (format == RowFormat::PARGB64 && alpha > 0 && alpha < LINEAR_MAX)
+					rgb[c] = min(LINEAR_MAX, (rgb[c] * LINEAR_MAX + alpha / 2) / alpha);
+			}
+			pixels[x] = Color::MakeARGB((BYTE) ((alpha * BYTE_MAX + LINEAR_MAX / 2) / LINEAR_MAX), toSRGB[rgb[2]], toSRGB[rgb[1]], toSRGB[rgb[0]]);
+		}
+		break;
+	}
+	}
+}
+
+bool DecodeRows(const BYTE* pSource, const UINT width, const UINT height, const int stride, const RowFormat format, const ColorPalette* pPalette, ARGB* pixels)
+{
+	const bool indexed = format == RowFormat::Indexed1 || format == RowFormat::Indexed4 || format == RowFormat::Indexed8;
+	if (pSource == nullptr || pixels == nullptr || width == 0 || height == 0 || (indexed && (pPalette == nullptr || pPalette->Count == 0))) {
+		cerr << "Invalid pixel rows" << endl;
+		return false;
+	}
+
+	// Indices past the end of the palette read as opaque black
+	ARGB entries[BYTE_MAX + 1];
+	if (indexed) {
+		const UINT count = min<UINT>(pPalette->Count, BYTE_MAX + 1);
+		copy(pPalette->Entries, pPalette->Entries + count, entries);
+		fill(entries + count, entries + BYTE_MAX + 1, Color::Black);
+	}
+
+	for (UINT y = 0; y < height; ++y)
+		DecodeRow(pSource + (ptrdiff_t) y * stride, width, format, entries, pixels + y * width);
+	return true;
+}
+
+#ifdef _WIN32
 bool ProcessImagePixels(Bitmap* pDest, const ARGB* qPixels, const bool& hasSemiTransparency, const int& transparentPixelIndex)
 {
 	UINT bpp = GetPixelFormatSize(pDest->GetPixelFormat());
@@ -806,125 +1196,99 @@ bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsig
 	return pDest->GetLastStatus() == Ok;
 }
 
-bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor)
+bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsigned short* qPixels, const bool& hasSemiTransparency, const int& transparentPixelIndex)
+{
+	const UINT nSize = pDest->GetWidth() * pDest->GetHeight();
+	auto pPixels = make_unique<ARGB[]>(nSize);
+	for (UINT i = 0; i < nSize; ++i) {
+		Color c(pPalette->Entries[qPixels[i]]);
+		pPixels[i] = hasSemiTransparency ? c.GetValue() : GetARGB1555(c);
+	}
+	return ProcessImagePixels(pDest, pPixels.get(), hasSemiTransparency, transparentPixelIndex);
+}
+
+static bool GetRowFormat(const PixelFormat pixelFormat, RowFormat& format)
+{
+	switch (pixelFormat) {
+	case PixelFormat1bppIndexed: format = RowFormat::Indexed1; return true;
+	case PixelFormat4bppIndexed: format = RowFormat::Indexed4; return true;
+	case PixelFormat8bppIndexed: format = RowFormat::Indexed8; return true;
+	case PixelFormat16bppRGB555: format = RowFormat::RGB555; return true;
+	case PixelFormat16bppRGB565: format = RowFormat::RGB565; return true;
+	case PixelFormat16bppARGB1555: format = RowFormat::ARGB1555; return true;
+	case PixelFormat24bppRGB: format = RowFormat::RGB24; return true;
+	case PixelFormat32bppRGB: format = RowFormat::RGB32; return true;
+	case PixelFormat32bppARGB: format = RowFormat::ARGB32; return true;
+	case PixelFormat32bppPARGB: format = RowFormat::PARGB32; return true;
+	case PixelFormat48bppRGB: format = RowFormat::RGB48; return true;
+	case PixelFormat64bppARGB: format = RowFormat::ARGB64; return true;
+	case PixelFormat64bppPARGB: format = RowFormat::PARGB64; return true;
+	}
+	return false;
+}
+
+bool ReadPixels(Bitmap* pSource, ARGB* pixels)
 {
-	const UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
 	const UINT bitmapWidth = pSource->GetWidth();
 	const UINT bitmapHeight = pSource->GetHeight();
-	
-	hasSemiTransparency = false;
-	transparentPixelIndex = -1;
 
-	int pixelIndex = 0;
-	if (pSource->GetPixelFormat() & PixelFormatIndexed) {
-		int paletteSize = pSource->GetPaletteSize();
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + (1 << bitDepth) * sizeof(ARGB));
-		auto pPalette = (ColorPalette*) pPaletteBytes.get();
-		pSource->GetPalette(pPalette, paletteSize);
+	// Formats DecodeRows does not know are converted by GDI+ instead
+	PixelFormat pixelFormat = pSource->GetPixelFormat();
+	RowFormat format;
+	if (!GetRowFormat(pixelFormat, format)) {
+		pixelFormat = PixelFormat32bppARGB;
+		format = RowFormat::ARGB32;
+	}
 
-		BitmapData data;
-		Status status = pSource->LockBits(&Rect(0, 0, bitmapWidth, bitmapHeight), ImageLockModeRead, pSource->GetPixelFormat(), &data);
-		if (status != Ok)
+	unique_ptr<BYTE[]> pPaletteBytes;
+	ColorPalette* pPalette = nullptr;
+	if (pixelFormat & PixelFormatIndexed) {
+		const int paletteSize = pSource->GetPaletteSize();
+		pPaletteBytes = make_unique<BYTE[]>(max<int>(paletteSize, sizeof(ColorPalette)));
+		pPalette = (ColorPalette*) pPaletteBytes.get();
+		if (pSource->GetPalette(pPalette, paletteSize) != Ok)
 			return false;
-
-		auto pRowSource = (LPBYTE)data.Scan0;
-		UINT strideSource;
-
-		if (data.Stride > 0)
-			strideSource = data.Stride;
-		else {
-			// Compensate for possible negative stride
-			// (not needed for first loop, but we have to do it
-			// for second loop anyway)
-			pRowSource += bitmapHeight * data.Stride;
-			strideSource = -data.Stride;
-		}
-
-		// First loop: gather color information
-		for (UINT y = 0; y < bitmapHeight; ++y) {	// For each row...
-			auto pPixelSource = pRowSource;
-
-			for (UINT x = 0; x < bitmapWidth; ++x) {	// ...for each pixel...
-				BYTE pixelAlpha = BYTE_MAX;
-
-				BYTE index = *pPixelSource++;
-				auto argb = pPalette->Entries[index];
-				if (index == transparentPixelIndex)
-					pixelAlpha = 0;
-
-				if (pixelAlpha < BYTE_MAX) {
-					hasSemiTransparency = true;
-					if (pixelAlpha == 0) {
-						transparentColor = argb;
-						transparentPixelIndex = pixelIndex;
-					}
-				}
-				pixels[pixelIndex++] = argb;
-			}
-
-			pRowSource += strideSource;
-		}
-
-		pSource->UnlockBits(&data);
-
-		auto nSize = pSource->GetPropertyItemSize(PropertyTagIndexTransparent);
-		if (nSize > 0) {
-			auto pPropertyItem = make_unique<PropertyItem[]>(nSize);
-			pSource->GetPropertyItem(PropertyTagIndexTransparent, nSize, pPropertyItem.get());
-			if (pPropertyItem.get()->length > 0) {
-				transparentPixelIndex = *(BYTE*)pPropertyItem.get()->value;
-				Color c(pPalette->Entries[transparentPixelIndex]);
-				transparentColor = Color::MakeARGB(0, c.GetR(), c.GetG(), c.GetB());
-			}
-		}
-		return true;
 	}
 
 	BitmapData data;
-	Status status = pSource->LockBits(&Rect(0, 0, bitmapWidth, bitmapHeight), ImageLockModeRead, PixelFormat32bppARGB, &data);
+	Status status = pSource->LockBits(&Rect(0, 0, bitmapWidth, bitmapHeight), ImageLockModeRead, pixelFormat, &data);
 	if (status != Ok)
 		return false;
 
-	auto pRowSource = (LPBYTE)data.Scan0;
-	UINT strideSource;
-
-	if (data.Stride > 0) strideSource = data.Stride;
-	else
-	{
-		// Compensate for possible negative stride
-		// (not needed for first loop, but we have to do it
-		// for second loop anyway)
-		pRowSource += bitmapHeight * data.Stride;
-		strideSource = -data.Stride;
-	}
-	
-	// First loop: gather color information
-	for (UINT y = 0; y < bitmapHeight; ++y) {	// For each row...
-		auto pPixelSource = pRowSource;
+	const bool result = DecodeRows((const BYTE*) data.Scan0, bitmapWidth, bitmapHeight, data.Stride, format, pPalette, pixels);
+	pSource->UnlockBits(&data);
+	return result;
+}
 
-		for (UINT x = 0; x < bitmapWidth; ++x) {	// ...for each pixel...
-			BYTE pixelBlue = *pPixelSource++;
-			BYTE pixelGreen = *pPixelSource++;
-			BYTE pixelRed = *pPixelSource++;
-			BYTE pixelAlpha = *pPixelSource++;
-			auto argb = Color::MakeARGB(pixelAlpha, pixelRed, pixelGreen, pixelBlue);			
+bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor)
+{
+	hasSemiTransparency = false;
+	transparentPixelIndex = -1;
 
-			if (pixelAlpha < BYTE_MAX) {									
-				if (pixelAlpha == 0) {
-					transparentColor = argb;
-					transparentPixelIndex = pixelIndex;
-				}
-				else
-					hasSemiTransparency = true;
-			}
-			pixels[pixelIndex++] = argb;
-		}
+	if (!ReadPixels(pSource, pixels.data()))
+		return false;
 
-		pRowSource += strideSource;
+	if (!(pSource->GetPixelFormat() & PixelFormatIndexed)) {
+		ScanTransparency(pixels.data(), (UINT) pixels.size(), 0, hasSemiTransparency, transparentPixelIndex, transparentColor);
+		return true;
 	}
 
-	pSource->UnlockBits(&data);
-
+	// Indexed images mark their transparent entry in a property instead
+	auto nSize = pSource->GetPropertyItemSize(PropertyTagIndexTransparent);
+	if (nSize > 0) {
+		auto pPropertyItem = make_unique<PropertyItem[]>(nSize);
+		pSource->GetPropertyItem(PropertyTagIndexTransparent, nSize, pPropertyItem.get());
+		if (pPropertyItem.get()->length > 0) {
+			const int paletteSize = pSource->GetPaletteSize();
+			auto pPaletteBytes = make_unique<BYTE[]>(paletteSize);
+			auto pPalette = (ColorPalette*) pPaletteBytes.get();
+			pSource->GetPalette(pPalette, paletteSize);
+
+			transparentPixelIndex = *(BYTE*)pPropertyItem.get()->value;
+			Color c(pPalette->Entries[transparentPixelIndex]);
+			transparentColor = Color::MakeARGB(0, c.GetR(), c.GetG(), c.GetB());
+		}
+	}
 	return true;
 }
 
@@ -1001,4 +1365,5 @@ bool HasTransparency(Bitmap* pSource)
 	pSource->UnlockBits(&data);
 
 	return false;
-}
\ No newline at end of file
+}
+#endif // _WIN32
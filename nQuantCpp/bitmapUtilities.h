@@ -1,9 +1,11 @@
 #pragma once
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <vector>
 using namespace std;
 
+#ifdef _WIN32
 //////////////////////////////////////////////////////////////////////////
 //
 // GetBitmapHeaderSize
@@ -57,20 +59,116 @@ BOOL FixBitmapHeight(PVOID pDib, ULONG nSize, BOOL bTopDown);
 //
 
 BOOL FillBitmapFileHeader(LPCVOID pDib, PBITMAPFILEHEADER pbmfh);
+#endif // _WIN32
 
-typedef unsigned short (*DitherFn)(const ColorPalette*, const UINT nMaxColors, const ARGB);
+typedef function<unsigned short(const ColorPalette*, const UINT nMaxColors, const ARGB)> DitherFn;
 
-bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height);
+//////////////////////////////////////////////////////////////////////////
+//
+// Stripe streaming
+//
+// ReadRowsFn fills pixels with rows [y, y + rows) of a 32bpp ARGB image,
+// packed width pixels per row. WriteRowsFn receives the palette indices of
+// the same rows. Either returns false to abort the quantization.
+//
+
+typedef function<bool(const UINT y, const UINT rows, ARGB* pixels)> ReadRowsFn;
+typedef function<bool(const UINT y, const UINT rows, const unsigned short* qPixels)> WriteRowsFn;
+typedef function<bool(const UINT y, const UINT rows, const ARGB* pixels)> StripeFn;
+
+bool ReadStripes(ReadRowsFn readRows, const UINT width, const UINT height, const UINT stripeHeight, vector<ARGB>& stripe, const StripeFn& stripeFn);
+
+void ScanTransparency(const ARGB* pixels, const UINT nSize, const UINT offset, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor);
+
+class InverseColormap;
+
+// How dither_image spreads the quantization error. ErrorDiffusion scans the rows
+// in serpentine order. ErrorDiffusionRaster scans every row left to right, which
+// lets several threads dither rows at once. The ordered modes offset each pixel
+// by its cell of a tiled Bayer or blue noise threshold matrix instead, so every
+// pixel is looked up on its own. ErrorDiffusionRaster and the ordered modes only
+// use threads when an InverseColormap replaces the DitherFn, which the quantizers
+// defer for them when they do not build one.
+// The last four diffuse in serpentine order like ErrorDiffusion, which is Floyd-
+// Steinberg, with other kernels: Sierra Lite and Atkinson reach fewer neighbours
+// and run faster, Stucki and Jarvis spread the error over two rows below.
+enum class DitherMode { ErrorDiffusion, ErrorDiffusionRaster, Bayer4x4, Bayer8x8, BlueNoise, SierraLite, Atkinson, Stucki, Jarvis };
+
+// Whether dither_image spreads mode over threads, given an InverseColormap
+inline bool IsThreadedDither(const DitherMode mode)
+{
+	return mode == DitherMode::ErrorDiffusionRaster || mode == DitherMode::Bayer4x4 || mode == DitherMode::Bayer8x8 || mode == DitherMode::BlueNoise;
+}
+
+// Error rows and colour lookup of dither_image, kept from one stripe to the
+// next so that dithering stripe by stripe matches dithering the whole image.
+// A pColormap, built or deferred, takes the place of the lookup filled while dithering.
+// row is the first row of the next stripe, where the ordered modes resume.
+// kernelErr holds the error rows of the serpentine kernels, erowErr the one of
+// ErrorDiffusionRaster.
+struct DitherState
+{
+	vector<short> erowErr, orowErr, lookup;
+	vector<vector<int> > kernelErr;
+	bool odd_scanline = false;
+	DitherMode mode = DitherMode::ErrorDiffusion;
+	UINT row = 0;
+	const InverseColormap* pColormap = nullptr;
+
+	DitherState(const UINT width) : erowErr((width + 2) * 4), orowErr((width + 2) * 4), lookup(65536)
+	{
+	}
+};
+
+bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const InverseColormap* pColormap = nullptr, const DitherMode ditherMode = DitherMode::ErrorDiffusion);
+
+bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT rows, DitherState& state);
 
 bool dithering_image(const ARGB* pixels, ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, ARGB* qPixels, const UINT width, const UINT height);
 
+//////////////////////////////////////////////////////////////////////////
+//
+// GrabPixels
+//
+// Scans a caller-owned 32bpp ARGB buffer for transparency. stride is the
+// distance in bytes between rows and may be negative for bottom-up buffers.
+// When the rows are contiguous pPixels refers to pSource directly,
+// otherwise they are packed into pixels and pPixels refers to that copy.
+//
+
+bool GrabPixels(const ARGB* pSource, const UINT width, const UINT height, const int stride, const ARGB*& pPixels, vector<ARGB>& pixels, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor);
+
+//////////////////////////////////////////////////////////////////////////
+//
+// DecodeRows
+//
+// Layouts of the source rows DecodeRows turns into 32bpp ARGB, as GDI+ lays
+// them out: channels little endian from blue up, indices packed from the most
+// significant bit, and 48 and 64bpp channels linear in 0 .. 8192.
+//
+
+enum class RowFormat { Indexed1, Indexed4, Indexed8, RGB555, RGB565, ARGB1555, RGB24, RGB32, ARGB32, PARGB32, RGB48, ARGB64, PARGB64 };
+
+// Decodes height rows of width pixels into packed ARGB a row at a time. Row y
+// starts stride * y bytes from pSource, so a negative stride walks backwards, and
+// pPalette gives the colours of the indexed formats.
+bool DecodeRows(const BYTE* pSource, const UINT width, const UINT height, const int stride, const RowFormat format, const ColorPalette* pPalette, ARGB* pixels);
+
+#ifdef _WIN32
 bool ProcessImagePixels(Bitmap* pDest, const ARGB* qPixels, const bool& hasSemiTransparency, const int& transparentPixelIndex);
 
 bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsigned short* qPixels);
 
+bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsigned short* qPixels, const bool& hasSemiTransparency, const int& transparentPixelIndex);
+
+// Decodes every pixel of pSource into width * height packed ARGB, locking the rows
+// in their own format when DecodeRows knows it and as 32bpp ARGB otherwise
+bool ReadPixels(Bitmap* pSource, ARGB* pixels);
+
 bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor);
 
 bool HasTransparency(Bitmap* pSource);
+#endif // _WIN32
 
 inline int GetARGBIndex(const Color& c, const bool& hasSemiTransparency)
 {
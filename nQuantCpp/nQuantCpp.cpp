@@ -2,8 +2,16 @@
 //
 
 #include "stdafx.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
 #include "nQuantCpp.h"
+#include "bitmapUtilities.h"
 
 #include "PnnQuantizer.h"
 #include "NeuQuantizer.h"
@@ -27,18 +35,22 @@ ostream& tcout = cout;
 
 GdiplusStartupInput  m_gdiplusStartupInput;
 ULONG_PTR m_gdiplusToken;
+mutex m_consoleMutex;
 
 CString algs = _T("PNN, PNNLAB, NEU, WU, EAS, SPA, DIV, MODE, MMC");
 
 void PrintUsage()
 {
     cout << endl;
-    cout << "usage: nQuantCpp <input image path> [options]" << endl;
+    cout << "usage: nQuantCpp <input image path | directory | wildcard | @list file> [options]" << endl;
     cout << endl;
     cout << "Valid options:" << endl;
 	cout << "  /a : Algorithm used - Choose one of them, otherwise give you the defaults from [" << CStringA(algs) << "] ." << endl;
+    cout << "  /d : Dithering - One of NONE, FS (Floyd-Steinberg), RASTER (Floyd-Steinberg without serpentine scan), BAYER4, BAYER8, BLUE (blue noise), SIERRA (Sierra Lite), ATKINSON, STUCKI or JARVIS. The default is FS." << endl;
     cout << "  /m : Max Colors (pixel-depth) - Maximum number of colors for the output format to support. The default is 256 (8-bit)." << endl;
     cout << "  /o : Output image file dir. The default is <source image path directory>" << endl;
+    cout << "  /t : Number of worker threads used when converting several images. The default is the number of processors." << endl;
+    cout << "  /s : Seed of the random choices, so that runs can be repeated. By default PNNLAB takes one from the clock and the others a fixed one." << endl;
 }
 
 bool isdigit(const char* string) {
@@ -62,7 +74,27 @@ bool isAlgo(const CString& algo) {
 	return false;
 }
 
-bool ProcessArgs(int argc, CString& algo, UINT& nMaxColors, CString& targetPath, char** argv)
+bool toDitherMode(const CString& name, bool& dither, DitherMode& ditherMode) {
+	static const pair<LPCTSTR, DitherMode> modes[] = {
+		{ _T("FS"), DitherMode::ErrorDiffusion }, { _T("RASTER"), DitherMode::ErrorDiffusionRaster },
+		{ _T("BAYER4"), DitherMode::Bayer4x4 }, { _T("BAYER8"), DitherMode::Bayer8x8 }, { _T("BLUE"), DitherMode::BlueNoise },
+		{ _T("SIERRA"), DitherMode::SierraLite }, { _T("ATKINSON"), DitherMode::Atkinson }, { _T("STUCKI"), DitherMode::Stucki }, { _T("JARVIS"), DitherMode::Jarvis }
+	};
+
+	dither = name != _T("NONE");
+	if (!dither)
+		return true;
+
+	for (const auto& mode : modes) {
+		if (name == mode.first) {
+			ditherMode = mode.second;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ProcessArgs(int argc, CString& algo, UINT& nMaxColors, CString& targetPath, UINT& nThreads, bool& dither, DitherMode& ditherMode, int& seed, char** argv)
 {
 	for (int index = 1; index < argc; ++index) {
 		auto currentArg = CString(argv[index]).MakeUpper();
@@ -77,6 +109,12 @@ bool ProcessArgs(int argc, CString& algo, UINT& nMaxColors, CString& targetPath,
 				}
 				algo = tmpAlgo;
 			}
+			else if (currentArg[1] == _T('D')) {
+				if (index >= argc - 1 || !toDitherMode(CString(argv[index + 1]).MakeUpper(), dither, ditherMode)) {
+					PrintUsage();
+					return false;
+				}
+			}
 			else if (currentArg[1] == _T('M')) {
 				if (index >= argc - 1 || !isdigit(argv[index + 1])) {
 					PrintUsage();
@@ -95,6 +133,22 @@ bool ProcessArgs(int argc, CString& algo, UINT& nMaxColors, CString& targetPath,
 				}
 				targetPath = CString(argv[index + 1]);
 			}
+			else if (currentArg[1] == _T('T')) {
+				if (index >= argc - 1 || !isdigit(argv[index + 1])) {
+					PrintUsage();
+					return false;
+				}
+				nThreads = atoi(argv[index + 1]);
+				if (nThreads < 1)
+					nThreads = 1;
+			}
+			else if (currentArg[1] == _T('S')) {
+				if (index >= argc - 1 || !isdigit(argv[index + 1])) {
+					PrintUsage();
+					return false;
+				}
+				seed = atoi(argv[index + 1]);
+			}
 			else {
 				PrintUsage();
 				return false;
@@ -104,47 +158,77 @@ bool ProcessArgs(int argc, CString& algo, UINT& nMaxColors, CString& targetPath,
 	return true;
 }
 
-bool QuantizeImage(const CString& algorithm, LPCTSTR sourceFile, LPCTSTR targetDir, Bitmap* pSource, UINT nMaxColors, bool dither)
+// Seeds the quantizer when the command line gave a seed
+template <typename Quantizer>
+void SetSeed(Quantizer& quantizer, const int seed)
+{
+	if (seed >= 0)
+		quantizer.SetSeed(seed);
+}
+
+// Quantizes pixels already grabbed from the source image and encodes the result,
+// so that several algorithms can share one decoded copy of the image.
+bool QuantizeImage(const CString& algorithm, LPCTSTR sourceFile, LPCTSTR targetDir, const vector<ARGB>& pixels, const UINT width, const UINT height, const bool hasSemiTransparency, const int transparentPixelIndex, UINT nMaxColors, bool dither, DitherMode ditherMode, const int seed)
 {	
-	// Create 8 bpp indexed bitmap of the same size
-	auto pDest = make_unique<Bitmap>(pSource->GetWidth(), pSource->GetHeight(), (nMaxColors > 256) ? PixelFormat16bppARGB1555 : (nMaxColors > 16) ? PixelFormat8bppIndexed : (nMaxColors > 2) ? PixelFormat4bppIndexed : PixelFormat1bppIndexed);
+	auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+	auto pPalette = (ColorPalette*)pPaletteBytes.get();
+	auto qPixels = make_unique<unsigned short[]>(pixels.size());
+	const int stride = width * sizeof(ARGB);
 
 	bool bSucceeded = false;
 	if(algorithm == _T("PNN")) {
 		PnnQuant::PnnQuantizer pnnQuantizer;
-		bSucceeded = pnnQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors, dither);
+		SetSeed(pnnQuantizer, seed);
+		bSucceeded = pnnQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors, dither, ditherMode);
 	}
 	else if(algorithm == _T("PNNLAB")) {
 		PnnLABQuant::PnnLABQuantizer pnnLABQuantizer;
-		bSucceeded = pnnLABQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors, dither);
+		SetSeed(pnnLABQuantizer, seed);
+		bSucceeded = pnnLABQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors, dither, ditherMode);
 	}
 	else if(algorithm == _T("NEU")) {
 		NeuralNet::NeuQuantizer neuQuantizer;
-		bSucceeded = neuQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors, dither);
+		SetSeed(neuQuantizer, seed);
+		bSucceeded = neuQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors, dither, ditherMode);
 	}
 	else if(algorithm == _T("WU")) {
 		nQuant::WuQuantizer wuQuantizer;
-		bSucceeded = wuQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors, dither);
+		SetSeed(wuQuantizer, seed);
+		bSucceeded = wuQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors, dither, 0, 1, ditherMode);
 	}
 	else if(algorithm == _T("EAS")) {
 		EdgeAwareSQuant::EdgeAwareSQuantizer easQuantizer;
-		bSucceeded = easQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors);
+		SetSeed(easQuantizer, seed);
+		bSucceeded = easQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors);
 	}
 	else if(algorithm == _T("SPA")) {
 		SpatialQuant::SpatialQuantizer spaQuantizer;
-		bSucceeded = spaQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors);
+		SetSeed(spaQuantizer, seed);
+		bSucceeded = spaQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors);
 	}
 	else if (algorithm == _T("DIV")) {
 		DivQuant::DivQuantizer divQuantizer;
-		bSucceeded = divQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors, dither);
+		bSucceeded = divQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors, dither, ditherMode);
 	}
 	else if (algorithm == _T("MODE")) {
 		MoDEQuant::MoDEQuantizer moDEQuantizer;
-		bSucceeded = moDEQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors, dither);		
+		SetSeed(moDEQuantizer, seed);
+		bSucceeded = moDEQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors, dither, ditherMode);
 	}
 	else if (algorithm == _T("MMC")) {
 		MedianCutQuant::MedianCut mmcQuantizer;
-		bSucceeded = mmcQuantizer.QuantizeImage(pSource, pDest.get(), nMaxColors, dither);
+		SetSeed(mmcQuantizer, seed);
+		bSucceeded = mmcQuantizer.QuantizeImage(pixels.data(), width, height, stride, pPalette, qPixels.get(), nMaxColors, dither, ditherMode);
+	}
+
+	// Several quantizers lower nMaxColors to the colours they produced, so the output
+	// format follows the returned count rather than the requested one
+	auto pDest = make_unique<Bitmap>(width, height, (nMaxColors > 256) ? PixelFormat16bppARGB1555 : (nMaxColors > 16) ? PixelFormat8bppIndexed : (nMaxColors > 2) ? PixelFormat4bppIndexed : PixelFormat1bppIndexed);
+	if (bSucceeded) {
+		if (nMaxColors > 256)
+			bSucceeded = ProcessImagePixels(pDest.get(), pPalette, qPixels.get(), hasSemiTransparency, transparentPixelIndex);
+		else
+			bSucceeded = ProcessImagePixels(pDest.get(), pPalette, qPixels.get());
 	}
 	
 	if(!bSucceeded)
@@ -162,6 +246,7 @@ bool QuantizeImage(const CString& algorithm, LPCTSTR sourceFile, LPCTSTR targetD
 	// image/png  : {557cf406-1a04-11d3-9a73-0000f81ef32e}
 	const CLSID pngEncoderClsId = { 0x557cf406, 0x1a04, 0x11d3,{ 0x9a,0x73,0x00,0x00,0xf8,0x1e,0xf3,0x2e } };
 	Status status = pDest->Save(CA2W(destPath), &pngEncoderClsId);
+	lock_guard<mutex> lock(m_consoleMutex);
 	if (status == Status::Ok)
 		tcout << _T("Converted image: ") << (LPCTSTR) destPath << endl;
 	else
@@ -170,6 +255,189 @@ bool QuantizeImage(const CString& algorithm, LPCTSTR sourceFile, LPCTSTR targetD
 	return status == Status::Ok;
 }
 
+bool isImageFile(LPCTSTR filePath)
+{
+	static const LPCTSTR extensions[] = { _T(".bmp"), _T(".gif"), _T(".jpg"), _T(".jpeg"), _T(".png"), _T(".tif"), _T(".tiff") };
+	auto ext = PathFindExtension(filePath);
+	for (auto extension : extensions) {
+		if (_tcsicmp(ext, extension) == 0)
+			return true;
+	}
+	return false;
+}
+
+CString GetFullPath(const CString& szDir, const CString& path)
+{
+	if (!PathIsRelative(path))
+		return path;
+
+	TCHAR szPath[MAX_PATH];
+	PathCombine(szPath, szDir, path);
+	return szPath;
+}
+
+void FindImageFiles(const CString& pattern, const bool imagesOnly, vector<CString>& sourcePaths)
+{
+	TCHAR szDir[MAX_PATH];
+	_tcsncpy_s(szDir, pattern, MAX_PATH);
+	PathRemoveFileSpec(szDir);
+
+	WIN32_FIND_DATA findData;
+	auto hFind = FindFirstFile(pattern, &findData);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+
+	do {
+		if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+		if (imagesOnly && !isImageFile(findData.cFileName))
+			continue;
+
+		TCHAR szPath[MAX_PATH];
+		PathCombine(szPath, szDir, findData.cFileName);
+		sourcePaths.emplace_back(szPath);
+	} while (FindNextFile(hFind, &findData));
+	FindClose(hFind);
+}
+
+// Expands the source argument: a directory, a wildcard pattern, a text file
+// prefixed with '@' listing one image per line, or a single image.
+bool GetSourcePaths(const CString& szDir, const CString& source, vector<CString>& sourcePaths, bool& isBatch)
+{
+	isBatch = true;
+	if (source.GetLength() > 1 && source[0] == _T('@')) {
+		auto listPath = GetFullPath(szDir, source.Mid(1));
+		ifstream listFile((LPCTSTR) listPath);
+		if (!listFile) {
+			cout << "The file list you specified does not exist." << endl;
+			return false;
+		}
+
+		string line;
+		while (getline(listFile, line)) {
+			CString path(line.c_str());
+			path.Trim();
+			if (!path.IsEmpty())
+				sourcePaths.emplace_back(GetFullPath(szDir, path));
+		}
+		return true;
+	}
+
+	auto sourcePath = GetFullPath(szDir, source);
+	if (sourcePath.FindOneOf(_T("*?")) >= 0) {
+		FindImageFiles(sourcePath, false, sourcePaths);
+		return true;
+	}
+
+	if (PathIsDirectory(sourcePath)) {
+		TCHAR szPattern[MAX_PATH];
+		PathCombine(szPattern, sourcePath, _T("*"));
+		FindImageFiles(szPattern, true, sourcePaths);
+		return true;
+	}
+
+	isBatch = false;
+	if (!PathFileExists(sourcePath)) {
+		cout << "The source file you specified does not exist." << endl;
+		return false;
+	}
+	sourcePaths.emplace_back(sourcePath);
+	return true;
+}
+
+bool ProcessImage(const CString& algo, const CString& sourcePath, CString targetDir, UINT nMaxColors, bool dither, DitherMode ditherMode, const int seed, UINT& nPixels)
+{
+	nPixels = 0;
+	auto pSource = unique_ptr<Bitmap>(Bitmap::FromFile(CA2W(sourcePath)));
+	Status status = pSource->GetLastStatus();
+	if (status != Ok) {
+		lock_guard<mutex> lock(m_consoleMutex);
+		tcout << _T("Failed to read image in '") << (LPCTSTR) sourcePath << _T("' file") << endl;
+		return false;
+	}
+
+	if (!PathFileExists(targetDir))
+		targetDir = sourcePath.Left(sourcePath.ReverseFind(_T('\\')));
+
+	const UINT width = pSource->GetWidth();
+	const UINT height = pSource->GetHeight();
+	nPixels = width * height;
+	vector<ARGB> pixels(width * height);
+	bool hasSemiTransparency = false;
+	int transparentPixelIndex = -1;
+	ARGB transparentColor = Color::Transparent;
+	if (!GrabPixels(pSource.get(), pixels, hasSemiTransparency, transparentPixelIndex, transparentColor)) {
+		lock_guard<mutex> lock(m_consoleMutex);
+		tcout << _T("Failed to read pixels of '") << (LPCTSTR) sourcePath << _T("' file") << endl;
+		return false;
+	}
+	pSource.reset();
+
+	CString sourceFile = sourcePath.Mid(sourcePath.ReverseFind(_T('\\')) + 1);
+	if (algo != _T(""))
+		return QuantizeImage(algo, sourceFile, targetDir, pixels, width, height, hasSemiTransparency, transparentPixelIndex, nMaxColors, dither, ditherMode, seed);
+
+	vector<CString> algorithms = { /*_T("MMC"),*/ _T("DIV") };
+	if (nMaxColors > 32)
+		algorithms.insert(algorithms.end(), { _T("PNN"), _T("WU"), /*_T("MODE"),*/ _T("NEU") });
+	else
+		algorithms.insert(algorithms.end(), { _T("PNNLAB"), _T("EAS"), _T("SPA") });
+
+	// Every quantizer keeps its own state, so the comparison runs them side by side
+	// over the shared pixels and each task encodes its own output.
+	vector<future<bool> > tasks;
+	for (const auto& algorithm : algorithms)
+		tasks.emplace_back(async(launch::async, [&, algorithm]() {
+			return QuantizeImage(algorithm, sourceFile, targetDir, pixels, width, height, hasSemiTransparency, transparentPixelIndex, nMaxColors, dither, ditherMode, seed);
+		}));
+
+	bool bSucceeded = true;
+	for (auto& task : tasks)
+		bSucceeded &= task.get();
+	return bSucceeded;
+}
+
+// Converts the images on a pool of nThreads workers, reporting the throughput
+// of each file and of the whole batch.
+void ProcessImages(const CString& algo, const vector<CString>& sourcePaths, const CString& targetDir, UINT nMaxColors, bool dither, DitherMode ditherMode, const int seed, UINT nThreads)
+{
+	atomic<size_t> nextIndex(0);
+	atomic<UINT> nFailed(0);
+	atomic<unsigned long long> nTotalPixels(0);
+
+	auto worker = [&]() {
+		for (size_t i = nextIndex++; i < sourcePaths.size(); i = nextIndex++) {
+			auto start = chrono::steady_clock::now();
+			UINT nPixels = 0;
+			bool bSucceeded = ProcessImage(algo, sourcePaths[i], targetDir, nMaxColors, dither, ditherMode, seed, nPixels);
+			double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			if (!bSucceeded)
+				++nFailed;
+			nTotalPixels += nPixels;
+
+			lock_guard<mutex> lock(m_consoleMutex);
+			tcout << (LPCTSTR) sourcePaths[i] << _T(": ") << (seconds * 1000) << _T(" ms, ")
+				<< (seconds > 0 ? nPixels / seconds / 1e6 : 0) << _T(" MP/s") << (bSucceeded ? _T("") : _T(" (failed)")) << endl;
+		}
+	};
+
+	if (nThreads > sourcePaths.size())
+		nThreads = (UINT) sourcePaths.size();
+
+	auto start = chrono::steady_clock::now();
+	vector<thread> workers;
+	for (UINT i = 1; i < nThreads; ++i)
+		workers.emplace_back(worker);
+	worker();
+	for (auto& t : workers)
+		t.join();
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	tcout << _T("Processed ") << sourcePaths.size() << _T(" images (") << nFailed.load() << _T(" failed) on ") << nThreads << _T(" threads in ")
+		<< seconds << _T(" s: ") << (seconds > 0 ? sourcePaths.size() / seconds : 0) << _T(" images/s, ")
+		<< (seconds > 0 ? nTotalPixels.load() / seconds / 1e6 : 0) << _T(" MP/s") << endl;
+}
+
 int main(int argc, char** argv)
 {
 	if (argc <= 1) {
@@ -184,56 +452,41 @@ int main(int argc, char** argv)
 	CString szDir = szDirectory;	
 	
 	UINT nMaxColors = 256;	
+	UINT nThreads = max(thread::hardware_concurrency(), 1u);
 	CString algo = _T(""), targetDir = _T("");
+	vector<CString> sourcePaths;
+	bool isBatch = false;
+	bool dither = true;
+	DitherMode ditherMode = DitherMode::ErrorDiffusion;
+	// Negative when the command line gives none
+	int seed = -1;
 #ifdef _DEBUG
-	CString sourcePath = szDir + _T("\\..\\ImgV64.gif");
+	sourcePaths.emplace_back(szDir + _T("\\..\\ImgV64.gif"));
 	nMaxColors = 1024;
+	if(!PathFileExists(sourcePaths[0])) {
+		cout << "The source file you specified does not exist." << endl;
+		return 0;
+	}
 #else
-	if (!ProcessArgs(argc, algo, nMaxColors, targetDir, argv))
+	if (!ProcessArgs(argc, algo, nMaxColors, targetDir, nThreads, dither, ditherMode, seed, argv))
 		return 0;
 
-	CString sourcePath = CString(argv[1]);
-	if (sourcePath.FindOneOf(_T("\\")) < 0) {
-		TCHAR szSourcePath[MAX_PATH];
-		PathCombine(szSourcePath, szDir, sourcePath);
-		sourcePath = szSourcePath;
-	}
+	if (!GetSourcePaths(szDir, CString(argv[1]), sourcePaths, isBatch))
+		return 0;
 #endif	
-	
-	if(!PathFileExists(sourcePath)) {
-		cout << "The source file you specified does not exist." << endl;
+
+	if (sourcePaths.empty()) {
+		cout << "No image files were found." << endl;
 		return 0;
-	}		
+	}
 
 	if(GdiplusStartup(&m_gdiplusToken, &m_gdiplusStartupInput, NULL) == Ok) {
-		auto pSource = unique_ptr<Bitmap>(Bitmap::FromFile(CA2W(sourcePath)));
-		Status status = pSource->GetLastStatus();
-		if (status == Ok) {
-			if (!PathFileExists(targetDir))
-				targetDir = szDir.Left(sourcePath.ReverseFind(_T('\\')));
-
-			bool dither = true;
-			CString sourceFile = sourcePath.Mid(sourcePath.ReverseFind(_T('\\')) + 1);
-			if (algo == _T("")) {
-				//QuantizeImage(_T("MMC"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-				QuantizeImage(_T("DIV"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-				if (nMaxColors > 32) {
-					QuantizeImage(_T("PNN"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-					QuantizeImage(_T("WU"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-					//QuantizeImage(_T("MODE"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-					QuantizeImage(_T("NEU"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-				}
-				else {
-					QuantizeImage(_T("PNNLAB"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-					QuantizeImage(_T("EAS"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-					QuantizeImage(_T("SPA"), sourceFile, targetDir, pSource.get(), nMaxColors, dither);
-				}
-			}
-			else
-				QuantizeImage(algo, sourceFile, targetDir, pSource.get(), nMaxColors, dither);
+		if (isBatch)
+			ProcessImages(algo, sourcePaths, targetDir, nMaxColors, dither, ditherMode, seed, nThreads);
+		else {
+			UINT nPixels;
+			ProcessImage(algo, sourcePaths[0], targetDir, nMaxColors, dither, ditherMode, seed, nPixels);
 		}
-		else
-			tcout << _T("Failed to read image in '") << (LPCTSTR) sourcePath << _T("' file");
 	}
 	GdiplusShutdown(m_gdiplusToken);
     return 0;
@@ -2,6 +2,7 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include "targetver.h"
 
 #include <atlstr.h>
@@ -16,13 +17,16 @@
 #include <gdiplus.h>
 using namespace Gdiplus;
 #pragma comment(linker, "/manifestdependency:\"type='win32' name='Microsoft.Windows.GdiPlus' version='1.1.0.0' processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
+#else
+#include "GdiplusTypes.h"
+#endif // _WIN32
 
 inline double sqr(double value)
 {
 	return value * value;
 }
 
-#ifdef _WIN64
+#if defined(_WIN64) || !defined(_WIN32)
 #define _sqrt sqrt
 #else
 inline double __declspec (naked) __fastcall _sqrt(double n)
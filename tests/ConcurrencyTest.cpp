@@ -0,0 +1,156 @@
+// Runs every seeded quantizer over several images at once and checks that each
+// result is bit-identical to a serial run of the same quantizer on the same image.
+
+#include "stdafx.h"
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DivQuantizer.h"
+#include "Dl3Quantizer.h"
+#include "EdgeAwareSQuantizer.h"
+#include "MedianCut.h"
+#include "NeuQuantizer.h"
+#include "PnnLABQuantizer.h"
+#include "PnnQuantizer.h"
+#include "SpatialQuantizer.h"
+#include "WuQuantizer.h"
+
+using namespace std;
+
+const UINT SEED = 7;
+const UINT ROUNDS = 2;
+
+struct Image {
+	UINT width, height;
+	vector<ARGB> pixels;
+};
+
+struct Result {
+	bool succeeded = false;
+	UINT nMaxColors = 0;
+	vector<ARGB> palette;
+	vector<unsigned short> indices;
+
+	bool operator==(const Result& other) const
+	{
+		return succeeded == other.succeeded && nMaxColors == other.nMaxColors && palette == other.palette && indices == other.indices;
+	}
+};
+
+typedef function<bool(const Image& image, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors)> QuantizeFn;
+
+struct Algorithm {
+	string name;
+	UINT nMaxColors;
+	QuantizeFn quantize;
+};
+
+// Gradients with noise, translucent for odd seeds
+static Image MakeImage(const UINT width, const UINT height, const UINT seed)
+{
+	mt19937 random(seed);
+	Image image = { width, height, vector<ARGB>(width * height) };
+	for (UINT y = 0; y < height; ++y) {
+		for (UINT x = 0; x < width; ++x) {
+			const BYTE alpha = (seed % 2 && random() % 4 == 0) ? static_cast<BYTE>(random() % 256) : BYTE_MAX;
+			const BYTE red = static_cast<BYTE>(x * 255 / width + random() % 24);
+			const BYTE green = static_cast<BYTE>(y * 255 / height + random() % 24);
+			const BYTE blue = static_cast<BYTE>((x ^ y) * (seed + 1));
+			image.pixels[y * width + x] = Color::MakeARGB(alpha, red, green, blue);
+		}
+	}
+	return image;
+}
+
+// A fresh quantizer seeded with SEED for every run
+template <typename Quantizer>
+static QuantizeFn Seeded(function<bool(Quantizer&, const Image&, ColorPalette*, unsigned short*, UINT&)> quantize)
+{
+	return [quantize](const Image& image, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors) {
+		Quantizer quantizer;
+		quantizer.SetSeed(SEED);
+		return quantize(quantizer, image, pPalette, qPixels, nMaxColors);
+	};
+}
+
+#define QUANTIZE(Quantizer, ...) Seeded<Quantizer>([](Quantizer& quantizer, const Image& image, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors) { \
+		return quantizer.QuantizeImage(image.pixels.data(), image.width, image.height, image.width * sizeof(ARGB), pPalette, qPixels, nMaxColors, __VA_ARGS__); })
+
+// MoDE is left out, its evolution takes minutes even on small images
+static vector<Algorithm> GetAlgorithms()
+{
+	return {
+		{ "PNN", 256, QUANTIZE(PnnQuant::PnnQuantizer, true) },
+		{ "PNNLAB", 64, QUANTIZE(PnnLABQuant::PnnLABQuantizer, true) },
+		{ "NEU", 256, QUANTIZE(NeuralNet::NeuQuantizer, true) },
+		{ "WU", 256, QUANTIZE(nQuant::WuQuantizer, true) },
+		{ "WU-NODITHER", 256, QUANTIZE(nQuant::WuQuantizer, false) },
+		{ "EAS", 16, QUANTIZE(EdgeAwareSQuant::EdgeAwareSQuantizer, true) },
+		{ "SPA", 16, QUANTIZE(SpatialQuant::SpatialQuantizer, true) },
+		{ "MMC", 256, QUANTIZE(MedianCutQuant::MedianCut, true) },
+		{ "DL3", 256, QUANTIZE(Dl3Quant::Dl3Quantizer, true) },
+		{ "DIV", 256, [](const Image& image, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors) {
+			DivQuant::DivQuantizer quantizer;
+			return quantizer.QuantizeImage(image.pixels.data(), image.width, image.height, image.width * sizeof(ARGB), pPalette, qPixels, nMaxColors, true);
+		} },
+	};
+}
+
+static Result Run(const Algorithm& algorithm, const Image& image)
+{
+	vector<BYTE> paletteBytes(sizeof(ColorPalette) + algorithm.nMaxColors * sizeof(ARGB));
+	auto pPalette = (ColorPalette*) paletteBytes.data();
+	Result result;
+	result.nMaxColors = algorithm.nMaxColors;
+	result.indices.resize(image.pixels.size());
+	result.succeeded = algorithm.quantize(image, pPalette, result.indices.data(), result.nMaxColors);
+	result.palette.assign(pPalette->Entries, pPalette->Entries + min(pPalette->Count, algorithm.nMaxColors));
+	return result;
+}
+
+int main()
+{
+	vector<Image> images;
+	for (UINT seed = 0; seed < 3; ++seed)
+		images.emplace_back(MakeImage(96 + seed * 8, 64 + seed * 4, seed));
+
+	const auto algorithms = GetAlgorithms();
+	const UINT nJobs = (UINT) (algorithms.size() * images.size());
+	vector<Result> expected(nJobs);
+	for (UINT job = 0; job < nJobs; ++job)
+		expected[job] = Run(algorithms[job / images.size()], images[job % images.size()]);
+
+	// Every job of a round on its own thread, each round repeating the whole set
+	UINT nFailures = 0;
+	for (UINT round = 0; round < ROUNDS; ++round) {
+		vector<Result> actual(nJobs);
+		vector<thread> workers;
+		for (UINT job = 0; job < nJobs; ++job)
+			workers.emplace_back([&, job]() { actual[job] = Run(algorithms[job / images.size()], images[job % images.size()]); });
+		for (auto& worker : workers)
+			worker.join();
+
+		for (UINT job = 0; job < nJobs; ++job) {
+			const auto& algorithm = algorithms[job / images.size()];
+			if (!expected[job].succeeded) {
+				cerr << algorithm.name << " failed on image " << job % images.size() << endl;
+				++nFailures;
+			}
+			else if (!(actual[job] == expected[job])) {
+				cerr << algorithm.name << " differs from its serial run on image " << job % images.size() << " in round " << round << endl;
+				++nFailures;
+			}
+		}
+	}
+
+	if (nFailures) {
+		cerr << nFailures << " concurrent runs failed" << endl;
+		return 1;
+	}
+	cout << nJobs << " quantizations matched their serial runs over " << ROUNDS << " concurrent rounds" << endl;
+	return 0;
+}
@@ -0,0 +1,65 @@
+// Checks the batched float RGB2LAB against the scalar double RGB2LAB over every
+// RGB colour, and that its scalar, SSE2 and AVX2 paths give the same floats.
+
+#include "stdafx.h"
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "CIELABConvertor.h"
+
+using namespace std;
+
+// The bound the batched RGB2LAB documents for each of L, A and B
+const double MAX_ERROR = 0.0005;
+const UINT CHUNK = 1 << 16;
+const UINT COLORS = 1 << 24;
+
+int main()
+{
+	vector<ARGB> pixels(CHUNK);
+	vector<float> L(CHUNK), A(CHUNK), B(CHUNK), pathL(CHUNK), pathA(CHUNK), pathB(CHUNK);
+	double maxError[3] = { 0, 0, 0 };
+	UINT nMismatches = 0;
+	bool pathTaken[9] = { false };
+
+	for (UINT first = 0; first < COLORS; first += CHUNK) {
+		for (UINT i = 0; i < CHUNK; ++i)
+			pixels[i] = Color::MakeARGB(BYTE_MAX, (first + i) >> 16, ((first + i) >> 8) & 0xFF, (first + i) & 0xFF);
+
+		const UINT lanes = CIELABConvertor::RGB2LAB(pixels.data(), CHUNK, L.data(), A.data(), B.data(), UINT_MAX);
+		pathTaken[lanes] = true;
+		for (UINT i = 0; i < CHUNK; ++i) {
+			CIELABConvertor::Lab lab;
+			CIELABConvertor::RGB2LAB(Color(pixels[i]), lab);
+			maxError[0] = max(maxError[0], fabs(L[i] - lab.L));
+			maxError[1] = max(maxError[1], fabs(A[i] - lab.A));
+			maxError[2] = max(maxError[2], fabs(B[i] - lab.B));
+		}
+
+		// Every narrower path, on an odd count so that each vector path also ends in its scalar tail
+		const UINT count = CHUNK - 3;
+		for (UINT maxLanes : { 1U, 4U }) {
+			const UINT pathLanes = CIELABConvertor::RGB2LAB(pixels.data(), count, pathL.data(), pathA.data(), pathB.data(), maxLanes);
+			pathTaken[pathLanes] = true;
+			if (memcmp(pathL.data(), L.data(), count * sizeof(float)) || memcmp(pathA.data(), A.data(), count * sizeof(float)) || memcmp(pathB.data(), B.data(), count * sizeof(float)))
+				++nMismatches;
+		}
+	}
+
+	cout << "Max error L " << maxError[0] << ", A " << maxError[1] << ", B " << maxError[2] << endl;
+	cout << "Paths compared:" << (pathTaken[1] ? " scalar" : "") << (pathTaken[4] ? " SSE2" : "") << (pathTaken[8] ? " AVX2" : "") << endl;
+
+	bool bSucceeded = true;
+	for (int k = 0; k < 3; ++k) {
+		if (maxError[k] > MAX_ERROR) {
+			cerr << "Channel " << "LAB"[k] << " is " << maxError[k] << " away from the scalar RGB2LAB" << endl;
+			bSucceeded = false;
+		}
+	}
+	if (nMismatches) {
+		cerr << nMismatches << " chunks differ between the vector paths" << endl;
+		bSucceeded = false;
+	}
+	return bSucceeded ? 0 : 1;
+}
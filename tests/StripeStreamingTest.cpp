@@ -0,0 +1,143 @@
+// Quantizes images stripe by stripe through ReadRowsFn and WriteRowsFn and checks
+// that the palette and indices are bit-identical to quantizing them in memory, with
+// and without dithering and with the undithered remap going through the colormap.
+
+#include "stdafx.h"
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "Dl3Quantizer.h"
+#include "PnnLABQuantizer.h"
+#include "PnnQuantizer.h"
+#include "WuQuantizer.h"
+
+using namespace std;
+
+const UINT SEED = 7;
+const UINT WIDTH = 80, HEIGHT = 60;
+
+struct Image {
+	UINT width, height;
+	vector<ARGB> pixels;
+};
+
+struct Result {
+	bool succeeded = false;
+	UINT nMaxColors = 0;
+	vector<ARGB> palette;
+	vector<unsigned short> indices;
+
+	bool operator==(const Result& other) const
+	{
+		return succeeded == other.succeeded && nMaxColors == other.nMaxColors && palette == other.palette && indices == other.indices;
+	}
+};
+
+// Quantizes image in memory when stripeHeight is 0, in stripes of stripeHeight rows otherwise
+typedef function<bool(const Image& image, const UINT stripeHeight, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, const bool dither, const bool colormapRemap)> QuantizeFn;
+
+struct Algorithm {
+	string name;
+	QuantizeFn quantize;
+};
+
+struct Remap {
+	bool dither, colormapRemap;
+	string name;
+};
+
+// Gradients with noise, with transparent and translucent pixels if asked for
+static Image MakeImage(const UINT width, const UINT height, const bool translucent)
+{
+	mt19937 random(translucent);
+	Image image = { width, height, vector<ARGB>(width * height) };
+	for (UINT y = 0; y < height; ++y) {
+		for (UINT x = 0; x < width; ++x) {
+			const BYTE alpha = (translucent && random() % 4 == 0) ? static_cast<BYTE>(random() % 256) : BYTE_MAX;
+			const BYTE red = static_cast<BYTE>(x * 255 / width + random() % 24);
+			const BYTE green = static_cast<BYTE>(y * 255 / height + random() % 24);
+			const BYTE blue = static_cast<BYTE>(x ^ y);
+			image.pixels[y * width + x] = Color::MakeARGB(alpha, red, green, blue);
+		}
+	}
+	return image;
+}
+
+template <typename Quantizer>
+static QuantizeFn Quantize()
+{
+	return [](const Image& image, const UINT stripeHeight, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, const bool dither, const bool colormapRemap) {
+		Quantizer quantizer;
+		// The paths that draw random numbers then draw the same ones in both runs
+		quantizer.SetSeed(SEED);
+		quantizer.SetColormapRemap(colormapRemap);
+		if (!stripeHeight)
+			return quantizer.QuantizeImage(image.pixels.data(), image.width, image.height, image.width * sizeof(ARGB), pPalette, qPixels, nMaxColors, dither);
+
+		ReadRowsFn readRows = [&image](const UINT y, const UINT rows, ARGB* pixels) {
+			copy(image.pixels.begin() + y * image.width, image.pixels.begin() + (y + rows) * image.width, pixels);
+			return true;
+		};
+		WriteRowsFn writeRows = [&image, qPixels](const UINT y, const UINT rows, const unsigned short* indices) {
+			copy(indices, indices + rows * image.width, qPixels + y * image.width);
+			return true;
+		};
+		return quantizer.QuantizeImage(readRows, writeRows, image.width, image.height, stripeHeight, pPalette, nMaxColors, dither);
+	};
+}
+
+static vector<Algorithm> GetAlgorithms()
+{
+	return {
+		{ "WU", Quantize<nQuant::WuQuantizer>() },
+		{ "PNN", Quantize<PnnQuant::PnnQuantizer>() },
+		{ "PNNLAB", Quantize<PnnLABQuant::PnnLABQuantizer>() },
+		{ "DL3", Quantize<Dl3Quant::Dl3Quantizer>() },
+	};
+}
+
+static Result Run(const Algorithm& algorithm, const Image& image, const UINT stripeHeight, const UINT nMaxColors, const Remap& remap)
+{
+	vector<BYTE> paletteBytes(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+	auto pPalette = (ColorPalette*) paletteBytes.data();
+	Result result;
+	result.nMaxColors = nMaxColors;
+	result.indices.resize(image.pixels.size());
+	result.succeeded = algorithm.quantize(image, stripeHeight, pPalette, result.indices.data(), result.nMaxColors, remap.dither, remap.colormapRemap);
+	result.palette.assign(pPalette->Entries, pPalette->Entries + min(pPalette->Count, nMaxColors));
+	return result;
+}
+
+int main()
+{
+	const Image images[] = { MakeImage(WIDTH, HEIGHT, false), MakeImage(WIDTH, HEIGHT, true) };
+	const Remap remaps[] = { { false, false, "" }, { false, true, ", through the colormap" }, { true, false, ", dithered" } };
+	UINT nRuns = 0, nFailures = 0;
+	for (const auto& algorithm : GetAlgorithms()) {
+		for (const auto& image : images) {
+			for (UINT nMaxColors : { 2U, 16U, 256U, 512U }) {
+				for (const auto& remap : remaps) {
+					const auto expected = Run(algorithm, image, 0, nMaxColors, remap);
+					for (UINT stripeHeight : { 1U, 5U, 64U, HEIGHT }) {
+						const auto actual = Run(algorithm, image, stripeHeight, nMaxColors, remap);
+						++nRuns;
+						if (!expected.succeeded || !(actual == expected)) {
+							cerr << algorithm.name << " differs in stripes of " << stripeHeight << " rows at " << nMaxColors << " colours"
+								<< (&image == images ? "" : " with alpha") << remap.name << endl;
+							++nFailures;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	if (nFailures) {
+		cerr << nFailures << " of " << nRuns << " streamed runs failed" << endl;
+		return 1;
+	}
+	cout << nRuns << " streamed runs matched the in-memory ones" << endl;
+	return 0;
+}